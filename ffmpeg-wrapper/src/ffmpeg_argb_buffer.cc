@@ -0,0 +1,81 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Referenced from api/video/nv12_buffer.cc
+ */
+
+#include "ffmpeg_argb_buffer.h"
+
+#include "api/video/i420_buffer.h"
+#include "rtc_base/ref_counted_object.h"
+#include "third_party/libyuv/include/libyuv.h"
+
+
+// same as I420Buffer and NV12Buffer
+static const int kBufferAlignment = 64;
+
+
+rtc::scoped_refptr<FFmpegARGBBuffer>
+FFmpegARGBBuffer::Create(int width, int height)
+{ return new rtc::RefCountedObject<FFmpegARGBBuffer>(width, height); }
+
+
+FFmpegARGBBuffer::FFmpegARGBBuffer(int width, int height)
+: width_(width),
+  height_(height),
+  stride_(width * 4),
+  data_(static_cast<uint8_t*>(webrtc::AlignedMalloc(
+      static_cast<size_t>(stride_) * height, kBufferAlignment)))
+{ }
+
+
+FFmpegARGBBuffer::~FFmpegARGBBuffer() { }
+
+
+FFmpegNativeBuffer::NativeType
+FFmpegARGBBuffer::native_type() const
+{ return kNativeARGB; }
+
+
+int
+FFmpegARGBBuffer::width() const
+{ return width_; }
+
+
+int
+FFmpegARGBBuffer::height() const
+{ return height_; }
+
+
+rtc::scoped_refptr<webrtc::I420BufferInterface>
+FFmpegARGBBuffer::ToI420()
+{
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        webrtc::I420Buffer::Create(width_, height_);
+    libyuv::ARGBToI420(
+        Data(), Stride(),
+        buffer->MutableDataY(), buffer->StrideY(),
+        buffer->MutableDataU(), buffer->StrideU(),
+        buffer->MutableDataV(), buffer->StrideV(),
+        width_, height_);
+    return buffer;
+}
+
+
+const uint8_t*
+FFmpegARGBBuffer::Data() const
+{ return data_.get(); }
+
+
+uint8_t*
+FFmpegARGBBuffer::MutableData()
+{ return data_.get(); }
+
+
+int
+FFmpegARGBBuffer::Stride() const
+{ return stride_; }
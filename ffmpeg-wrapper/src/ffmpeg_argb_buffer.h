@@ -0,0 +1,50 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Packed 32-bit ARGB frames, as a native webrtc::VideoFrameBuffer.
+ */
+
+#ifndef DEMO_FFMPEG_ARGB_BUFFER_H_
+#define DEMO_FFMPEG_ARGB_BUFFER_H_
+
+#include <cstdint>
+#include <memory>
+
+#include "api/scoped_refptr.h"
+#include "rtc_base/memory/aligned_malloc.h"
+#include "ffmpeg_native_buffer.h"
+
+
+// WebRTC has no RGB buffer type, so ARGB frames travel as kNative buffers
+// and are only converted when a consumer asks for ToI420(). Byte order is
+// libyuv's ARGB (B, G, R, A in memory), i.e. ffmpeg's "bgra".
+class FFmpegARGBBuffer : public FFmpegNativeBuffer {
+public:
+    static rtc::scoped_refptr<FFmpegARGBBuffer> Create(int width, int height);
+
+    NativeType native_type() const override;
+    int width() const override;
+    int height() const override;
+
+    rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+    const uint8_t* Data() const;
+    uint8_t* MutableData();
+    int Stride() const;
+
+protected:
+    FFmpegARGBBuffer(int width, int height);
+    ~FFmpegARGBBuffer() override;
+
+private:
+    const int width_;
+    const int height_;
+    const int stride_;
+    const std::unique_ptr<uint8_t, webrtc::AlignedFreeDeleter> data_;
+};
+
+#endif
@@ -10,14 +10,15 @@
 
 #include "ffmpeg_audio_device.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <sstream>
 
 #include "rtc_base/checks.h"
 #include "rtc_base/logging.h"
-#include "rtc_base/platform_thread.h"
 #include "rtc_base/time_utils.h"
-#include "system_wrappers/include/sleep.h"
+
+#include "ffmpeg_device_registry.h"
 
 
 const int kRecordingFixedSampleRate = 48000;
@@ -28,6 +29,8 @@ const size_t kPlayoutBufferSize =
     kPlayoutFixedSampleRate / 100 * kPlayoutNumChannels * 2;
 const size_t kRecordingBufferSize =
     kRecordingFixedSampleRate / 100 * kRecordingNumChannels * 2;
+const int64_t kPlayoutPeriodUs = 10 * rtc::kNumMicrosecsPerMillisec;
+const int64_t kRecordingPeriodUs = 10 * rtc::kNumMicrosecsPerMillisec;
 
 FFmpegAudioDevice::FFmpegAudioDevice()
     : _ptrAudioBuffer(NULL),
@@ -42,14 +45,28 @@ FFmpegAudioDevice::FFmpegAudioDevice()
       _recording(false),
       _lastCallPlayoutMillis(0),
       _lastCallRecordMillis(0),
+      _recordedSamples(0),
+      _lastRecordedCaptureTimeUs(0),
+      _lastRecordedFrameUs(-1),
+      _firstRecordedFrameUs(-1),
+      _framesDelivered(0),
+      _framesDropped(0),
+      _shortReads(0),
+      _bytesIngested(0),
+      _recordingDriftUs(0),
+      _recordingAgeUs(0),
+      _playoutChunks(0),
+      _playoutCatchUps(0),
       // _outputFile(*webrtc::FileWrapper::Create()),
       // _inputFile(*FileWrapper::Create()),
       _inputStream(NULL),
       _outputFilename("webrtcOutputFile.dat"),
-      _inputFilename("ffmpegInputStream.pipe")
-{ }
+      _inputFilename("ffmpegInputStream.pipe") {
+  FFmpegStatsRegistry::GetInstance()->Register("audio", this);
+}
 
 FFmpegAudioDevice::~FFmpegAudioDevice() {
+  FFmpegStatsRegistry::GetInstance()->Unregister(this);
   delete &_outputFile;
 //   delete &_inputFile;
   if (_inputStream != NULL) {
@@ -208,6 +225,9 @@ int32_t FFmpegAudioDevice::StartPlayout() {
 
   _playing = true;
   _playoutFramesLeft = 0;
+  _playoutChunks = 0;
+  _playoutCatchUps = 0;
+  _playoutLateUs.Reset();
 
   if (!_playoutBuffer) {
     _playoutBuffer = new int8_t[kPlayoutBufferSize];
@@ -231,10 +251,14 @@ int32_t FFmpegAudioDevice::StartPlayout() {
     }
   }
 
-  _ptrThreadPlay.reset(new rtc::PlatformThread(
-      PlayThreadFunc, this, "webrtc_audio_module_play_thread"));
-  _ptrThreadPlay->Start();
-  // _ptrThreadPlay->SetPriority(rtc::kRealtimePriority);
+  if (!FFmpegIngestReactor::GetInstance()->AddTimer(this, kPlayoutPeriodUs)) {
+    RTC_LOG(LS_ERROR) << "Failed to start the playout timer";
+    _playing = false;
+    _outputFile.Close();
+    delete[] _playoutBuffer;
+    _playoutBuffer = NULL;
+    return -1;
+  }
 
   RTC_LOG(LS_INFO) << "Started playout capture to output file: "
                    << _outputFilename;
@@ -248,11 +272,8 @@ int32_t FFmpegAudioDevice::StopPlayout() {
     _playing = false;
   }
 
-  // stop playout thread first
-  if (_ptrThreadPlay) {
-    _ptrThreadPlay->Stop();
-    _ptrThreadPlay.reset();
-  }
+  // stop the playout timer first; waits for a tick in progress
+  FFmpegIngestReactor::GetInstance()->RemoveTimer(this);
 
   // rtc::CritScope lock(&_critSect);
   webrtc::MutexLock lock(&mutex_);
@@ -274,6 +295,19 @@ bool FFmpegAudioDevice::Playing() const {
 
 int32_t FFmpegAudioDevice::StartRecording() {
   _recording = true;
+  _recordingTimestamps.Reset();
+  _recordedSamples = 0;
+  _lastRecordedFrameUs = -1;
+  _firstRecordedFrameUs = -1;
+  _framesDelivered = 0;
+  _framesDropped = 0;
+  _shortReads = 0;
+  _bytesIngested = 0;
+  _recordingDriftUs = 0;
+  _recordingAgeUs = 0;
+  _readUs.Reset();
+  _deliverUs.Reset();
+  _jitterUs.Reset();
 
   // Make sure we only create the buffer once.
   _recordingBufferSizeIn10MS =
@@ -283,7 +317,7 @@ int32_t FFmpegAudioDevice::StartRecording() {
   }
 
   std::ostringstream command;
-  command << "/usr/local/bin/ffmpeg";
+  command << FFmpegDeviceRegistry::FFmpegBinary();
 //   command << " -rtsp_transport tcp";
   command << " -i rtmp://localhost/camera -vn";
   command << " -f s16le -c:a pcm_s16le";
@@ -300,12 +334,16 @@ int32_t FFmpegAudioDevice::StartRecording() {
     return -1;
   }
 
-
-  _ptrThreadRec.reset(new rtc::PlatformThread(
-      RecThreadFunc, this, "webrtc_audio_module_capture_thread"));
-
-  _ptrThreadRec->Start();
-  // _ptrThreadRec->SetPriority(rtc::kRealtimePriority);
+  if (!FFmpegIngestReactor::GetInstance()->AddSource(this,
+                                                     fileno(_inputStream))) {
+    RTC_LOG(LS_ERROR) << "Failed to watch audio input: " << _inputFilename;
+    _recording = false;
+    pclose(_inputStream);
+    _inputStream = NULL;
+    delete[] _recordingBuffer;
+    _recordingBuffer = NULL;
+    return -1;
+  }
 
   RTC_LOG(LS_INFO) << "Started recording from input file: " << _inputFilename;
 
@@ -319,10 +357,8 @@ int32_t FFmpegAudioDevice::StopRecording() {
     _recording = false;
   }
 
-  if (_ptrThreadRec) {
-    _ptrThreadRec->Stop();
-    _ptrThreadRec.reset();
-  }
+  // waits for a chunk being handled on a reactor thread
+  FFmpegIngestReactor::GetInstance()->RemoveSource(this);
 
   // rtc::CritScope lock(&_critSect);
   webrtc::MutexLock lock(&mutex_);
@@ -456,6 +492,44 @@ int32_t FFmpegAudioDevice::PlayoutDelay(uint16_t& delayMS) const {
   return 0;
 }
 
+int64_t FFmpegAudioDevice::LastRecordedCaptureTimeUs() {
+  webrtc::MutexLock lock(&mutex_);
+  return _lastRecordedCaptureTimeUs;
+}
+
+FFmpegAudioDevice::Stats FFmpegAudioDevice::GetStats() {
+  Stats stats;
+  stats.framesDelivered = _framesDelivered.load(std::memory_order_relaxed);
+  stats.framesDropped = _framesDropped.load(std::memory_order_relaxed);
+  stats.shortReads = _shortReads.load(std::memory_order_relaxed);
+  stats.bytesIngested = _bytesIngested.load(std::memory_order_relaxed);
+  stats.recordingDriftUs = _recordingDriftUs.load(std::memory_order_relaxed);
+  stats.recordingAgeUs = _recordingAgeUs.load(std::memory_order_relaxed);
+  stats.readUs = _readUs.GetSnapshot();
+  stats.deliverUs = _deliverUs.GetSnapshot();
+  stats.jitterUs = _jitterUs.GetSnapshot();
+  stats.playoutChunks = _playoutChunks.load(std::memory_order_relaxed);
+  stats.playoutCatchUps = _playoutCatchUps.load(std::memory_order_relaxed);
+  stats.playoutLateUs = _playoutLateUs.GetSnapshot();
+  return stats;
+}
+
+void FFmpegAudioDevice::ReportStats(FFmpegStatsReport& report) {
+  Stats stats = GetStats();
+  report.AddCounter("framesDelivered", stats.framesDelivered);
+  report.AddCounter("framesDropped", stats.framesDropped);
+  report.AddCounter("shortReads", stats.shortReads);
+  report.AddCounter("bytesIngested", stats.bytesIngested);
+  report.AddValue("recordingDriftUs", stats.recordingDriftUs);
+  report.AddValue("recordingAgeUs", stats.recordingAgeUs);
+  report.AddHistogram("readUs", stats.readUs);
+  report.AddHistogram("deliverUs", stats.deliverUs);
+  report.AddHistogram("jitterUs", stats.jitterUs);
+  report.AddCounter("playoutChunks", stats.playoutChunks);
+  report.AddCounter("playoutCatchUps", stats.playoutCatchUps);
+  report.AddHistogram("playoutLateUs", stats.playoutLateUs);
+}
+
 void FFmpegAudioDevice::AttachAudioBuffer(webrtc::AudioDeviceBuffer* audioBuffer) {
   // rtc::CritScope lock(&_critSect);
   webrtc::MutexLock lock(&mutex_);
@@ -471,101 +545,89 @@ void FFmpegAudioDevice::AttachAudioBuffer(webrtc::AudioDeviceBuffer* audioBuffer
   _ptrAudioBuffer->SetPlayoutChannels(0);
 }
 
-// bool FFmpegAudioDevice::PlayThreadFunc(void* pThis) {
-//   return (static_cast<FFmpegAudioDevice*>(pThis)->PlayThreadProcess());
-// }
-void FFmpegAudioDevice::PlayThreadFunc(void* pThis) {
-  FFmpegAudioDevice* device = static_cast<FFmpegAudioDevice*>(pThis);
-  while (device->PlayThreadProcess()) { }
-}
-
-// bool FFmpegAudioDevice::RecThreadFunc(void* pThis) {
-//   return (static_cast<FFmpegAudioDevice*>(pThis)->RecThreadProcess());
-// }
-void FFmpegAudioDevice::RecThreadFunc(void* pThis) {
-  FFmpegAudioDevice* device = static_cast<FFmpegAudioDevice*>(pThis);
-  while (device->RecThreadProcess()) { }
-}
-
-bool FFmpegAudioDevice::PlayThreadProcess() {
-  if (!_playing) {
-    return false;
-  }
-  int64_t currentTime = rtc::TimeMillis();
-  // _critSect.Enter();
-  mutex_.Lock();
-
-  if (_lastCallPlayoutMillis == 0 ||
-      currentTime - _lastCallPlayoutMillis >= 10) {
-    // _critSect.Leave();
-    mutex_.Unlock();
+void FFmpegAudioDevice::OnTimer(uint64_t expirations, int64_t lateUs) {
+  _playoutLateUs.Record(lateUs);
+  // a late tick still plays out every 10ms that went by, back to back, and
+  // the next one is due on the original schedule
+  _playoutCatchUps.fetch_add(expirations - 1, std::memory_order_relaxed);
+  for (uint64_t i = 0; i < expirations; i++) {
+    {
+      webrtc::MutexLock lock(&mutex_);
+      if (!_playing) {
+        return;
+      }
+    }
     _ptrAudioBuffer->RequestPlayoutData(_playoutFramesIn10MS);
-    // _critSect.Enter();
-    mutex_.Lock();
 
+    webrtc::MutexLock lock(&mutex_);
     _playoutFramesLeft = _ptrAudioBuffer->GetPlayoutData(_playoutBuffer);
     RTC_DCHECK_EQ(_playoutFramesIn10MS, _playoutFramesLeft);
     if (_outputFile.is_open()) {
       _outputFile.Write(_playoutBuffer, kPlayoutBufferSize);
     }
-    _lastCallPlayoutMillis = currentTime;
-  }
-  _playoutFramesLeft = 0;
-  // _critSect.Leave();
-  mutex_.Unlock();
-
-  int64_t deltaTimeMillis = rtc::TimeMillis() - currentTime;
-  if (deltaTimeMillis < 10) {
-    webrtc::SleepMs(10 - deltaTimeMillis);
+    _lastCallPlayoutMillis = rtc::TimeMillis();
+    _playoutFramesLeft = 0;
+    _playoutChunks.fetch_add(1, std::memory_order_relaxed);
   }
+}
 
-  return true;
+uint8_t* FFmpegAudioDevice::NextFrame(size_t& size) {
+  size = kRecordingBufferSize;
+  return reinterpret_cast<uint8_t*>(_recordingBuffer);
 }
 
-bool FFmpegAudioDevice::RecThreadProcess() {
-  if (!_recording) {
-    return false;
-  }
+bool FFmpegAudioDevice::OnFrame() {
+  _bytesIngested.fetch_add(kRecordingBufferSize, std::memory_order_relaxed);
+  int64_t nowUs = FFmpegCaptureClock::GetInstance()->TimeMicros();
+  {
+    webrtc::MutexLock lock(&mutex_);
+    if (!_recording) {
+      _framesDropped.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
 
-  int64_t currentTime = rtc::TimeMillis();
-  // _critSect.Enter();
-  mutex_.Lock();
-
-  if (_lastCallRecordMillis == 0 || (currentTime - _lastCallRecordMillis) >= 10) {
-    // if (_inputFile.is_open()) {
-    //   if (_inputFile.Read(_recordingBuffer, kRecordingBufferSize) > 0) {
-    //     _ptrAudioBuffer->SetRecordedBuffer(_recordingBuffer,
-    //                                        _recordingFramesIn10MS);
-    //   } else {
-    //     _inputFile.Rewind();
-    //   }
-    //   _lastCallRecordMillis = currentTime;
-    //   _critSect.Leave();
-    //   _ptrAudioBuffer->DeliverRecordedData();
-    //   _critSect.Enter();
-    // }
-    if (_inputStream != NULL) {
-      size_t bytes_read = fread(_recordingBuffer, 1, kRecordingBufferSize, _inputStream);
-      if (static_cast<int>(bytes_read) > 0) {
-        _ptrAudioBuffer->SetRecordedBuffer(_recordingBuffer,
-                                           _recordingFramesIn10MS);
-      }
-      _lastCallRecordMillis = currentTime;
-      // _critSect.Leave();
-      mutex_.Unlock();
-      _ptrAudioBuffer->DeliverRecordedData();
-      // _critSect.Enter();
-      mutex_.Lock();
+    if (_lastRecordedFrameUs >= 0) {
+      _jitterUs.Record(
+          llabs(nowUs - _lastRecordedFrameUs - kRecordingPeriodUs));
     }
+    _lastRecordedFrameUs = nowUs;
+
+    int64_t ptsUs = _recordedSamples * rtc::kNumMicrosecsPerSec /
+                    kRecordingFixedSampleRate;
+    if (_firstRecordedFrameUs < 0) {
+      _firstRecordedFrameUs = nowUs;
+    }
+    _recordingDriftUs.store(nowUs - _firstRecordedFrameUs - ptsUs,
+                            std::memory_order_relaxed);
+    _recordedSamples += kRecordingBufferSize / (kRecordingNumChannels * 2);
+
+    _lastRecordedCaptureTimeUs =
+        _recordingTimestamps.ToLocalTime(ptsUs, nowUs);
+
+    // The chunk's age is not a playout-to-capture delay, which is what the
+    // echo canceller takes here; there is no loopback to cancel anyway.
+    _recordingAgeUs.store(nowUs - _lastRecordedCaptureTimeUs,
+                          std::memory_order_relaxed);
+    _ptrAudioBuffer->SetVQEData(0, 0);
+    _ptrAudioBuffer->SetRecordedBuffer(_recordingBuffer,
+                                       _recordingFramesIn10MS);
+    _lastCallRecordMillis = nowUs / rtc::kNumMicrosecsPerMillisec;
   }
+  _ptrAudioBuffer->DeliverRecordedData();
+  _deliverUs.Record(FFmpegCaptureClock::GetInstance()->TimeMicros() - nowUs);
+  _framesDelivered.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
 
-  // _critSect.Leave();
-  mutex_.Unlock();
+void FFmpegAudioDevice::OnClosed() {
+  RTC_LOG(LS_WARNING) << "Audio input ended: " << _inputFilename;
+}
 
-  int64_t deltaTimeMillis = rtc::TimeMillis() - currentTime;
-  if (deltaTimeMillis < 10) {
-    webrtc::SleepMs(10 - deltaTimeMillis);
-  }
+void FFmpegAudioDevice::OnFrameRead(int64_t readUs) {
+  _readUs.Record(readUs);
+}
 
-  return true;
+void FFmpegAudioDevice::OnShortRead(size_t filled, size_t size) {
+  _shortReads.fetch_add(1, std::memory_order_relaxed);
+  _bytesIngested.fetch_add(filled, std::memory_order_relaxed);
 }
@@ -13,6 +13,7 @@
 
 #include <stdio.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -22,13 +23,26 @@
 #include "rtc_base/system/file_wrapper.h"
 #include "rtc_base/time_utils.h"
 
-namespace rtc {
-class PlatformThread;
-}  // namespace rtc
+#include "ffmpeg_capture_clock.h"
+#include "ffmpeg_histogram.h"
+#include "ffmpeg_ingest_reactor.h"
+#include "ffmpeg_stats_registry.h"
 
 // This is a fake audio device which plays audio from a file as its microphone
 // and plays out into a file.
-class FFmpegAudioDevice : public webrtc::AudioDeviceGeneric {
+//
+// Neither direction has a thread of its own: the ffmpeg pipe is read, and
+// the 10ms playout timer fires, on the shared FFmpegIngestReactor.
+// Recording goes at the pace ffmpeg writes, the source's clock; playout
+// at the timer's, whose deadlines are absolute, so 100 chunks go out every
+// second however late any one tick runs: a late tick plays out the
+// chunks it missed at once.
+//
+// Its Stats are reported to FFmpegStatsRegistry as "audio".
+class FFmpegAudioDevice : public webrtc::AudioDeviceGeneric,
+                          private FFmpegIngestReactor::Source,
+                          private FFmpegIngestReactor::Timer,
+                          private FFmpegStatsRegistry::Provider {
  public:
   // Constructs a file audio device with |id|. It will read audio from
   // |inputFilename| and record output audio to |outputFilename|.
@@ -125,13 +139,49 @@ class FFmpegAudioDevice : public webrtc::AudioDeviceGeneric {
 
   void AttachAudioBuffer(webrtc::AudioDeviceBuffer* audioBuffer) override;
 
+  // Capture time, on FFmpegCaptureClock, of the last 10ms chunk handed to
+  // the audio buffer. Comparable with the video frames' timestamp_us().
+  int64_t LastRecordedCaptureTimeUs();
+
+  // Recording, since the last StartRecording(), and playout, since the
+  // last StartPlayout(); frames are 10ms chunks.
+  struct Stats {
+    uint64_t framesDelivered;
+    uint64_t framesDropped;  // read while recording was being stopped
+    uint64_t shortReads;     // input ended part way through a frame
+    uint64_t bytesIngested;
+    // How far the last frame came in after (or before) a strict 10ms
+    // schedule from the first: grows if ffmpeg's clock runs slow.
+    int64_t recordingDriftUs;
+    // How old the last chunk was when it was delivered, by its mapped
+    // capture time.
+    int64_t recordingAgeUs;
+    // In microseconds. Read: from a frame's first byte to its last.
+    // Deliver: DeliverRecordedData(), i.e. the APM and the encoder.
+    // Jitter: how far the time between two frames is from 10ms.
+    FFmpegLatencyHistogram::Snapshot readUs;
+    FFmpegLatencyHistogram::Snapshot deliverUs;
+    FFmpegLatencyHistogram::Snapshot jitterUs;
+
+    uint64_t playoutChunks;
+    uint64_t playoutCatchUps;  // chunks the clock was late for, played
+                               // out in a batch with the next one
+    // how long after its deadline each playout tick ran
+    FFmpegLatencyHistogram::Snapshot playoutLateUs;
+  };
+  Stats GetStats();
+
  private:
-  // static bool RecThreadFunc(void*);
-  // static bool PlayThreadFunc(void*);
-  static void RecThreadFunc(void*);
-  static void PlayThreadFunc(void*);
-  bool RecThreadProcess();
-  bool PlayThreadProcess();
+  // FFmpegIngestReactor::Source: 10ms chunks from the ffmpeg pipe
+  uint8_t* NextFrame(size_t& size) override;
+  bool OnFrame() override;
+  void OnClosed() override;
+  void OnFrameRead(int64_t readUs) override;
+  void OnShortRead(size_t filled, size_t size) override;
+  // FFmpegIngestReactor::Timer: the playout clock
+  void OnTimer(uint64_t expirations, int64_t lateUs) override;
+  // FFmpegStatsRegistry::Provider
+  void ReportStats(FFmpegStatsReport& report) override;
 
   int32_t _playout_index;
   int32_t _record_index;
@@ -147,15 +197,32 @@ class FFmpegAudioDevice : public webrtc::AudioDeviceGeneric {
   size_t _recordingFramesIn10MS;
   size_t _playoutFramesIn10MS;
 
-  // TODO(pbos): Make plain members instead of pointers and stop resetting them.
-  std::unique_ptr<rtc::PlatformThread> _ptrThreadRec;
-  std::unique_ptr<rtc::PlatformThread> _ptrThreadPlay;
-
   bool _playing;
   bool _recording;
   int64_t _lastCallPlayoutMillis;
   int64_t _lastCallRecordMillis;
 
+  // The pipe carries no timestamps; ffmpeg's sample count is the media
+  // clock, mapped onto the shared capture clock like video's pts.
+  FFmpegTimestampEstimator _recordingTimestamps;
+  int64_t _recordedSamples;
+  int64_t _lastRecordedCaptureTimeUs;
+  int64_t _lastRecordedFrameUs;  // when it came in, -1 before the first
+  int64_t _firstRecordedFrameUs;
+
+  std::atomic<uint64_t> _framesDelivered;
+  std::atomic<uint64_t> _framesDropped;
+  std::atomic<uint64_t> _shortReads;
+  std::atomic<uint64_t> _bytesIngested;
+  std::atomic<int64_t> _recordingDriftUs;
+  std::atomic<int64_t> _recordingAgeUs;
+  FFmpegLatencyHistogram _readUs;
+  FFmpegLatencyHistogram _deliverUs;
+  FFmpegLatencyHistogram _jitterUs;
+  std::atomic<uint64_t> _playoutChunks;
+  std::atomic<uint64_t> _playoutCatchUps;
+  FFmpegLatencyHistogram _playoutLateUs;
+
   webrtc::FileWrapper _outputFile;
 //   FileWrapper _inputFile;
   FILE* _inputStream;
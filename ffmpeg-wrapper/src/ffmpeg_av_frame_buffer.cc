@@ -0,0 +1,162 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Wraps a decoded AVFrame as a webrtc::VideoFrameBuffer without copying.
+ */
+
+#include "ffmpeg_av_frame_buffer.h"
+
+#include "api/video/i420_buffer.h"
+#include "rtc_base/ref_counted_object.h"
+#include "third_party/libyuv/include/libyuv.h"
+
+extern "C" {
+#include "third_party/ffmpeg/libavutil/frame.h"
+#include "third_party/ffmpeg/libavutil/pixfmt.h"
+}
+
+
+rtc::scoped_refptr<FFmpegAVFrameBuffer>
+FFmpegAVFrameBuffer::Create(const AVFrame* frame)
+{
+    if (!IsWrappable(frame)) return nullptr;
+    // av_frame_clone() only takes a new reference on the frame's buffers
+    AVFrame* clone = av_frame_clone(frame);
+    if (clone == NULL) return nullptr;
+    return new rtc::RefCountedObject<FFmpegAVFrameBuffer>(clone);
+}
+
+
+bool
+FFmpegAVFrameBuffer::IsWrappable(const AVFrame* frame)
+{
+    if (frame == NULL || frame->buf[0] == NULL) return false;
+    return frame->format == AV_PIX_FMT_YUV420P ||
+           frame->format == AV_PIX_FMT_YUVJ420P;
+}
+
+
+FFmpegAVFrameBuffer::FFmpegAVFrameBuffer(AVFrame* frame)
+: frame_(frame)
+{ }
+
+
+FFmpegAVFrameBuffer::~FFmpegAVFrameBuffer()
+{ av_frame_free(&frame_); }
+
+
+int
+FFmpegAVFrameBuffer::width() const
+{ return frame_->width; }
+
+
+int
+FFmpegAVFrameBuffer::height() const
+{ return frame_->height; }
+
+
+const uint8_t*
+FFmpegAVFrameBuffer::DataY() const
+{ return frame_->data[0]; }
+
+
+const uint8_t*
+FFmpegAVFrameBuffer::DataU() const
+{ return frame_->data[1]; }
+
+
+const uint8_t*
+FFmpegAVFrameBuffer::DataV() const
+{ return frame_->data[2]; }
+
+
+int
+FFmpegAVFrameBuffer::StrideY() const
+{ return frame_->linesize[0]; }
+
+
+int
+FFmpegAVFrameBuffer::StrideU() const
+{ return frame_->linesize[1]; }
+
+
+int
+FFmpegAVFrameBuffer::StrideV() const
+{ return frame_->linesize[2]; }
+
+
+rtc::scoped_refptr<FFmpegAVNV12FrameBuffer>
+FFmpegAVNV12FrameBuffer::Create(const AVFrame* frame)
+{
+    if (!IsWrappable(frame)) return nullptr;
+    AVFrame* clone = av_frame_clone(frame);
+    if (clone == NULL) return nullptr;
+    return new rtc::RefCountedObject<FFmpegAVNV12FrameBuffer>(clone);
+}
+
+
+bool
+FFmpegAVNV12FrameBuffer::IsWrappable(const AVFrame* frame)
+{
+    if (frame == NULL || frame->buf[0] == NULL) return false;
+    return frame->format == AV_PIX_FMT_NV12;
+}
+
+
+FFmpegAVNV12FrameBuffer::FFmpegAVNV12FrameBuffer(AVFrame* frame)
+: frame_(frame)
+{ }
+
+
+FFmpegAVNV12FrameBuffer::~FFmpegAVNV12FrameBuffer()
+{ av_frame_free(&frame_); }
+
+
+int
+FFmpegAVNV12FrameBuffer::width() const
+{ return frame_->width; }
+
+
+int
+FFmpegAVNV12FrameBuffer::height() const
+{ return frame_->height; }
+
+
+rtc::scoped_refptr<webrtc::I420BufferInterface>
+FFmpegAVNV12FrameBuffer::ToI420()
+{
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        webrtc::I420Buffer::Create(width(), height());
+    libyuv::NV12ToI420(
+        DataY(), StrideY(),
+        DataUV(), StrideUV(),
+        buffer->MutableDataY(), buffer->StrideY(),
+        buffer->MutableDataU(), buffer->StrideU(),
+        buffer->MutableDataV(), buffer->StrideV(),
+        width(), height());
+    return buffer;
+}
+
+
+const uint8_t*
+FFmpegAVNV12FrameBuffer::DataY() const
+{ return frame_->data[0]; }
+
+
+const uint8_t*
+FFmpegAVNV12FrameBuffer::DataUV() const
+{ return frame_->data[1]; }
+
+
+int
+FFmpegAVNV12FrameBuffer::StrideY() const
+{ return frame_->linesize[0]; }
+
+
+int
+FFmpegAVNV12FrameBuffer::StrideUV() const
+{ return frame_->linesize[1]; }
@@ -0,0 +1,78 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Wraps a decoded AVFrame as a webrtc::VideoFrameBuffer without copying.
+ */
+
+#ifndef DEMO_FFMPEG_AV_FRAME_BUFFER_H_
+#define DEMO_FFMPEG_AV_FRAME_BUFFER_H_
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+
+struct AVFrame;
+
+
+// Holds its own reference to the decoder's picture; the decoder's buffer
+// pool gets the memory back once the last sink releases this buffer.
+class FFmpegAVFrameBuffer : public webrtc::I420BufferInterface {
+public:
+    // Returns nullptr unless |frame| is planar 4:2:0 (yuv420p / yuvj420p).
+    static rtc::scoped_refptr<FFmpegAVFrameBuffer> Create(const AVFrame* frame);
+
+    // Returns true if |frame| can be wrapped without conversion.
+    static bool IsWrappable(const AVFrame* frame);
+
+    int width() const override;
+    int height() const override;
+
+    const uint8_t* DataY() const override;
+    const uint8_t* DataU() const override;
+    const uint8_t* DataV() const override;
+
+    int StrideY() const override;
+    int StrideU() const override;
+    int StrideV() const override;
+
+protected:
+    explicit FFmpegAVFrameBuffer(AVFrame* frame);
+    ~FFmpegAVFrameBuffer() override;
+
+private:
+    AVFrame* frame_;
+};
+
+// The same for semi-planar 4:2:0 pictures (nv12), which is what hardware
+// decoders hand out.
+class FFmpegAVNV12FrameBuffer : public webrtc::NV12BufferInterface {
+public:
+    // Returns nullptr unless |frame| is nv12.
+    static rtc::scoped_refptr<FFmpegAVNV12FrameBuffer> Create(const AVFrame* frame);
+
+    static bool IsWrappable(const AVFrame* frame);
+
+    int width() const override;
+    int height() const override;
+
+    // Converts on demand; sinks that take NV12 never pay for it.
+    rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+    const uint8_t* DataY() const override;
+    const uint8_t* DataUV() const override;
+
+    int StrideY() const override;
+    int StrideUV() const override;
+
+protected:
+    explicit FFmpegAVNV12FrameBuffer(AVFrame* frame);
+    ~FFmpegAVNV12FrameBuffer() override;
+
+private:
+    AVFrame* frame_;
+};
+
+#endif
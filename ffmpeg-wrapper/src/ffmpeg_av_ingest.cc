@@ -0,0 +1,684 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  In-process demux/decode using libavformat and libavcodec.
+ */
+
+#include "ffmpeg_av_ingest.h"
+#include "ffmpeg_av_frame_buffer.h"
+
+#include "api/video/i420_buffer.h"
+#include "api/video/encoded_image.h"
+#include "api/video/nv12_buffer.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+#include "third_party/libyuv/include/libyuv.h"
+
+extern "C" {
+#include "third_party/ffmpeg/libavcodec/avcodec.h"
+#include "third_party/ffmpeg/libavformat/avformat.h"
+#include "third_party/ffmpeg/libavutil/dict.h"
+#include "third_party/ffmpeg/libavutil/error.h"
+}
+
+
+// scaled and converted pictures in flight: a few queued at every sink
+static const size_t kPooledFrames = 16;
+
+
+static std::string
+AVErrorString(int error)
+{
+    char message[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+    av_strerror(error, message, sizeof(message));
+    return std::string(message);
+}
+
+
+// rtsp:// and friends, once per process; never undone, since ingests may
+// be open until exit
+static void
+InitNetwork()
+{
+    static const int result = avformat_network_init();
+    if (result < 0)
+        RTC_LOG(LS_WARNING) << "avformat_network_init failed: "
+            << AVErrorString(result);
+}
+
+
+// Full-range ("JPEG") levels, as MJPEG cameras send them, to the limited
+// ones every consumer of an I420 buffer assumes: Y 0-255 to 16-235, U and
+// V 0-255 to 16-240 around 128. |from| and |to| may be the same buffer.
+static void
+ToLimitedRange(const webrtc::I420BufferInterface& from, webrtc::I420Buffer* to)
+{
+    static const struct Levels {
+        uint8_t luma[256];
+        uint8_t chroma[256];
+        Levels() {
+            for (int i = 0; i < 256; i++) {
+                luma[i]   = static_cast<uint8_t>(16 + (i * 219 + 127) / 255);
+                chroma[i] = static_cast<uint8_t>(
+                    128 + ((i - 128) * 224 + (i < 128 ? -127 : 127)) / 255);
+            }
+        }
+    } levels;
+
+    const struct {
+        const uint8_t* from;
+        int fromStride;
+        uint8_t* to;
+        int toStride;
+        int width;
+        int height;
+        const uint8_t* table;
+    } planes[] = {
+        { from.DataY(), from.StrideY(), to->MutableDataY(), to->StrideY(),
+          from.width(), from.height(), levels.luma },
+        { from.DataU(), from.StrideU(), to->MutableDataU(), to->StrideU(),
+          from.ChromaWidth(), from.ChromaHeight(), levels.chroma },
+        { from.DataV(), from.StrideV(), to->MutableDataV(), to->StrideV(),
+          from.ChromaWidth(), from.ChromaHeight(), levels.chroma },
+    };
+    for (auto& plane : planes)
+        for (int row = 0; row < plane.height; row++) {
+            const uint8_t* in = plane.from + row * plane.fromStride;
+            uint8_t* out = plane.to + row * plane.toStride;
+            for (int x = 0; x < plane.width; x++) out[x] = plane.table[in[x]];
+        }
+}
+
+
+static bool
+IsFullRange(const AVFrame* frame)
+{
+    return frame->format == AV_PIX_FMT_YUVJ420P ||
+        frame->format == AV_PIX_FMT_YUVJ422P ||
+        frame->format == AV_PIX_FMT_YUVJ444P ||
+        frame->color_range == AVCOL_RANGE_JPEG;
+}
+
+
+// What the decoders in //third_party/ffmpeg put out besides yuv420p and
+// nv12: yuvj422p from MJPEG cameras, packed 4:2:2 from raw captures,
+// 4:4:4 and 10-bit from VP9/AV1 profiles
+static bool
+IsConvertible(int format)
+{
+    switch (format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422:
+    case AV_PIX_FMT_YUV420P10LE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// Into |to|, the frame's size; levels are left as they are
+static bool
+ConvertFrame(const AVFrame* frame, webrtc::I420Buffer* to)
+{
+    uint8_t* const* data = frame->data;
+    const int* stride    = frame->linesize;
+    uint8_t* y = to->MutableDataY();
+    uint8_t* u = to->MutableDataU();
+    uint8_t* v = to->MutableDataV();
+    const int width  = frame->width;
+    const int height = frame->height;
+
+    int result = -1;
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        result = libyuv::I420Copy(data[0], stride[0], data[1], stride[1],
+            data[2], stride[2], y, to->StrideY(), u, to->StrideU(),
+            v, to->StrideV(), width, height);
+        break;
+    case AV_PIX_FMT_NV12:
+        result = libyuv::NV12ToI420(data[0], stride[0], data[1], stride[1],
+            y, to->StrideY(), u, to->StrideU(), v, to->StrideV(),
+            width, height);
+        break;
+    case AV_PIX_FMT_NV21:
+        result = libyuv::NV21ToI420(data[0], stride[0], data[1], stride[1],
+            y, to->StrideY(), u, to->StrideU(), v, to->StrideV(),
+            width, height);
+        break;
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+        result = libyuv::I422ToI420(data[0], stride[0], data[1], stride[1],
+            data[2], stride[2], y, to->StrideY(), u, to->StrideU(),
+            v, to->StrideV(), width, height);
+        break;
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        result = libyuv::I444ToI420(data[0], stride[0], data[1], stride[1],
+            data[2], stride[2], y, to->StrideY(), u, to->StrideU(),
+            v, to->StrideV(), width, height);
+        break;
+    case AV_PIX_FMT_YUYV422:
+        result = libyuv::YUY2ToI420(data[0], stride[0],
+            y, to->StrideY(), u, to->StrideU(), v, to->StrideV(),
+            width, height);
+        break;
+    case AV_PIX_FMT_UYVY422:
+        result = libyuv::UYVYToI420(data[0], stride[0],
+            y, to->StrideY(), u, to->StrideU(), v, to->StrideV(),
+            width, height);
+        break;
+    case AV_PIX_FMT_YUV420P10LE:
+        // libyuv counts 16-bit strides in samples, ffmpeg in bytes
+        result = libyuv::I010ToI420(
+            reinterpret_cast<const uint16_t*>(data[0]), stride[0] / 2,
+            reinterpret_cast<const uint16_t*>(data[1]), stride[1] / 2,
+            reinterpret_cast<const uint16_t*>(data[2]), stride[2] / 2,
+            y, to->StrideY(), u, to->StrideU(), v, to->StrideV(),
+            width, height);
+        break;
+    }
+    return result == 0;
+}
+
+
+FFmpegAVIngest::FFmpegAVIngest()
+: loops_(0),
+  bytesRead_(0),
+  aborted_(false),
+  pool_(kPooledFrames)
+{
+    formatContext_   = NULL;
+    codecContext_    = NULL;
+    packet_          = NULL;
+    frame_           = NULL;
+    streamIndex_     = -1;
+    draining_        = false;
+    loop_            = false;
+    readSinceRewind_ = false;
+    outputWidth_     = 0;
+    outputHeight_    = 0;
+    passthrough_     = false;
+    nalLengthSize_   = 0;
+    keyFrameRequest_ = FFmpegKeyFrameRequest::Create();
+    InitNetwork();
+}
+
+
+FFmpegAVIngest::~FFmpegAVIngest()
+{ Close(); }
+
+
+int32_t
+FFmpegAVIngest::Open(
+    const std::string& url,
+    const FFmpegOptions& options,
+    const webrtc::VideoCaptureCapability& capability,
+    bool passthrough)
+{
+    Close();
+
+    SetOutputFormat(capability.width, capability.height, capability.maxFPS);
+    decimator_.Reset();
+    draining_        = false;
+    readSinceRewind_ = false;
+    passthrough_     = passthrough;
+    aborted_.store(false, std::memory_order_release);
+
+    // Chromium's libavformat has no network protocols: say so, rather
+    // than leave it to a "Protocol not found"
+    if (url.find("://") != std::string::npos &&
+        avio_find_protocol_name(url.c_str()) == NULL) {
+        RTC_LOG(LS_ERROR) << "This libavformat can't read " << url
+            << "; it has no protocol for it.";
+        return -1;
+    }
+
+    AVDictionary* dictionary = NULL;
+    for (auto& option : options)
+        av_dict_set(&dictionary, option.first.c_str(),
+            option.second.c_str(), 0);
+    // allocated here only to install the callback before anything blocks;
+    // avformat_open_input() frees it if it fails
+    formatContext_ = avformat_alloc_context();
+    if (formatContext_ == NULL) {
+        av_dict_free(&dictionary);
+        return -1;
+    }
+    formatContext_->interrupt_callback.callback = FFmpegAVIngest::Interrupt;
+    formatContext_->interrupt_callback.opaque   = this;
+    int result = avformat_open_input(
+        &formatContext_, url.c_str(), NULL, &dictionary);
+    // whatever is left wasn't recognized by the demuxer
+    AVDictionaryEntry* unused = NULL;
+    while ((unused = av_dict_get(dictionary, "", unused, AV_DICT_IGNORE_SUFFIX)))
+        RTC_LOG(LS_WARNING) << "Ignored ffmpeg option " << unused->key;
+    av_dict_free(&dictionary);
+    if (result < 0) {
+        RTC_LOG(LS_ERROR) << "Failed to open " << url << ": "
+            << AVErrorString(result);
+        formatContext_ = NULL;
+        return -1;
+    }
+
+    if ((result = avformat_find_stream_info(formatContext_, NULL)) < 0) {
+        RTC_LOG(LS_ERROR) << "Failed to probe " << url << ": "
+            << AVErrorString(result);
+        Close();
+        return -1;
+    }
+
+    streamIndex_ = av_find_best_stream(
+        formatContext_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (streamIndex_ < 0) {
+        RTC_LOG(LS_ERROR) << "No video stream in " << url;
+        Close();
+        return -1;
+    }
+
+    if (passthrough_) return OpenPassthrough(url);
+
+    AVCodecParameters* parameters =
+        formatContext_->streams[streamIndex_]->codecpar;
+    const AVCodec* decoder = avcodec_find_decoder(parameters->codec_id);
+    if (decoder == NULL) {
+        RTC_LOG(LS_ERROR) << "No decoder for codec id " << parameters->codec_id;
+        Close();
+        return -1;
+    }
+
+    codecContext_ = avcodec_alloc_context3(decoder);
+    if (codecContext_ == NULL ||
+        avcodec_parameters_to_context(codecContext_, parameters) < 0 ||
+        (result = avcodec_open2(codecContext_, decoder, NULL)) < 0) {
+        RTC_LOG(LS_ERROR) << "Failed to open decoder: " << AVErrorString(result);
+        Close();
+        return -1;
+    }
+
+    packet_ = av_packet_alloc();
+    frame_  = av_frame_alloc();
+    if (packet_ == NULL || frame_ == NULL) {
+        Close();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void
+FFmpegAVIngest::Close()
+{
+    if (frame_)         av_frame_free(&frame_);
+    if (packet_)        av_packet_free(&packet_);
+    if (codecContext_)  avcodec_free_context(&codecContext_);
+    if (formatContext_) avformat_close_input(&formatContext_);
+    streamIndex_ = -1;
+    parameterSets_.clear();
+}
+
+
+void
+FFmpegAVIngest::Abort()
+{ aborted_.store(true, std::memory_order_release); }
+
+
+int
+FFmpegAVIngest::Interrupt(void* object)
+{
+    // polled by every blocking read, connect and wait of libavformat's
+    return static_cast<FFmpegAVIngest*>(object)->aborted_.load(
+        std::memory_order_acquire) ? 1 : 0;
+}
+
+
+bool
+FFmpegAVIngest::IsOpen() const
+{
+    return !aborted_.load(std::memory_order_acquire) &&
+        (codecContext_ != NULL || (passthrough_ && packet_ != NULL));
+}
+
+
+bool
+FFmpegAVIngest::IsPassthrough() const
+{ return passthrough_; }
+
+
+void
+FFmpegAVIngest::SetLoop(bool loop)
+{ loop_ = loop; }
+
+
+uint64_t
+FFmpegAVIngest::Loops() const
+{ return loops_.load(std::memory_order_relaxed); }
+
+
+uint64_t
+FFmpegAVIngest::BytesRead() const
+{ return bytesRead_.load(std::memory_order_relaxed); }
+
+
+bool
+FFmpegAVIngest::Rewind()
+{
+    if (!loop_ || !readSinceRewind_ ||
+        aborted_.load(std::memory_order_acquire))
+        return false;
+
+    int result = av_seek_frame(formatContext_, -1,
+        formatContext_->start_time == AV_NOPTS_VALUE ?
+            0 : formatContext_->start_time,
+        AVSEEK_FLAG_BACKWARD);
+    if (result < 0) {
+        RTC_LOG(LS_WARNING) << "Can't loop: " << AVErrorString(result);
+        return false;
+    }
+
+    // the decoder was drained; it starts over at the first keyframe
+    if (codecContext_) avcodec_flush_buffers(codecContext_);
+    draining_        = false;
+    readSinceRewind_ = false;
+    loops_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+
+bool
+FFmpegAVIngest::TakeKeyFrameRequest()
+{ return keyFrameRequest_->TakeRequest(); }
+
+
+uint64_t
+FFmpegAVIngest::KeyFrameRequests() const
+{ return keyFrameRequest_->Requests(); }
+
+
+void
+FFmpegAVIngest::SetOutputFormat(int width, int height, int maxFPS)
+{
+    webrtc::MutexLock lock(&formatMutex_);
+    output_.width  = width;
+    output_.height = height;
+    output_.maxFPS = maxFPS;
+}
+
+
+int32_t
+FFmpegAVIngest::ReadFrame(
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    int64_t& ptsUs)
+{
+    if (!IsOpen()) return -1;
+    if (passthrough_) return ReadPacket(buffer, ptsUs);
+
+    while (ReceiveFrame() == 0) {
+        int64_t pts = frame_->best_effort_timestamp;
+        ptsUs = (pts == AV_NOPTS_VALUE) ? -1 : av_rescale_q(pts,
+            formatContext_->streams[streamIndex_]->time_base,
+            av_make_q(1, rtc::kNumMicrosecsPerSec));
+
+        // picks up SetOutputFormat() between pictures, never mid-way
+        {
+            webrtc::MutexLock lock(&formatMutex_);
+            outputWidth_  = output_.width;
+            outputHeight_ = output_.height;
+            decimator_.SetMaxFps(output_.maxFPS);
+        }
+
+        // same job as ffmpeg's "-r": drop pictures that arrive early
+        if (!decimator_.Accept(ptsUs)) {
+            av_frame_unref(frame_);
+            continue;
+        }
+
+        if (!IsConvertible(frame_->format)) {
+            RTC_LOG(LS_ERROR) << "Unsupported decoder pixel format "
+                << frame_->format;
+            av_frame_unref(frame_);
+            return -1;
+        }
+
+        // nullptr if every pooled buffer is still held downstream: the
+        // picture is dropped, as a sink too slow for the pipe's would be
+        buffer = WrapFrame();
+        av_frame_unref(frame_);
+        if (buffer) return 0;
+    }
+
+    return -1;
+}
+
+
+int32_t
+FFmpegAVIngest::ReceiveFrame()
+{
+    while (true) {
+        int result = avcodec_receive_frame(codecContext_, frame_);
+        if (result == 0) {
+            readSinceRewind_ = true;
+            return 0;
+        }
+        if (result == AVERROR_EOF && Rewind()) continue;
+        if (result != AVERROR(EAGAIN) || draining_) return -1;
+
+        result = av_read_frame(formatContext_, packet_);
+        if (result < 0 && aborted_.load(std::memory_order_acquire))
+            return -1; // not the end: nothing left worth draining
+        if (result < 0) {
+            // end of input - flush whatever the decoder is still holding
+            draining_ = true;
+            avcodec_send_packet(codecContext_, NULL);
+            continue;
+        }
+        bytesRead_.fetch_add(packet_->size, std::memory_order_relaxed);
+
+        if (packet_->stream_index == streamIndex_)
+            result = avcodec_send_packet(codecContext_, packet_);
+        av_packet_unref(packet_);
+
+        // a corrupt packet is not fatal; the next keyframe recovers it
+        if (result < 0 && result != AVERROR(EAGAIN) &&
+            result != AVERROR_INVALIDDATA) {
+            RTC_LOG(LS_ERROR) << "Decode failed: " << AVErrorString(result);
+            return -1;
+        }
+    }
+}
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegAVIngest::WrapFrame()
+{
+    const int width  = outputWidth_  > 0 ? outputWidth_  : frame_->width;
+    const int height = outputHeight_ > 0 ? outputHeight_ : frame_->height;
+    const bool scale = frame_->width != width || frame_->height != height;
+    // yuvj can't be handed out as it is: sinks would read its levels as
+    // limited range, washed out
+    const bool fullRange = IsFullRange(frame_);
+
+    // NV12 (hardware decoders) stays NV12: sinks that want I420 convert
+    // on their own, through ToI420()
+    if (!fullRange && FFmpegAVNV12FrameBuffer::IsWrappable(frame_)) {
+        rtc::scoped_refptr<webrtc::NV12BufferInterface> source =
+            FFmpegAVNV12FrameBuffer::Create(frame_);
+        if (!source || !scale) return source;
+
+        rtc::scoped_refptr<webrtc::NV12Buffer> scaled =
+            pool_.CreateNV12Buffer(width, height);
+        if (scaled)
+            scaled->CropAndScaleFrom(*source, 0, 0,
+                source->width(), source->height());
+        return scaled;
+    }
+
+    // the common case: hand the decoder's picture straight to the sinks
+    rtc::scoped_refptr<webrtc::I420BufferInterface> source;
+    if (FFmpegAVFrameBuffer::IsWrappable(frame_))
+        source = FFmpegAVFrameBuffer::Create(frame_);
+    if (source && !scale && !fullRange) return source;
+
+    rtc::scoped_refptr<webrtc::I420Buffer> output =
+        pool_.CreateI420Buffer(width, height);
+    if (!output) return nullptr;
+
+    // anything else is converted at its own size: straight into the
+    // output, unless that still has to be scaled
+    if (!source) {
+        rtc::scoped_refptr<webrtc::I420Buffer> converted = scale ?
+            pool_.CreateI420Buffer(frame_->width, frame_->height) : output;
+        if (!converted || !ConvertFrame(frame_, converted.get()))
+            return nullptr;
+        source = converted;
+    }
+
+    // the levels are mapped in the last pass over the picture, into the
+    // output (or within it, after the scale); no copy of their own
+    if (scale) output->ScaleFrom(*source);
+    if (fullRange) ToLimitedRange(scale ? *output : *source, output.get());
+    return output;
+}
+
+
+int32_t
+FFmpegAVIngest::OpenPassthrough(const std::string& url)
+{
+    AVCodecParameters* parameters =
+        formatContext_->streams[streamIndex_]->codecpar;
+    if (parameters->codec_id != AV_CODEC_ID_H264) {
+        RTC_LOG(LS_WARNING) << url << " is not H.264; can't pass it through.";
+        Close();
+        return -1;
+    }
+
+    // MP4/MKV carry "avcC": length-prefixed NAL units, with the parameter
+    // sets out of band. The RTP packetizer wants start codes and in-band
+    // parameter sets.
+    const uint8_t* extra = parameters->extradata;
+    const int extraSize  = parameters->extradata_size;
+    nalLengthSize_ = 0;
+    if (extra && extraSize >= 7 && extra[0] == 1) {
+        nalLengthSize_ = (extra[4] & 0x3) + 1;
+        int offset = 5;
+        for (int set = 0; set < 2 && offset < extraSize; set++) {
+            // first the SPSs, then the PPSs
+            int count = set == 0 ? extra[offset++] & 0x1F : extra[offset++];
+            for (int i = 0; i < count && offset + 2 <= extraSize; i++) {
+                int length = (extra[offset] << 8) | extra[offset + 1];
+                offset += 2;
+                if (offset + length > extraSize) break;
+                static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+                parameterSets_.insert(parameterSets_.end(),
+                    kStartCode, kStartCode + sizeof(kStartCode));
+                parameterSets_.insert(parameterSets_.end(),
+                    extra + offset, extra + offset + length);
+                offset += length;
+            }
+        }
+    }
+    else if (extra && extraSize > 0)
+        parameterSets_.assign(extra, extra + extraSize); // already Annex B
+
+    packet_ = av_packet_alloc();
+    if (packet_ == NULL) {
+        Close();
+        return -1;
+    }
+
+    RTC_LOG(LS_INFO) << "Passing " << url << " through ("
+        << parameters->width << "x" << parameters->height << ", "
+        << (nalLengthSize_ ? "avcC" : "Annex B") << ")";
+    return 0;
+}
+
+
+int32_t
+FFmpegAVIngest::ReadPacket(
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    int64_t& ptsUs)
+{
+    AVStream* stream = formatContext_->streams[streamIndex_];
+
+    while (av_read_frame(formatContext_, packet_) >= 0 || Rewind()) {
+        bytesRead_.fetch_add(packet_->size, std::memory_order_relaxed);
+        if (packet_->stream_index != streamIndex_ || packet_->size <= 0) {
+            av_packet_unref(packet_);
+            continue;
+        }
+        readSinceRewind_ = true;
+
+        // no "-r" here: dropping a frame would break every frame after it
+        // up to the next keyframe
+        int64_t pts = packet_->pts;
+        ptsUs = (pts == AV_NOPTS_VALUE) ? -1 : av_rescale_q(pts,
+            stream->time_base, av_make_q(1, rtc::kNumMicrosecsPerSec));
+
+        bool keyFrame = (packet_->flags & AV_PKT_FLAG_KEY) != 0;
+        rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data =
+            ToAnnexB(packet_->data, packet_->size, keyFrame);
+        av_packet_unref(packet_);
+        if (!data) continue; // malformed; the next keyframe recovers it
+
+        buffer = FFmpegEncodedFrameBuffer::Create(webrtc::kVideoCodecH264,
+            stream->codecpar->width, stream->codecpar->height,
+            keyFrame, data, keyFrameRequest_);
+        return 0;
+    }
+
+    return -1;
+}
+
+
+rtc::scoped_refptr<webrtc::EncodedImageBufferInterface>
+FFmpegAVIngest::ToAnnexB(const uint8_t* data, size_t size, bool keyFrame)
+{
+    static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+    std::vector<uint8_t> units;
+    bool hasParameterSets = false;
+
+    if (nalLengthSize_ == 0) {
+        // look for an SPS (type 7) after any start code
+        for (size_t i = 0; i + 3 < size && !hasParameterSets; i++)
+            if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+                hasParameterSets = (data[i + 3] & 0x1F) == 7;
+        units.assign(data, data + size);
+    }
+    else {
+        size_t offset = 0;
+        while (offset + nalLengthSize_ <= size) {
+            size_t length = 0;
+            for (size_t i = 0; i < nalLengthSize_; i++)
+                length = (length << 8) | data[offset + i];
+            offset += nalLengthSize_;
+            if (length == 0 || offset + length > size) return nullptr;
+            hasParameterSets |= (data[offset] & 0x1F) == 7;
+            units.insert(units.end(), kStartCode,
+                kStartCode + sizeof(kStartCode));
+            units.insert(units.end(), data + offset, data + offset + length);
+            offset += length;
+        }
+        if (offset != size) return nullptr;
+    }
+
+    // a receiver joining at this keyframe has to get the SPS/PPS too
+    if (keyFrame && !hasParameterSets && !parameterSets_.empty())
+        units.insert(units.begin(),
+            parameterSets_.begin(), parameterSets_.end());
+
+    return webrtc::EncodedImageBuffer::Create(units.data(), units.size());
+}
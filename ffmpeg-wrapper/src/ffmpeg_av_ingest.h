@@ -0,0 +1,145 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  In-process demux/decode using libavformat and libavcodec.
+ */
+
+#ifndef DEMO_FFMPEG_AV_INGEST_H_
+#define DEMO_FFMPEG_AV_INGEST_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include "modules/video_capture/video_capture.h"
+#include "rtc_base/synchronization/mutex.h"
+#include "ffmpeg_capture_clock.h"
+#include "ffmpeg_device_registry.h"
+#include "ffmpeg_encoded_frame_buffer.h"
+#include "ffmpeg_frame_buffer_pool.h"
+
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVPacket;
+
+
+// Does the same job as the "ffmpeg -i <url> -c:v rawvideo -" child process,
+// minus the fork/exec and the copies through the pipe: decoded pictures are
+// handed out as FFmpegAVFrameBuffers (yuv420p) or FFmpegAVNV12FrameBuffers
+// (nv12) referencing the decoder's own memory. Pictures that have to be
+// scaled, brought to limited range, or converted from another format
+// (yuvj422p, yuyv422, yuv444p, yuv420p10le...) go into pooled buffers.
+//
+// In passthrough mode nothing is decoded: H.264 access units are handed out
+// as FFmpegEncodedFrameBuffers, for FFmpegPassthroughVideoEncoder to send
+// as they are.
+//
+// Built against //third_party/ffmpeg, Chromium's decode-only libavformat
+// and libavcodec: it opens the containers and codecs a browser plays, but
+// has neither network protocols nor a raw H.264 demuxer. Such inputs go
+// through the ffmpeg CLI instead (FFmpegDeviceConfig::pipe).
+class FFmpegAVIngest {
+public:
+    FFmpegAVIngest();
+    ~FFmpegAVIngest();
+
+    // Opens |url| and its best video stream. Frames are scaled to the
+    // capability's size (when it differs from the stream's) and decimated
+    // to capability.maxFPS. |options| go to the demuxer, as they would
+    // before "-i" on the command line.
+    // With |passthrough| the capability's size and frame rate are ignored
+    // (encoded frames can be neither scaled nor dropped), and opening fails
+    // unless the stream is H.264.
+    int32_t Open(
+        const std::string& url,
+        const FFmpegOptions& options,
+        const webrtc::VideoCaptureCapability& capability,
+        bool passthrough = false);
+
+    void Close();
+
+    // Makes a ReadFrame() (or Open()) blocked in the demuxer, waiting on a
+    // stalled source, return -1 now, and every later one until the next
+    // Open(). Safe to call from any thread. The input is left mid-packet,
+    // so IsOpen() is false from then on and nothing should reuse it.
+    void Abort();
+
+    // How long a reader is given to finish the read in progress before
+    // it's aborted: a frame interval or two of any healthy source.
+    static const int kAbortGraceMs = 500;
+
+    bool IsOpen() const;
+    bool IsPassthrough() const;
+
+    // Changes the size and frame rate pictures are scaled and decimated
+    // to, from the next picture on; the decoder keeps running. Safe to
+    // call from any thread, even while ReadFrame() is blocked.
+    void SetOutputFormat(int width, int height, int maxFPS);
+
+    // Seeks back to the start at the end of the input rather than ending,
+    // like "-stream_loop -1". Presentation times start over with it.
+    void SetLoop(bool loop);
+    uint64_t Loops() const;
+
+    // Of every packet demuxed, since it was created.
+    uint64_t BytesRead() const;
+
+    // Demuxes and decodes until the next picture is ready.
+    // ptsUs is the picture's presentation time in microseconds, or -1 if
+    // the stream does not carry one.
+    // Returns -1 on end-of-stream or error.
+    int32_t ReadFrame(
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        int64_t& ptsUs);
+
+    // Passthrough only: true (once) if an encoder asked for a keyframe.
+    bool TakeKeyFrameRequest();
+    uint64_t KeyFrameRequests() const;
+
+private:
+    static int Interrupt(void* object); // AVIOInterruptCB
+
+    AVFormatContext* formatContext_;
+    AVCodecContext* codecContext_;
+    AVPacket* packet_;
+    AVFrame* frame_;
+    int streamIndex_;
+    bool draining_;
+    bool loop_;
+    std::atomic<uint64_t> loops_;
+    std::atomic<uint64_t> bytesRead_;
+    std::atomic<bool> aborted_;
+    bool readSinceRewind_; // an empty input would loop forever
+
+    webrtc::Mutex formatMutex_;
+    webrtc::VideoCaptureCapability output_; // as last set; guarded
+    int outputWidth_;  // as of the picture being read
+    int outputHeight_;
+    FFmpegFrameDecimator decimator_;
+    FFmpegFrameBufferPool pool_; // for pictures that can't be wrapped
+
+    bool passthrough_;
+    size_t nalLengthSize_;                // 0 if packets already are Annex B
+    std::vector<uint8_t> parameterSets_;  // SPS/PPS, Annex B
+    rtc::scoped_refptr<FFmpegKeyFrameRequest> keyFrameRequest_;
+
+    int32_t ReceiveFrame();
+    bool Rewind();
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> WrapFrame();
+    int32_t OpenPassthrough(const std::string& url);
+    int32_t ReadPacket(
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        int64_t& ptsUs);
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> ToAnnexB(
+        const uint8_t* data, size_t size, bool keyFrame);
+};
+
+#endif
@@ -0,0 +1,947 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Microbenchmarks for the capture paths in ffmpeg_video_capture_module.cc
+ *  and ffmpeg_audio_device.cc
+ */
+
+#include <stdlib.h> // mkstemps(), setenv()
+#include <time.h>   // clock_gettime()
+#include <unistd.h> // readlink()
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api/task_queue/default_task_queue_factory.h"
+#include "api/video/i420_buffer.h"
+#include "api/video/nv12_buffer.h"
+#include "api/video/video_frame.h"
+#include "api/video/video_sink_interface.h"
+#include "api/video_codecs/video_codec.h"
+#include "api/video_codecs/video_encoder.h"
+#include "common_video/libyuv/include/webrtc_libyuv.h"
+#include "media/base/codec.h"
+#include "media/base/media_constants.h"
+#include "modules/audio_device/include/audio_device_defines.h"
+#include "modules/video_coding/codecs/h264/include/h264.h"
+#include "modules/video_coding/include/video_error_codes.h"
+#include "rtc_base/event.h"
+#include "rtc_base/ref_counted_object.h"
+#include "rtc_base/time_utils.h"
+#include "third_party/libyuv/include/libyuv.h"
+
+#include "ffmpeg_argb_buffer.h"
+#include "ffmpeg_audio_device_module.h"
+#include "ffmpeg_device_registry.h"
+#include "ffmpeg_frame_buffer_pool.h"
+#include "ffmpeg_frame_cache.h"
+#include "ffmpeg_frame_converter.h"
+#include "ffmpeg_simulcast_scaler.h"
+#include "ffmpeg_synthetic_source.h"
+#include "ffmpeg_video_capture_module.h"
+#include "ffmpeg_worker_pool.h"
+#include "system_wrappers/include/cpu_info.h"
+
+
+namespace {
+
+const int kFramesPerRun = 300;
+
+struct Resolution {
+    int width;
+    int height;
+};
+
+const Resolution kResolutions[] = {
+    {  640,  480 },
+    { 1280,  720 },
+    { 1920, 1080 },
+};
+
+// What the conversion is spread over: a huge frame, or many small ones
+struct StreamMix {
+    const char* name;
+    Resolution resolution;
+    int streams;
+};
+
+const StreamMix kStreamMixes[] = {
+    { "1 x 4k rgb24",   { 3840, 2160 }, 1 },
+    { "8 x 720p rgb24", { 1280,  720 }, 8 },
+};
+
+// frames per stream and run; a 4K conversion takes tens of milliseconds
+const int kFramesPerCoresRun = 60;
+
+
+// One raw frame, read back through stdio the same way the capture thread
+// reads the ffmpeg pipe.
+class SyntheticStream {
+public:
+    SyntheticStream(webrtc::VideoType type, int width, int height)
+    : frame_(webrtc::CalcBufferSize(type, width, height))
+    {
+        for (size_t i = 0; i < frame_.size(); i++)
+            frame_[i] = static_cast<uint8_t>(i * 7);
+        stream_ = fmemopen(&frame_[0], frame_.size(), "r");
+    }
+
+    ~SyntheticStream()
+    { if (stream_) fclose(stream_); }
+
+    FILE* NextFrame()
+    {
+        fseek(stream_, 0, SEEK_SET);
+        return stream_;
+    }
+
+    size_t FrameSize() const
+    { return frame_.size(); }
+
+private:
+    std::vector<uint8_t> frame_;
+    FILE* stream_;
+};
+
+
+struct Result {
+    double nsPerFrame;
+    double cpuNsPerFrame;
+    double bytesCopiedPerFrame;
+};
+
+
+struct PixelFormat {
+    const char* name;
+    webrtc::VideoType type;
+};
+
+const PixelFormat kPixelFormats[] = {
+    { "i420",  webrtc::VideoType::kI420  },
+    { "nv12",  webrtc::VideoType::kNV12  },
+    { "argb",  webrtc::VideoType::kARGB  },
+    { "rgb24", webrtc::VideoType::kRGB24 },
+};
+
+
+// CPU time of the calling thread; unlike wall time it doesn't count the
+// time the benchmark was preempted
+int64_t
+ThreadCpuNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<int64_t>(now.tv_sec) * rtc::kNumNanosecsPerSec +
+        now.tv_nsec;
+}
+
+
+class Timer {
+public:
+    Timer()
+    : start_(rtc::TimeNanos()),
+      cpuStart_(ThreadCpuNanos())
+    { }
+
+    Result Stop(uint64_t copied) const
+    {
+        Result result;
+        result.nsPerFrame = static_cast<double>(
+            rtc::TimeNanos() - start_) / kFramesPerRun;
+        result.cpuNsPerFrame = static_cast<double>(
+            ThreadCpuNanos() - cpuStart_) / kFramesPerRun;
+        result.bytesCopiedPerFrame =
+            static_cast<double>(copied) / kFramesPerRun;
+        return result;
+    }
+
+private:
+    int64_t start_;
+    int64_t cpuStart_;
+};
+
+
+bool
+ReadPlane(FILE* stream, uint8_t* data, int stride, int width, int height)
+{
+    size_t rowLength = static_cast<size_t>(width);
+    if (stride == width) {
+        size_t length = rowLength * height;
+        return fread(data, 1, length, stream) == length;
+    }
+    for (int row = 0; row < height; row++, data += stride)
+        if (fread(data, 1, rowLength, stream) != rowLength) return false;
+    return true;
+}
+
+
+// fread() into rawFrameBuffer_, then ConvertToI420() into a fresh buffer
+Result
+ReadAndConvert(const Resolution& resolution, FFmpegFrameBufferPool* pool)
+{
+    const int width = resolution.width, height = resolution.height;
+    SyntheticStream stream(webrtc::VideoType::kI420, width, height);
+    std::vector<uint8_t> raw(stream.FrameSize());
+    uint64_t copied = 0;
+
+    Timer timer;
+    for (int i = 0; i < kFramesPerRun; i++) {
+        copied += fread(&raw[0], 1, raw.size(), stream.NextFrame());
+        rtc::scoped_refptr<webrtc::I420Buffer> buffer = pool ?
+            pool->CreateI420Buffer(width, height) :
+            webrtc::I420Buffer::Create(width, height);
+        libyuv::ConvertToI420(
+            &raw[0], raw.size(),
+            buffer->MutableDataY(), buffer->StrideY(),
+            buffer->MutableDataU(), buffer->StrideU(),
+            buffer->MutableDataV(), buffer->StrideV(),
+            0, 0, width, height, width, height,
+            libyuv::kRotate0, libyuv::FOURCC_I420);
+        copied += raw.size();
+    }
+    return timer.Stop(copied);
+}
+
+
+// ReadI420Frame(): fread() straight into the planes of a pooled buffer
+Result
+ReadIntoPlanes(const Resolution& resolution, FFmpegFrameBufferPool* pool)
+{
+    const int width = resolution.width, height = resolution.height;
+    SyntheticStream stream(webrtc::VideoType::kI420, width, height);
+    uint64_t copied = 0;
+
+    Timer timer;
+    for (int i = 0; i < kFramesPerRun; i++) {
+        FILE* file = stream.NextFrame();
+        rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+            pool->CreateI420Buffer(width, height);
+        if (!ReadPlane(file, buffer->MutableDataY(), buffer->StrideY(),
+                buffer->width(), buffer->height()) ||
+            !ReadPlane(file, buffer->MutableDataU(), buffer->StrideU(),
+                buffer->ChromaWidth(), buffer->ChromaHeight()) ||
+            !ReadPlane(file, buffer->MutableDataV(), buffer->StrideV(),
+                buffer->ChromaWidth(), buffer->ChromaHeight()))
+            abort();
+        copied += stream.FrameSize();
+    }
+    return timer.Stop(copied);
+}
+
+
+// FFmpegVideoCaptureModule::NextFrame(): read into a pooled buffer of the
+// source's own format (RGB24 has none and is converted). With |toI420| the consumer
+// also asks for I420, as an encoder without native NV12 input would.
+Result
+ReadNative(const Resolution& resolution, const PixelFormat& format,
+    FFmpegFrameBufferPool* pool, bool toI420)
+{
+    const int width = resolution.width, height = resolution.height;
+    SyntheticStream stream(format.type, width, height);
+    std::vector<uint8_t> raw;
+    uint64_t copied = 0;
+
+    Timer timer;
+    for (int i = 0; i < kFramesPerRun; i++) {
+        FILE* file = stream.NextFrame();
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame;
+        bool complete = false;
+
+        switch (format.type) {
+        case webrtc::VideoType::kNV12: {
+            rtc::scoped_refptr<webrtc::NV12Buffer> buffer =
+                pool->CreateNV12Buffer(width, height);
+            complete =
+                ReadPlane(file, buffer->MutableDataY(), buffer->StrideY(),
+                    width, height) &&
+                ReadPlane(file, buffer->MutableDataUV(), buffer->StrideUV(),
+                    buffer->ChromaWidth() * 2, buffer->ChromaHeight());
+            frame = buffer;
+            break;
+        }
+        case webrtc::VideoType::kARGB: {
+            rtc::scoped_refptr<FFmpegARGBBuffer> buffer =
+                pool->CreateARGBBuffer(width, height);
+            complete = ReadPlane(file, buffer->MutableData(),
+                buffer->Stride(), width * 4, height);
+            frame = buffer;
+            break;
+        }
+        case webrtc::VideoType::kRGB24: {
+            raw.resize(stream.FrameSize());
+            complete = fread(&raw[0], 1, raw.size(), file) == raw.size();
+            rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+                pool->CreateI420Buffer(width, height);
+            libyuv::ConvertToI420(
+                &raw[0], raw.size(),
+                buffer->MutableDataY(), buffer->StrideY(),
+                buffer->MutableDataU(), buffer->StrideU(),
+                buffer->MutableDataV(), buffer->StrideV(),
+                0, 0, width, height, width, height,
+                libyuv::kRotate0, libyuv::FOURCC_24BG);
+            copied += webrtc::CalcBufferSize(
+                webrtc::VideoType::kI420, width, height);
+            frame = buffer;
+            break;
+        }
+        default: {
+            rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+                pool->CreateI420Buffer(width, height);
+            complete =
+                ReadPlane(file, buffer->MutableDataY(), buffer->StrideY(),
+                    width, height) &&
+                ReadPlane(file, buffer->MutableDataU(), buffer->StrideU(),
+                    buffer->ChromaWidth(), buffer->ChromaHeight()) &&
+                ReadPlane(file, buffer->MutableDataV(), buffer->StrideV(),
+                    buffer->ChromaWidth(), buffer->ChromaHeight());
+            frame = buffer;
+            break;
+        }
+        }
+        if (!complete) abort();
+        copied += stream.FrameSize();
+
+        // a no-op for I420 buffers
+        if (toI420 && frame->type() != webrtc::VideoFrameBuffer::Type::kI420) {
+            frame->ToI420();
+            copied += webrtc::CalcBufferSize(
+                webrtc::VideoType::kI420, width, height);
+        }
+    }
+    return timer.Stop(copied);
+}
+
+
+rtc::scoped_refptr<webrtc::I420Buffer>
+SyntheticI420Frame(const Resolution& resolution)
+{
+    rtc::scoped_refptr<webrtc::I420Buffer> frame =
+        webrtc::I420Buffer::Create(resolution.width, resolution.height);
+    for (int row = 0; row < frame->height(); row++)
+        memset(frame->MutableDataY() + row * frame->StrideY(), row,
+            frame->width());
+    for (int row = 0; row < frame->ChromaHeight(); row++) {
+        memset(frame->MutableDataU() + row * frame->StrideU(), 128,
+            frame->ChromaWidth());
+        memset(frame->MutableDataV() + row * frame->StrideV(), 128,
+            frame->ChromaWidth());
+    }
+    return frame;
+}
+
+
+// What the SimulcastEncoderAdapter does for every stream but the top one:
+// scale the full frame into a fresh buffer, one stream after the other
+Result
+ScalePerStream(const Resolution& resolution)
+{
+    rtc::scoped_refptr<webrtc::I420Buffer> source =
+        SyntheticI420Frame(resolution);
+    uint64_t copied = 0;
+
+    Timer timer;
+    for (int i = 0; i < kFramesPerRun; i++) {
+        for (size_t layer = 1; layer < FFmpegSimulcastScaler::kMaxLayers;
+                layer++) {
+            rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+                webrtc::I420Buffer::Create(
+                    resolution.width >> layer, resolution.height >> layer);
+            scaled->ScaleFrom(*source->ToI420());
+            copied += webrtc::CalcBufferSize(webrtc::VideoType::kI420,
+                scaled->width(), scaled->height());
+        }
+    }
+    return timer.Stop(copied);
+}
+
+
+// FFmpegSimulcastScaler: the same layers into pooled buffers, in bands of
+// each plane on the shared worker pool; cpu ns/frame is the delivery
+// thread's share
+Result
+ScalePyramid(const Resolution& resolution, FFmpegFrameBufferPool* pool)
+{
+    rtc::scoped_refptr<webrtc::I420Buffer> source =
+        SyntheticI420Frame(resolution);
+    FFmpegSimulcastScaler scaler(pool);
+    scaler.SetLayers(FFmpegSimulcastScaler::kMaxLayers);
+    uint64_t copied = 0;
+
+    Timer timer;
+    for (int i = 0; i < kFramesPerRun; i++) {
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer> layered =
+            scaler.Scale(source);
+        for (size_t layer = 1; layer < FFmpegSimulcastScaler::kMaxLayers;
+                layer++)
+            copied += webrtc::CalcBufferSize(webrtc::VideoType::kI420,
+                resolution.width >> layer, resolution.height >> layer);
+    }
+    return timer.Stop(copied);
+}
+
+
+// FFmpegFrameConverter: RGB24 to I420 in bands on a pool of |threads|
+// workers, from every stream at once (each stream is a capture thread);
+// returns frames converted a second, across all streams
+double
+ConvertOnCores(const StreamMix& mix, size_t threads)
+{
+    const int width = mix.resolution.width, height = mix.resolution.height;
+    std::vector<uint8_t> frame(
+        webrtc::CalcBufferSize(webrtc::VideoType::kRGB24, width, height));
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = static_cast<uint8_t>(i * 7);
+
+    FFmpegWorkerPool workers(threads, "BenchWorker");
+    std::vector<std::thread> streams;
+    const int64_t start = rtc::TimeNanos();
+    for (int i = 0; i < mix.streams; i++) {
+        streams.emplace_back([&]() {
+            FFmpegFrameConverter converter(&workers);
+            rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+                webrtc::I420Buffer::Create(width, height);
+            for (int f = 0; f < kFramesPerCoresRun; f++)
+                converter.ConvertToI420(&frame[0], frame.size(),
+                    webrtc::VideoType::kRGB24, width, height,
+                    libyuv::kRotate0, buffer.get());
+        });
+    }
+    for (std::thread& stream : streams) stream.join();
+
+    return static_cast<double>(mix.streams) * kFramesPerCoresRun *
+        rtc::kNumNanosecsPerSec / (rtc::TimeNanos() - start);
+}
+
+
+// Counts every operator new in the process, on any thread
+std::atomic<uint64_t> allocations(0);
+
+// What the module benchmarks leave out: the start, and whatever the first
+// frames cost on top of the steady state
+const int kWarmupFrames  = 30;
+const int kRunTimeoutMs  = 60000;
+// Encoded once per resolution, then looped by the in-process ingest
+const int kH264Frames    = 60;
+const char kStandInFlag[] = "--synthetic-ffmpeg";
+const char kBenchDevice[] = "ffmpeg-bench";
+
+
+int64_t
+ProcessCpuNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return static_cast<int64_t>(now.tv_sec) * rtc::kNumNanosecsPerSec +
+        now.tv_nsec;
+}
+
+
+struct Throughput {
+    double framesPerSecond;
+    double nsPerFrame;
+    double cpuNsPerFrame;     // every thread of the process
+    double allocationsPerFrame;
+};
+
+
+// Times kFramesPerRun frames (or 10ms chunks, or calls) after the first
+// kWarmupFrames, with whatever threads the module runs them on.
+class RateMeter {
+public:
+    RateMeter()
+    : ticks_(0)
+    { }
+
+    void Tick()
+    {
+        const int tick = ++ticks_;
+        if (tick == kWarmupFrames) Sample(start_);
+        else if (tick == kWarmupFrames + kFramesPerRun) {
+            Sample(end_);
+            done_.Set();
+        }
+    }
+
+    bool Wait()
+    { return done_.Wait(kRunTimeoutMs); }
+
+    Throughput Result() const
+    {
+        Throughput result;
+        const double ns = static_cast<double>(end_.ns - start_.ns);
+        result.framesPerSecond = kFramesPerRun * rtc::kNumNanosecsPerSec / ns;
+        result.nsPerFrame = ns / kFramesPerRun;
+        result.cpuNsPerFrame =
+            static_cast<double>(end_.cpuNs - start_.cpuNs) / kFramesPerRun;
+        result.allocationsPerFrame =
+            static_cast<double>(end_.allocations - start_.allocations) /
+            kFramesPerRun;
+        return result;
+    }
+
+private:
+    struct Point {
+        int64_t ns;
+        int64_t cpuNs;
+        uint64_t allocations;
+    };
+
+    static void Sample(Point& point)
+    {
+        point.ns          = rtc::TimeNanos();
+        point.cpuNs       = ProcessCpuNanos();
+        point.allocations = allocations.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<int> ticks_;
+    Point start_;
+    Point end_;
+    rtc::Event done_;
+};
+
+
+class CountingSink : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+public:
+    void OnFrame(const webrtc::VideoFrame& /* frame */) override
+    { meter.Tick(); }
+
+    RateMeter meter;
+};
+
+
+class CountingTransport : public webrtc::AudioTransport {
+public:
+    int32_t RecordedDataIsAvailable(
+        const void* /* audioSamples */,
+        const size_t /* nSamples */,
+        const size_t /* nBytesPerSample */,
+        const size_t /* nChannels */,
+        const uint32_t /* samplesPerSec */,
+        const uint32_t /* totalDelayMS */,
+        const int32_t /* clockDrift */,
+        const uint32_t /* currentMicLevel */,
+        const bool /* keyPressed */,
+        uint32_t& newMicLevel) override
+    {
+        newMicLevel = 0;
+        meter.Tick();
+        return 0;
+    }
+
+    int32_t NeedMorePlayData(
+        const size_t nSamples,
+        const size_t nBytesPerSample,
+        const size_t nChannels,
+        const uint32_t /* samplesPerSec */,
+        void* audioSamples,
+        size_t& nSamplesOut,
+        int64_t* elapsed_time_ms,
+        int64_t* ntp_time_ms) override
+    {
+        memset(audioSamples, 0, nSamples * nBytesPerSample);
+        nSamplesOut = nSamples;
+        *elapsed_time_ms = -1;
+        *ntp_time_ms = -1;
+        return 0;
+    }
+
+    void PullRenderData(
+        int /* bits_per_sample */,
+        int /* sample_rate */,
+        size_t /* number_of_channels */,
+        size_t /* number_of_frames */,
+        void* /* audio_data */,
+        int64_t* /* elapsed_time_ms */,
+        int64_t* /* ntp_time_ms */) override
+    { }
+
+    RateMeter meter;
+};
+
+
+// Has the pipe ingests run this very program, as FFmpegSyntheticSource,
+// in place of ffmpeg
+bool
+UseSyntheticFFmpeg()
+{
+    char self[4096];
+    ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length <= 0) return false;
+    self[length] = '\0';
+    std::string command = std::string("'") + self + "' " + kStandInFlag;
+    return setenv("FFMPEG_BINARY", command.c_str(), 1) == 0;
+}
+
+
+FFmpegDeviceConfig
+BenchDevice(const std::string& url,
+    const std::vector<webrtc::VideoCaptureCapability>& capabilities)
+{
+    FFmpegDeviceConfig device;
+    device.name            = kBenchDevice;
+    device.id              = kBenchDevice;
+    device.product         = kBenchDevice;
+    device.orientation     = webrtc::kVideoRotation_0;
+    device.capabilities    = capabilities;
+    device.url             = url;
+    device.passthrough     = false;
+    device.simulcastLayers = 1;
+    device.realtime        = false; // as fast as it goes
+    device.loop            = true;
+    device.warmSeconds     = 0;
+    device.shared          = true;
+    return device;
+}
+
+
+webrtc::VideoCaptureCapability
+Capability(const Resolution& resolution, webrtc::VideoType type, int fps)
+{
+    webrtc::VideoCaptureCapability capability;
+    capability.width     = resolution.width;
+    capability.height    = resolution.height;
+    capability.maxFPS    = fps;
+    capability.videoType = type;
+    return capability;
+}
+
+
+// StartCapture() to StopCapture() of FFmpegVideoCaptureModule, from
+// |url|, unpaced. Returns false if the frames didn't come, or came some
+// other way than |mode| (a fallback would measure the wrong thing).
+bool
+RunCapture(const std::string& url, const webrtc::VideoCaptureCapability&
+    capability, FFmpegVideoCaptureModule::IngestMode mode, Throughput& result)
+{
+    FFmpegDeviceRegistry::GetInstance()->AddDevice(
+        BenchDevice(url, { capability }));
+    rtc::scoped_refptr<FFmpegVideoCaptureModule> module(
+        new rtc::RefCountedObject<FFmpegVideoCaptureModule>(kBenchDevice));
+    CountingSink sink;
+    module->RegisterCaptureDataCallback(&sink);
+    module->SetIngestMode(mode);
+
+    bool ok = module->StartCapture(capability) == 0 &&
+        module->GetActiveIngestMode() == mode && sink.meter.Wait();
+    module->StopCapture();
+    module->DeRegisterCaptureDataCallback();
+    if (ok) result = sink.meter.Result();
+    return ok;
+}
+
+
+class H264FileWriter : public webrtc::EncodedImageCallback {
+public:
+    explicit H264FileWriter(FILE* file)
+    : file_(file)
+    { }
+
+    Result OnEncodedImage(
+        const webrtc::EncodedImage& image,
+        const webrtc::CodecSpecificInfo* /* info */) override
+    {
+        // OpenH264 writes Annex B, what the raw h264 demuxer reads
+        fwrite(image.data(), 1, image.size(), file_);
+        return Result(Result::OK);
+    }
+
+private:
+    FILE* file_;
+};
+
+
+// kH264Frames of FFmpegSyntheticSource's pattern, encoded with WebRTC's
+// own H.264 encoder, as a stand-in for a camera's stream. Returns the
+// file's path, or "" if there's no H.264 encoder in this build.
+std::string
+WriteSyntheticH264(const Resolution& resolution)
+{
+    if (!webrtc::H264Encoder::IsSupported()) return "";
+    char path[] = "/tmp/ffmpeg_capture_benchmark_XXXXXX.h264";
+    int fd = mkstemps(path, 5);
+    if (fd < 0) return "";
+    FILE* file = fdopen(fd, "wb");
+
+    const int width = resolution.width, height = resolution.height;
+    webrtc::VideoCodec codec;
+    codec.codecType    = webrtc::kVideoCodecH264;
+    codec.width        = width;
+    codec.height       = height;
+    codec.maxFramerate = 30;
+    codec.startBitrate = 4000;
+    codec.maxBitrate   = 4000;
+    *codec.H264() = webrtc::VideoEncoder::GetDefaultH264Settings();
+    codec.H264()->frameDroppingOn  = false;
+    codec.H264()->keyFrameInterval = kH264Frames;
+
+    std::unique_ptr<webrtc::H264Encoder> encoder =
+        webrtc::H264Encoder::Create(cricket::VideoCodec(cricket::kH264CodecName));
+    H264FileWriter writer(file);
+    bool ok = encoder->InitEncode(&codec, webrtc::VideoEncoder::Settings(
+            webrtc::VideoEncoder::Capabilities(false), 1, 1200)) ==
+        WEBRTC_VIDEO_CODEC_OK &&
+        encoder->RegisterEncodeCompleteCallback(&writer) ==
+        WEBRTC_VIDEO_CODEC_OK;
+
+    std::vector<uint8_t> raw(
+        webrtc::CalcBufferSize(webrtc::VideoType::kI420, width, height));
+    const int chromaWidth  = (width  + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+    for (int i = 0; ok && i < kH264Frames; i++) {
+        FFmpegSyntheticSource::FillFrame(&raw[0], raw.size(), width, i);
+        const uint8_t* dataU = &raw[0] + width * height;
+        const uint8_t* dataV = dataU + chromaWidth * chromaHeight;
+        webrtc::VideoFrame frame = webrtc::VideoFrame::Builder()
+            .set_video_frame_buffer(webrtc::I420Buffer::Copy(width, height,
+                &raw[0], width, dataU, chromaWidth, dataV, chromaWidth))
+            .set_timestamp_rtp(i * 90000 / codec.maxFramerate)
+            .build();
+        std::vector<webrtc::VideoFrameType> types(1, i == 0 ?
+            webrtc::VideoFrameType::kVideoFrameKey :
+            webrtc::VideoFrameType::kVideoFrameDelta);
+        ok = encoder->Encode(frame, &types) == WEBRTC_VIDEO_CODEC_OK;
+    }
+    encoder->Release();
+    fclose(file);
+
+    if (!ok) {
+        unlink(path);
+        return "";
+    }
+    return path;
+}
+
+
+// FFmpegAudioDevice's 10ms recording loop, from the reactor's read of
+// the (synthetic) ffmpeg pipe to the AudioTransport
+bool
+RunAudio(Throughput& result)
+{
+    std::unique_ptr<webrtc::TaskQueueFactory> taskQueueFactory =
+        webrtc::CreateDefaultTaskQueueFactory();
+    rtc::scoped_refptr<FFmpegAudioDeviceModule> adm(
+        new rtc::RefCountedObject<FFmpegAudioDeviceModule>(
+            taskQueueFactory.get()));
+    CountingTransport transport;
+    adm->RegisterAudioCallback(&transport);
+
+    bool ok = adm->Init() == 0 && adm->InitRecording() == 0 &&
+        adm->StartRecording() == 0 && transport.meter.Wait();
+    adm->StopRecording();
+    adm->RegisterAudioCallback(nullptr);
+    adm->Terminate();
+    if (ok) result = transport.meter.Result();
+    return ok;
+}
+
+
+// FFmpegVideoDeviceInfo::GetBestMatchedCapability() against a device
+// with every resolution and pixel format at 15 and 30 fps
+Throughput
+MatchCapabilities()
+{
+    std::vector<webrtc::VideoCaptureCapability> capabilities;
+    for (const Resolution& resolution : kResolutions)
+        for (const PixelFormat& format : kPixelFormats)
+            for (int fps : { 15, 30 })
+                capabilities.push_back(
+                    Capability(resolution, format.type, fps));
+    FFmpegDeviceRegistry::GetInstance()->AddDevice(
+        BenchDevice("synthetic", capabilities));
+
+    std::unique_ptr<webrtc::VideoCaptureModule::DeviceInfo> info(
+        FFmpegVideoCaptureModule::CreateDeviceInfo());
+    RateMeter meter;
+    webrtc::VideoCaptureCapability requested = Capability(
+        { 1280, 720 }, webrtc::VideoType::kI420, 25);
+    webrtc::VideoCaptureCapability resulting;
+    for (int i = 0; i < kWarmupFrames + kFramesPerRun; i++) {
+        requested.width = 640 + (i % 8) * 160;
+        info->GetBestMatchedCapability(kBenchDevice, requested, resulting);
+        meter.Tick();
+    }
+    return meter.Result();
+}
+
+
+void
+Report(const char* name, const Resolution& resolution,
+    const Throughput& result)
+{
+    printf("%-28s %5dx%-5d %12.1f %12.0f %12.0f %12.1f\n", name,
+        resolution.width, resolution.height, result.framesPerSecond,
+        result.nsPerFrame, result.cpuNsPerFrame, result.allocationsPerFrame);
+}
+
+
+void
+ReportHeader(const char* title, const char* unit)
+{
+    printf("\n%-28s %11s %12s %12s %12s %12s\n", title, "resolution",
+        (std::string(unit) + "s/s").c_str(),
+        (std::string("ns/") + unit).c_str(),
+        (std::string("cpu ns/") + unit).c_str(),
+        (std::string("allocs/") + unit).c_str());
+}
+
+
+void
+Report(const char* name, const Resolution& resolution, const Result& result)
+{
+    printf("%-28s %5dx%-5d %12.0f %12.0f %14.0f\n", name,
+        resolution.width, resolution.height, result.nsPerFrame,
+        result.cpuNsPerFrame, result.bytesCopiedPerFrame);
+}
+
+}  // namespace
+
+
+void*
+operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* memory = malloc(size ? size : 1);
+    if (!memory) abort();
+    return memory;
+}
+
+
+void
+operator delete(void* memory) noexcept
+{ free(memory); }
+
+
+int
+main(int argc, char** argv)
+{
+    // started by a capture module or the audio device as their ffmpeg
+    if (argc > 1 && strcmp(argv[1], kStandInFlag) == 0)
+        return FFmpegSyntheticSource::Run(argc - 2, argv + 2);
+
+    printf("%-28s %11s %12s %12s %14s\n", "i420 capture path",
+        "resolution", "ns/frame", "cpu ns/frame", "bytes copied");
+
+    for (const Resolution& resolution : kResolutions) {
+        FFmpegFrameBufferPool pool;
+        Report("create + ConvertToI420", resolution,
+            ReadAndConvert(resolution, nullptr));
+        Report("pooled + ConvertToI420", resolution,
+            ReadAndConvert(resolution, &pool));
+        Report("pooled + read into planes", resolution,
+            ReadIntoPlanes(resolution, &pool));
+    }
+
+    printf("\n%-28s %11s %12s %12s %14s\n", "pixel format",
+        "resolution", "ns/frame", "cpu ns/frame", "bytes copied");
+
+    for (const Resolution& resolution : kResolutions) {
+        FFmpegFrameBufferPool pool;
+        for (const PixelFormat& format : kPixelFormats) {
+            std::string name(format.name);
+            Report((name + " native").c_str(), resolution,
+                ReadNative(resolution, format, &pool, false));
+            Report((name + " native + ToI420()").c_str(), resolution,
+                ReadNative(resolution, format, &pool, true));
+        }
+    }
+
+    printf("\n%-28s %11s %12s %12s %14s\n", "simulcast layers",
+        "resolution", "ns/frame", "cpu ns/frame", "bytes copied");
+
+    for (const Resolution& resolution : kResolutions) {
+        FFmpegFrameBufferPool pool;
+        Report("scaled per stream", resolution, ScalePerStream(resolution));
+        Report("FFmpegSimulcastScaler", resolution,
+            ScalePyramid(resolution, &pool));
+    }
+
+    printf("\n%-28s %11s %12s %12s\n", "rgb24 conversion vs cores",
+        "cores", "frames/s", "speedup");
+
+    // the calling threads convert too: n cores is n - 1 workers
+    const size_t cores = webrtc::CpuInfo::DetectNumberOfCores();
+    for (const StreamMix& mix : kStreamMixes) {
+        double single = 0;
+        for (size_t used = 1; ; used = std::min(used * 2, cores)) {
+            double fps = ConvertOnCores(mix, used - 1);
+            if (used == 1) single = fps;
+            printf("%-28s %11zu %12.1f %11.2fx\n", mix.name, used, fps,
+                fps / single);
+            if (used == cores) break;
+        }
+    }
+
+    // the rest runs the capture module and the audio device themselves
+    if (!UseSyntheticFFmpeg()) {
+        printf("\nCan't run the synthetic ffmpeg stand-in\n");
+        return 1;
+    }
+
+    ReportHeader("capture module, ffmpeg pipe", "frame");
+    for (const Resolution& resolution : kResolutions)
+        for (const PixelFormat& format : kPixelFormats) {
+            Throughput result;
+            if (RunCapture("synthetic", Capability(resolution, format.type, 30),
+                    FFmpegVideoCaptureModule::kIngestPipe, result))
+                Report(format.name, resolution, result);
+            else
+                printf("%-28s %5dx%-5d no frames\n", format.name,
+                    resolution.width, resolution.height);
+        }
+
+    ReportHeader("capture module, in-process", "frame");
+    for (const Resolution& resolution : kResolutions) {
+        std::string path = WriteSyntheticH264(resolution);
+        Throughput result;
+        if (path.empty())
+            printf("%-28s %5dx%-5d no H.264 encoder in this build\n",
+                "h264 decode", resolution.width, resolution.height);
+        else if (RunCapture(path,
+                Capability(resolution, webrtc::VideoType::kI420, 30),
+                FFmpegVideoCaptureModule::kIngestLibav, result))
+            Report("h264 decode", resolution, result);
+        else
+            printf("%-28s %5dx%-5d no frames\n", "h264 decode",
+                resolution.width, resolution.height);
+
+        // decoded ahead of the run, which then plays from the mapping
+        // the module shares with us
+        webrtc::VideoCaptureCapability capability =
+            Capability(resolution, webrtc::VideoType::kI420, 30);
+        std::shared_ptr<FFmpegFrameCache> cache = path.empty() ? nullptr :
+            FFmpegFrameCache::Open(BenchDevice(path, { capability }), "",
+                capability);
+        if (cache && RunCapture(path, capability,
+                FFmpegVideoCaptureModule::kIngestFrameCache, result))
+            Report("h264 frame cache", resolution, result);
+        else if (!path.empty())
+            printf("%-28s %5dx%-5d no frames\n", "h264 frame cache",
+                resolution.width, resolution.height);
+        if (cache) unlink(cache->Path().c_str());
+        if (!path.empty()) unlink(path.c_str());
+    }
+
+    ReportHeader("audio device, 48k stereo", "chunk");
+    Throughput audio;
+    if (RunAudio(audio))
+        Report("10ms recording", { 0, 0 }, audio);
+    else
+        printf("%-28s no chunks\n", "10ms recording");
+
+    ReportHeader("device info", "call");
+    Report("GetBestMatchedCapability", { 0, 0 }, MatchCapabilities());
+
+    FFmpegDeviceRegistry::GetInstance()->RemoveDevice(kBenchDevice);
+    return 0;
+}
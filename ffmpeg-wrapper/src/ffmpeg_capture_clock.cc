@@ -0,0 +1,311 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Maps source presentation timestamps onto WebRTC's capture clock.
+ */
+
+#include "ffmpeg_capture_clock.h"
+
+#include <errno.h>
+#include <time.h> // clock_gettime(), clock_nanosleep()
+
+#include <algorithm>
+#include <cmath>
+
+#include "rtc_base/time_utils.h"
+#include "system_wrappers/include/clock.h"
+#include "ffmpeg_thread_policy.h"
+
+
+// Length of the windows whose minimum delay feeds the drift fit
+static const double  kWindowUs          = 1000000.0;
+// Windows kept for the fit (~30 s)
+static const size_t  kMaxWindows        = 30;
+// Larger jumps than this are treated as a discontinuity
+static const int64_t kResyncThresholdUs = 500000;
+// No real clock drifts more than this; anything beyond is noise
+static const double  kMaxSkew           = 0.005;
+// A paced consumer this far behind starts over rather than catching up
+static const int64_t kMaxPaceLagUs      = 200000;
+// Frame rate assumed until the pacer is told one
+static const int     kDefaultFps        = 30;
+// WaitUntil() leaves this much before a deadline to SleepUntil()
+static const int64_t kPreciseWaitUs     = 2000;
+
+
+FFmpegCaptureClock*
+FFmpegCaptureClock::GetInstance()
+{
+    static FFmpegCaptureClock clock;
+    return &clock;
+}
+
+
+FFmpegCaptureClock::FFmpegCaptureClock()
+{
+    // same as VideoStreamEncoder's delta_ntp_internal_ms_
+    ntpOffsetMs_ =
+        webrtc::Clock::GetRealTimeClock()->CurrentNtpInMilliseconds() -
+        rtc::TimeMillis();
+}
+
+
+int64_t
+FFmpegCaptureClock::TimeMicros() const
+{ return rtc::TimeMicros(); }
+
+
+int64_t
+FFmpegCaptureClock::NtpMs(int64_t localUs) const
+{ return localUs / rtc::kNumMicrosecsPerMillisec + ntpOffsetMs_; }
+
+
+void
+FFmpegCaptureClock::SleepUntil(int64_t deadlineUs) const
+{
+    int64_t remainingUs = deadlineUs - TimeMicros();
+    if (remainingUs <= 0) return;
+
+    // an absolute CLOCK_MONOTONIC deadline: wake-ups interrupted by a
+    // signal resume without drifting
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    int64_t nanoseconds = deadline.tv_nsec +
+        remainingUs * rtc::kNumNanosecsPerMicrosec;
+    deadline.tv_sec  += nanoseconds / rtc::kNumNanosecsPerSec;
+    deadline.tv_nsec  = nanoseconds % rtc::kNumNanosecsPerSec;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+        &deadline, NULL) == EINTR) { }
+}
+
+
+bool
+FFmpegCaptureClock::WaitUntil(int64_t deadlineUs, rtc::Event& stop) const
+{
+    int64_t remainingUs;
+    while ((remainingUs = deadlineUs - TimeMicros()) > kPreciseWaitUs) {
+        int waitMs = static_cast<int>(
+            (remainingUs - kPreciseWaitUs / 2) / rtc::kNumMicrosecsPerMillisec);
+        if (stop.Wait(waitMs)) return false;
+    }
+    SleepUntil(deadlineUs);
+    FFmpegThreadPolicy::RecordWakeUp(TimeMicros() - deadlineUs);
+    return !stop.Wait(0);
+}
+
+
+FFmpegTimestampEstimator::FFmpegTimestampEstimator()
+{
+    lastLocalUs_ = 0;
+    Reset();
+}
+
+
+void
+FFmpegTimestampEstimator::Reset()
+{
+    initialized_ = false;
+    basePtsUs_   = 0;
+    baseLocalUs_ = 0;
+    lastPtsUs_   = 0;
+    rate_        = 1.0;
+    offset_      = 0.0;
+    windowValid_ = false;
+    windowStart_ = 0.0;
+    minima_.clear();
+}
+
+
+int64_t
+FFmpegTimestampEstimator::ToLocalTime(int64_t ptsUs, int64_t arrivalUs)
+{
+    if (ptsUs < 0) {
+        lastLocalUs_ = std::max(arrivalUs, lastLocalUs_ + 1);
+        return lastLocalUs_;
+    }
+
+    if (!initialized_ || ptsUs < lastPtsUs_ ||
+        std::abs(Estimate(ptsUs) - arrivalUs) > kResyncThresholdUs)
+        Restart(ptsUs, arrivalUs);
+    lastPtsUs_ = ptsUs;
+
+    Point point;
+    point.pts   = static_cast<double>(ptsUs - basePtsUs_);
+    point.local = static_cast<double>(arrivalUs - baseLocalUs_);
+
+    // keep the least delayed sample of the window
+    if (!windowValid_ ||
+        point.local - point.pts < windowMin_.local - windowMin_.pts) {
+        windowMin_   = point;
+        windowValid_ = true;
+    }
+    if (point.pts - windowStart_ >= kWindowUs) {
+        minima_.push_back(windowMin_);
+        if (minima_.size() > kMaxWindows) minima_.pop_front();
+        windowValid_ = false;
+        windowStart_ = point.pts;
+        Refit();
+    }
+
+    // an arrival below the line means the line runs late
+    if (point.local < rate_ * point.pts + offset_)
+        offset_ = point.local - rate_ * point.pts;
+
+    int64_t localUs = static_cast<int64_t>(llround(Estimate(ptsUs)));
+    localUs = std::min(localUs, arrivalUs);
+    localUs = std::max(localUs, lastLocalUs_ + 1);
+    lastLocalUs_ = localUs;
+    return localUs;
+}
+
+
+double
+FFmpegTimestampEstimator::SkewPpm() const
+{ return (rate_ - 1.0) * 1e6; }
+
+
+void
+FFmpegTimestampEstimator::Restart(int64_t ptsUs, int64_t arrivalUs)
+{
+    Reset();
+    initialized_ = true;
+    basePtsUs_   = ptsUs;
+    baseLocalUs_ = arrivalUs;
+}
+
+
+void
+FFmpegTimestampEstimator::Refit()
+{
+    // least-squares slope through the window minima
+    if (minima_.size() >= 2) {
+        double meanPts = 0, meanLocal = 0;
+        for (const Point& point : minima_) {
+            meanPts   += point.pts;
+            meanLocal += point.local;
+        }
+        meanPts   /= minima_.size();
+        meanLocal /= minima_.size();
+
+        double covariance = 0, variance = 0;
+        for (const Point& point : minima_) {
+            covariance += (point.pts - meanPts) * (point.local - meanLocal);
+            variance   += (point.pts - meanPts) * (point.pts - meanPts);
+        }
+        if (variance > 0)
+            rate_ = std::min(std::max(covariance / variance,
+                1.0 - kMaxSkew), 1.0 + kMaxSkew);
+    }
+
+    // then lower the line until it touches the envelope
+    offset_ = minima_.front().local - rate_ * minima_.front().pts;
+    for (const Point& point : minima_)
+        offset_ = std::min(offset_, point.local - rate_ * point.pts);
+}
+
+
+double
+FFmpegTimestampEstimator::Estimate(int64_t ptsUs) const
+{
+    return baseLocalUs_ +
+        rate_ * static_cast<double>(ptsUs - basePtsUs_) + offset_;
+}
+
+
+FFmpegFrameDecimator::FFmpegFrameDecimator()
+: maxFps_(0),
+  intervalUs_(0),
+  nextUs_(-1)
+{ }
+
+
+void
+FFmpegFrameDecimator::SetMaxFps(int maxFps)
+{
+    if (maxFps == maxFps_) return;
+    maxFps_     = maxFps;
+    intervalUs_ = maxFps > 0 ? rtc::kNumMicrosecsPerSec / maxFps : 0;
+    nextUs_     = -1;
+}
+
+
+void
+FFmpegFrameDecimator::Reset()
+{ nextUs_ = -1; }
+
+
+bool
+FFmpegFrameDecimator::Accept(int64_t timeUs)
+{
+    if (timeUs < 0 || intervalUs_ <= 0) return true;
+
+    // no frame after the last one let through can be this early, unless
+    // time went backwards (a loop or a seek): start over
+    const int64_t slackUs = intervalUs_ / 4;
+    if (nextUs_ >= 0 && timeUs < nextUs_ - intervalUs_ - slackUs)
+        nextUs_ = -1;
+    if (nextUs_ >= 0 && timeUs < nextUs_ - slackUs) return false;
+
+    // resync after a gap instead of bursting
+    if (nextUs_ < 0 || timeUs - nextUs_ > intervalUs_) nextUs_ = timeUs;
+    nextUs_ += intervalUs_;
+    return true;
+}
+
+
+FFmpegFramePacer::FFmpegFramePacer()
+: intervalUs_(rtc::kNumMicrosecsPerSec / kDefaultFps)
+{ Reset(); }
+
+
+void
+FFmpegFramePacer::SetFrameRate(int fps)
+{ intervalUs_ = rtc::kNumMicrosecsPerSec / (fps > 0 ? fps : kDefaultFps); }
+
+
+void
+FFmpegFramePacer::Reset()
+{
+    anchored_       = false;
+    basePtsUs_      = 0;
+    baseDeadlineUs_ = 0;
+    lastPtsUs_      = -1;
+    lastDeadlineUs_ = 0;
+}
+
+
+int64_t
+FFmpegFramePacer::Deadline(int64_t ptsUs, int64_t nowUs)
+{
+    int64_t deadlineUs;
+    if (!anchored_) {
+        anchored_       = true;
+        basePtsUs_      = ptsUs;
+        baseDeadlineUs_ = nowUs;
+        deadlineUs      = nowUs;
+    }
+    else if (ptsUs < 0 || lastPtsUs_ < 0 || ptsUs < lastPtsUs_ ||
+        ptsUs - lastPtsUs_ > kResyncThresholdUs) {
+        // no usable presentation time: carry on at the frame rate, and
+        // re-anchor there
+        deadlineUs      = lastDeadlineUs_ + intervalUs_;
+        basePtsUs_      = ptsUs;
+        baseDeadlineUs_ = deadlineUs;
+    }
+    else
+        deadlineUs = baseDeadlineUs_ + (ptsUs - basePtsUs_);
+
+    if (nowUs - deadlineUs > kMaxPaceLagUs) {
+        basePtsUs_      = ptsUs;
+        baseDeadlineUs_ = nowUs;
+        deadlineUs      = nowUs;
+    }
+
+    lastPtsUs_      = ptsUs;
+    lastDeadlineUs_ = deadlineUs;
+    return deadlineUs;
+}
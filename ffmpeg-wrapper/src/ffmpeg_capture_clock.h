@@ -0,0 +1,154 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Maps source presentation timestamps onto WebRTC's capture clock.
+ */
+
+#ifndef DEMO_FFMPEG_CAPTURE_CLOCK_H_
+#define DEMO_FFMPEG_CAPTURE_CLOCK_H_
+
+#include <cstdint>
+#include <deque>
+
+#include "rtc_base/event.h"
+
+
+// The clock both FFmpegVideoCaptureModule and FFmpegAudioDevice stamp their
+// media against: rtc::TimeMicros() for local time, and the same NTP offset
+// VideoStreamEncoder applies, so audio and video captured at the same
+// instant carry the same NTP time.
+class FFmpegCaptureClock {
+public:
+    static FFmpegCaptureClock* GetInstance();
+
+    int64_t TimeMicros() const;
+
+    // NTP time (ms) of a TimeMicros() timestamp
+    int64_t NtpMs(int64_t localUs) const;
+
+    // Sleeps until TimeMicros() reaches |deadlineUs|, to within the
+    // kernel's timer slack (tens of microseconds) rather than a tick.
+    void SleepUntil(int64_t deadlineUs) const;
+
+    // Same, but returns false as soon as |stop| is set: waits on |stop|
+    // for most of it, SleepUntil() for the last stretch, which an event
+    // wait would oversleep by up to a scheduler tick. Reports how late it
+    // woke up to the thread's FFmpegThreadPolicy.
+    bool WaitUntil(int64_t deadlineUs, rtc::Event& stop) const;
+
+private:
+    FFmpegCaptureClock();
+
+    int64_t ntpOffsetMs_;
+};
+
+
+// Turns a stream of (presentation time, arrival time) pairs into capture
+// times. Arrivals are delayed by a varying amount (pipe buffering, decoder
+// latency, scheduling) but never arrive early, so the estimator fits a line
+// to the lower envelope of arrival-vs-pts: the slope tracks the drift of
+// the source clock against ours, and the jitter above the line is removed.
+// Discontinuities (seeks, loops, restarts) re-anchor the line.
+class FFmpegTimestampEstimator {
+public:
+    FFmpegTimestampEstimator();
+
+    void Reset();
+
+    // Returns the capture time, on FFmpegCaptureClock, of a sample with
+    // presentation time |ptsUs| that became available at |arrivalUs|.
+    // Capture times never go backwards and never exceed their arrival.
+    // A negative ptsUs (unknown) maps to the arrival time.
+    int64_t ToLocalTime(int64_t ptsUs, int64_t arrivalUs);
+
+    // Estimated source clock drift, parts per million
+    double SkewPpm() const;
+
+private:
+    struct Point {
+        double pts;   // relative to basePtsUs_
+        double local; // relative to baseLocalUs_
+    };
+
+    bool initialized_;
+    int64_t basePtsUs_;
+    int64_t baseLocalUs_;
+    int64_t lastPtsUs_;
+    int64_t lastLocalUs_;
+
+    double rate_;   // local microseconds per source microsecond
+    double offset_; // local = rate_ * pts + offset_ (relative to the bases)
+
+    std::deque<Point> minima_; // lowest point of each finished window
+    Point windowMin_;
+    bool windowValid_;
+    double windowStart_;
+
+    void Restart(int64_t ptsUs, int64_t arrivalUs);
+    void Refit();
+    double Estimate(int64_t ptsUs) const;
+};
+
+
+// Same job as ffmpeg's "-r" on the way out: lets through at most |maxFps|
+// frames a second, on a grid anchored at the first frame, and drops the
+// ones that come early. Frames up to a quarter interval early still count
+// as on time, so a source that already runs at the target rate isn't
+// thinned out by its own jitter.
+class FFmpegFrameDecimator {
+public:
+    FFmpegFrameDecimator();
+
+    // 0 lets every frame through. A new rate re-anchors the grid.
+    void SetMaxFps(int maxFps);
+    void Reset();
+
+    // False if the frame at |timeUs| should be dropped. Frames without a
+    // time (negative) are always let through.
+    bool Accept(int64_t timeUs);
+
+private:
+    int maxFps_;
+    int64_t intervalUs_;
+    int64_t nextUs_;
+};
+
+
+
+// Same job as ffmpeg's "-re" for files and VOD: gives every frame an
+// absolute deadline, on FFmpegCaptureClock, as far from the first frame's
+// as their presentation times are apart. Deadlines are offsets from that
+// anchor rather than from the previous frame, so waking up late for one
+// frame doesn't push back every frame after it.
+//
+// Frames without a presentation time come one interval after the last
+// deadline. So do frames whose presentation time jumps (back to the start
+// of a looped file, or across a gap), which makes a loop seamless. If the
+// consumer falls further behind than a few frames, the schedule is
+// re-anchored at the present rather than released in a burst.
+class FFmpegFramePacer {
+public:
+    FFmpegFramePacer();
+
+    // The interval of frames without (usable) presentation times
+    void SetFrameRate(int fps);
+    void Reset();
+
+    // Deadline of the frame with presentation time |ptsUs| (-1 if none),
+    // given the time is now |nowUs|.
+    int64_t Deadline(int64_t ptsUs, int64_t nowUs);
+
+private:
+    int64_t intervalUs_;
+    bool anchored_;
+    int64_t basePtsUs_;      // the anchor
+    int64_t baseDeadlineUs_;
+    int64_t lastPtsUs_;
+    int64_t lastDeadlineUs_;
+};
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Registry of the ffmpeg inputs exposed as capture devices.
+ */
+
+#include "ffmpeg_device_registry.h"
+#include "ffmpeg_simulcast_scaler.h"
+
+#include <cstdio>  // sscanf()
+#include <cerrno>
+#include <climits>
+#include <cstdlib> // getenv(), strtol()
+#include <cstring> // strcmp()
+#include <fstream>
+
+#include "rtc_base/logging.h"
+
+
+static const char kConfigEnvironment[] = "FFMPEG_DEVICE_CONFIG";
+static const char kBinaryEnvironment[] = "FFMPEG_BINARY";
+static const char kDefaultBinary[]     = "/usr/local/bin/ffmpeg";
+
+static const struct {
+    const char* name;
+    webrtc::VideoType type;
+} kVideoTypes[] = {
+    { "i420",  webrtc::VideoType::kI420  },
+    { "rgb24", webrtc::VideoType::kRGB24 },
+    { "nv12",  webrtc::VideoType::kNV12  },
+    { "nv21",  webrtc::VideoType::kNV21  },
+    { "argb",  webrtc::VideoType::kARGB  },
+    { "yuy2",  webrtc::VideoType::kYUY2  },
+    { "uyvy",  webrtc::VideoType::kUYVY  },
+    { "mjpeg", webrtc::VideoType::kMJPEG },
+};
+
+
+static std::string
+Trim(const std::string& value)
+{
+    size_t begin = value.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return std::string();
+    size_t end = value.find_last_not_of(" \t\r");
+    return value.substr(begin, end - begin + 1);
+}
+
+
+// false unless all of |value| is a decimal number that fits an int
+static bool
+ParseInt(const std::string& value, int& number)
+{
+    if (value.empty()) return false;
+    char* end;
+    errno = 0;
+    long parsed = strtol(value.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE ||
+        parsed < INT_MIN || parsed > INT_MAX)
+        return false;
+    number = static_cast<int>(parsed);
+    return true;
+}
+
+
+FFmpegDeviceRegistry*
+FFmpegDeviceRegistry::GetInstance()
+{
+    static FFmpegDeviceRegistry registry;
+    return &registry;
+}
+
+
+FFmpegDeviceRegistry::FFmpegDeviceRegistry()
+{
+    const char* path = getenv(kConfigEnvironment);
+    if (path && *path && LoadFile(path) > 0) return;
+    AddDevice(DefaultDevice());
+}
+
+
+int32_t
+FFmpegDeviceRegistry::LoadFile(const std::string& path)
+{
+    std::ifstream stream(path);
+    if (!stream) {
+        RTC_LOG(LS_ERROR) << "Failed to open device config " << path;
+        return -1;
+    }
+    return Load(stream);
+}
+
+
+int32_t
+FFmpegDeviceRegistry::Load(std::istream& stream)
+{
+    std::vector<FFmpegDeviceConfig> devices;
+    std::vector<bool> realtimeSet; // per device
+    std::string line;
+    size_t lineNumber = 0;
+
+    // parse everything first, so a bad file leaves the registry untouched
+    while (std::getline(stream, line)) {
+        lineNumber++;
+        line = Trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        if (line == "[device]") {
+            FFmpegDeviceConfig device;
+            device.orientation = webrtc::VideoRotation::kVideoRotation_0;
+            device.pipe        = false;
+            device.passthrough = false;
+            device.simulcastLayers = 1;
+            device.realtime = false;
+            device.loop     = false;
+            device.warmSeconds = 0;
+            device.shared   = true;
+            devices.push_back(device);
+            realtimeSet.push_back(false);
+            continue;
+        }
+
+        size_t equals = line.find('=');
+        if (devices.empty() || equals == std::string::npos) {
+            RTC_LOG(LS_ERROR) << "Device config line " << lineNumber
+                << ": expected [device] or key = value";
+            return -1;
+        }
+
+        FFmpegDeviceConfig& device = devices.back();
+        std::string key   = Trim(line.substr(0, equals));
+        std::string value = Trim(line.substr(equals + 1));
+        bool valid = true;
+
+        if      (key == "name")    device.name    = value;
+        else if (key == "id")      device.id      = value;
+        else if (key == "product") device.product = value;
+        else if (key == "url")     device.url     = value;
+        else if (key == "producer") device.producer = value;
+        else if (key == "cache")    device.cache    = value;
+        else if (key == "orientation") {
+            int degrees = -1;
+            valid = ParseInt(value, degrees) && (degrees == 0 ||
+                degrees == 90 || degrees == 180 || degrees == 270);
+            device.orientation = static_cast<webrtc::VideoRotation>(degrees);
+        }
+        else if (key == "capability") {
+            webrtc::VideoCaptureCapability capability;
+            valid = ParseCapability(value, capability);
+            device.capabilities.push_back(capability);
+        }
+        else if (key == "pipe") {
+            valid = value == "0" || value == "1";
+            device.pipe = value == "1";
+        }
+        else if (key == "passthrough") {
+            valid = value == "0" || value == "1";
+            device.passthrough = value == "1";
+        }
+        else if (key == "layers") {
+            int layers = 0;
+            valid = ParseInt(value, layers) && layers >= 1 &&
+                layers <= static_cast<int>(FFmpegSimulcastScaler::kMaxLayers);
+            device.simulcastLayers = layers;
+        }
+        else if (key == "realtime") {
+            valid = value == "0" || value == "1";
+            device.realtime = value == "1";
+            realtimeSet.back() = true;
+        }
+        else if (key == "loop") {
+            valid = value == "0" || value == "1";
+            device.loop = value == "1";
+        }
+        else if (key == "warm") {
+            valid = ParseInt(value, device.warmSeconds) &&
+                device.warmSeconds >= 0;
+        }
+        else if (key == "shared") {
+            valid = value == "0" || value == "1";
+            device.shared = value == "1";
+        }
+        else if (key == "option") {
+            size_t split = value.find('=');
+            valid = split != std::string::npos && split > 0;
+            if (valid)
+                device.options.push_back(std::make_pair(
+                    Trim(value.substr(0, split)),
+                    Trim(value.substr(split + 1))));
+        }
+        else valid = false;
+
+        if (!valid) {
+            RTC_LOG(LS_ERROR) << "Device config line " << lineNumber
+                << ": bad " << key << " \"" << value << "\"";
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < devices.size(); i++) {
+        FFmpegDeviceConfig& device = devices[i];
+        if (device.name.empty())    device.name    = device.id;
+        if (device.product.empty()) device.product = device.id;
+        // a producer paces itself, like a live url
+        if (!realtimeSet[i])
+            device.realtime = device.producer.empty() &&
+                device.url.find("://") == std::string::npos;
+        if (device.id.empty() ||
+            (device.url.empty() && device.producer.empty()) ||
+            device.capabilities.empty()) {
+            RTC_LOG(LS_ERROR) << "Device config: \"" << device.name
+                << "\" needs an id, a url or producer and at least one "
+                << "capability";
+            return -1;
+        }
+    }
+
+    for (auto& device : devices)
+        AddDevice(device);
+    return static_cast<int32_t>(devices.size());
+}
+
+
+bool
+FFmpegDeviceRegistry::AddDevice(const FFmpegDeviceConfig& device)
+{
+    if (device.id.empty() || device.capabilities.empty()) return false;
+    Entry entry = std::make_shared<const FFmpegDeviceConfig>(device);
+
+    webrtc::MutexLock lock(&mutex_);
+    auto it = index_.find(device.id);
+    if (it != index_.end())
+        devices_[it->second] = entry;
+    else {
+        index_[device.id] = devices_.size();
+        devices_.push_back(entry);
+    }
+    return true;
+}
+
+
+bool
+FFmpegDeviceRegistry::RemoveDevice(const std::string& id)
+{
+    webrtc::MutexLock lock(&mutex_);
+    auto it = index_.find(id);
+    if (it == index_.end()) return false;
+
+    // move the last device into the hole
+    size_t index = it->second;
+    index_.erase(it);
+    if (index != devices_.size() - 1) {
+        devices_[index] = devices_.back();
+        index_[devices_[index]->id] = index;
+    }
+    devices_.pop_back();
+    return true;
+}
+
+
+FFmpegDeviceRegistry::Entry
+FFmpegDeviceRegistry::Find(const std::string& id) const
+{
+    webrtc::MutexLock lock(&mutex_);
+    auto it = index_.find(id);
+    return it == index_.end() ? nullptr : devices_[it->second];
+}
+
+
+FFmpegDeviceRegistry::Entry
+FFmpegDeviceRegistry::GetDevice(size_t index) const
+{
+    webrtc::MutexLock lock(&mutex_);
+    return index < devices_.size() ? devices_[index] : nullptr;
+}
+
+
+size_t
+FFmpegDeviceRegistry::NumberOfDevices() const
+{
+    webrtc::MutexLock lock(&mutex_);
+    return devices_.size();
+}
+
+
+std::string
+FFmpegDeviceRegistry::FFmpegBinary()
+{
+    // read every time, so a benchmark can set it after startup
+    const char* binary = getenv(kBinaryEnvironment);
+    return binary && *binary ? binary : kDefaultBinary;
+}
+
+
+bool
+FFmpegDeviceRegistry::ParseCapability(
+    const std::string& value,
+    webrtc::VideoCaptureCapability& capability)
+{
+    // <width>x<height>@<fps> <pixel format>
+    char format[16] = { 0 };
+    if (sscanf(value.c_str(), "%dx%d@%d %15s", &capability.width,
+            &capability.height, &capability.maxFPS, format) != 4)
+        return false;
+    if (capability.width <= 0 || capability.height <= 0 ||
+        capability.maxFPS <= 0)
+        return false;
+
+    capability.interlaced = false;
+    for (auto& entry : kVideoTypes) {
+        if (strcmp(entry.name, format) != 0) continue;
+        capability.videoType = entry.type;
+        return true;
+    }
+    return false;
+}
+
+
+FFmpegDeviceConfig
+FFmpegDeviceRegistry::DefaultDevice()
+{
+    FFmpegDeviceConfig device;
+    device.name        = std::string("ffmpeg-0");     // arbitrary (name)
+    device.id          = std::string("F3E977DB27F1"); // random (id)
+    device.product     = std::string("A0A0860E9BDC"); // random (product id)
+    device.orientation = webrtc::VideoRotation::kVideoRotation_0;
+    device.url         = std::string("video.h264");
+    device.pipe        = true;  // raw H.264: Chromium's libavformat can't
+    device.passthrough = false;
+    device.simulcastLayers = 1;
+    device.realtime    = true; // a local file
+    device.loop        = false;
+    device.warmSeconds = 0;
+    device.shared      = true;
+    // device.options.push_back(std::make_pair("rtsp_transport", "tcp"));
+    {
+        webrtc::VideoCaptureCapability capability;
+        capability.width      = 640;
+        capability.height     = 480;
+        capability.maxFPS     = 30;
+        capability.interlaced = false;
+        capability.videoType  = webrtc::VideoType::kI420;
+        device.capabilities.push_back(capability);
+        capability.videoType  = webrtc::VideoType::kRGB24;
+        device.capabilities.push_back(capability);
+        capability.videoType  = webrtc::VideoType::kNV12;
+        device.capabilities.push_back(capability);
+        capability.videoType  = webrtc::VideoType::kARGB;
+        device.capabilities.push_back(capability);
+    }
+    return device;
+}
@@ -0,0 +1,156 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Registry of the ffmpeg inputs exposed as capture devices.
+ */
+
+#ifndef DEMO_FFMPEG_DEVICE_REGISTRY_H_
+#define DEMO_FFMPEG_DEVICE_REGISTRY_H_
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "modules/video_capture/video_capture.h"
+#include "rtc_base/synchronization/mutex.h"
+
+
+// ffmpeg input options, in command line order (e.g. rtsp_transport=tcp)
+typedef std::vector<std::pair<std::string, std::string>> FFmpegOptions;
+
+
+struct FFmpegDeviceConfig {
+    std::string name;
+    std::string id;      // unique id, the key of the registry
+    std::string product;
+    webrtc::VideoRotation orientation;
+    std::vector<webrtc::VideoCaptureCapability> capabilities;
+
+    std::string url;        // what "ffmpeg -i" would be given
+    FFmpegOptions options;  // applied before opening |url|
+    bool pipe;              // read through the ffmpeg CLI, not in-process
+    bool passthrough;       // send the source's H.264 without re-encoding
+    size_t simulcastLayers; // 1 for none, up to 3 (full, 1/2, 1/4)
+    bool realtime;          // pace frames by their timestamps ("-re")
+    bool loop;              // start over at the end ("-stream_loop -1")
+    std::string producer;   // fills a shared memory ring instead of |url|
+    int warmSeconds;        // keep an ingest open while idle, 0 for never
+    bool shared;            // one ingest for every capture of it
+    std::string cache;      // decode |url| into this directory once, and
+                            // play it from there
+};
+
+
+// Every capture device FFmpegVideoFactory can create. Entries are immutable
+// and shared: a capture module keeps the entry it was started with, so
+// devices can be added, replaced and removed while others are capturing.
+//
+// The registry starts out with the devices of the file named by the
+// FFMPEG_DEVICE_CONFIG environment variable, or with a single "ffmpeg-0"
+// device reading "video.h264" when it is not set. The file holds one
+// section per device:
+//
+//   [device]
+//   name        = lobby
+//   id          = 6A1D0C4E90B2
+//   product     = 6A1D0C4E90B2
+//   url         = rtsp://10.0.0.12/stream1
+//   orientation = 0
+//   capability  = 1280x720@30 i420
+//   capability  = 640x480@15 rgb24
+//   option      = rtsp_transport=tcp
+//   pipe        = 1
+//   passthrough = 1
+//   layers      = 3
+//   realtime    = 0
+//   loop        = 0
+//   producer    = /usr/local/bin/grabber --camera 2
+//   warm        = 600
+//   shared      = 1
+//   cache       = /var/cache/ffmpeg-frames
+//
+// "pipe" reads the device through an "ffmpeg" child process instead of
+// decoding it in-process. Chromium's libavformat, which the in-process
+// ingest is built with, only demuxes the containers a browser plays (MP4,
+// WebM, Ogg...): it has no network protocols and no raw H.264 demuxer, so
+// rtsp://, udp:// and the like, and .h264 files, need "pipe = 1". Opening
+// them in-process fails StartCapture(). The default device has it set.
+//
+// "realtime" defaults to 1 for local files, which would otherwise be read
+// as fast as they decode, and to 0 for urls ("scheme://"): live sources
+// pace themselves. Give it as 1 for VOD urls.
+//
+// A device with a "producer" is ingested through shared memory: the
+// command is run with an FFmpegShmRing's fds as 3, 4 and 5 and writes
+// frames of the requested capability into it. "producer = test" runs
+// FFmpegShmTestProducer, a test pattern, in-process instead.
+//
+// "warm" has FFmpegIngestPool keep the device's in-process ingest open
+// (and, for a live url, reading) for that many seconds while no capture
+// uses it, so that StartCapture() doesn't wait for ffmpeg to connect,
+// probe the input and start decoding.
+//
+// "shared", on by default, has every capture of a live or paced device
+// subscribe to one FFmpegSharedIngest, so the input is read and decoded
+// once however many peer connections send it. Give it as 0 for captures
+// to open an ingest each.
+//
+// "cache" names a directory to decode the device's clip into, once, at
+// each capability's size and frame rate (FFmpegFrameCache); captures then
+// play the decoded frames from a memory mapping of that file instead of
+// decoding the clip. For load tests, with "loop = 1".
+//
+// Blank lines and lines starting with '#' are ignored.
+class FFmpegDeviceRegistry {
+public:
+    typedef std::shared_ptr<const FFmpegDeviceConfig> Entry;
+
+    static FFmpegDeviceRegistry* GetInstance();
+
+    // Adds every device in |path|, replacing those with the same id.
+    // Nothing is changed if the file can't be parsed.
+    // Returns the number of devices read, or -1 on error.
+    int32_t LoadFile(const std::string& path);
+    int32_t Load(std::istream& stream);
+
+    // Adds |device|, or replaces the one with the same id.
+    // Returns false if the device has no id or no capabilities.
+    bool AddDevice(const FFmpegDeviceConfig& device);
+
+    // Returns false if there was no such device.
+    bool RemoveDevice(const std::string& id);
+
+    // nullptr if there is no such device
+    Entry Find(const std::string& id) const;
+
+    // Devices are numbered in insertion order, but removing a device
+    // renumbers the last one in its place.
+    Entry GetDevice(size_t index) const;
+    size_t NumberOfDevices() const;
+
+    // The ffmpeg command the pipe ingests run, video and audio alike:
+    // FFMPEG_BINARY if set (it may carry arguments of its own, e.g. a
+    // stand-in's), else /usr/local/bin/ffmpeg.
+    static std::string FFmpegBinary();
+
+private:
+    FFmpegDeviceRegistry();
+
+    mutable webrtc::Mutex mutex_;
+    std::vector<Entry> devices_;
+    std::unordered_map<std::string, size_t> index_; // id -> devices_ index
+
+    static bool ParseCapability(
+        const std::string& value,
+        webrtc::VideoCaptureCapability& capability);
+    static FFmpegDeviceConfig DefaultDevice();
+};
+
+#endif
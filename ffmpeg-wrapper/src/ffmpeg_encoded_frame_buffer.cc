@@ -0,0 +1,124 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Carries an encoded access unit through the video track as a frame.
+ */
+
+#include "ffmpeg_encoded_frame_buffer.h"
+
+#include "api/video/i420_buffer.h"
+#include "rtc_base/ref_counted_object.h"
+
+
+rtc::scoped_refptr<FFmpegKeyFrameRequest>
+FFmpegKeyFrameRequest::Create()
+{ return new rtc::RefCountedObject<FFmpegKeyFrameRequest>(); }
+
+
+FFmpegKeyFrameRequest::FFmpegKeyFrameRequest()
+: pending_(false),
+  requests_(0)
+{ }
+
+
+FFmpegKeyFrameRequest::~FFmpegKeyFrameRequest() { }
+
+
+void
+FFmpegKeyFrameRequest::Request()
+{
+    requests_.fetch_add(1, std::memory_order_relaxed);
+    pending_.store(true, std::memory_order_release);
+}
+
+
+bool
+FFmpegKeyFrameRequest::TakeRequest()
+{ return pending_.exchange(false, std::memory_order_acq_rel); }
+
+
+uint64_t
+FFmpegKeyFrameRequest::Requests() const
+{ return requests_.load(std::memory_order_relaxed); }
+
+
+rtc::scoped_refptr<FFmpegEncodedFrameBuffer>
+FFmpegEncodedFrameBuffer::Create(
+    webrtc::VideoCodecType codec,
+    int width,
+    int height,
+    bool keyFrame,
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+    rtc::scoped_refptr<FFmpegKeyFrameRequest> keyFrameRequest)
+{
+    return new rtc::RefCountedObject<FFmpegEncodedFrameBuffer>(
+        codec, width, height, keyFrame, data, keyFrameRequest);
+}
+
+
+FFmpegEncodedFrameBuffer::FFmpegEncodedFrameBuffer(
+    webrtc::VideoCodecType codec,
+    int width,
+    int height,
+    bool keyFrame,
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+    rtc::scoped_refptr<FFmpegKeyFrameRequest> keyFrameRequest)
+: codec_(codec),
+  width_(width),
+  height_(height),
+  keyFrame_(keyFrame),
+  data_(data),
+  keyFrameRequest_(keyFrameRequest)
+{ }
+
+
+FFmpegEncodedFrameBuffer::~FFmpegEncodedFrameBuffer() { }
+
+
+FFmpegNativeBuffer::NativeType
+FFmpegEncodedFrameBuffer::native_type() const
+{ return kNativeEncoded; }
+
+
+int
+FFmpegEncodedFrameBuffer::width() const
+{ return width_; }
+
+
+int
+FFmpegEncodedFrameBuffer::height() const
+{ return height_; }
+
+
+rtc::scoped_refptr<webrtc::I420BufferInterface>
+FFmpegEncodedFrameBuffer::ToI420()
+{
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        webrtc::I420Buffer::Create(width_, height_);
+    webrtc::I420Buffer::SetBlack(buffer.get());
+    return buffer;
+}
+
+
+webrtc::VideoCodecType
+FFmpegEncodedFrameBuffer::codec() const
+{ return codec_; }
+
+
+bool
+FFmpegEncodedFrameBuffer::IsKeyFrame() const
+{ return keyFrame_; }
+
+
+rtc::scoped_refptr<webrtc::EncodedImageBufferInterface>
+FFmpegEncodedFrameBuffer::data() const
+{ return data_; }
+
+
+void
+FFmpegEncodedFrameBuffer::RequestKeyFrame()
+{ if (keyFrameRequest_) keyFrameRequest_->Request(); }
@@ -0,0 +1,98 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Carries an encoded access unit through the video track as a frame.
+ */
+
+#ifndef DEMO_FFMPEG_ENCODED_FRAME_BUFFER_H_
+#define DEMO_FFMPEG_ENCODED_FRAME_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "api/scoped_refptr.h"
+#include "api/video/encoded_image.h"
+#include "api/video_codecs/video_codec.h"
+#include "rtc_base/ref_count.h"
+#include "ffmpeg_native_buffer.h"
+
+
+// Shared between a passthrough source and the frames it emits, so an
+// encoder can ask the source for a keyframe without holding on to it.
+class FFmpegKeyFrameRequest : public rtc::RefCountInterface {
+public:
+    static rtc::scoped_refptr<FFmpegKeyFrameRequest> Create();
+
+    // Encoder side; any thread.
+    void Request();
+
+    // Source side. Returns true (once) if a keyframe was asked for since
+    // the last call.
+    bool TakeRequest();
+
+    uint64_t Requests() const;
+
+protected:
+    FFmpegKeyFrameRequest();
+    ~FFmpegKeyFrameRequest() override;
+
+private:
+    std::atomic<bool> pending_;
+    std::atomic<uint64_t> requests_;
+};
+
+
+// One access unit exactly as the source produced it (H.264 in Annex B
+// form, parameter sets in front of every keyframe), to be forwarded by
+// FFmpegPassthroughVideoEncoder instead of being decoded and encoded again.
+//
+// There is no decoder behind it: ToI420() yields a black picture of the
+// same size, which is what a local preview or a non-passthrough encoder
+// gets to see.
+class FFmpegEncodedFrameBuffer : public FFmpegNativeBuffer {
+public:
+    static rtc::scoped_refptr<FFmpegEncodedFrameBuffer> Create(
+        webrtc::VideoCodecType codec,
+        int width,
+        int height,
+        bool keyFrame,
+        rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+        rtc::scoped_refptr<FFmpegKeyFrameRequest> keyFrameRequest);
+
+    NativeType native_type() const override;
+    int width() const override;
+    int height() const override;
+
+    rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+    webrtc::VideoCodecType codec() const;
+    bool IsKeyFrame() const;
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data() const;
+
+    // Asks the source to produce a keyframe as soon as it can.
+    void RequestKeyFrame();
+
+protected:
+    FFmpegEncodedFrameBuffer(
+        webrtc::VideoCodecType codec,
+        int width,
+        int height,
+        bool keyFrame,
+        rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+        rtc::scoped_refptr<FFmpegKeyFrameRequest> keyFrameRequest);
+    ~FFmpegEncodedFrameBuffer() override;
+
+private:
+    const webrtc::VideoCodecType codec_;
+    const int width_;
+    const int height_;
+    const bool keyFrame_;
+    const rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data_;
+    const rtc::scoped_refptr<FFmpegKeyFrameRequest> keyFrameRequest_;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Referenced from common_video/video_frame_buffer_pool.cc
+ */
+
+#include "ffmpeg_frame_buffer_pool.h"
+
+#include "rtc_base/logging.h"
+#include "rtc_base/ref_counted_object.h"
+
+
+template <typename T>
+static bool
+IsIdle(webrtc::VideoFrameBuffer* buffer)
+{ return static_cast<rtc::RefCountedObject<T>*>(buffer)->HasOneRef(); }
+
+
+FFmpegFrameBufferPool::FFmpegFrameBufferPool(size_t maxBuffers)
+: maxBuffers_(maxBuffers),
+  size_(0)
+{ stats_ = Stats(); }
+
+
+FFmpegFrameBufferPool::~FFmpegFrameBufferPool() { }
+
+
+rtc::scoped_refptr<webrtc::I420Buffer>
+FFmpegFrameBufferPool::CreateI420Buffer(int width, int height)
+{ return CreateBuffer<webrtc::I420Buffer>(kFormatI420, width, height); }
+
+
+rtc::scoped_refptr<webrtc::NV12Buffer>
+FFmpegFrameBufferPool::CreateNV12Buffer(int width, int height)
+{ return CreateBuffer<webrtc::NV12Buffer>(kFormatNV12, width, height); }
+
+
+rtc::scoped_refptr<FFmpegARGBBuffer>
+FFmpegFrameBufferPool::CreateARGBBuffer(int width, int height)
+{ return CreateBuffer<FFmpegARGBBuffer>(kFormatARGB, width, height); }
+
+
+template <typename T>
+rtc::scoped_refptr<T>
+FFmpegFrameBufferPool::CreateBuffer(Format format, int width, int height)
+{
+    webrtc::MutexLock lock(&mutex_);
+    // buffers that were busy when the bound came down
+    while (size_ > maxBuffers_ && EvictOne()) { }
+    const uint64_t key = Key(format, width, height);
+
+    // an idle buffer is one only the pool is holding on to
+    for (auto& pooled : buckets_[key]) {
+        if (!pooled.isIdle(pooled.buffer.get())) continue;
+        stats_.hits++;
+        size_t inUse = InUse() + 1; // plus the one being handed out
+        if (inUse > stats_.highWater) stats_.highWater = inUse;
+        return static_cast<T*>(pooled.buffer.get());
+    }
+
+    // make room by dropping an idle buffer, most likely of another format
+    // or resolution; it may empty and erase any bucket, this one included,
+    // since buffers go idle without the lock
+    if (size_ >= maxBuffers_ && !EvictOne()) {
+        if (stats_.exhausted++ == 0)
+            RTC_LOG(LS_WARNING) << "Frame buffer pool exhausted ("
+                << maxBuffers_ << " buffers in flight).";
+        return nullptr;
+    }
+
+    rtc::scoped_refptr<T> buffer(
+        new rtc::RefCountedObject<T>(width, height));
+    PooledBuffer pooled;
+    pooled.buffer = buffer;
+    pooled.isIdle = &IsIdle<T>;
+    buckets_[key].push_back(pooled);
+    size_++;
+    stats_.misses++;
+
+    size_t inUse = InUse();
+    if (inUse > stats_.highWater) stats_.highWater = inUse;
+    return buffer;
+}
+
+
+void
+FFmpegFrameBufferPool::SetMaxBuffers(size_t maxBuffers)
+{
+    webrtc::MutexLock lock(&mutex_);
+    maxBuffers_ = maxBuffers;
+    while (size_ > maxBuffers_ && EvictOne()) { }
+}
+
+
+void
+FFmpegFrameBufferPool::ReleaseUnused()
+{
+    webrtc::MutexLock lock(&mutex_);
+    while (EvictOne()) { }
+}
+
+
+FFmpegFrameBufferPool::Stats
+FFmpegFrameBufferPool::GetStats() const
+{
+    webrtc::MutexLock lock(&mutex_);
+    Stats stats = stats_;
+    stats.size  = size_;
+    return stats;
+}
+
+
+uint64_t
+FFmpegFrameBufferPool::Key(Format format, int width, int height)
+{
+    return (static_cast<uint64_t>(format) << 48) |
+        (static_cast<uint64_t>(width & 0xFFFFFF) << 24) |
+        static_cast<uint64_t>(height & 0xFFFFFF);
+}
+
+
+bool
+FFmpegFrameBufferPool::EvictOne()
+{
+    for (auto it = buckets_.begin(); it != buckets_.end(); ++it) {
+        Bucket& bucket = it->second;
+        for (size_t i = 0; i < bucket.size(); i++) {
+            if (!bucket[i].isIdle(bucket[i].buffer.get())) continue;
+            bucket[i] = bucket.back();
+            bucket.pop_back();
+            if (bucket.empty()) buckets_.erase(it);
+            size_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+size_t
+FFmpegFrameBufferPool::InUse() const
+{
+    size_t count = 0;
+    for (auto& entry : buckets_)
+        for (auto& pooled : entry.second)
+            if (!pooled.isIdle(pooled.buffer.get())) count++;
+    return count;
+}
@@ -0,0 +1,84 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Referenced from common_video/include/video_frame_buffer_pool.h
+ */
+
+#ifndef DEMO_FFMPEG_FRAME_BUFFER_POOL_H_
+#define DEMO_FFMPEG_FRAME_BUFFER_POOL_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "api/video/i420_buffer.h"
+#include "api/video/nv12_buffer.h"
+#include "rtc_base/synchronization/mutex.h"
+#include "ffmpeg_argb_buffer.h"
+
+
+// A bounded pool of frame buffers, bucketed by pixel format and resolution.
+// A buffer goes back to the pool on its own once every sink has dropped its
+// reference; the pool never hands out a buffer that is still referenced
+// elsewhere. The bound covers all formats together.
+class FFmpegFrameBufferPool {
+public:
+    struct Stats {
+        uint64_t hits;      // requests served by a recycled buffer
+        uint64_t misses;    // requests that had to allocate
+        uint64_t exhausted; // requests refused because every buffer was busy
+        size_t   size;      // buffers currently owned by the pool
+        size_t   highWater; // most buffers ever in use at the same time
+    };
+
+    explicit FFmpegFrameBufferPool(size_t maxBuffers = kDefaultMaxBuffers);
+    ~FFmpegFrameBufferPool();
+
+    // Return a buffer of the given size, or nullptr if |maxBuffers| are
+    // already in flight.
+    rtc::scoped_refptr<webrtc::I420Buffer> CreateI420Buffer(int width, int height);
+    rtc::scoped_refptr<webrtc::NV12Buffer> CreateNV12Buffer(int width, int height);
+    rtc::scoped_refptr<FFmpegARGBBuffer>   CreateARGBBuffer(int width, int height);
+
+    // Changes the bound. Idle buffers over the new bound are freed right
+    // away; busy ones by the first request after they come back.
+    void SetMaxBuffers(size_t maxBuffers);
+
+    // Frees every idle buffer.
+    void ReleaseUnused();
+
+    Stats GetStats() const;
+
+    static const size_t kDefaultMaxBuffers = 8;
+
+private:
+    enum Format { kFormatI420, kFormatNV12, kFormatARGB };
+
+    // The buffers are all RefCountedObject<T>s for some T; |isIdle| knows
+    // which, so it can ask HasOneRef().
+    struct PooledBuffer {
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+        bool (*isIdle)(webrtc::VideoFrameBuffer* buffer);
+    };
+    typedef std::vector<PooledBuffer> Bucket;
+
+    mutable webrtc::Mutex mutex_;
+    std::unordered_map<uint64_t, Bucket> buckets_;
+    size_t maxBuffers_;
+    size_t size_;
+    Stats stats_;
+
+    template <typename T>
+    rtc::scoped_refptr<T> CreateBuffer(Format format, int width, int height);
+
+    static uint64_t Key(Format format, int width, int height);
+    bool EvictOne();
+    size_t InUse() const;
+};
+
+#endif
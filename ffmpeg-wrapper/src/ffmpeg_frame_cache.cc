@@ -0,0 +1,368 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Clips decoded once into memory-mapped raw frame files.
+ */
+
+#include "ffmpeg_frame_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>  // isalnum()
+#include <cstdio>  // rename(), snprintf()
+#include <cstdlib> // abs()
+#include <cstring> // memset()
+#include <functional>
+#include <unordered_map>
+
+#include "api/video/i420_buffer.h"
+#include "common_video/include/video_frame_buffer.h"
+#include "common_video/libyuv/include/webrtc_libyuv.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/synchronization/mutex.h"
+#include "rtc_base/time_utils.h"
+#include "ffmpeg_av_ingest.h"
+
+
+static const uint32_t kMagic   = 0x43524646; // "FFRC"
+static const uint32_t kVersion = 1;
+
+// A clip that doesn't end, or a long one at a large size, is cut short
+// here rather than filling the disk
+static const uint64_t kMaxCacheBytes = 4ULL * 1024 * 1024 * 1024;
+
+
+const char FFmpegFrameCache::kDefaultDirectory[] = "/tmp";
+
+
+// The caches mapped, by file: every capture of a clip shares one mapping.
+// The lock of a file's slot is held while it's decoded, so only the first
+// capture decodes it and the others wait for the file.
+namespace {
+
+struct Slot {
+    webrtc::Mutex mutex;
+    std::weak_ptr<FFmpegFrameCache> cache; // guarded
+};
+
+struct Directory {
+    webrtc::Mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Slot>> slots;
+};
+
+Directory*
+GetDirectory()
+{
+    // never destroyed, like the ingests' other singletons
+    static Directory* directory = new Directory();
+    return directory;
+}
+
+}  // namespace
+
+
+static size_t
+RoundToPage(size_t size)
+{
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (size + page - 1) / page * page;
+}
+
+
+// false if |url| isn't a local file
+static bool
+SourceStamp(const std::string& url, uint64_t& size, int64_t& mtimeNs)
+{
+    struct stat status;
+    if (stat(url.c_str(), &status) < 0) {
+        size    = 0;
+        mtimeNs = 0;
+        return false;
+    }
+    size    = static_cast<uint64_t>(status.st_size);
+    mtimeNs = static_cast<int64_t>(status.st_mtim.tv_sec) *
+        rtc::kNumNanosecsPerSec + status.st_mtim.tv_nsec;
+    return true;
+}
+
+
+static bool
+WriteAll(int fd, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+std::shared_ptr<FFmpegFrameCache>
+FFmpegFrameCache::Open(
+    const FFmpegDeviceConfig& device,
+    const std::string& directory,
+    const webrtc::VideoCaptureCapability& capability)
+{
+    const std::string path = CachePath(device, directory, capability);
+
+    std::shared_ptr<Slot> slot;
+    {
+        Directory* caches = GetDirectory();
+        webrtc::MutexLock lock(&caches->mutex);
+        std::shared_ptr<Slot>& entry = caches->slots[path];
+        if (!entry) entry.reset(new Slot());
+        slot = entry;
+    }
+
+    // decoded outside the directory's lock: it takes a while, and other
+    // clips' captures shouldn't wait for it
+    webrtc::MutexLock lock(&slot->mutex);
+    std::shared_ptr<FFmpegFrameCache> cache = slot->cache.lock();
+    if (cache) return cache;
+
+    cache.reset(new FFmpegFrameCache());
+    cache->self_ = cache;
+    if (!cache->Map(path, device)) {
+        const int64_t startUs = rtc::TimeMicros();
+        if (!Decode(device, capability, path) || !cache->Map(path, device))
+            return nullptr;
+        RTC_LOG(LS_INFO) << "Decoded " << device.url << " into " << path
+            << ", " << cache->Frames() << " frames, in "
+            << (rtc::TimeMicros() - startUs) / rtc::kNumMicrosecsPerMillisec
+            << " ms";
+    }
+    slot->cache = cache;
+    return cache;
+}
+
+
+FFmpegFrameCache::FFmpegFrameCache()
+: memory_(nullptr),
+  size_(0),
+  header_(nullptr)
+{ }
+
+
+FFmpegFrameCache::~FFmpegFrameCache()
+{
+    if (memory_) munmap(const_cast<uint8_t*>(memory_), size_);
+}
+
+
+std::string
+FFmpegFrameCache::CachePath(
+    const FFmpegDeviceConfig& device,
+    const std::string& directory,
+    const webrtc::VideoCaptureCapability& capability)
+{
+    // the id names it for whoever lists the directory; the hash tells
+    // apart the clips of a device whose url or options changed
+    std::string name;
+    for (char c : device.id)
+        name += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    std::string source = device.url;
+    for (auto& option : device.options)
+        source += " -" + option.first + " " + option.second;
+
+    char suffix[96];
+    snprintf(suffix, sizeof(suffix), "-%016zx-%dx%d@%d.i420",
+        std::hash<std::string>()(source), capability.width,
+        abs(capability.height), capability.maxFPS);
+    return (directory.empty() ? std::string(kDefaultDirectory) : directory) +
+        "/" + name + suffix;
+}
+
+
+bool
+FFmpegFrameCache::Decode(
+    const FFmpegDeviceConfig& device,
+    const webrtc::VideoCaptureCapability& capability,
+    const std::string& path)
+{
+    webrtc::VideoCaptureCapability decoded = capability;
+    decoded.height    = abs(capability.height);
+    decoded.videoType = webrtc::VideoType::kI420;
+    FFmpegAVIngest ingest;
+    if (ingest.Open(device.url, device.options, decoded) != 0) {
+        RTC_LOG(LS_ERROR) << "Can't open " << device.url << " to cache it";
+        return false;
+    }
+
+    // another process may be decoding the same clip: each writes a file
+    // of its own, and the last one renamed into place stays
+    const std::string temporary = path + ".tmp." + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0644);
+    if (fd < 0) {
+        RTC_LOG(LS_ERROR) << "Can't create " << temporary << ": " << errno;
+        return false;
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic       = kMagic;
+    header.version     = kVersion;
+    header.frameRate   = capability.maxFPS;
+    header.frameOffset = RoundToPage(sizeof(Header));
+    SourceStamp(device.url, header.sourceSize, header.sourceMtimeNs);
+
+    bool ok = lseek(fd, header.frameOffset, SEEK_SET) >= 0;
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+    int64_t ptsUs;
+    while (ok && ingest.ReadFrame(buffer, ptsUs) == 0) {
+        rtc::scoped_refptr<webrtc::I420BufferInterface> i420 =
+            buffer->ToI420();
+        if (header.frames == 0) {
+            header.width     = i420->width();
+            header.height    = i420->height();
+            header.frameSize = webrtc::CalcBufferSize(
+                webrtc::VideoType::kI420, header.width, header.height);
+        }
+        // the first picture sets the size; a stream that changes it
+        // midway is scaled back to it
+        if (i420->width() != header.width || i420->height() != header.height) {
+            rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+                webrtc::I420Buffer::Create(header.width, header.height);
+            scaled->ScaleFrom(*i420);
+            i420 = scaled;
+        }
+        if ((header.frames + 1) * header.frameSize > kMaxCacheBytes) {
+            RTC_LOG(LS_WARNING) << "Caching only the first " << header.frames
+                << " frames of " << device.url;
+            break;
+        }
+
+        const int chromaWidth  = i420->ChromaWidth();
+        const int chromaHeight = i420->ChromaHeight();
+        for (int row = 0; ok && row < header.height; row++)
+            ok = WriteAll(fd, i420->DataY() + row * i420->StrideY(),
+                header.width);
+        for (int row = 0; ok && row < chromaHeight; row++)
+            ok = WriteAll(fd, i420->DataU() + row * i420->StrideU(),
+                chromaWidth);
+        for (int row = 0; ok && row < chromaHeight; row++)
+            ok = WriteAll(fd, i420->DataV() + row * i420->StrideV(),
+                chromaWidth);
+        header.frames++;
+    }
+
+    // the header goes in last: a file cut short has none
+    ok = ok && header.frames > 0 && lseek(fd, 0, SEEK_SET) == 0 &&
+        WriteAll(fd, reinterpret_cast<const uint8_t*>(&header),
+            sizeof(header)) &&
+        fsync(fd) == 0;
+    if (close(fd) < 0) ok = false;
+    if (!ok || rename(temporary.c_str(), path.c_str()) < 0) {
+        RTC_LOG(LS_ERROR) << "Failed to cache " << device.url << " in "
+            << path << ": " << errno;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool
+FFmpegFrameCache::Map(const std::string& path, const FFmpegDeviceConfig& device)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat status;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &status) == 0 &&
+        static_cast<size_t>(status.st_size) >= sizeof(Header))
+        memory = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (memory == MAP_FAILED) return false;
+
+    memory_ = static_cast<const uint8_t*>(memory);
+    size_   = status.st_size;
+    const Header* header = reinterpret_cast<const Header*>(memory_);
+    uint64_t sourceSize;
+    int64_t sourceMtimeNs;
+    SourceStamp(device.url, sourceSize, sourceMtimeNs);
+    if (header->magic != kMagic || header->version != kVersion ||
+        header->width <= 0 || header->height <= 0 || header->frames == 0 ||
+        header->frameSize != webrtc::CalcBufferSize(webrtc::VideoType::kI420,
+            header->width, header->height) ||
+        header->frameOffset + header->frames * header->frameSize > size_ ||
+        header->sourceSize != sourceSize ||
+        header->sourceMtimeNs != sourceMtimeNs) {
+        // another version's, or of what the clip was before: decoded again
+        munmap(memory, size_);
+        memory_ = nullptr;
+        size_   = 0;
+        return false;
+    }
+
+    // read ahead of the first capture; not MADV_SEQUENTIAL, which would
+    // have the pages behind a reader reclaimed first, when every capture
+    // of the clip loops back to them
+    madvise(memory, size_, MADV_WILLNEED);
+    header_ = header;
+    path_   = path;
+    return true;
+}
+
+
+const std::string&
+FFmpegFrameCache::Path() const
+{ return path_; }
+
+
+int
+FFmpegFrameCache::Width() const
+{ return header_->width; }
+
+
+int
+FFmpegFrameCache::Height() const
+{ return header_->height; }
+
+
+int
+FFmpegFrameCache::FrameRate() const
+{ return header_->frameRate; }
+
+
+size_t
+FFmpegFrameCache::Frames() const
+{ return static_cast<size_t>(header_->frames); }
+
+
+size_t
+FFmpegFrameCache::FrameSize() const
+{ return static_cast<size_t>(header_->frameSize); }
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegFrameCache::Frame(size_t index) const
+{
+    const int width        = header_->width;
+    const int height       = header_->height;
+    const int chromaWidth  = (width  + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+    const uint8_t* dataY = memory_ + header_->frameOffset +
+        index * header_->frameSize;
+    const uint8_t* dataU = dataY + width * height;
+    const uint8_t* dataV = dataU + chromaWidth * chromaHeight;
+    // the sinks may hold on to it after the capture has let go of us
+    std::shared_ptr<FFmpegFrameCache> self = self_.lock();
+    return webrtc::WrapI420Buffer(width, height,
+        dataY, width,
+        dataU, chromaWidth,
+        dataV, chromaWidth,
+        [self]() { });
+}
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Clips decoded once into memory-mapped raw frame files.
+ */
+
+#ifndef DEMO_FFMPEG_FRAME_CACHE_H_
+#define DEMO_FFMPEG_FRAME_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include "modules/video_capture/video_capture.h"
+#include "ffmpeg_device_registry.h"
+
+
+// For load tests: a clip decoded once, then played from memory however
+// many captures play it, so what's measured is the WebRTC side rather than
+// the decoder.
+//
+// The first Open() of a device's clip at a given size and frame rate
+// decodes it with FFmpegAVIngest, scaled and decimated to them, into an
+// I420 file in the cache directory; every later one, in this process or
+// another, maps that file. The frames lie back to back after a header,
+// all the same size, so frame i is at a fixed offset and the file needs
+// no other index. Frame() wraps a frame where it lies in the mapping:
+// nothing is copied, and every capture shares the same pages.
+//
+// The file is rebuilt when the clip's size or modification time changes.
+// It's written under a temporary name and renamed into place, so readers
+// never see one half written.
+class FFmpegFrameCache {
+public:
+    // |capability|'s size and frame rate; its pixel format is ignored, the
+    // frames are I420. A zero width or height is the clip's own. Captures
+    // of the same file share one mapping. Returns nullptr if the clip
+    // can't be decoded or the file can't be written or mapped.
+    static std::shared_ptr<FFmpegFrameCache> Open(
+        const FFmpegDeviceConfig& device,
+        const std::string& directory,
+        const webrtc::VideoCaptureCapability& capability);
+
+    ~FFmpegFrameCache();
+
+    const std::string& Path() const;
+    int Width() const;
+    int Height() const;
+    int FrameRate() const;   // as decimated to; 0 if it wasn't
+    size_t Frames() const;
+    size_t FrameSize() const;
+
+    // Frame |index| (below Frames()), read-only; the mapping stays as long
+    // as it's referenced.
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> Frame(size_t index) const;
+
+    // where the cache goes without a device "cache" directory
+    static const char kDefaultDirectory[];
+
+private:
+    // at the start of the file; the frames follow, page aligned
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        int32_t  width;
+        int32_t  height;
+        int32_t  frameRate;
+        uint32_t reserved;
+        uint64_t frames;
+        uint64_t frameSize;
+        uint64_t frameOffset;
+        uint64_t sourceSize;   // of the clip, when it was decoded
+        int64_t  sourceMtimeNs;
+    };
+
+    FFmpegFrameCache();
+
+    static std::string CachePath(
+        const FFmpegDeviceConfig& device,
+        const std::string& directory,
+        const webrtc::VideoCaptureCapability& capability);
+    static bool Decode(
+        const FFmpegDeviceConfig& device,
+        const webrtc::VideoCaptureCapability& capability,
+        const std::string& path);
+    bool Map(const std::string& path, const FFmpegDeviceConfig& device);
+
+    std::string path_;
+    const uint8_t* memory_;
+    size_t size_;
+    const Header* header_;
+    std::weak_ptr<FFmpegFrameCache> self_; // for the frames' references
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Raw capture frames to I420, a horizontal band per core.
+ */
+
+#include "ffmpeg_frame_converter.h"
+
+#include <stdlib.h> // abs()
+
+#include <atomic>
+
+#include "third_party/libyuv/include/libyuv.h"
+
+
+FFmpegFrameConverter::FFmpegFrameConverter(FFmpegWorkerPool* workers)
+: workers_(workers)
+{ }
+
+
+int
+FFmpegFrameConverter::ConvertToI420(
+    const uint8_t* sample,
+    size_t sampleSize,
+    webrtc::VideoType type,
+    int width,
+    int height,
+    libyuv::RotationMode rotation,
+    webrtc::I420Buffer* dst)
+{
+    const uint32_t fourcc = webrtc::ConvertVideoType(type);
+    if (!workers_ || rotation != libyuv::kRotate0 || height < 0 ||
+            type == webrtc::VideoType::kMJPEG)
+        return libyuv::ConvertToI420(
+            sample, sampleSize,
+            dst->MutableDataY(), dst->StrideY(),
+            dst->MutableDataU(), dst->StrideU(),
+            dst->MutableDataV(), dst->StrideV(),
+            0, 0,  // No Cropping
+            width, height,
+            width, abs(height),
+            rotation, fourcc);
+
+    // Cropping a band out of the source keeps libyuv's format handling,
+    // and even band starts keep every chroma row within one band
+    std::atomic<int> result(0);
+    tasks_.clear();
+    workers_->AddSlices(tasks_, height, width, 2,
+        [=, &result](int first, int count) {
+            const int chromaFirst = first / 2;
+            int bandResult = libyuv::ConvertToI420(
+                sample, sampleSize,
+                dst->MutableDataY() + first       * dst->StrideY(),
+                dst->StrideY(),
+                dst->MutableDataU() + chromaFirst * dst->StrideU(),
+                dst->StrideU(),
+                dst->MutableDataV() + chromaFirst * dst->StrideV(),
+                dst->StrideV(),
+                0, first,
+                width, height,
+                width, count,
+                libyuv::kRotate0, fourcc);
+            if (bandResult < 0) result.store(bandResult);
+        });
+    workers_->Run(tasks_);
+    tasks_.clear();
+    return result.load();
+}
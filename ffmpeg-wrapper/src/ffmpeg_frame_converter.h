@@ -0,0 +1,52 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Raw capture frames to I420, a horizontal band per core.
+ */
+
+#ifndef DEMO_FFMPEG_FRAME_CONVERTER_H_
+#define DEMO_FFMPEG_FRAME_CONVERTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "api/video/i420_buffer.h"
+#include "common_video/libyuv/include/webrtc_libyuv.h"
+#include "third_party/libyuv/include/libyuv/rotate.h"
+#include "ffmpeg_worker_pool.h"
+
+
+// libyuv::ConvertToI420() on a worker pool. A 4K RGB24 frame takes longer
+// to convert than a frame interval on one core; cut into bands (cropping
+// the source a band at a time), it's converted on all of them, while
+// frames too small to be worth splitting stay a single task. Rotated,
+// bottom-up and MJPEG frames are converted whole.
+//
+// Not thread-safe, but converters on different threads may share a pool.
+class FFmpegFrameConverter {
+public:
+    explicit FFmpegFrameConverter(FFmpegWorkerPool* workers);
+
+    // As libyuv::ConvertToI420(): |height| is negative for bottom-up
+    // frames, and |dst| is |width| x abs(|height|), transposed for 90 and
+    // 270 degree rotations. Returns libyuv's result, 0 on success.
+    int ConvertToI420(
+        const uint8_t* sample,
+        size_t sampleSize,
+        webrtc::VideoType type,
+        int width,
+        int height,
+        libyuv::RotationMode rotation,
+        webrtc::I420Buffer* dst);
+
+private:
+    FFmpegWorkerPool* const workers_;
+    std::vector<FFmpegWorkerPool::Task> tasks_; // reused from frame to frame
+};
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Bounded lock-free frame queue between the capture reader and delivery
+ *  threads.
+ */
+
+#ifndef DEMO_FFMPEG_FRAME_RING_H_
+#define DEMO_FFMPEG_FRAME_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "rtc_base/event.h"
+
+
+struct FFmpegFrameRingStats {
+    size_t   capacity;
+    size_t   depth;         // frames queued right now
+    size_t   highWater;     // deepest the queue has been
+    uint64_t pushed;        // frames queued by the reader stage
+    uint64_t popped;        // frames taken by the delivery stage
+    uint64_t dropped;       // frames discarded by kDropOldest
+    uint64_t producerWaits; // times the reader stage blocked on a full ring
+    uint64_t consumerWaits; // times the delivery stage found the ring empty
+};
+
+
+// Single-producer/single-consumer ring after Vyukov's bounded queue: every
+// slot carries a sequence number, so neither side ever takes a lock. The
+// tail is advanced with a CAS rather than a plain store because, under
+// kDropOldest, the producer also consumes: it discards the oldest frame to
+// make room for the newest one.
+//
+// Events are only used to park a side that has nothing to do.
+template <typename T>
+class FFmpegFrameRing {
+public:
+    enum OverflowPolicy {
+        kDropOldest, // live sources: never stall the reader
+        kBlock       // file playback: never lose a frame
+    };
+
+    // |capacity| is rounded up to a power of two
+    explicit FFmpegFrameRing(size_t capacity)
+    : capacity_(RoundUp(capacity)),
+      mask_(capacity_ - 1),
+      slots_(new Slot[capacity_]),
+      policy_(kDropOldest)
+    { Reset(); }
+
+    void SetOverflowPolicy(OverflowPolicy policy)
+    { policy_.store(policy, std::memory_order_relaxed); }
+
+    OverflowPolicy GetOverflowPolicy() const
+    { return static_cast<OverflowPolicy>(policy_.load(std::memory_order_relaxed)); }
+
+    // Producer only. Returns false once the ring is closed.
+    bool Push(T item)
+    {
+        while (!closed_.load(std::memory_order_acquire)) {
+            if (TryPush(item)) {
+                dataEvent_.Set();
+                return true;
+            }
+
+            if (GetOverflowPolicy() == kDropOldest) {
+                T oldest;
+                if (TryPop(oldest)) dropped_.fetch_add(1, std::memory_order_relaxed);
+                continue; // the slot may still be in the consumer's hands
+            }
+
+            producerWaits_.fetch_add(1, std::memory_order_relaxed);
+            spaceEvent_.Wait(kParkMs);
+        }
+        return false;
+    }
+
+    // Consumer only. Waits up to |waitMs| for a frame.
+    bool Pop(T& item, int waitMs)
+    {
+        if (TryPop(item)) {
+            popped_.fetch_add(1, std::memory_order_relaxed);
+            spaceEvent_.Set();
+            return true;
+        }
+        consumerWaits_.fetch_add(1, std::memory_order_relaxed);
+        if (closed_.load(std::memory_order_acquire)) return false;
+
+        dataEvent_.Wait(waitMs);
+        if (!TryPop(item)) return false;
+        popped_.fetch_add(1, std::memory_order_relaxed);
+        spaceEvent_.Set();
+        return true;
+    }
+
+    // Makes Push() fail and wakes both sides. Queued frames stay poppable.
+    void Close()
+    {
+        closed_.store(true, std::memory_order_release);
+        dataEvent_.Set();
+        spaceEvent_.Set();
+    }
+
+    bool IsClosed() const
+    { return closed_.load(std::memory_order_acquire); }
+
+    size_t Capacity() const
+    { return capacity_; }
+
+    // Drops everything and reopens. Only call while neither side is running.
+    void Reset()
+    {
+        for (size_t i = 0; i < capacity_; i++) {
+            slots_[i].item = T();
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        highWater_.store(0, std::memory_order_relaxed);
+        pushed_.store(0, std::memory_order_relaxed);
+        popped_.store(0, std::memory_order_relaxed);
+        dropped_.store(0, std::memory_order_relaxed);
+        producerWaits_.store(0, std::memory_order_relaxed);
+        consumerWaits_.store(0, std::memory_order_relaxed);
+        closed_.store(false, std::memory_order_release);
+    }
+
+    size_t Depth() const
+    {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return head >= tail ? head - tail : 0;
+    }
+
+    FFmpegFrameRingStats GetStats() const
+    {
+        FFmpegFrameRingStats stats;
+        stats.capacity      = capacity_;
+        stats.depth         = Depth();
+        stats.highWater     = highWater_.load(std::memory_order_relaxed);
+        stats.pushed        = pushed_.load(std::memory_order_relaxed);
+        stats.popped        = popped_.load(std::memory_order_relaxed);
+        stats.dropped       = dropped_.load(std::memory_order_relaxed);
+        stats.producerWaits = producerWaits_.load(std::memory_order_relaxed);
+        stats.consumerWaits = consumerWaits_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    static const int kParkMs = 10;
+
+    static size_t RoundUp(size_t value)
+    {
+        size_t result = 2;
+        while (result < value) result <<= 1;
+        return result;
+    }
+
+    bool TryPush(T& item)
+    {
+        size_t position = head_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[position & mask_];
+        if (slot.sequence.load(std::memory_order_acquire) != position)
+            return false; // full: the slot still holds an unconsumed frame
+
+        slot.item = std::move(item);
+        slot.sequence.store(position + 1, std::memory_order_release);
+        head_.store(position + 1, std::memory_order_release);
+
+        pushed_.fetch_add(1, std::memory_order_relaxed);
+        size_t depth = Depth();
+        if (depth > highWater_.load(std::memory_order_relaxed))
+            highWater_.store(depth, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool TryPop(T& item)
+    {
+        size_t position = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots_[position & mask_];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) -
+                static_cast<intptr_t>(position + 1);
+            if (diff < 0) return false; // empty
+            if (diff > 0) {
+                position = tail_.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (tail_.compare_exchange_weak(position, position + 1,
+                    std::memory_order_relaxed)) {
+                item = std::move(slot.item);
+                slot.item = T();
+                slot.sequence.store(position + capacity_,
+                    std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+
+    std::atomic<int>    policy_;
+    std::atomic<bool>   closed_;
+    std::atomic<size_t> highWater_;
+    std::atomic<uint64_t> pushed_;
+    std::atomic<uint64_t> popped_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> producerWaits_;
+    std::atomic<uint64_t> consumerWaits_;
+
+    rtc::Event dataEvent_;
+    rtc::Event spaceEvent_;
+};
+
+#endif
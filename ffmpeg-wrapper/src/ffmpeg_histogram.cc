@@ -0,0 +1,110 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Lock-free log-linear latency histogram.
+ */
+
+#include "ffmpeg_histogram.h"
+
+#include <algorithm>
+#include <limits>
+
+
+FFmpegLatencyHistogram::FFmpegLatencyHistogram()
+{ Reset(); }
+
+
+void
+FFmpegLatencyHistogram::Record(int64_t us)
+{
+    if (us < 0) us = 0;
+    buckets_[BucketOf(static_cast<uint64_t>(us))]
+        .fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(static_cast<uint64_t>(us), std::memory_order_relaxed);
+
+    // a new extreme is rare; most calls get by on the loads
+    int64_t min = min_.load(std::memory_order_relaxed);
+    while (us < min && !min_.compare_exchange_weak(min, us,
+            std::memory_order_relaxed)) { }
+    int64_t max = max_.load(std::memory_order_relaxed);
+    while (us > max && !max_.compare_exchange_weak(max, us,
+            std::memory_order_relaxed)) { }
+}
+
+
+void
+FFmpegLatencyHistogram::Reset()
+{
+    for (size_t i = 0; i < kBuckets; i++)
+        buckets_[i].store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    min_.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+
+FFmpegLatencyHistogram::Snapshot
+FFmpegLatencyHistogram::GetSnapshot() const
+{
+    Snapshot snapshot = {};
+    uint64_t counts[kBuckets];
+    uint64_t count = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        count += counts[i];
+    }
+    if (count == 0) return snapshot;
+
+    snapshot.count = count;
+    snapshot.min   = min_.load(std::memory_order_relaxed);
+    snapshot.max   = max_.load(std::memory_order_relaxed);
+    snapshot.min   = std::min(snapshot.min, snapshot.max); // raced a Record()
+    snapshot.mean  = static_cast<int64_t>(
+        sum_.load(std::memory_order_relaxed) /
+        std::max<uint64_t>(count_.load(std::memory_order_relaxed), 1));
+
+    // the highest value of the bucket the rank falls in, within min..max
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    int64_t* values[] =
+        { &snapshot.p50, &snapshot.p90, &snapshot.p99, &snapshot.p999 };
+    size_t bucket = 0;
+    uint64_t seen = counts[0];
+    for (size_t q = 0; q < 4; q++) {
+        uint64_t rank = static_cast<uint64_t>(quantiles[q] * count + 0.5);
+        rank = std::max<uint64_t>(rank, 1);
+        while (seen < rank && bucket + 1 < kBuckets) seen += counts[++bucket];
+        *values[q] = std::max(snapshot.min,
+            std::min(ValueOf(bucket), snapshot.max));
+    }
+    return snapshot;
+}
+
+
+size_t
+FFmpegLatencyHistogram::BucketOf(uint64_t us)
+{
+    if (us < kSubBuckets) return static_cast<size_t>(us);
+    if (us >> kMaxBits) return kBuckets - 1;
+    // a power of two's range is split in kSubBuckets by the bits after
+    // its highest
+    const int msb = 63 - __builtin_clzll(us);
+    const int shift = msb - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((us >> shift) & (kSubBuckets - 1));
+}
+
+
+int64_t
+FFmpegLatencyHistogram::ValueOf(size_t bucket)
+{
+    if (bucket < kSubBuckets) return static_cast<int64_t>(bucket);
+    const int shift = static_cast<int>(bucket / kSubBuckets) - 1;
+    const uint64_t lowest =
+        (kSubBuckets + bucket % kSubBuckets) << shift;
+    return static_cast<int64_t>(lowest + (uint64_t(1) << shift) - 1);
+}
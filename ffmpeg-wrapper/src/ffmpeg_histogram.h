@@ -0,0 +1,67 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Lock-free log-linear latency histogram.
+ */
+
+#ifndef DEMO_FFMPEG_HISTOGRAM_H_
+#define DEMO_FFMPEG_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+// Microsecond latencies in HdrHistogram's log-linear buckets: exact below
+// 2^kSubBucketBits, then 2^kSubBucketBits buckets per power of two, so any
+// value is off by at most 1/16th (6%) from 0 to 2^kMaxBits us (12 days).
+//
+// Record() is a handful of relaxed atomic adds, safe from any number of
+// threads at once, and never waits. A snapshot taken while values are
+// being recorded may be off by those values, no more.
+class FFmpegLatencyHistogram {
+public:
+    struct Snapshot {
+        uint64_t count;
+        int64_t  min;      // all 0 when empty
+        int64_t  max;
+        int64_t  mean;
+        int64_t  p50;      // within a bucket's width of the exact value
+        int64_t  p90;
+        int64_t  p99;
+        int64_t  p999;
+    };
+
+    FFmpegLatencyHistogram();
+
+    // Negative values count as 0, values past the last bucket as the last.
+    void Record(int64_t us);
+
+    // Not atomic as a whole: values recorded while it runs may survive it.
+    void Reset();
+
+    Snapshot GetSnapshot() const;
+
+    static const int kSubBucketBits = 4;
+    static const int kMaxBits       = 40;
+
+private:
+    static const size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    static const size_t kBuckets    =
+        (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+    static size_t BucketOf(uint64_t us);
+    static int64_t ValueOf(size_t bucket); // the highest it holds
+
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<int64_t>  min_;
+    std::atomic<int64_t>  max_;
+};
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  In-process ingests kept open ahead of StartCapture().
+ */
+
+#include "ffmpeg_ingest_pool.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+#include "ffmpeg_thread_policy.h"
+
+
+FFmpegIngestPool*
+FFmpegIngestPool::GetInstance()
+{
+    // never destroyed: its ingests may still be reading at exit
+    static FFmpegIngestPool* pool = new FFmpegIngestPool();
+    return pool;
+}
+
+
+FFmpegIngestPool::FFmpegIngestPool()
+: opened_(0),
+  hits_(0),
+  misses_(0),
+  expired_(0),
+  failed_(0),
+  warmStarts_(0),
+  warmFirstFrameUs_(0),
+  coldStarts_(0),
+  coldFirstFrameUs_(0)
+{
+    warmer_.reset(new rtc::PlatformThread(
+        FFmpegIngestPool::WarmerThread, this, "IngestWarmer"));
+    warmer_->Start();
+}
+
+
+void
+FFmpegIngestPool::Prewarm()
+{
+    FFmpegDeviceRegistry* registry = FFmpegDeviceRegistry::GetInstance();
+    {
+        webrtc::MutexLock lock(&mutex_);
+        for (size_t i = 0; i < registry->NumberOfDevices(); i++) {
+            FFmpegDeviceRegistry::Entry device = registry->GetDevice(i);
+            if (device && device->warmSeconds > 0 &&
+                !members_.count(device->id))
+                pending_.push_back(device);
+        }
+    }
+    wake_.Set();
+}
+
+
+std::unique_ptr<FFmpegAVIngest>
+FFmpegIngestPool::Acquire(
+    const FFmpegDeviceRegistry::Entry& device,
+    bool passthrough,
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer>& frame,
+    int64_t& ptsUs)
+{
+    frame = nullptr;
+    ptsUs = -1;
+    if (!device || device->warmSeconds <= 0) return nullptr;
+
+    MemberRef member;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        auto it = members_.find(device->id);
+        if (it != members_.end() && it->second->device == device &&
+            it->second->ingest->IsPassthrough() == passthrough) {
+            member = it->second;
+            members_.erase(it);
+        }
+    }
+    if (member) {
+        // waits for the read in progress, or aborts it if the source has
+        // stalled; an aborted ingest counts as a miss
+        StopReader(*member);
+        if (member->failed.load(std::memory_order_acquire)) member = nullptr;
+    }
+    if (!member) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    webrtc::MutexLock lock(&member->frameMutex);
+    frame = member->frame;
+    ptsUs = member->ptsUs;
+    return std::move(member->ingest);
+}
+
+
+void
+FFmpegIngestPool::Release(
+    const FFmpegDeviceRegistry::Entry& device,
+    std::unique_ptr<FFmpegAVIngest> ingest)
+{
+    if (!ingest || !ingest->IsOpen() || !IsWanted(device)) return;
+
+    if (!IsLive(*device)) {
+        // it's part way through the file; open it again from the start
+        ingest.reset();
+        webrtc::MutexLock lock(&mutex_);
+        pending_.push_back(device);
+        wake_.Set();
+        return;
+    }
+
+    MemberRef member = NewMember(device, std::move(ingest));
+    MemberRef replaced;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        MemberRef& slot = members_[device->id];
+        replaced = slot; // another capture's; keep the newer
+        slot = member;
+    }
+    if (replaced) StopReader(*replaced);
+    wake_.Set(); // its expiry may be the next one due
+}
+
+
+void
+FFmpegIngestPool::ReportFirstFrame(bool warm, int64_t firstFrameUs)
+{
+    if (warm) {
+        warmStarts_.fetch_add(1, std::memory_order_relaxed);
+        warmFirstFrameUs_.fetch_add(firstFrameUs, std::memory_order_relaxed);
+    }
+    else {
+        coldStarts_.fetch_add(1, std::memory_order_relaxed);
+        coldFirstFrameUs_.fetch_add(firstFrameUs, std::memory_order_relaxed);
+    }
+}
+
+
+FFmpegIngestPool::Stats
+FFmpegIngestPool::GetStats() const
+{
+    Stats stats;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        stats.members = members_.size();
+    }
+    stats.opened  = opened_.load(std::memory_order_relaxed);
+    stats.hits    = hits_.load(std::memory_order_relaxed);
+    stats.misses  = misses_.load(std::memory_order_relaxed);
+    stats.expired = expired_.load(std::memory_order_relaxed);
+    stats.failed  = failed_.load(std::memory_order_relaxed);
+    stats.warmStarts = warmStarts_.load(std::memory_order_relaxed);
+    stats.coldStarts = coldStarts_.load(std::memory_order_relaxed);
+    stats.warmFirstFrameUs = stats.warmStarts == 0 ? 0 :
+        warmFirstFrameUs_.load(std::memory_order_relaxed) /
+            static_cast<int64_t>(stats.warmStarts);
+    stats.coldFirstFrameUs = stats.coldStarts == 0 ? 0 :
+        coldFirstFrameUs_.load(std::memory_order_relaxed) /
+            static_cast<int64_t>(stats.coldStarts);
+    return stats;
+}
+
+
+void
+FFmpegIngestPool::WarmerThread(void* object)
+{
+    FFmpegIngestPool* pool = static_cast<FFmpegIngestPool*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kCapture, "warmer");
+    for (;;)
+        pool->wake_.Wait(pool->Maintain());
+}
+
+
+int
+FFmpegIngestPool::Maintain()
+{
+    // 1. open what's pending, one at a time: each takes as long as a
+    //    cold StartCapture() would
+    for (;;) {
+        FFmpegDeviceRegistry::Entry device;
+        {
+            webrtc::MutexLock lock(&mutex_);
+            if (pending_.empty()) break;
+            device = pending_.back();
+            pending_.pop_back();
+            if (members_.count(device->id)) continue;
+        }
+        if (!IsWanted(device)) continue;
+
+        // the first capability, as a capture would most likely ask for;
+        // the one it asks for is set when it takes the ingest
+        std::unique_ptr<FFmpegAVIngest> ingest(new FFmpegAVIngest());
+        const webrtc::VideoCaptureCapability& capability =
+            device->capabilities.front();
+        if (ingest->Open(device->url, device->options, capability,
+                device->passthrough) != 0 &&
+            (!device->passthrough ||
+             ingest->Open(device->url, device->options, capability) != 0)) {
+            RTC_LOG(LS_WARNING) << "Can't warm up device " << device->id;
+            failed_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        opened_.fetch_add(1, std::memory_order_relaxed);
+
+        MemberRef member = NewMember(device, std::move(ingest));
+        {
+            // unless a capture handed one back meanwhile
+            webrtc::MutexLock lock(&mutex_);
+            MemberRef& slot = members_[device->id];
+            if (!slot) {
+                slot = member;
+                continue;
+            }
+        }
+        StopReader(*member);
+    }
+
+    // 2. close members that expired, went stale or stopped reading
+    const int64_t nowMs = rtc::TimeMillis();
+    int64_t nextMs = std::numeric_limits<int64_t>::max();
+    std::vector<MemberRef> closing;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        for (auto it = members_.begin(); it != members_.end();) {
+            Member& member = *it->second;
+            const int64_t expiresMs =
+                member.idleSinceMs + member.device->warmSeconds * 1000;
+            const bool failed = member.failed.load(std::memory_order_acquire);
+            if (!failed && nowMs < expiresMs && IsWanted(member.device)) {
+                nextMs = std::min(nextMs, expiresMs);
+                ++it;
+                continue;
+            }
+            if (failed) {
+                // the stream dropped; connect again
+                failed_.fetch_add(1, std::memory_order_relaxed);
+                pending_.push_back(member.device);
+            }
+            else if (nowMs >= expiresMs)
+                expired_.fetch_add(1, std::memory_order_relaxed);
+            closing.push_back(it->second);
+            it = members_.erase(it);
+        }
+        if (!pending_.empty()) nextMs = nowMs;
+    }
+    for (auto& member : closing) StopReader(*member);
+    closing.clear(); // closes the ingests, outside the lock
+
+    if (nextMs == std::numeric_limits<int64_t>::max())
+        return rtc::Event::kForever;
+    return static_cast<int>(std::max<int64_t>(nextMs - nowMs, 0));
+}
+
+
+FFmpegIngestPool::MemberRef
+FFmpegIngestPool::NewMember(
+    const FFmpegDeviceRegistry::Entry& device,
+    std::unique_ptr<FFmpegAVIngest> ingest)
+{
+    MemberRef member = std::make_shared<Member>();
+    member->device      = device;
+    member->ingest      = std::move(ingest);
+    member->idleSinceMs = rtc::TimeMillis();
+    member->stopping.store(false, std::memory_order_relaxed);
+    member->failed.store(false, std::memory_order_relaxed);
+    member->ptsUs       = -1;
+
+    if (IsLive(*device)) {
+        member->reader.reset(new rtc::PlatformThread(
+            FFmpegIngestPool::ReaderThread, member.get(), "IngestKeeper"));
+        member->reader->Start();
+    }
+    return member;
+}
+
+
+void
+FFmpegIngestPool::ReaderThread(void* object)
+{
+    Member* member = static_cast<Member*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kCapture,
+        "warm/" + member->device->id);
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+    int64_t ptsUs;
+    while (!member->stopping.load(std::memory_order_acquire)) {
+        if (member->ingest->ReadFrame(buffer, ptsUs) != 0) {
+            member->failed.store(true, std::memory_order_release);
+            GetInstance()->wake_.Set();
+            break;
+        }
+        // an access unit is no use without the ones before it
+        if (member->ingest->IsPassthrough()) continue;
+        webrtc::MutexLock lock(&member->frameMutex);
+        member->frame = buffer;
+        member->ptsUs = ptsUs;
+    }
+    member->done.Set();
+}
+
+
+void
+FFmpegIngestPool::StopReader(Member& member)
+{
+    member.stopping.store(true, std::memory_order_release);
+    if (member.reader) {
+        // a read blocked on a stalled source would hold the join up
+        if (!member.done.Wait(FFmpegAVIngest::kAbortGraceMs)) {
+            member.ingest->Abort();
+            member.failed.store(true, std::memory_order_release);
+        }
+        member.reader->Stop();
+        member.reader.reset();
+    }
+}
+
+
+bool
+FFmpegIngestPool::IsWanted(const FFmpegDeviceRegistry::Entry& device)
+{
+    // a device replaced or removed since takes its ingest with it
+    return device && device->warmSeconds > 0 && device->producer.empty() &&
+        !device->pipe &&
+        FFmpegDeviceRegistry::GetInstance()->Find(device->id) == device;
+}
+
+
+bool
+FFmpegIngestPool::IsLive(const FFmpegDeviceConfig& device)
+{ return !device.realtime && device.url.find("://") != std::string::npos; }
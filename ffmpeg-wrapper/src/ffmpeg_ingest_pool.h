@@ -0,0 +1,135 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  In-process ingests kept open ahead of StartCapture().
+ */
+
+#ifndef DEMO_FFMPEG_INGEST_POOL_H_
+#define DEMO_FFMPEG_INGEST_POOL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include "rtc_base/event.h"
+#include "rtc_base/platform_thread.h"
+#include "rtc_base/synchronization/mutex.h"
+#include "ffmpeg_av_ingest.h"
+#include "ffmpeg_device_registry.h"
+
+
+// Most of the time to a capture's first frame goes into opening the input:
+// connecting, probing it (probesize/analyzeduration) and waiting for the
+// decoder's first picture. For devices with a "warm" time, the pool does
+// that ahead of time, on a thread of its own, and keeps one open
+// FFmpegAVIngest per device for StartCapture() to take.
+//
+// The ingest of a live url (one that isn't paced) keeps reading while it
+// waits, so the connection stays up, the decoder stays current and the
+// capture that takes it starts with the picture it decoded last. A file's
+// is only opened, and one handed back is replaced by a fresh one, so the
+// next capture starts at the beginning again.
+//
+// An ingest nobody took for the device's "warm" time is closed; the next
+// capture opens one as usual, and hands it to the pool when it stops.
+class FFmpegIngestPool {
+public:
+    struct Stats {
+        size_t   members;          // open ingests waiting
+        uint64_t opened;           // ahead of time, by the pool
+        uint64_t hits;             // warm devices' captures that took one
+        uint64_t misses;           // ... and those that had to open one
+        uint64_t expired;          // closed after the device's warm time
+        uint64_t failed;           // couldn't be opened, or stopped reading
+        // StartCapture() -> first frame out, on average, of captures that
+        // took a warm ingest and of all the others
+        uint64_t warmStarts;
+        int64_t  warmFirstFrameUs;
+        uint64_t coldStarts;
+        int64_t  coldFirstFrameUs;
+    };
+
+    static FFmpegIngestPool* GetInstance();
+
+    // Opens an ingest in the background for every warm device in the
+    // registry that has none. Call it at startup, and after adding warm
+    // devices to the registry.
+    void Prewarm();
+
+    // The device's waiting ingest, if it's open in the same mode, or
+    // nullptr. |frame| is the last picture a live url's ingest decoded
+    // while it waited (null if none, or in passthrough), for the capture
+    // to start with.
+    std::unique_ptr<FFmpegAVIngest> Acquire(
+        const FFmpegDeviceRegistry::Entry& device,
+        bool passthrough,
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer>& frame,
+        int64_t& ptsUs);
+
+    // Takes the ingest of a capture that stopped. Closed unless the device
+    // is warm and the same as in the registry.
+    void Release(
+        const FFmpegDeviceRegistry::Entry& device,
+        std::unique_ptr<FFmpegAVIngest> ingest);
+
+    // A capture's first frame went out |firstFrameUs| after StartCapture().
+    void ReportFirstFrame(bool warm, int64_t firstFrameUs);
+
+    Stats GetStats() const;
+
+private:
+    struct Member {
+        FFmpegDeviceRegistry::Entry device; // as opened
+        std::unique_ptr<FFmpegAVIngest> ingest;
+        int64_t idleSinceMs;
+
+        // live urls: reads until the ingest is taken
+        std::unique_ptr<rtc::PlatformThread> reader;
+        std::atomic<bool> stopping;
+        std::atomic<bool> failed;
+        rtc::Event done;            // the reader is returning
+        webrtc::Mutex frameMutex;
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame; // guarded
+        int64_t ptsUs;                                      // guarded
+    };
+    typedef std::shared_ptr<Member> MemberRef;
+
+    FFmpegIngestPool();
+
+    static void WarmerThread(void* object);
+    static void ReaderThread(void* object);
+    int Maintain(); // ms until a member is due to expire
+    static bool IsWanted(const FFmpegDeviceRegistry::Entry& device);
+    static bool IsLive(const FFmpegDeviceConfig& device);
+    MemberRef NewMember(
+        const FFmpegDeviceRegistry::Entry& device,
+        std::unique_ptr<FFmpegAVIngest> ingest);
+    static void StopReader(Member& member);
+
+    mutable webrtc::Mutex mutex_;
+    std::unordered_map<std::string, MemberRef> members_; // by device id
+    std::vector<FFmpegDeviceRegistry::Entry> pending_;   // to be opened
+    rtc::Event wake_;
+    std::unique_ptr<rtc::PlatformThread> warmer_;
+
+    std::atomic<uint64_t> opened_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> expired_;
+    std::atomic<uint64_t> failed_;
+    std::atomic<uint64_t> warmStarts_;
+    std::atomic<int64_t>  warmFirstFrameUs_; // totals
+    std::atomic<uint64_t> coldStarts_;
+    std::atomic<int64_t>  coldFirstFrameUs_;
+};
+
+#endif
@@ -0,0 +1,637 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Shared epoll or io_uring reactor that reads every ingest pipe.
+ */
+
+#include "ffmpeg_ingest_reactor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h> // getenv(), atoi()
+#include <string.h> // strcmp()
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>   // clock_gettime()
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "rtc_base/checks.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+#include "system_wrappers/include/cpu_info.h"
+#include "ffmpeg_thread_policy.h"
+
+
+// One event per epoll_wait(): a thread that took several ready fds would
+// sit on the rest while it reads the first, when idle threads could have
+// taken them
+static const int    kEventsPerWait      = 1;
+// Frames read from one fd before it goes back to the end of the line
+static const int    kMaxFramesPerWakeup = 2;
+// epoll_event.data of the wake-up eventfd; entry ids start at 1
+static const uint64_t kWakeId           = 0;
+
+// Submission queue entries: a read or a resume per source, plus cancels
+static const unsigned kUringEntries     = 256;
+// Completions a thread takes at once, at most; see Harvest()
+static const size_t kMaxCompletionsPerHarvest = 16;
+// io_uring user_data: the entry id, shifted, and what was posted for it
+static const int      kOpBits   = 2;
+static const int      kOpRead   = 0;
+static const int      kOpResume = 1;  // no-op; the next read is posted on it
+static const int      kOpCancel = 2;
+static const int      kOpWake   = 3;  // shutdown, passed from thread to thread
+
+
+static uint64_t
+Tag(uint64_t id, int op)
+{ return (id << kOpBits) | op; }
+
+
+// timerfds run on CLOCK_MONOTONIC, which FFmpegCaptureClock may not
+static int64_t
+MonotonicMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * rtc::kNumMicrosecsPerSec +
+        now.tv_nsec / rtc::kNumNanosecsPerMicrosec;
+}
+
+
+static struct timespec
+ToTimespec(int64_t us)
+{
+    struct timespec time;
+    time.tv_sec  = us / rtc::kNumMicrosecsPerSec;
+    time.tv_nsec = (us % rtc::kNumMicrosecsPerSec) *
+        rtc::kNumNanosecsPerMicrosec;
+    return time;
+}
+
+
+FFmpegIngestReactor*
+FFmpegIngestReactor::GetInstance()
+{
+    // never destroyed: capture modules may still be running at exit
+    static FFmpegIngestReactor* reactor = [] {
+        const char* value = getenv("FFMPEG_REACTOR_THREADS");
+        int threads = value ? atoi(value) : 0;
+        if (threads <= 0)
+            threads = std::min<int>(webrtc::CpuInfo::DetectNumberOfCores(),
+                kDefaultMaxThreads);
+        const char* backend = getenv("FFMPEG_REACTOR_BACKEND");
+        return new FFmpegIngestReactor(threads, "IngestReactor",
+            backend && !strcmp(backend, "epoll") ? kBackendEpoll :
+                kBackendIoUring);
+    }();
+    return reactor;
+}
+
+
+FFmpegIngestReactor::FFmpegIngestReactor(
+    size_t threads,
+    const std::string& name,
+    Backend backend)
+: epollFd_(-1),
+  wakeFd_(-1),
+  threadCount_(std::max<size_t>(threads, 1)),
+  stopping_(false),
+  name_(name),
+  threadsStarted_(0),
+  nextId_(kWakeId + 1),
+  wakeups_(0),
+  harvests_(0),
+  frames_(0),
+  bytes_(0),
+  pauses_(0)
+{
+    if (backend == kBackendIoUring)
+        uring_ = FFmpegIoUring::Create(kUringEntries);
+    if (!uring_) {
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd_  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        RTC_CHECK(epollFd_ >= 0 && wakeFd_ >= 0) << "Can't create the reactor";
+
+        // level-triggered and never read: once written, it wakes every thread
+        struct epoll_event event = {};
+        event.events   = EPOLLIN;
+        event.data.u64 = kWakeId;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &event);
+    }
+    RTC_LOG(LS_INFO) << name << " reads with "
+        << (uring_ ? "io_uring" : "epoll");
+
+    for (size_t i = 0; i < threadCount_; i++) {
+        threads_.emplace_back(new rtc::PlatformThread(
+            FFmpegIngestReactor::ReactorThread, this,
+            name + std::to_string(i)));
+        threads_.back()->Start();
+    }
+}
+
+
+FFmpegIngestReactor::~FFmpegIngestReactor()
+{
+    stopping_.store(true, std::memory_order_release);
+    if (uring_) {
+        uring_->QueueNop(Tag(0, kOpWake));
+        uring_->Submit(false);
+    }
+    else {
+        uint64_t one = 1;
+        if (write(wakeFd_, &one, sizeof(one)) != sizeof(one))
+            RTC_LOG(LS_ERROR) << "Failed to wake the reactor threads";
+    }
+    for (auto& thread : threads_)
+        thread->Stop();
+
+    for (auto& it : entries_)
+        if (it.second->timer) close(it.second->fd);
+    if (wakeFd_ >= 0) close(wakeFd_);
+    if (epollFd_ >= 0) close(epollFd_);
+}
+
+
+bool
+FFmpegIngestReactor::AddSource(Source* source, int fd)
+{
+    // io_uring polls a blocking fd when it's empty, where a non-blocking
+    // one would just fail the read with EAGAIN
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL,
+            uring_ ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) < 0) {
+        RTC_LOG(LS_ERROR) << "Can't set the blocking mode of fd " << fd;
+        return false;
+    }
+
+    EntryRef entry = std::make_shared<Entry>();
+    entry->fd     = fd;
+    entry->source = source;
+    entry->timer  = nullptr;
+    entry->periodUs   = 0;
+    entry->deadlineUs = 0;
+    return Add(entry, source);
+}
+
+
+bool
+FFmpegIngestReactor::AddTimer(Timer* timer, int64_t periodUs)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC,
+        (uring_ ? 0 : TFD_NONBLOCK) | TFD_CLOEXEC);
+    if (fd < 0) {
+        RTC_LOG(LS_ERROR) << "Can't create a timer";
+        return false;
+    }
+
+    // the first deadline is absolute, and the kernel adds the interval to
+    // each deadline rather than to when it was read, so expiration n is
+    // due at exactly first + n * period however late any tick ran
+    const int64_t firstUs = MonotonicMicros() + periodUs;
+    struct itimerspec spec = {};
+    spec.it_interval = ToTimespec(periodUs);
+    spec.it_value    = ToTimespec(firstUs);
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        close(fd);
+        return false;
+    }
+
+    EntryRef entry = std::make_shared<Entry>();
+    entry->fd     = fd;
+    entry->source = nullptr;
+    entry->timer  = timer;
+    entry->periodUs   = periodUs;
+    entry->deadlineUs = firstUs;
+    if (Add(entry, timer)) return true;
+    close(fd);
+    return false;
+}
+
+
+bool
+FFmpegIngestReactor::Add(const EntryRef& entry, const void* key)
+{
+    entry->frame       = nullptr;
+    entry->size        = 0;
+    entry->filled      = 0;
+    entry->firstByteUs = 0;
+    entry->expirations = 0;
+    entry->busy        = false;
+    entry->inflight    = false;
+    entry->paused      = false;
+    entry->resume      = false;
+    entry->removed     = false;
+
+    {
+        webrtc::MutexLock lock(&mutex_);
+        if (ids_.count(key)) return false;
+        entry->id = nextId_++;
+
+        if (uring_)
+            // the first frame is asked for on a reactor thread, like the rest
+            Post(*entry, kOpResume);
+        else {
+            struct epoll_event event = {};
+            event.events   = EPOLLIN | EPOLLONESHOT;
+            event.data.u64 = entry->id;
+            if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, entry->fd, &event) < 0) {
+                RTC_LOG(LS_ERROR) << "Can't watch fd " << entry->fd;
+                return false;
+            }
+        }
+        entries_[entry->id] = entry;
+        ids_[key] = entry->id;
+    }
+    if (uring_) uring_->Submit(false);
+    return true;
+}
+
+
+void
+FFmpegIngestReactor::RemoveSource(Source* source)
+{ Remove(source); }
+
+
+void
+FFmpegIngestReactor::RemoveTimer(Timer* timer)
+{ Remove(timer); }
+
+
+void
+FFmpegIngestReactor::Fire(Entry& entry, uint64_t expirations)
+{
+    // busy, so no other thread touches |deadlineUs| meanwhile
+    const int64_t lastUs = entry.deadlineUs +
+        static_cast<int64_t>(expirations - 1) * entry.periodUs;
+    entry.deadlineUs = lastUs + entry.periodUs;
+    const int64_t lateUs = MonotonicMicros() - lastUs;
+    FFmpegThreadPolicy::RecordWakeUp(lateUs);
+    entry.timer->OnTimer(expirations, lateUs);
+}
+
+
+void
+FFmpegIngestReactor::Remove(const void* key)
+{
+    EntryRef entry;
+    bool wait;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        auto id = ids_.find(key);
+        if (id == ids_.end()) return;
+        auto it = entries_.find(id->second);
+        entry = it->second;
+        ids_.erase(id);
+        entry->removed = true;
+
+        if (entry->inflight) {
+            // the kernel may still write into the frame: wait for the read
+            // to end, which takes it out of |entries_|
+            uring_->QueueCancel(Tag(entry->id, kOpRead), Tag(0, kOpCancel));
+            wait = true;
+        }
+        else {
+            entries_.erase(it);
+            if (!uring_) epoll_ctl(epollFd_, EPOLL_CTL_DEL, entry->fd, NULL);
+            wait = entry->busy;
+        }
+    }
+    if (uring_) uring_->Submit(false);
+
+    // a thread that already took an event for it finds it gone
+    if (wait) entry->idle.Wait(rtc::Event::kForever);
+    if (entry->timer) close(entry->fd);
+}
+
+
+void
+FFmpegIngestReactor::Resume(Source* source)
+{
+    {
+        webrtc::MutexLock lock(&mutex_);
+        auto id = ids_.find(source);
+        if (id == ids_.end()) return;
+        Entry& entry = *entries_[id->second];
+        if (entry.busy)
+            entry.resume = true; // picked up when the handler is done
+        else if (entry.paused) {
+            entry.paused = false;
+            if (uring_) Post(entry, kOpResume);
+            else Arm(entry);
+        }
+    }
+    if (uring_) uring_->Submit(false);
+}
+
+
+size_t
+FFmpegIngestReactor::NumberOfThreads() const
+{ return threads_.size(); }
+
+
+FFmpegIngestReactor::Backend
+FFmpegIngestReactor::GetBackend() const
+{ return uring_ ? kBackendIoUring : kBackendEpoll; }
+
+
+FFmpegIngestReactor::Stats
+FFmpegIngestReactor::GetStats() const
+{
+    Stats stats;
+    stats.threads = threads_.size();
+    {
+        webrtc::MutexLock lock(&mutex_);
+        stats.sources = entries_.size();
+    }
+    stats.wakeups  = wakeups_.load(std::memory_order_relaxed);
+    stats.harvests = harvests_.load(std::memory_order_relaxed);
+    stats.frames  = frames_.load(std::memory_order_relaxed);
+    stats.bytes   = bytes_.load(std::memory_order_relaxed);
+    stats.pauses  = pauses_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+
+void
+FFmpegIngestReactor::ReactorThread(void* object)
+{
+    FFmpegIngestReactor* reactor = static_cast<FFmpegIngestReactor*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kReactor,
+        reactor->name_ + std::to_string(reactor->threadsStarted_.fetch_add(1)));
+    if (reactor->uring_) reactor->WaitUring();
+    else reactor->WaitEpoll();
+}
+
+
+void
+FFmpegIngestReactor::WaitEpoll()
+{
+    struct epoll_event events[kEventsPerWait];
+    while (!stopping_.load(std::memory_order_acquire)) {
+        int count = epoll_wait(epollFd_, events, kEventsPerWait, -1);
+        if (count < 0 && errno != EINTR) {
+            RTC_LOG(LS_ERROR) << "epoll_wait failed: " << errno;
+            return;
+        }
+        if (count > 0) harvests_.fetch_add(1, std::memory_order_relaxed);
+        for (int i = 0; i < count; i++)
+            if (events[i].data.u64 != kWakeId)
+                Handle(events[i].data.u64);
+    }
+}
+
+
+void
+FFmpegIngestReactor::Handle(uint64_t id)
+{
+    EntryRef entry;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) return; // removed since it fired
+        entry = it->second;
+        entry->busy = true;
+    }
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+
+    bool open = true;
+    if (entry->timer) {
+        uint64_t expirations = 0;
+        if (read(entry->fd, &expirations, sizeof(expirations)) ==
+                sizeof(expirations))
+            Fire(*entry, expirations);
+    }
+    else {
+        open = ReadFrames(*entry);
+        // still busy, so RemoveSource() waits until this returns
+        if (!open) Close(*entry);
+    }
+
+    webrtc::MutexLock lock(&mutex_);
+    entry->busy = false;
+    if (entry->removed) {
+        entry->idle.Set();
+        return;
+    }
+
+    if (!open) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, entry->fd, NULL);
+        ids_.erase(entry->source);
+        entries_.erase(id);
+        entry->removed = true;
+    }
+    else if (entry->resume || !entry->paused) {
+        entry->paused = false;
+        entry->resume = false;
+        Arm(*entry);
+    }
+}
+
+
+bool
+FFmpegIngestReactor::ReadFrames(Entry& entry)
+{
+    int frames = 0;
+    while (frames < kMaxFramesPerWakeup) {
+        if (!entry.frame) {
+            entry.frame  = entry.source->NextFrame(entry.size);
+            entry.filled = 0;
+            RTC_DCHECK(entry.frame && entry.size > 0);
+        }
+
+        ssize_t count = read(entry.fd,
+            entry.frame + entry.filled, entry.size - entry.filled);
+        if (count > 0) {
+            bytes_.fetch_add(count, std::memory_order_relaxed);
+            if (entry.filled == 0) entry.firstByteUs = rtc::TimeMicros();
+            entry.filled += count;
+            if (entry.filled < entry.size) continue;
+
+            entry.frame = nullptr;
+            frames++;
+            frames_.fetch_add(1, std::memory_order_relaxed);
+            entry.source->OnFrameRead(rtc::TimeMicros() - entry.firstByteUs);
+            if (!entry.source->OnFrame()) {
+                entry.paused = true;
+                pauses_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        else if (count == 0)
+            return false; // the writer is gone
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return true;  // the rest of the frame isn't there yet
+        else if (errno != EINTR) {
+            RTC_LOG(LS_ERROR) << "Failed to read fd " << entry.fd
+                << ": " << errno;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void
+FFmpegIngestReactor::Close(Entry& entry)
+{
+    if (entry.frame && entry.filled > 0)
+        entry.source->OnShortRead(entry.filled, entry.size);
+    entry.source->OnClosed();
+}
+
+
+void
+FFmpegIngestReactor::Arm(const Entry& entry)
+{
+    struct epoll_event event = {};
+    event.events   = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = entry.id;
+    epoll_ctl(epollFd_, EPOLL_CTL_MOD, entry.fd, &event);
+}
+
+
+void
+FFmpegIngestReactor::WaitUring()
+{
+    FFmpegIoUring::Completion completions[kMaxCompletionsPerHarvest];
+    for (;;) {
+        // a fair share of what's ready, so a batch doesn't sit behind one
+        // thread while the others have nothing to do
+        size_t count = uring_->Harvest(completions, kMaxCompletionsPerHarvest,
+            threadCount_);
+        if (count == 0) {
+            // submits the reads the last batch posted, then sleeps
+            uring_->Submit(true);
+            continue;
+        }
+        harvests_.fetch_add(1, std::memory_order_relaxed);
+
+        bool wake = false;
+        for (size_t i = 0; i < count; i++) {
+            const uint64_t id = completions[i].userData >> kOpBits;
+            const int op = completions[i].userData & ((1 << kOpBits) - 1);
+            if (op == kOpWake) wake = true;
+            else if (op != kOpCancel) Complete(id, op, completions[i].result);
+        }
+        if (wake) {
+            // one no-op is enough to stop every thread, one after the other
+            uring_->QueueNop(Tag(0, kOpWake));
+            uring_->Submit(false);
+            return;
+        }
+    }
+}
+
+
+void
+FFmpegIngestReactor::Complete(uint64_t id, int op, int32_t result)
+{
+    EntryRef entry;
+    {
+        webrtc::MutexLock lock(&mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) return;
+        entry = it->second;
+        entry->inflight = false;
+        if (entry->removed) {
+            // Remove() cancelled the read and is waiting for it to end
+            entries_.erase(it);
+            entry->idle.Set();
+            return;
+        }
+        entry->busy = true;
+    }
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+
+    bool open = true;
+    if (op == kOpRead && entry->timer) {
+        if (result == sizeof(entry->expirations))
+            Fire(*entry, entry->expirations);
+    }
+    else if (op == kOpRead)
+        open = ReadCompleted(*entry, result);
+
+    if (!open)
+        // still busy, so RemoveSource() waits until this returns
+        Close(*entry);
+    else if (entry->source && !entry->frame && !entry->paused) {
+        // outside the lock: the source may take locks of its own
+        entry->frame  = entry->source->NextFrame(entry->size);
+        entry->filled = 0;
+        RTC_DCHECK(entry->frame && entry->size > 0);
+    }
+
+    webrtc::MutexLock lock(&mutex_);
+    entry->busy = false;
+    if (entry->removed) {
+        entry->idle.Set();
+        return;
+    }
+
+    if (!open) {
+        ids_.erase(entry->source);
+        entries_.erase(id);
+        entry->removed = true;
+    }
+    else if (!entry->paused) {
+        entry->resume = false;
+        Post(*entry, kOpRead);
+    }
+    else if (entry->resume) {
+        // the next frame is asked for when the no-op completes
+        entry->paused = false;
+        entry->resume = false;
+        Post(*entry, kOpResume);
+    }
+    // the reads go to the kernel with the next Submit() of this thread
+}
+
+
+bool
+FFmpegIngestReactor::ReadCompleted(Entry& entry, int32_t result)
+{
+    if (result > 0) {
+        bytes_.fetch_add(result, std::memory_order_relaxed);
+        if (entry.filled == 0) entry.firstByteUs = rtc::TimeMicros();
+        entry.filled += result;
+        if (entry.filled < entry.size) return true;
+
+        entry.frame = nullptr;
+        frames_.fetch_add(1, std::memory_order_relaxed);
+        entry.source->OnFrameRead(rtc::TimeMicros() - entry.firstByteUs);
+        if (!entry.source->OnFrame()) {
+            entry.paused = true;
+            pauses_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+    if (result == 0)
+        return false; // the writer is gone
+    if (result == -EINTR || result == -EAGAIN)
+        return true;  // read again
+    RTC_LOG(LS_ERROR) << "Failed to read fd " << entry.fd << ": " << -result;
+    return false;
+}
+
+
+void
+FFmpegIngestReactor::Post(Entry& entry, int op)
+{
+    if (op == kOpResume)
+        uring_->QueueNop(Tag(entry.id, kOpResume));
+    else if (entry.timer)
+        uring_->QueueRead(entry.fd, &entry.expirations,
+            sizeof(entry.expirations), Tag(entry.id, kOpRead));
+    else
+        uring_->QueueRead(entry.fd, entry.frame + entry.filled,
+            entry.size - entry.filled, Tag(entry.id, kOpRead));
+    entry.inflight = true;
+}
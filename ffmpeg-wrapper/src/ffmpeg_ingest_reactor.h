@@ -0,0 +1,197 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Shared epoll or io_uring reactor that reads every ingest pipe.
+ */
+
+#ifndef DEMO_FFMPEG_INGEST_REACTOR_H_
+#define DEMO_FFMPEG_INGEST_REACTOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ffmpeg_io_uring.h"
+#include "rtc_base/event.h"
+#include "rtc_base/platform_thread.h"
+#include "rtc_base/synchronization/mutex.h"
+
+
+// Reads fixed-size frames from non-blocking pipes (raw video from an
+// ffmpeg child, 10 ms of PCM) and fires periodic timers, for any number of
+// sources on a fixed number of threads.
+//
+// Every thread waits on the same epoll set, and every fd is armed
+// EPOLLONESHOT: whichever thread is woken for it owns it until it is
+// re-armed, so one source's frames are read and handled in order, on one
+// thread at a time, while other threads serve other sources. A frame is
+// handled on the thread that completed it; there's no hand-off between a
+// reading thread and a working one. Handlers must not block: a source that
+// can't take another frame returns false from OnFrame() and is left alone
+// until Resume(), which makes the pipe fill up and ffmpeg wait.
+//
+// With io_uring the same guarantees hold, but rather than being told an fd
+// is readable and then reading it, each source has one read in flight,
+// straight into the buffer NextFrame() returned, and threads harvest the
+// completed reads of every source in batches: a read costs no system call
+// of its own, and the reads a batch posts go to the kernel together, in
+// the call that waits for the next batch.
+class FFmpegIngestReactor {
+public:
+    class Source {
+    public:
+        virtual ~Source() { }
+
+        // Where the next frame goes, |size| bytes of it. Asked once per
+        // frame, before its first byte is read.
+        virtual uint8_t* NextFrame(size_t& size) = 0;
+
+        // All of the frame has been read. False pauses the source.
+        virtual bool OnFrame() = 0;
+
+        // End of input, or a read error. The source has been removed.
+        virtual void OnClosed() = 0;
+
+        // Optional, just before OnFrame(): how long the frame took to
+        // come in, from its first byte to its last.
+        virtual void OnFrameRead(int64_t readUs) { }
+
+        // Optional, just before OnClosed(): the input ended |filled| bytes
+        // into a |size|-byte frame, which is lost.
+        virtual void OnShortRead(size_t filled, size_t size) { }
+    };
+
+    class Timer {
+    public:
+        virtual ~Timer() { }
+
+        // |expirations| is more than one if the timer fell behind, and
+        // |lateUs| how long after the last of them it fired. The periods
+        // are counted from when the timer was added, on absolute
+        // deadlines, so being late once doesn't push back the ones after.
+        virtual void OnTimer(uint64_t expirations, int64_t lateUs) = 0;
+    };
+
+    struct Stats {
+        size_t   threads;
+        size_t   sources;     // pipes and timers
+        uint64_t wakeups;     // events or completions handled
+        uint64_t harvests;    // times a thread took a batch of them
+        uint64_t frames;      // frames read
+        uint64_t bytes;
+        uint64_t pauses;      // OnFrame() returned false
+    };
+
+    enum Backend {
+        kBackendEpoll,
+        kBackendIoUring   // falls back to epoll where io_uring can't be used
+    };
+
+    // Shared by every capture module and audio device. Runs
+    // FFMPEG_REACTOR_THREADS threads if set, else one per core up to
+    // kDefaultMaxThreads, on io_uring unless FFMPEG_REACTOR_BACKEND is
+    // "epoll".
+    static FFmpegIngestReactor* GetInstance();
+
+    FFmpegIngestReactor(
+        size_t threads,
+        const std::string& name,
+        Backend backend = kBackendIoUring);
+    ~FFmpegIngestReactor();
+
+    // Reads frames from |fd|, which is made non-blocking for epoll and
+    // blocking for io_uring. The caller keeps ownership of both.
+    bool AddSource(Source* source, int fd);
+
+    // Calls |timer| every |periodUs|, starting one period from now, on
+    // CLOCK_MONOTONIC deadlines that never drift from that start.
+    bool AddTimer(Timer* timer, int64_t periodUs);
+
+    // Stops watching. Waits for a handler of |source| that's running on
+    // another thread, so it must not be called from one of |source|'s own
+    // handlers. Removing what isn't there (anymore) is fine.
+    void RemoveSource(Source* source);
+    void RemoveTimer(Timer* timer);
+
+    // Lets a paused source be read again. Safe from any thread, including
+    // while the source's OnFrame() is still returning false.
+    void Resume(Source* source);
+
+    size_t NumberOfThreads() const;
+    Backend GetBackend() const;   // what it actually runs on
+    Stats GetStats() const;
+
+    static const size_t kDefaultMaxThreads = 4;
+
+private:
+    struct Entry {
+        uint64_t id;
+        int fd;
+        Source* source;
+        Timer* timer;     // timerfd entries; we own |fd|
+        int64_t periodUs;
+        int64_t deadlineUs;   // of the next expiration, on CLOCK_MONOTONIC
+
+        uint8_t* frame;   // the frame being read
+        size_t size;
+        size_t filled;
+        int64_t firstByteUs;  // of the frame being read, on rtc::TimeMicros()
+        uint64_t expirations; // where io_uring reads a timerfd into
+
+        bool busy;        // a thread is handling it
+        bool inflight;    // io_uring: a read or a resume is posted
+        bool paused;
+        bool resume;      // Resume() came in while busy
+        bool removed;
+        rtc::Event idle;  // set when a busy or in-flight removed entry is let go of
+    };
+    typedef std::shared_ptr<Entry> EntryRef;
+
+    std::unique_ptr<FFmpegIoUring> uring_;  // null: epoll
+    int epollFd_;
+    int wakeFd_;          // eventfd that gets every thread out of epoll_wait
+    size_t threadCount_;
+    std::atomic<bool> stopping_;
+    std::vector<std::unique_ptr<rtc::PlatformThread>> threads_;
+    const std::string name_;
+    std::atomic<size_t> threadsStarted_; // numbers them for their Scope
+
+    mutable webrtc::Mutex mutex_;
+    std::unordered_map<uint64_t, EntryRef> entries_; // by id
+    std::unordered_map<const void*, uint64_t> ids_;  // Source/Timer -> id
+    uint64_t nextId_;
+
+    std::atomic<uint64_t> wakeups_;
+    std::atomic<uint64_t> harvests_;
+    std::atomic<uint64_t> frames_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> pauses_;
+
+    static void ReactorThread(void* object);
+    bool Add(const EntryRef& entry, const void* key);
+    void Fire(Entry& entry, uint64_t expirations);
+    void Remove(const void* key);
+
+    // epoll
+    void WaitEpoll();
+    void Handle(uint64_t id);
+    bool ReadFrames(Entry& entry); // false at end of input
+    void Close(Entry& entry);      // tells the source its input ended
+    void Arm(const Entry& entry);
+
+    // io_uring
+    void WaitUring();
+    void Complete(uint64_t id, int op, int32_t result);
+    bool ReadCompleted(Entry& entry, int32_t result); // false at end of input
+    void Post(Entry& entry, int op);
+};
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Minimal io_uring submission and completion queues.
+ */
+
+#include "ffmpeg_io_uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define FFMPEG_HAVE_IO_URING 1
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "rtc_base/logging.h"
+
+
+#if defined(FFMPEG_HAVE_IO_URING) && defined(__NR_io_uring_setup) && \
+    defined(IORING_FEAT_FAST_POLL)
+
+// Features ingest can't do without: a completion is never dropped, a read
+// at offset -1 reads from where the fd is, and a read of an empty pipe
+// waits on a poll instead of blocking a kernel worker thread.
+static const uint32_t kRequiredFeatures =
+    IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS | IORING_FEAT_FAST_POLL;
+
+
+static bool
+Supports(int fd, const std::vector<uint8_t>& opcodes)
+{
+    const size_t ops = 256;
+    std::vector<uint8_t> memory(
+        sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe =
+        reinterpret_cast<struct io_uring_probe*>(memory.data());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+            probe, ops) < 0)
+        return false;
+    for (uint8_t opcode : opcodes)
+        if (opcode > probe->last_op ||
+                !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    return true;
+}
+
+
+std::unique_ptr<FFmpegIoUring>
+FFmpegIoUring::Create(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        RTC_LOG(LS_INFO) << "io_uring unavailable: " << errno;
+        return nullptr;
+    }
+    if ((params.features & kRequiredFeatures) != kRequiredFeatures ||
+            !Supports(fd, { IORING_OP_READ, IORING_OP_ASYNC_CANCEL })) {
+        RTC_LOG(LS_INFO) << "io_uring lacks the features ingest needs";
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<FFmpegIoUring> ring(new FFmpegIoUring());
+    ring->fd_ = fd;
+    ring->sqRingSize_ = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize_ = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        ring->sqRingSize_ = ring->cqRingSize_ =
+            std::max(ring->sqRingSize_, ring->cqRingSize_);
+
+    void* sq = mmap(NULL, ring->sqRingSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return nullptr;
+    ring->sqRing_ = static_cast<uint8_t*>(sq);
+
+    if (single)
+        ring->cqRing_ = ring->sqRing_;
+    else {
+        void* cq = mmap(NULL, ring->cqRingSize_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return nullptr;
+        ring->cqRing_ = static_cast<uint8_t*>(cq);
+    }
+
+    void* sqes = mmap(NULL, ring->sqesSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return nullptr;
+    ring->sqes_ = sqes;
+
+    uint8_t* sqRing = ring->sqRing_;
+    uint8_t* cqRing = ring->cqRing_;
+    ring->sqHead_  = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+    ring->sqTail_  = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+    ring->sqMask_  = reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+    ring->sqArray_ = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+    ring->cqHead_  = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+    ring->cqTail_  = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+    ring->cqMask_  = reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+    ring->cqes_    = cqRing + params.cq_off.cqes;
+    return ring;
+}
+
+
+FFmpegIoUring::FFmpegIoUring()
+: fd_(-1),
+  sqRing_(nullptr),
+  sqRingSize_(0),
+  cqRing_(nullptr),
+  cqRingSize_(0),
+  sqes_(nullptr),
+  sqesSize_(0)
+{
+}
+
+
+FFmpegIoUring::~FFmpegIoUring()
+{
+    if (sqes_) munmap(sqes_, sqesSize_);
+    if (cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+    if (sqRing_) munmap(sqRing_, sqRingSize_);
+    if (fd_ >= 0) close(fd_);
+}
+
+
+void
+FFmpegIoUring::QueueRead(int fd, void* buffer, size_t size, uint64_t userData)
+{
+    Push(IORING_OP_READ, fd, reinterpret_cast<uintptr_t>(buffer),
+        static_cast<uint32_t>(size), userData);
+}
+
+
+void
+FFmpegIoUring::QueueCancel(uint64_t target, uint64_t userData)
+{ Push(IORING_OP_ASYNC_CANCEL, -1, target, 0, userData); }
+
+
+void
+FFmpegIoUring::QueueNop(uint64_t userData)
+{ Push(IORING_OP_NOP, -1, 0, 0, userData); }
+
+
+void
+FFmpegIoUring::Push(
+    uint8_t opcode,
+    int fd,
+    uint64_t address,
+    uint32_t size,
+    uint64_t userData)
+{
+    webrtc::MutexLock lock(&sqMutex_);
+    const unsigned mask = *sqMask_;
+    unsigned tail = __atomic_load_n(sqTail_, __ATOMIC_RELAXED);
+    // full: the kernel takes them off the queue before the call returns
+    while (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) > mask)
+        Enter(tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE), 0);
+
+    struct io_uring_sqe* sqe =
+        static_cast<struct io_uring_sqe*>(sqes_) + (tail & mask);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    // the fd's own position, for reads; anything else wants 0
+    sqe->off       = opcode == IORING_OP_READ ? static_cast<uint64_t>(-1) : 0;
+    sqe->addr      = address;
+    sqe->len       = size;
+    sqe->user_data = userData;
+    sqArray_[tail & mask] = tail & mask;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+void
+FFmpegIoUring::Submit(bool wait)
+{
+    // everything not yet taken by the kernel, whoever queued it
+    unsigned queued = __atomic_load_n(sqTail_, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    if (queued || wait) Enter(queued, wait ? 1 : 0);
+}
+
+
+void
+FFmpegIoUring::Enter(unsigned submit, unsigned wait)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if (syscall(__NR_io_uring_enter, fd_, submit, wait, flags, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        RTC_LOG(LS_ERROR) << "io_uring_enter failed: " << errno;
+}
+
+
+size_t
+FFmpegIoUring::Harvest(Completion* completions, size_t max, size_t shares)
+{
+    webrtc::MutexLock lock(&cqMutex_);
+    const unsigned mask = *cqMask_;
+    unsigned head = *cqHead_;
+    const unsigned ready = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) - head;
+    const size_t share = (ready + std::max<size_t>(shares, 1) - 1) /
+        std::max<size_t>(shares, 1);
+
+    const size_t count = std::min(max, share);
+    const struct io_uring_cqe* cqes = static_cast<struct io_uring_cqe*>(cqes_);
+    for (size_t i = 0; i < count; i++, head++) {
+        completions[i].userData = cqes[head & mask].user_data;
+        completions[i].result   = cqes[head & mask].res;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#else
+
+std::unique_ptr<FFmpegIoUring>
+FFmpegIoUring::Create(unsigned entries)
+{
+    RTC_LOG(LS_INFO) << "Built without io_uring";
+    return nullptr;
+}
+
+// never constructed
+FFmpegIoUring::FFmpegIoUring() { }
+FFmpegIoUring::~FFmpegIoUring() { }
+void FFmpegIoUring::QueueRead(int, void*, size_t, uint64_t) { }
+void FFmpegIoUring::QueueCancel(uint64_t, uint64_t) { }
+void FFmpegIoUring::QueueNop(uint64_t) { }
+void FFmpegIoUring::Submit(bool) { }
+size_t FFmpegIoUring::Harvest(Completion*, size_t, size_t) { return 0; }
+
+#endif
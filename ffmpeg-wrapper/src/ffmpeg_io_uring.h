@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Minimal io_uring submission and completion queues.
+ */
+
+#ifndef DEMO_FFMPEG_IO_URING_H_
+#define DEMO_FFMPEG_IO_URING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "rtc_base/synchronization/mutex.h"
+
+
+// Just enough of io_uring for the ingest reactor, on the raw system calls
+// so there's no liburing to build: reads, cancels and no-ops go into the
+// submission queue, any thread submits them and waits, and any thread
+// harvests completions. Queuing and harvesting each take a lock of their
+// own; neither makes a system call unless the submission queue is full.
+class FFmpegIoUring {
+public:
+    struct Completion {
+        uint64_t userData;
+        int32_t  result;     // bytes read, or -errno
+    };
+
+    // nullptr when io_uring isn't there (old kernel, disabled, blocked by
+    // seccomp) or lacks what ingest needs: IORING_OP_READ, cancellation,
+    // and reads that poll rather than tie up a kernel worker while a pipe
+    // is empty (Linux 5.7).
+    static std::unique_ptr<FFmpegIoUring> Create(unsigned entries);
+    ~FFmpegIoUring();
+
+    // Reads from the fd's current position, or wherever a pipe is at.
+    void QueueRead(int fd, void* buffer, size_t size, uint64_t userData);
+    // Cancels the queued or pending request tagged |target|.
+    void QueueCancel(uint64_t target, uint64_t userData);
+    void QueueNop(uint64_t userData);
+
+    // Hands everything queued to the kernel in one call and, if |wait|,
+    // sleeps until there's at least one completion to harvest.
+    void Submit(bool wait);
+
+    // Takes up to |max| completions, and no more than a |shares|th of
+    // those ready (rounded up), so the other threads get some too.
+    size_t Harvest(Completion* completions, size_t max, size_t shares);
+
+private:
+    FFmpegIoUring();
+    void Enter(unsigned submit, unsigned wait);
+    void Push(uint8_t opcode, int fd, uint64_t address, uint32_t size,
+        uint64_t userData);
+
+    int fd_;
+
+    uint8_t* sqRing_;
+    size_t sqRingSize_;
+    uint8_t* cqRing_;     // same as |sqRing_| with a single mmap
+    size_t cqRingSize_;
+    void* sqes_;
+    size_t sqesSize_;
+
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned* sqMask_;
+    unsigned* sqArray_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned* cqMask_;
+    void* cqes_;
+
+    webrtc::Mutex sqMutex_;   // guards the submission queue's tail
+    webrtc::Mutex cqMutex_;   // guards the completion queue's head
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Common base of the kNative frame buffers the capture module emits.
+ */
+
+#include "ffmpeg_native_buffer.h"
+
+#include <unordered_set>
+
+#include "rtc_base/synchronization/mutex.h"
+
+
+// Every FFmpegNativeBuffer alive, from its constructor to its destructor.
+// A foreign buffer can't share an address with one of them, so finding
+// it here is proof enough.
+namespace {
+
+struct LiveBuffers {
+    webrtc::Mutex mutex;
+    std::unordered_set<const webrtc::VideoFrameBuffer*> buffers;
+};
+
+LiveBuffers*
+GetLiveBuffers()
+{
+    // never destroyed: buffers may outlive static destruction
+    static LiveBuffers* live = new LiveBuffers();
+    return live;
+}
+
+}  // namespace
+
+
+FFmpegNativeBuffer::FFmpegNativeBuffer()
+{
+    LiveBuffers* live = GetLiveBuffers();
+    webrtc::MutexLock lock(&live->mutex);
+    live->buffers.insert(this);
+}
+
+
+FFmpegNativeBuffer::~FFmpegNativeBuffer()
+{
+    LiveBuffers* live = GetLiveBuffers();
+    webrtc::MutexLock lock(&live->mutex);
+    live->buffers.erase(this);
+}
+
+
+const FFmpegNativeBuffer*
+FFmpegNativeBuffer::From(const webrtc::VideoFrameBuffer* buffer)
+{
+    if (buffer == nullptr || buffer->type() != Type::kNative) return nullptr;
+
+    LiveBuffers* live = GetLiveBuffers();
+    webrtc::MutexLock lock(&live->mutex);
+    return live->buffers.count(buffer) ?
+        static_cast<const FFmpegNativeBuffer*>(buffer) : nullptr;
+}
+
+
+bool
+FFmpegNativeBuffer::Is(const webrtc::VideoFrameBuffer* buffer, NativeType type)
+{
+    const FFmpegNativeBuffer* native = From(buffer);
+    return native && native->native_type() == type;
+}
@@ -0,0 +1,49 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Common base of the kNative frame buffers the capture module emits.
+ */
+
+#ifndef DEMO_FFMPEG_NATIVE_BUFFER_H_
+#define DEMO_FFMPEG_NATIVE_BUFFER_H_
+
+#include "api/video/video_frame_buffer.h"
+
+
+// WebRTC is built without RTTI, so consumers can't dynamic_cast a kNative
+// buffer to find out what it is. Every kNative buffer this module emits
+// derives from FFmpegNativeBuffer, which says which one it is. Other
+// modules' kNative buffers (texture-backed ones, a test's) may reach the
+// same sinks, so nothing may be cast to FFmpegNativeBuffer without From():
+// the live FFmpegNativeBuffers are listed, and it looks the buffer up.
+class FFmpegNativeBuffer : public webrtc::VideoFrameBuffer {
+public:
+    enum NativeType {
+        kNativeARGB,     // FFmpegARGBBuffer
+        kNativeEncoded,  // FFmpegEncodedFrameBuffer
+        kNativeSimulcast // FFmpegSimulcastFrameBuffer
+    };
+
+    // |buffer| if it is an FFmpegNativeBuffer, otherwise nullptr.
+    static const FFmpegNativeBuffer* From(
+        const webrtc::VideoFrameBuffer* buffer);
+
+    // True if |buffer| is an FFmpegNativeBuffer of that type, which it may
+    // then be cast to.
+    static bool Is(const webrtc::VideoFrameBuffer* buffer, NativeType type);
+
+    virtual NativeType native_type() const = 0;
+
+    Type type() const override
+    { return Type::kNative; }
+
+protected:
+    FFmpegNativeBuffer();
+    ~FFmpegNativeBuffer() override;
+};
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Sends the source's own H.264 instead of encoding decoded frames again.
+ */
+
+#include "ffmpeg_passthrough_video_encoder.h"
+#include "ffmpeg_encoded_frame_buffer.h"
+
+#include <algorithm>
+
+#include "media/base/media_constants.h"
+#include "modules/video_coding/codecs/h264/include/h264.h"
+#include "rtc_base/logging.h"
+
+
+static bool
+IsH264(const webrtc::SdpVideoFormat& format)
+{ return format.name == cricket::kH264CodecName; }
+
+
+FFmpegPassthroughVideoEncoder::FFmpegPassthroughVideoEncoder(
+    const webrtc::SdpVideoFormat& format,
+    std::unique_ptr<webrtc::VideoEncoder> fallback)
+: fallback_(std::move(fallback)),
+  fallbackInitialized_(false),
+  callback_(nullptr),
+  waitingForKeyFrame_(true),
+  keyFrameRequested_(false),
+  passingThrough_(false)
+{
+    // same as H264EncoderImpl
+    auto it = format.parameters.find(cricket::kH264FmtpPacketizationMode);
+    packetizationMode_ = it != format.parameters.end() && it->second == "1" ?
+        webrtc::H264PacketizationMode::NonInterleaved :
+        webrtc::H264PacketizationMode::SingleNalUnit;
+}
+
+
+FFmpegPassthroughVideoEncoder::~FFmpegPassthroughVideoEncoder()
+{ Release(); }
+
+
+int32_t
+FFmpegPassthroughVideoEncoder::InitEncode(
+    const webrtc::VideoCodec* codecSettings,
+    const webrtc::VideoEncoder::Settings& settings)
+{
+    if (codecSettings == nullptr ||
+        codecSettings->codecType != webrtc::kVideoCodecH264)
+        return WEBRTC_VIDEO_CODEC_ERR_PARAMETER;
+
+    // the first frame sent has to be a keyframe
+    waitingForKeyFrame_ = true;
+    keyFrameRequested_  = false;
+
+    fallbackInitialized_ = fallback_ &&
+        fallback_->InitEncode(codecSettings, settings) == WEBRTC_VIDEO_CODEC_OK;
+    if (fallbackInitialized_ && callback_)
+        fallback_->RegisterEncodeCompleteCallback(callback_);
+    return WEBRTC_VIDEO_CODEC_OK;
+}
+
+
+int32_t
+FFmpegPassthroughVideoEncoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback* callback)
+{
+    callback_ = callback;
+    if (fallbackInitialized_)
+        fallback_->RegisterEncodeCompleteCallback(callback);
+    return WEBRTC_VIDEO_CODEC_OK;
+}
+
+
+int32_t
+FFmpegPassthroughVideoEncoder::Release()
+{
+    if (fallbackInitialized_) fallback_->Release();
+    fallbackInitialized_ = false;
+    return WEBRTC_VIDEO_CODEC_OK;
+}
+
+
+int32_t
+FFmpegPassthroughVideoEncoder::Encode(
+    const webrtc::VideoFrame& frame,
+    const std::vector<webrtc::VideoFrameType>* frameTypes)
+{
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer =
+        frame.video_frame_buffer();
+    if (!FFmpegNativeBuffer::Is(
+            buffer.get(), FFmpegNativeBuffer::kNativeEncoded))
+        return EncodeFallback(frame, frameTypes);
+    passingThrough_.store(true, std::memory_order_relaxed);
+
+    FFmpegEncodedFrameBuffer* encoded =
+        static_cast<FFmpegEncodedFrameBuffer*>(buffer.get());
+    if (callback_ == nullptr) return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+    if (encoded->codec() != webrtc::kVideoCodecH264)
+        return WEBRTC_VIDEO_CODEC_ERROR;
+
+    bool keyFrameWanted = frameTypes && std::find(
+        frameTypes->begin(), frameTypes->end(),
+        webrtc::VideoFrameType::kVideoFrameKey) != frameTypes->end();
+    if (keyFrameWanted && !encoded->IsKeyFrame())
+        waitingForKeyFrame_ = true;
+
+    // delta frames are useless to a receiver without the keyframe before
+    // them; ask the source for one and send nothing until it comes
+    if (waitingForKeyFrame_ && !encoded->IsKeyFrame()) {
+        if (!keyFrameRequested_) {
+            encoded->RequestKeyFrame();
+            keyFrameRequested_ = true;
+        }
+        callback_->OnDroppedFrame(
+            webrtc::EncodedImageCallback::DropReason::kDroppedByEncoder);
+        return WEBRTC_VIDEO_CODEC_OK;
+    }
+    waitingForKeyFrame_ = false;
+    keyFrameRequested_  = false;
+
+    webrtc::EncodedImage image;
+    image.SetEncodedData(encoded->data());
+    image.SetTimestamp(frame.timestamp());
+    image.ntp_time_ms_     = frame.ntp_time_ms();
+    image.capture_time_ms_ = frame.render_time_ms();
+    image.rotation_        = frame.rotation();
+    image._encodedWidth    = encoded->width();
+    image._encodedHeight   = encoded->height();
+    image._frameType       = encoded->IsKeyFrame() ?
+        webrtc::VideoFrameType::kVideoFrameKey :
+        webrtc::VideoFrameType::kVideoFrameDelta;
+
+    webrtc::CodecSpecificInfo info;
+    info.codecType = webrtc::kVideoCodecH264;
+    info.codecSpecific.H264.packetization_mode = packetizationMode_;
+    info.codecSpecific.H264.temporal_idx       = webrtc::kNoTemporalIdx;
+    info.codecSpecific.H264.base_layer_sync    = false;
+    info.codecSpecific.H264.idr_frame          = encoded->IsKeyFrame();
+
+    webrtc::EncodedImageCallback::Result result =
+        callback_->OnEncodedImage(image, &info);
+    return result.error == webrtc::EncodedImageCallback::Result::OK ?
+        WEBRTC_VIDEO_CODEC_OK : WEBRTC_VIDEO_CODEC_ERROR;
+}
+
+
+void
+FFmpegPassthroughVideoEncoder::SetRates(const RateControlParameters& parameters)
+{ if (fallbackInitialized_) fallback_->SetRates(parameters); }
+
+
+webrtc::VideoEncoder::EncoderInfo
+FFmpegPassthroughVideoEncoder::GetEncoderInfo() const
+{
+    // raw frames are the fallback's to encode, with its own scaling and
+    // rate control
+    EncoderInfo info = fallback_ ? fallback_->GetEncoderInfo() : EncoderInfo();
+    // hand us FFmpegEncodedFrameBuffers, not their black ToI420()
+    info.supports_native_handle = true;
+    if (!passingThrough_.load(std::memory_order_relaxed)) return info;
+
+    info.implementation_name = "FFmpegPassthrough";
+    // the source can't be scaled or rate controlled from here, so keep
+    // the quality scaler and the frame dropper out of it
+    info.scaling_settings = webrtc::VideoEncoder::ScalingSettings::kOff;
+    info.has_trusted_rate_controller = true;
+    info.is_hardware_accelerated = true;
+    return info;
+}
+
+
+int32_t
+FFmpegPassthroughVideoEncoder::EncodeFallback(
+    const webrtc::VideoFrame& frame,
+    const std::vector<webrtc::VideoFrameType>* frameTypes)
+{
+    passingThrough_.store(false, std::memory_order_relaxed);
+    if (!fallbackInitialized_) {
+        RTC_LOG(LS_ERROR) << "Got a raw frame but have no H.264 encoder.";
+        return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    return fallback_->Encode(frame, frameTypes);
+}
+
+
+FFmpegPassthroughVideoEncoderFactory::FFmpegPassthroughVideoEncoderFactory(
+    std::unique_ptr<webrtc::VideoEncoderFactory> factory)
+: factory_(std::move(factory))
+{ }
+
+
+FFmpegPassthroughVideoEncoderFactory::~FFmpegPassthroughVideoEncoderFactory()
+{ }
+
+
+std::vector<webrtc::SdpVideoFormat>
+FFmpegPassthroughVideoEncoderFactory::GetSupportedFormats() const
+{
+    std::vector<webrtc::SdpVideoFormat> wrapped = factory_->GetSupportedFormats();
+    std::vector<webrtc::SdpVideoFormat> formats;
+
+    for (auto& format : wrapped)
+        if (IsH264(format)) formats.push_back(format);
+    if (formats.empty()) {
+        // cameras mostly send High; constrained baseline is what every
+        // browser can decode
+        formats.push_back(webrtc::CreateH264Format(
+            webrtc::H264::kProfileHigh, webrtc::H264::kLevel3_1, "1"));
+        formats.push_back(webrtc::CreateH264Format(
+            webrtc::H264::kProfileConstrainedBaseline,
+            webrtc::H264::kLevel3_1, "1"));
+        formats.push_back(webrtc::CreateH264Format(
+            webrtc::H264::kProfileConstrainedBaseline,
+            webrtc::H264::kLevel3_1, "0"));
+    }
+
+    for (auto& format : wrapped)
+        if (!IsH264(format)) formats.push_back(format);
+    return formats;
+}
+
+
+std::unique_ptr<webrtc::VideoEncoder>
+FFmpegPassthroughVideoEncoderFactory::CreateVideoEncoder(
+    const webrtc::SdpVideoFormat& format)
+{
+    if (!IsH264(format)) return factory_->CreateVideoEncoder(format);
+
+    std::unique_ptr<webrtc::VideoEncoder> fallback;
+    for (auto& supported : factory_->GetSupportedFormats()) {
+        if (!supported.IsSameCodec(format)) continue;
+        fallback = factory_->CreateVideoEncoder(format);
+        break;
+    }
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        new FFmpegPassthroughVideoEncoder(format, std::move(fallback)));
+}
@@ -0,0 +1,92 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Sends the source's own H.264 instead of encoding decoded frames again.
+ */
+
+#ifndef DEMO_FFMPEG_PASSTHROUGH_VIDEO_ENCODER_H_
+#define DEMO_FFMPEG_PASSTHROUGH_VIDEO_ENCODER_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "api/video_codecs/sdp_video_format.h"
+#include "api/video_codecs/video_encoder.h"
+#include "api/video_codecs/video_encoder_factory.h"
+#include "modules/video_coding/include/video_codec_interface.h"
+
+
+// Forwards FFmpegEncodedFrameBuffers as EncodedImages, unchanged. Any other
+// frame goes to |fallback|, so the same encoder serves a passthrough source
+// that had to fall back to decoding. GetEncoderInfo() is the fallback's
+// unless the last frame was passed through.
+//
+// The source's bitrate is whatever the camera was configured for: SetRates()
+// can't change it, and frames are never dropped (that would break the rest
+// of the GOP). When a keyframe is requested, delta frames are held back
+// until the source sends one; FFmpegVideoCaptureModule passes the request
+// on to its KeyFrameRequestHandler.
+class FFmpegPassthroughVideoEncoder : public webrtc::VideoEncoder {
+public:
+    FFmpegPassthroughVideoEncoder(
+        const webrtc::SdpVideoFormat& format,
+        std::unique_ptr<webrtc::VideoEncoder> fallback);
+    ~FFmpegPassthroughVideoEncoder() override;
+
+    int32_t InitEncode(
+        const webrtc::VideoCodec* codecSettings,
+        const webrtc::VideoEncoder::Settings& settings) override;
+
+    int32_t RegisterEncodeCompleteCallback(
+        webrtc::EncodedImageCallback* callback) override;
+
+    int32_t Release() override;
+
+    int32_t Encode(
+        const webrtc::VideoFrame& frame,
+        const std::vector<webrtc::VideoFrameType>* frameTypes) override;
+
+    void SetRates(const RateControlParameters& parameters) override;
+
+    EncoderInfo GetEncoderInfo() const override;
+
+private:
+    webrtc::H264PacketizationMode packetizationMode_;
+    std::unique_ptr<webrtc::VideoEncoder> fallback_;
+    bool fallbackInitialized_;
+    webrtc::EncodedImageCallback* callback_;
+    bool waitingForKeyFrame_; // holding back delta frames
+    bool keyFrameRequested_;  // ... and the source has been asked
+    std::atomic<bool> passingThrough_; // the last frame was encoded already
+
+    int32_t EncodeFallback(
+        const webrtc::VideoFrame& frame,
+        const std::vector<webrtc::VideoFrameType>* frameTypes);
+};
+
+
+// Wraps another factory (normally the builtin one). H.264 is offered first,
+// and whether or not |factory| can encode it, so that passthrough sources
+// get to negotiate it; H.264 encoders come wrapped in an
+// FFmpegPassthroughVideoEncoder.
+class FFmpegPassthroughVideoEncoderFactory : public webrtc::VideoEncoderFactory {
+public:
+    explicit FFmpegPassthroughVideoEncoderFactory(
+        std::unique_ptr<webrtc::VideoEncoderFactory> factory);
+    ~FFmpegPassthroughVideoEncoderFactory() override;
+
+    std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
+
+    std::unique_ptr<webrtc::VideoEncoder> CreateVideoEncoder(
+        const webrtc::SdpVideoFormat& format) override;
+
+private:
+    std::unique_ptr<webrtc::VideoEncoderFactory> factory_;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  One in-process ingest per device, fanned out to every capture of it.
+ */
+
+#include "ffmpeg_shared_ingest.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+#include "ffmpeg_ingest_pool.h"
+#include "ffmpeg_thread_policy.h"
+
+
+// The shared ingests open, by device id. An ingest stays listed from the
+// first Subscribe() until its last subscriber leaves, or until a newer one
+// for the device (replaced in the registry, or whose input ended) takes
+// its place; its subscribers keep it either way.
+namespace {
+
+struct Directory {
+    webrtc::Mutex mutex;
+    std::unordered_map<std::string,
+        std::shared_ptr<FFmpegSharedIngest>> ingests;
+};
+
+Directory*
+GetDirectory()
+{
+    // never destroyed, like the ingests' other singletons
+    static Directory* directory = new Directory();
+    return directory;
+}
+
+}  // namespace
+
+
+FFmpegSharedIngest::FFmpegSharedIngest(
+    const FFmpegDeviceRegistry::Entry& device)
+: device_(device),
+  opened_(true /* manual reset */, false),
+  stopEvent_(true /* manual reset */, false),
+  readerDone_(true /* manual reset */, false),
+  failed_(false),
+  ended_(false),
+  stopping_(false),
+  framesRead_(0),
+  framesFannedOut_(0),
+  subscribes_(0)
+{
+    warm_       = false;
+    users_      = 0;
+    lastPtsUs_  = -1;
+}
+
+
+FFmpegSharedIngest::~FFmpegSharedIngest()
+{ Stop(); }
+
+
+bool
+FFmpegSharedIngest::IsShareable(const FFmpegDeviceConfig& device)
+{
+    return device.producer.empty() && !device.pipe && (device.realtime ||
+        device.url.find("://") != std::string::npos);
+}
+
+
+std::shared_ptr<FFmpegSharedIngest>
+FFmpegSharedIngest::Subscribe(
+    const FFmpegDeviceRegistry::Entry& device,
+    const webrtc::VideoCaptureCapability& capability,
+    Subscriber* subscriber,
+    bool& warm)
+{
+    warm = false;
+    if (!device || !IsShareable(*device)) return nullptr;
+
+    Directory* directory = GetDirectory();
+    std::shared_ptr<FFmpegSharedIngest> ingest;
+    bool opening = false;
+    {
+        webrtc::MutexLock lock(&directory->mutex);
+        std::shared_ptr<FFmpegSharedIngest>& slot =
+            directory->ingests[device->id];
+        if (!slot || slot->device_ != device ||
+            slot->ended_.load(std::memory_order_acquire)) {
+            slot.reset(new FFmpegSharedIngest(device));
+            opening = true;
+        }
+        ingest = slot;
+        ingest->users_++; // so it can't close while we wait for it
+    }
+
+    // opened outside the lock: connecting and probing take a while, and
+    // other devices' captures shouldn't wait for it
+    if (opening) ingest->Open(capability);
+    else ingest->opened_.Wait(rtc::Event::kForever);
+
+    if (ingest->failed_.load(std::memory_order_acquire)) {
+        ingest->Leave();
+        return nullptr;
+    }
+    warm = !opening || ingest->warm_;
+    ingest->Attach(subscriber);
+    return ingest;
+}
+
+
+void
+FFmpegSharedIngest::Unsubscribe(Subscriber* subscriber)
+{
+    bool found = false;
+    {
+        // held while a frame is handed out, so none reaches |subscriber|
+        // once it's off the list
+        webrtc::MutexLock lock(&subscribersMutex_);
+        auto it = std::find(subscribers_.begin(), subscribers_.end(),
+            subscriber);
+        if (it != subscribers_.end()) {
+            subscribers_.erase(it);
+            found = true;
+        }
+    }
+    if (found) Leave();
+}
+
+
+FFmpegSharedIngest::Stats
+FFmpegSharedIngest::GetStats() const
+{
+    Stats stats;
+    {
+        webrtc::MutexLock lock(&subscribersMutex_);
+        stats.subscribers = subscribers_.size();
+    }
+    stats.framesRead      = framesRead_.load(std::memory_order_relaxed);
+    stats.framesFannedOut = framesFannedOut_.load(std::memory_order_relaxed);
+    stats.subscribes      = subscribes_.load(std::memory_order_relaxed);
+    stats.loops     = ingest_ ? ingest_->Loops() : 0;
+    stats.bytesRead = ingest_ ? ingest_->BytesRead() : 0;
+    stats.warm      = warm_;
+    return stats;
+}
+
+
+bool
+FFmpegSharedIngest::Open(const webrtc::VideoCaptureCapability& capability)
+{
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> warmFrame;
+    int64_t warmPtsUs = -1;
+    ingest_ = FFmpegIngestPool::GetInstance()->Acquire(
+        device_, false, warmFrame, warmPtsUs);
+    warm_ = ingest_ != nullptr;
+
+    // every picture at the size it was decoded at, and all of them: the
+    // subscribers scale and decimate them to what they were asked for
+    webrtc::VideoCaptureCapability decoded = capability;
+    decoded.width  = 0;
+    decoded.height = 0;
+    decoded.maxFPS = 0;
+    if (!ingest_) {
+        ingest_.reset(new FFmpegAVIngest());
+        if (ingest_->Open(device_->url, device_->options, decoded) != 0) {
+            RTC_LOG(LS_WARNING) << "Can't open a shared ingest of device "
+                << device_->id;
+            ingest_.reset();
+            failed_.store(true, std::memory_order_release);
+            opened_.Set();
+            return false;
+        }
+    }
+    ingest_->SetLoop(device_->loop);
+    ingest_->SetOutputFormat(decoded.width, decoded.height, decoded.maxFPS);
+
+    // frames without timestamps are paced at the rate first asked for
+    pacer_.SetFrameRate(capability.maxFPS);
+    pacer_.Reset();
+    lastFrame_ = warmFrame;
+    lastPtsUs_ = warmPtsUs;
+
+    reader_.reset(new rtc::PlatformThread(
+        FFmpegSharedIngest::ReaderThread, this, "SharedIngest"));
+    reader_->Start();
+    FFmpegStatsRegistry::GetInstance()->Register("ingest/" + device_->id, this);
+    opened_.Set();
+    return true;
+}
+
+
+void
+FFmpegSharedIngest::Attach(Subscriber* subscriber)
+{
+    subscribes_.fetch_add(1, std::memory_order_relaxed);
+    webrtc::MutexLock lock(&subscribersMutex_);
+    // ahead of the next picture, which the reader can't hand out until
+    // we let go of the lock
+    if (lastFrame_)
+        subscriber->OnSharedFrame(lastFrame_, lastPtsUs_, -1);
+    if (ended_.load(std::memory_order_acquire))
+        subscriber->OnSharedEnd();
+    subscribers_.push_back(subscriber);
+}
+
+
+void
+FFmpegSharedIngest::Leave()
+{
+    Directory* directory = GetDirectory();
+    std::shared_ptr<FFmpegSharedIngest> self; // the directory's reference
+    {
+        webrtc::MutexLock lock(&directory->mutex);
+        if (--users_ > 0) return;
+        auto it = directory->ingests.find(device_->id);
+        if (it != directory->ingests.end() && it->second.get() == this) {
+            self = it->second;
+            directory->ingests.erase(it);
+        }
+    }
+    // nobody can find it now; the last subscriber's reference keeps it
+    // alive until Unsubscribe() returns
+    Stop();
+}
+
+
+void
+FFmpegSharedIngest::Stop()
+{
+    if (stopping_.exchange(true, std::memory_order_acq_rel)) return;
+    stopEvent_.Set();
+    if (reader_) {
+        FFmpegStatsRegistry::GetInstance()->Unregister(this);
+        // a read blocked on a stalled source would hold the join up
+        if (!readerDone_.Wait(FFmpegAVIngest::kAbortGraceMs)) {
+            RTC_LOG(LS_WARNING) << "Aborting the read from "
+                << device_->url;
+            ingest_->Abort();
+        }
+        reader_->Stop();
+        reader_.reset();
+    }
+    {
+        webrtc::MutexLock lock(&subscribersMutex_);
+        lastFrame_ = nullptr;
+    }
+    // kept open for the next capture if the device is warm
+    FFmpegIngestPool::GetInstance()->Release(device_, std::move(ingest_));
+}
+
+
+void
+FFmpegSharedIngest::ReaderThread(void* object)
+{
+    FFmpegSharedIngest* ingest = static_cast<FFmpegSharedIngest*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kCapture,
+        "ingest/" + ingest->device_->id);
+    while (ingest->ReadProcess()) { }
+
+    // end of input, or stopping: let the subscribers drain what they have
+    {
+        webrtc::MutexLock lock(&ingest->subscribersMutex_);
+        ingest->ended_.store(true, std::memory_order_release);
+        for (Subscriber* subscriber : ingest->subscribers_)
+            subscriber->OnSharedEnd();
+    }
+    ingest->readerDone_.Set();
+}
+
+
+bool
+FFmpegSharedIngest::ReadProcess()
+{
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+    int64_t ptsUs;
+    FFmpegCaptureClock* clock = FFmpegCaptureClock::GetInstance();
+    const int64_t readStartUs = clock->TimeMicros();
+    if (ingest_->ReadFrame(buffer, ptsUs) != 0) return false;
+    const int64_t readUs = clock->TimeMicros() - readStartUs;
+
+    // once for everybody, so the subscribers needn't
+    if (device_->realtime &&
+        !clock->WaitUntil(pacer_.Deadline(ptsUs, clock->TimeMicros()),
+            stopEvent_))
+        return false;
+
+    framesRead_.fetch_add(1, std::memory_order_relaxed);
+    webrtc::MutexLock lock(&subscribersMutex_);
+    lastFrame_ = buffer;
+    lastPtsUs_ = ptsUs;
+    for (Subscriber* subscriber : subscribers_)
+        subscriber->OnSharedFrame(buffer, ptsUs, readUs);
+    framesFannedOut_.fetch_add(subscribers_.size(), std::memory_order_relaxed);
+    return !stopping_.load(std::memory_order_acquire);
+}
+
+
+void
+FFmpegSharedIngest::ReportStats(FFmpegStatsReport& report)
+{
+    Stats stats = GetStats();
+    report.AddCounter("subscribers",     stats.subscribers);
+    report.AddCounter("framesRead",      stats.framesRead);
+    report.AddCounter("framesFannedOut", stats.framesFannedOut);
+    report.AddCounter("subscribes",      stats.subscribes);
+    report.AddCounter("loops",           stats.loops);
+    report.AddCounter("bytesRead",       stats.bytesRead);
+}
@@ -0,0 +1,138 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  One in-process ingest per device, fanned out to every capture of it.
+ */
+
+#ifndef DEMO_FFMPEG_SHARED_INGEST_H_
+#define DEMO_FFMPEG_SHARED_INGEST_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include "modules/video_capture/video_capture.h"
+#include "rtc_base/event.h"
+#include "rtc_base/platform_thread.h"
+#include "rtc_base/synchronization/mutex.h"
+#include "ffmpeg_av_ingest.h"
+#include "ffmpeg_capture_clock.h"
+#include "ffmpeg_device_registry.h"
+#include "ffmpeg_stats_registry.h"
+
+
+// Every viewer of a camera gets a capture module of its own, and without
+// this every one of them would connect to the camera and decode its stream
+// again. Instead, the captures of a live or paced device subscribe to one
+// FFmpegSharedIngest: a single FFmpegAVIngest, read on a thread of its
+// own, whose pictures are handed to every subscriber as they are decoded.
+// Frame buffers are refcounted and never written to once decoded, so all
+// subscribers share the same ones; each scales, rotates and decimates them
+// on its own delivery thread, as it would its own ingest's.
+//
+// Subscribers come and go without disturbing the ones already there: a new
+// one starts with the picture decoded last, and the input is only closed
+// (or handed to FFmpegIngestPool, if the device is warm) when the last one
+// leaves. A paced device is paced here, once, for all of them.
+//
+// A file read as fast as it decodes isn't shared: every capture of it
+// starts at the beginning and runs at its encoder's speed.
+//
+// Reports its Stats to FFmpegStatsRegistry as "ingest/<device id>".
+class FFmpegSharedIngest : private FFmpegStatsRegistry::Provider {
+public:
+    class Subscriber {
+    public:
+        virtual ~Subscriber() { }
+
+        // On the ingest's reader thread, with the subscriber list locked:
+        // queue the frame and return, since a subscriber that waits holds
+        // up every other. |readUs| is what demuxing and decoding it took,
+        // -1 for the picture a new subscriber starts with.
+        virtual void OnSharedFrame(
+            const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+            int64_t ptsUs,
+            int64_t readUs) = 0;
+
+        // The input ended or failed; no frames follow.
+        virtual void OnSharedEnd() = 0;
+    };
+
+    struct Stats {
+        size_t   subscribers;
+        uint64_t framesRead;      // decoded once...
+        uint64_t framesFannedOut; // ... and handed to this many subscribers
+        uint64_t subscribes;      // since it was opened
+        uint64_t loops;
+        uint64_t bytesRead;
+        bool     warm;            // taken from FFmpegIngestPool
+    };
+
+    ~FFmpegSharedIngest();
+
+    // Live urls, and devices paced by their timestamps, read in-process.
+    static bool IsShareable(const FFmpegDeviceConfig& device);
+
+    // Subscribes to the device's shared ingest, opening it with
+    // |capability|'s pixel format if no capture has it open. Waits while
+    // another capture is opening it. Returns nullptr if the input can't be
+    // opened; |warm| is true if it was open already, or came from the pool.
+    static std::shared_ptr<FFmpegSharedIngest> Subscribe(
+        const FFmpegDeviceRegistry::Entry& device,
+        const webrtc::VideoCaptureCapability& capability,
+        Subscriber* subscriber,
+        bool& warm);
+
+    // Waits for a frame being handed to |subscriber|; none follow. The
+    // last subscriber to leave stops the reader.
+    void Unsubscribe(Subscriber* subscriber);
+
+    // While subscribed: the input is closed once nobody is.
+    Stats GetStats() const;
+
+private:
+    explicit FFmpegSharedIngest(const FFmpegDeviceRegistry::Entry& device);
+
+    bool Open(const webrtc::VideoCaptureCapability& capability);
+    void Attach(Subscriber* subscriber);
+    void Leave();
+    void Stop();
+    static void ReaderThread(void* object);
+    bool ReadProcess();
+
+    // FFmpegStatsRegistry::Provider
+    void ReportStats(FFmpegStatsReport& report) override;
+
+    const FFmpegDeviceRegistry::Entry device_; // as opened
+    std::unique_ptr<FFmpegAVIngest> ingest_;
+    std::unique_ptr<rtc::PlatformThread> reader_;
+    rtc::Event opened_;            // set once Open() is done, either way
+    rtc::Event stopEvent_;         // cuts a paced wait short
+    rtc::Event readerDone_;        // the reader is returning
+    std::atomic<bool> failed_;     // couldn't be opened
+    std::atomic<bool> ended_;      // the reader is done
+    std::atomic<bool> stopping_;
+    bool warm_;
+    size_t users_;                 // subscribing or subscribed; guarded by
+                                   // the directory's lock
+    FFmpegFramePacer pacer_;       // reader thread only
+
+    mutable webrtc::Mutex subscribersMutex_;
+    std::vector<Subscriber*> subscribers_;                   // guarded
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> lastFrame_; // guarded
+    int64_t lastPtsUs_;                                      // guarded
+
+    std::atomic<uint64_t> framesRead_;
+    std::atomic<uint64_t> framesFannedOut_;
+    std::atomic<uint64_t> subscribes_;
+};
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Ring of raw frame slots in shared memory, between processes.
+ */
+
+#include "ffmpeg_shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+#include "ffmpeg_capture_clock.h"
+#include "ffmpeg_synthetic_source.h"
+#include "ffmpeg_thread_policy.h"
+
+extern char** environ;
+
+
+static const uint32_t kMagic   = 0x4d485346; // "FSHM"
+static const uint32_t kVersion = 2;
+
+// Slot states
+static const uint32_t kSlotFree   = 0; // the producer's to fill
+static const uint32_t kSlotFilled = 1; // published, not taken yet
+static const uint32_t kSlotHeld   = 2; // wrapped in a frame buffer
+
+// Where a producer process finds the ring
+static const int kChildMemoryFd = 3;
+static const int kChildFilledFd = 4;
+static const int kChildFreedFd  = 5;
+
+
+static size_t
+RoundToPage(size_t size)
+{
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (size + page - 1) / page * page;
+}
+
+
+static void
+Signal(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        RTC_LOG(LS_ERROR) << "Failed to signal the frame ring: " << errno;
+}
+
+
+std::shared_ptr<FFmpegShmRing>
+FFmpegShmRing::Create(
+    webrtc::VideoType type,
+    int width,
+    int height,
+    size_t slots)
+{
+    const size_t frameSize = webrtc::CalcBufferSize(type, width, height);
+    if (frameSize == 0 || slots == 0 || slots > kMaxSlots) return nullptr;
+
+    int memoryFd = memfd_create("ffmpeg-frames",
+        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int filledFd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    int freedFd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    std::shared_ptr<FFmpegShmRing> ring(
+        new FFmpegShmRing(memoryFd, filledFd, freedFd));
+    if (memoryFd < 0 || filledFd < 0 || freedFd < 0) {
+        RTC_LOG(LS_ERROR) << "Can't create a shared memory frame ring";
+        return nullptr;
+    }
+
+    const size_t slotSize   = RoundToPage(frameSize);
+    const size_t slotOffset = RoundToPage(sizeof(Header));
+    const size_t size       = slotOffset + slotSize * slots;
+    // a fixed size: a producer can't truncate it under the consumer
+    if (ftruncate(memoryFd, size) < 0 ||
+        fcntl(memoryFd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+        !ring->Map(size))
+        return nullptr;
+
+    Header* header = new (ring->memory_) Header();
+    header->magic      = kMagic;
+    header->version    = kVersion;
+    header->type       = static_cast<int32_t>(type);
+    header->width      = width;
+    header->height     = height;
+    header->slots      = static_cast<uint32_t>(slots);
+    header->frameSize  = frameSize;
+    header->slotSize   = slotSize;
+    header->slotOffset = slotOffset;
+    ring->header_     = header;
+    ring->type_       = type;
+    ring->width_      = width;
+    ring->height_     = height;
+    ring->slots_      = slots;
+    ring->frameSize_  = frameSize;
+    ring->slotSize_   = slotSize;
+    ring->slotOffset_ = slotOffset;
+    return ring;
+}
+
+
+std::shared_ptr<FFmpegShmRing>
+FFmpegShmRing::Attach(int memoryFd, int filledFd, int freedFd)
+{
+    std::shared_ptr<FFmpegShmRing> ring(
+        new FFmpegShmRing(memoryFd, filledFd, freedFd));
+
+    struct stat status;
+    if (fstat(memoryFd, &status) < 0 ||
+        static_cast<size_t>(status.st_size) < sizeof(Header) ||
+        !ring->Map(status.st_size))
+        return nullptr;
+
+    Header* header = reinterpret_cast<Header*>(ring->memory_);
+    if (header->magic != kMagic || header->version != kVersion ||
+        header->slots == 0 || header->slots > kMaxSlots ||
+        header->frameSize > header->slotSize ||
+        header->slotOffset + header->slotSize * header->slots >
+            ring->size_) {
+        RTC_LOG(LS_ERROR) << "Not a frame ring, or not this version of one";
+        return nullptr;
+    }
+    ring->header_     = header;
+    ring->type_       = static_cast<webrtc::VideoType>(header->type);
+    ring->width_      = header->width;
+    ring->height_     = header->height;
+    ring->slots_      = header->slots;
+    ring->frameSize_  = header->frameSize;
+    ring->slotSize_   = header->slotSize;
+    ring->slotOffset_ = header->slotOffset;
+    return ring;
+}
+
+
+FFmpegShmRing::FFmpegShmRing(int memoryFd, int filledFd, int freedFd)
+: memoryFd_(memoryFd),
+  filledFd_(filledFd),
+  freedFd_(freedFd),
+  memory_(nullptr),
+  size_(0),
+  header_(nullptr),
+  type_(webrtc::VideoType::kUnknown),
+  width_(0),
+  height_(0),
+  slots_(0),
+  frameSize_(0),
+  slotSize_(0),
+  slotOffset_(0),
+  taken_(0)
+{ }
+
+
+FFmpegShmRing::~FFmpegShmRing()
+{
+    if (memory_) munmap(memory_, size_);
+    if (memoryFd_ >= 0) close(memoryFd_);
+    if (filledFd_ >= 0) close(filledFd_);
+    if (freedFd_  >= 0) close(freedFd_);
+}
+
+
+bool
+FFmpegShmRing::Map(size_t size)
+{
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        memoryFd_, 0);
+    if (memory == MAP_FAILED) {
+        RTC_LOG(LS_ERROR) << "Can't map the frame ring: " << errno;
+        return false;
+    }
+    memory_ = static_cast<uint8_t*>(memory);
+    size_   = size;
+    return true;
+}
+
+
+int
+FFmpegShmRing::MemoryFd() const
+{ return memoryFd_; }
+
+
+int
+FFmpegShmRing::FilledFd() const
+{ return filledFd_; }
+
+
+int
+FFmpegShmRing::FreedFd() const
+{ return freedFd_; }
+
+
+webrtc::VideoType
+FFmpegShmRing::Type() const
+{ return type_; }
+
+
+int
+FFmpegShmRing::Width() const
+{ return width_; }
+
+
+int
+FFmpegShmRing::Height() const
+{ return height_; }
+
+
+size_t
+FFmpegShmRing::FrameSize() const
+{ return frameSize_; }
+
+
+size_t
+FFmpegShmRing::Slots() const
+{ return slots_; }
+
+
+uint8_t*
+FFmpegShmRing::AcquireSlot(int timeoutMs)
+{
+    const int64_t deadlineMs = rtc::TimeMillis() + timeoutMs;
+    const size_t index =
+        header_->published.load(std::memory_order_relaxed) % slots_;
+    Slot& slot = header_->slot[index];
+
+    for (;;) {
+        if (IsClosed()) return nullptr;
+        if (slot.state.load(std::memory_order_acquire) == kSlotFree)
+            return memory_ + slotOffset_ + index * slotSize_;
+
+        const int64_t leftMs = deadlineMs - rtc::TimeMillis();
+        if (leftMs <= 0) return nullptr;
+        struct pollfd freed = { freedFd_, POLLIN, 0 };
+        if (poll(&freed, 1, static_cast<int>(leftMs)) > 0) {
+            uint64_t count;
+            if (read(freedFd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return nullptr;
+        }
+    }
+}
+
+
+void
+FFmpegShmRing::PublishSlot(int64_t ptsUs)
+{
+    const uint64_t published =
+        header_->published.load(std::memory_order_relaxed);
+    Slot& slot = header_->slot[published % slots_];
+    slot.ptsUs = ptsUs;
+    slot.state.store(kSlotFilled, std::memory_order_release);
+    header_->published.store(published + 1, std::memory_order_release);
+    Signal(filledFd_);
+}
+
+
+bool
+FFmpegShmRing::TakeSlot(size_t& index, int64_t& ptsUs)
+{
+    if (taken_ >= header_->published.load(std::memory_order_acquire))
+        return false;
+
+    index = taken_ % slots_;
+    Slot& slot = header_->slot[index];
+    if (slot.state.load(std::memory_order_acquire) != kSlotFilled)
+        return false;
+    ptsUs = slot.ptsUs;
+    slot.state.store(kSlotHeld, std::memory_order_relaxed);
+    taken_++;
+    return true;
+}
+
+
+const uint8_t*
+FFmpegShmRing::SlotData(size_t index) const
+{ return memory_ + slotOffset_ + index * slotSize_; }
+
+
+void
+FFmpegShmRing::ReleaseSlot(size_t index)
+{
+    header_->slot[index].state.store(kSlotFree, std::memory_order_release);
+    Signal(freedFd_);
+}
+
+
+void
+FFmpegShmRing::Close()
+{
+    header_->closed.store(1, std::memory_order_release);
+    Signal(freedFd_);
+}
+
+
+bool
+FFmpegShmRing::IsClosed() const
+{ return header_->closed.load(std::memory_order_acquire) != 0; }
+
+
+FFmpegShmTestProducer::FFmpegShmTestProducer(
+    std::shared_ptr<FFmpegShmRing> ring,
+    int fps)
+: ring_(ring),
+  intervalUs_(rtc::kNumMicrosecsPerSec / std::max(fps, 1)),
+  stopping_(false),
+  frames_(0)
+{ }
+
+
+FFmpegShmTestProducer::~FFmpegShmTestProducer()
+{ Stop(); }
+
+
+bool
+FFmpegShmTestProducer::Start()
+{
+    if (thread_) return true;
+    stopping_ = false;
+    thread_.reset(new rtc::PlatformThread(
+        FFmpegShmTestProducer::ProducerThread, this, "ShmTestProducer"));
+    thread_->Start();
+    return true;
+}
+
+
+void
+FFmpegShmTestProducer::Stop()
+{
+    if (!thread_) return;
+    stopping_ = true;
+    thread_->Stop();
+    thread_.reset();
+}
+
+
+uint64_t
+FFmpegShmTestProducer::FramesProduced() const
+{ return frames_.load(std::memory_order_relaxed); }
+
+
+void
+FFmpegShmTestProducer::ProducerThread(void* object)
+{
+    // waits for a slot at most this long before looking at |stopping_|
+    static const int kAcquireTimeoutMs = 100;
+
+    FFmpegShmTestProducer* producer =
+        static_cast<FFmpegShmTestProducer*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kCapture,
+        "ShmTestProducer");
+    FFmpegCaptureClock* clock = FFmpegCaptureClock::GetInstance();
+    const int64_t startUs = clock->TimeMicros();
+
+    while (!producer->stopping_ && !producer->ring_->IsClosed()) {
+        uint8_t* data = producer->ring_->AcquireSlot(kAcquireTimeoutMs);
+        if (!data) continue;
+
+        const uint64_t frame = producer->frames_.load();
+        producer->Fill(data, frame);
+        producer->ring_->PublishSlot(frame * producer->intervalUs_);
+        producer->frames_.fetch_add(1);
+
+        const int64_t deadlineUs = startUs + (frame + 1) * producer->intervalUs_;
+        clock->SleepUntil(deadlineUs);
+        FFmpegThreadPolicy::RecordWakeUp(clock->TimeMicros() - deadlineUs);
+    }
+}
+
+
+void
+FFmpegShmTestProducer::Fill(uint8_t* data, uint64_t frame) const
+{
+    // bands that move down a line per frame
+    FFmpegSyntheticSource::FillFrame(
+        data, ring_->FrameSize(), ring_->Width(), frame);
+}
+
+
+FFmpegShmProducerProcess::FFmpegShmProducerProcess()
+: pid_(-1)
+{ }
+
+
+FFmpegShmProducerProcess::~FFmpegShmProducerProcess()
+{ Stop(); }
+
+
+bool
+FFmpegShmProducerProcess::Start(
+    const std::string& command,
+    const FFmpegShmRing& ring)
+{
+    if (pid_ > 0) return false;
+
+    // fresh copies above the child's fds, so none is overwritten before
+    // it's moved into place
+    const int fds[] = { ring.MemoryFd(), ring.FilledFd(), ring.FreedFd() };
+    const int targets[] = { kChildMemoryFd, kChildFilledFd, kChildFreedFd };
+    int copies[3] = { -1, -1, -1 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    bool ok = true;
+    for (int i = 0; i < 3 && ok; i++) {
+        copies[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, kChildFreedFd + 1);
+        ok = copies[i] >= 0 &&
+            posix_spawn_file_actions_adddup2(&actions, copies[i],
+                targets[i]) == 0;
+    }
+
+    // a group of its own, so Stop() gets whatever the shell started too
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    if (ok) {
+        const char* argv[] = { "/bin/sh", "-c", command.c_str(), NULL };
+        ok = posix_spawn(&pid_, "/bin/sh", &actions, &attributes,
+            const_cast<char* const*>(argv), environ) == 0;
+    }
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    for (int copy : copies)
+        if (copy >= 0) close(copy);
+
+    if (!ok) {
+        RTC_LOG(LS_ERROR) << "Failed to start frame producer: " << command;
+        pid_ = -1;
+        return false;
+    }
+    return true;
+}
+
+
+void
+FFmpegShmProducerProcess::Stop()
+{
+    if (pid_ <= 0) return;
+    kill(-pid_, SIGTERM);
+    int status;
+    while (waitpid(pid_, &status, 0) < 0 && errno == EINTR) { }
+    pid_ = -1;
+}
@@ -0,0 +1,176 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Ring of raw frame slots in shared memory, between processes.
+ */
+
+#ifndef DEMO_FFMPEG_SHM_RING_H_
+#define DEMO_FFMPEG_SHM_RING_H_
+
+#include <sys/types.h> // pid_t
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "common_video/libyuv/include/webrtc_libyuv.h"
+#include "rtc_base/platform_thread.h"
+
+
+// Frames go from a producer process to the capture module through a memfd
+// holding a header and a ring of frame-sized slots, so the pixels are
+// written once, by the producer, and never cross a pipe or get copied into
+// a buffer of ours: the consumer wraps a slot as a frame buffer and hands
+// the slot back when the last sink lets go of it.
+//
+// Two eventfds carry the signalling. "filled" is a semaphore the producer
+// bumps once per published slot, so each 8-byte read of it stands for one
+// frame (it's read by the FFmpegIngestReactor like any pipe); "freed" wakes
+// a producer that's waiting for its next slot. Slots are filled in order
+// but may be released in any order; the producer waits for the slot it's
+// up to.
+//
+// A producer in another process gets the three fds as 3 (memory),
+// 4 (filled) and 5 (freed) and calls Attach(3, 4, 5); the header tells it
+// the frame format. Each side keeps its own copy of the geometry, so a
+// producer scribbling over the header can't make the consumer read or
+// write outside the mapping; only the counters, the slot states and the
+// closed flag are read back from shared memory.
+class FFmpegShmRing {
+public:
+    // Consumer side: a new ring for |slots| frames
+    static std::shared_ptr<FFmpegShmRing> Create(
+        webrtc::VideoType type,
+        int width,
+        int height,
+        size_t slots);
+
+    // Producer side, on inherited fds; the ring takes ownership of them
+    static std::shared_ptr<FFmpegShmRing> Attach(
+        int memoryFd,
+        int filledFd,
+        int freedFd);
+
+    ~FFmpegShmRing();
+
+    int MemoryFd() const;
+    int FilledFd() const;
+    int FreedFd() const;
+
+    webrtc::VideoType Type() const;
+    int Width() const;
+    int Height() const;
+    size_t FrameSize() const;  // bytes of a frame in a slot
+    size_t Slots() const;
+
+    // Producer: the next slot, once the consumer is done with it.
+    // nullptr after |timeoutMs| or once the ring is closed.
+    uint8_t* AcquireSlot(int timeoutMs);
+
+    // Producer: hands the acquired slot over.
+    void PublishSlot(int64_t ptsUs);
+
+    // Consumer: the next filled slot; call once per read of FilledFd().
+    // False if the producer broke the protocol.
+    bool TakeSlot(size_t& index, int64_t& ptsUs);
+    const uint8_t* SlotData(size_t index) const;
+
+    // Consumer, from any thread, in any order
+    void ReleaseSlot(size_t index);
+
+    // Tells the producer to stop; wakes it if it's waiting for a slot.
+    void Close();
+    bool IsClosed() const;
+
+    static const size_t kMaxSlots = 64;
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> state;
+        int64_t ptsUs;
+    };
+
+    // at the start of the memfd; the slots follow, page aligned
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        int32_t  type;       // webrtc::VideoType
+        int32_t  width;
+        int32_t  height;
+        uint32_t slots;
+        uint64_t frameSize;
+        uint64_t slotSize;
+        uint64_t slotOffset;
+        std::atomic<uint32_t> closed;
+        std::atomic<uint64_t> published; // by the producer
+        Slot slot[kMaxSlots];
+    };
+
+    FFmpegShmRing(int memoryFd, int filledFd, int freedFd);
+    bool Map(size_t size);
+
+    int memoryFd_;
+    int filledFd_;
+    int freedFd_;
+    uint8_t* memory_;
+    size_t size_;
+    Header* header_;
+
+    // as created, or as checked by Attach()
+    webrtc::VideoType type_;
+    int width_;
+    int height_;
+    size_t slots_;
+    size_t frameSize_;
+    size_t slotSize_;
+    size_t slotOffset_;
+    uint64_t taken_; // consumer: slots taken so far
+};
+
+
+// Stand-in producer for tests and benchmarks: a thread that writes a
+// moving test pattern into a ring at |fps| frames a second, the way a
+// grabber process would.
+class FFmpegShmTestProducer {
+public:
+    FFmpegShmTestProducer(std::shared_ptr<FFmpegShmRing> ring, int fps);
+    ~FFmpegShmTestProducer();
+
+    bool Start();
+    void Stop();
+
+    uint64_t FramesProduced() const;
+
+private:
+    std::shared_ptr<FFmpegShmRing> ring_;
+    int64_t intervalUs_;
+    std::atomic<bool> stopping_;
+    std::atomic<uint64_t> frames_;
+    std::unique_ptr<rtc::PlatformThread> thread_;
+
+    static void ProducerThread(void* object);
+    void Fill(uint8_t* data, uint64_t frame) const;
+};
+
+
+// A producer process: "/bin/sh -c |command|" with the ring's fds as 3, 4
+// and 5.
+class FFmpegShmProducerProcess {
+public:
+    FFmpegShmProducerProcess();
+    ~FFmpegShmProducerProcess();
+
+    bool Start(const std::string& command, const FFmpegShmRing& ring);
+    void Stop();  // SIGTERM to its process group, then waits
+
+private:
+    pid_t pid_;
+};
+
+#endif
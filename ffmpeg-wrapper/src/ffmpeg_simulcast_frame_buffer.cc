@@ -0,0 +1,71 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  One captured frame at several resolutions, for simulcast encoders.
+ */
+
+#include "ffmpeg_simulcast_frame_buffer.h"
+
+#include "rtc_base/checks.h"
+#include "rtc_base/ref_counted_object.h"
+
+
+rtc::scoped_refptr<FFmpegSimulcastFrameBuffer>
+FFmpegSimulcastFrameBuffer::Create(Layers layers)
+{ return new rtc::RefCountedObject<FFmpegSimulcastFrameBuffer>(std::move(layers)); }
+
+
+FFmpegSimulcastFrameBuffer::FFmpegSimulcastFrameBuffer(Layers layers)
+: layers_(std::move(layers))
+{ RTC_DCHECK(!layers_.empty()); }
+
+
+FFmpegSimulcastFrameBuffer::~FFmpegSimulcastFrameBuffer() { }
+
+
+FFmpegNativeBuffer::NativeType
+FFmpegSimulcastFrameBuffer::native_type() const
+{ return kNativeSimulcast; }
+
+
+int
+FFmpegSimulcastFrameBuffer::width() const
+{ return layers_[0]->width(); }
+
+
+int
+FFmpegSimulcastFrameBuffer::height() const
+{ return layers_[0]->height(); }
+
+
+rtc::scoped_refptr<webrtc::I420BufferInterface>
+FFmpegSimulcastFrameBuffer::ToI420()
+{ return layers_[0]->ToI420(); }
+
+
+size_t
+FFmpegSimulcastFrameBuffer::NumberOfLayers() const
+{ return layers_.size(); }
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegSimulcastFrameBuffer::GetLayer(size_t index) const
+{ return layers_[index]; }
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegSimulcastFrameBuffer::FindLayer(int width, int height) const
+{
+    // layers shrink as the index grows
+    size_t index = 0;
+    for (size_t i = 1; i < layers_.size(); i++) {
+        if (layers_[i]->width() < width || layers_[i]->height() < height)
+            break;
+        index = i;
+    }
+    return layers_[index];
+}
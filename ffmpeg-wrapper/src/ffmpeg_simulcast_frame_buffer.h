@@ -0,0 +1,52 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  One captured frame at several resolutions, for simulcast encoders.
+ */
+
+#ifndef DEMO_FFMPEG_SIMULCAST_FRAME_BUFFER_H_
+#define DEMO_FFMPEG_SIMULCAST_FRAME_BUFFER_H_
+
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "ffmpeg_native_buffer.h"
+
+
+// The frame as decoded plus its downscaled layers, largest first. To
+// anything but an FFmpegSimulcastVideoEncoder it is just the full-size
+// frame: width(), height() and ToI420() are those of layer 0.
+class FFmpegSimulcastFrameBuffer : public FFmpegNativeBuffer {
+public:
+    typedef std::vector<rtc::scoped_refptr<webrtc::VideoFrameBuffer>> Layers;
+
+    static rtc::scoped_refptr<FFmpegSimulcastFrameBuffer> Create(Layers layers);
+
+    NativeType native_type() const override;
+    int width() const override;
+    int height() const override;
+
+    rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+    size_t NumberOfLayers() const;
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> GetLayer(size_t index) const;
+
+    // The smallest layer at least |width| x |height|, or layer 0 if none
+    // is that large.
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> FindLayer(
+        int width,
+        int height) const;
+
+protected:
+    explicit FFmpegSimulcastFrameBuffer(Layers layers);
+    ~FFmpegSimulcastFrameBuffer() override;
+
+private:
+    const Layers layers_;
+};
+
+#endif
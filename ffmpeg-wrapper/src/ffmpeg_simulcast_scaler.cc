@@ -0,0 +1,212 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Builds the simulcast layers of a captured frame.
+ */
+
+#include "ffmpeg_simulcast_scaler.h"
+#include "ffmpeg_simulcast_frame_buffer.h"
+
+#include <algorithm>
+
+#include "third_party/libyuv/include/libyuv.h"
+
+
+// Layers smaller than a macroblock aren't worth encoding
+static const int kMinLayerSize = 16;
+
+
+FFmpegSimulcastScaler::FFmpegSimulcastScaler(FFmpegFrameBufferPool* pool)
+: pool_(pool),
+  layers_(1),
+  workers_(FFmpegWorkerPool::GetShared())
+{ }
+
+
+FFmpegSimulcastScaler::~FFmpegSimulcastScaler() { }
+
+
+void
+FFmpegSimulcastScaler::SetLayers(size_t layers)
+{
+    layers_ = std::max<size_t>(1, std::min(layers, kMaxLayers));
+}
+
+
+size_t
+FFmpegSimulcastScaler::GetLayers() const
+{ return layers_; }
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegSimulcastScaler::Scale(
+    const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& frame)
+{
+    if (layers_ <= 1) return frame;
+
+    // layers are scaled from |source|: the frame itself, or for another
+    // module's native buffer, its ToI420()
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> source = frame;
+    const FFmpegARGBBuffer* argb = nullptr;
+    if (frame->type() == webrtc::VideoFrameBuffer::Type::kNative) {
+        const FFmpegNativeBuffer* native =
+            FFmpegNativeBuffer::From(frame.get());
+        // passthrough frames have nothing to scale
+        if (native && native->native_type() != FFmpegNativeBuffer::kNativeARGB)
+            return frame;
+        if (native)
+            argb = static_cast<const FFmpegARGBBuffer*>(native);
+        else
+            source = frame->ToI420();
+        if (!source) return frame;
+    }
+
+    FFmpegSimulcastFrameBuffer::Layers layers;
+    layers.push_back(frame); // layer 0 is the frame itself, no copy
+    tasks_.clear();
+
+    for (size_t i = 1; i < layers_; i++) {
+        const int width  = frame->width()  >> i;
+        const int height = frame->height() >> i;
+        if (width < kMinLayerSize || height < kMinLayerSize) break;
+
+        if (argb) {
+            rtc::scoped_refptr<FFmpegARGBBuffer> layer =
+                pool_->CreateARGBBuffer(width, height);
+            if (!layer) break;
+            AddARGBTasks(argb, layer.get());
+            layers.push_back(layer);
+        }
+        else if (source->type() == webrtc::VideoFrameBuffer::Type::kNV12) {
+            rtc::scoped_refptr<webrtc::NV12Buffer> layer =
+                pool_->CreateNV12Buffer(width, height);
+            if (!layer) break;
+            AddNV12Tasks(source->GetNV12(), layer.get());
+            layers.push_back(layer);
+        }
+        else if (source->type() == webrtc::VideoFrameBuffer::Type::kI420) {
+            rtc::scoped_refptr<webrtc::I420Buffer> layer =
+                pool_->CreateI420Buffer(width, height);
+            if (!layer) break;
+            AddI420Tasks(source->GetI420(), layer.get());
+            layers.push_back(layer);
+        }
+        else break; // not a format the capture module produces
+    }
+
+    if (layers.size() == 1) return frame;
+
+    workers_->Run(tasks_);
+    tasks_.clear();
+    return FFmpegSimulcastFrameBuffer::Create(std::move(layers));
+}
+
+
+void
+FFmpegSimulcastScaler::AddPlaneTasks(
+    int sourceHeight,
+    int width,
+    int height,
+    const BandScaler& scale)
+{
+    // A band of the layer is a band of the source only if every layer row
+    // is made of the same whole number of source rows; otherwise the box
+    // filter straddles band edges, so the plane is scaled in one go.
+    if (height <= 0 || sourceHeight % height != 0) {
+        tasks_.push_back([scale, sourceHeight, height]() {
+            scale(0, sourceHeight, 0, height);
+        });
+        return;
+    }
+
+    const int factor = sourceHeight / height;
+    workers_->AddSlices(tasks_, height, width, 1,
+        [scale, factor](int first, int count) {
+            scale(first * factor, count * factor, first, count);
+        });
+}
+
+
+void
+FFmpegSimulcastScaler::AddI420Tasks(
+    const webrtc::I420BufferInterface* source,
+    webrtc::I420Buffer* layer)
+{
+    AddPlaneTasks(source->height(), layer->width(), layer->height(),
+        [source, layer](int sourceFirst, int sourceRows, int first, int rows) {
+            libyuv::ScalePlane(
+                source->DataY() + sourceFirst * source->StrideY(),
+                source->StrideY(), source->width(), sourceRows,
+                layer->MutableDataY() + first * layer->StrideY(),
+                layer->StrideY(), layer->width(), rows,
+                libyuv::kFilterBox);
+        });
+    AddPlaneTasks(source->ChromaHeight(),
+        layer->ChromaWidth(), layer->ChromaHeight(),
+        [source, layer](int sourceFirst, int sourceRows, int first, int rows) {
+            libyuv::ScalePlane(
+                source->DataU() + sourceFirst * source->StrideU(),
+                source->StrideU(), source->ChromaWidth(), sourceRows,
+                layer->MutableDataU() + first * layer->StrideU(),
+                layer->StrideU(), layer->ChromaWidth(), rows,
+                libyuv::kFilterBox);
+        });
+    AddPlaneTasks(source->ChromaHeight(),
+        layer->ChromaWidth(), layer->ChromaHeight(),
+        [source, layer](int sourceFirst, int sourceRows, int first, int rows) {
+            libyuv::ScalePlane(
+                source->DataV() + sourceFirst * source->StrideV(),
+                source->StrideV(), source->ChromaWidth(), sourceRows,
+                layer->MutableDataV() + first * layer->StrideV(),
+                layer->StrideV(), layer->ChromaWidth(), rows,
+                libyuv::kFilterBox);
+        });
+}
+
+
+void
+FFmpegSimulcastScaler::AddNV12Tasks(
+    const webrtc::NV12BufferInterface* source,
+    webrtc::NV12Buffer* layer)
+{
+    AddPlaneTasks(source->height(), layer->width(), layer->height(),
+        [source, layer](int sourceFirst, int sourceRows, int first, int rows) {
+            libyuv::ScalePlane(
+                source->DataY() + sourceFirst * source->StrideY(),
+                source->StrideY(), source->width(), sourceRows,
+                layer->MutableDataY() + first * layer->StrideY(),
+                layer->StrideY(), layer->width(), rows,
+                libyuv::kFilterBox);
+        });
+    AddPlaneTasks(source->ChromaHeight(),
+        layer->ChromaWidth(), layer->ChromaHeight(),
+        [source, layer](int sourceFirst, int sourceRows, int first, int rows) {
+            libyuv::UVScale(
+                source->DataUV() + sourceFirst * source->StrideUV(),
+                source->StrideUV(), source->ChromaWidth(), sourceRows,
+                layer->MutableDataUV() + first * layer->StrideUV(),
+                layer->StrideUV(), layer->ChromaWidth(), rows,
+                libyuv::kFilterBox);
+        });
+}
+
+
+void
+FFmpegSimulcastScaler::AddARGBTasks(
+    const FFmpegARGBBuffer* source,
+    FFmpegARGBBuffer* layer)
+{
+    AddPlaneTasks(source->height(), layer->width(), layer->height(),
+        [source, layer](int sourceFirst, int sourceRows, int first, int rows) {
+            libyuv::ARGBScale(
+                source->Data() + sourceFirst * source->Stride(),
+                source->Stride(), source->width(), sourceRows,
+                layer->MutableData() + first * layer->Stride(),
+                layer->Stride(), layer->width(), rows,
+                libyuv::kFilterBox);
+        });
+}
@@ -0,0 +1,75 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Builds the simulcast layers of a captured frame.
+ */
+
+#ifndef DEMO_FFMPEG_SIMULCAST_SCALER_H_
+#define DEMO_FFMPEG_SIMULCAST_SCALER_H_
+
+#include <functional>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include "ffmpeg_frame_buffer_pool.h"
+#include "ffmpeg_worker_pool.h"
+
+
+// Scales each frame down to 1/2, 1/4, ... of its size, the way WebRTC lays
+// out simulcast streams, and wraps the lot in an FFmpegSimulcastFrameBuffer.
+// Every layer is scaled from the full frame with libyuv's box filter, in
+// horizontal bands of each plane, on the shared worker pool; layer buffers
+// come from |pool|.
+//
+// Not thread-safe: one thread scales, and only it changes the layers.
+class FFmpegSimulcastScaler {
+public:
+    static const size_t kMaxLayers = 3; // webrtc::kMaxSimulcastStreams
+
+    explicit FFmpegSimulcastScaler(FFmpegFrameBufferPool* pool);
+    ~FFmpegSimulcastScaler();
+
+    // 1 (the default) turns scaling off.
+    void SetLayers(size_t layers);
+    size_t GetLayers() const;
+
+    // Returns |frame| itself when there's nothing to scale: a single layer,
+    // an encoded frame, or a pool with no buffers to spare. Any layer the
+    // pool can't supply is left out.
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> Scale(
+        const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& frame);
+
+private:
+    FFmpegFrameBufferPool* const pool_;
+    size_t layers_;
+    FFmpegWorkerPool* const workers_;
+    std::vector<FFmpegWorkerPool::Task> tasks_; // reused from frame to frame
+
+    // scales source rows [sourceFirst, + sourceRows) into layer rows
+    // [first, + rows) of one plane
+    typedef std::function<void(
+        int sourceFirst, int sourceRows, int first, int rows)> BandScaler;
+
+    void AddPlaneTasks(
+        int sourceHeight,
+        int width,
+        int height,
+        const BandScaler& scale);
+
+    void AddI420Tasks(
+        const webrtc::I420BufferInterface* source,
+        webrtc::I420Buffer* layer);
+    void AddNV12Tasks(
+        const webrtc::NV12BufferInterface* source,
+        webrtc::NV12Buffer* layer);
+    void AddARGBTasks(
+        const FFmpegARGBBuffer* source,
+        FFmpegARGBBuffer* layer);
+};
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Encodes simulcast streams from the layers the capture module scaled.
+ */
+
+#include "ffmpeg_simulcast_video_encoder.h"
+#include "ffmpeg_simulcast_frame_buffer.h"
+
+#include "api/video/i420_buffer.h"
+#include "media/engine/encoder_simulcast_proxy.h"
+#include "media/engine/internal_encoder_factory.h"
+#include "modules/video_coding/include/video_error_codes.h"
+
+
+FFmpegSimulcastVideoEncoder::FFmpegSimulcastVideoEncoder(
+    std::unique_ptr<webrtc::VideoEncoder> encoder)
+: encoder_(std::move(encoder)),
+  width_(0),
+  height_(0)
+{ }
+
+
+FFmpegSimulcastVideoEncoder::~FFmpegSimulcastVideoEncoder() { }
+
+
+void
+FFmpegSimulcastVideoEncoder::SetFecControllerOverride(
+    webrtc::FecControllerOverride* fecControllerOverride)
+{ encoder_->SetFecControllerOverride(fecControllerOverride); }
+
+
+int32_t
+FFmpegSimulcastVideoEncoder::InitEncode(
+    const webrtc::VideoCodec* codecSettings,
+    const webrtc::VideoEncoder::Settings& settings)
+{
+    if (codecSettings == nullptr) return WEBRTC_VIDEO_CODEC_ERR_PARAMETER;
+
+    // one stream per encoder; see the class comment
+    if (codecSettings->numberOfSimulcastStreams > 1)
+        return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+
+    width_  = codecSettings->width;
+    height_ = codecSettings->height;
+    return encoder_->InitEncode(codecSettings, settings);
+}
+
+
+int32_t
+FFmpegSimulcastVideoEncoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback* callback)
+{ return encoder_->RegisterEncodeCompleteCallback(callback); }
+
+
+int32_t
+FFmpegSimulcastVideoEncoder::Release()
+{ return encoder_->Release(); }
+
+
+int32_t
+FFmpegSimulcastVideoEncoder::Encode(
+    const webrtc::VideoFrame& frame,
+    const std::vector<webrtc::VideoFrameType>* frameTypes)
+{
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer =
+        frame.video_frame_buffer();
+    if (buffer->type() != webrtc::VideoFrameBuffer::Type::kNative)
+        return encoder_->Encode(frame, frameTypes);
+
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> layer = buffer;
+    if (FFmpegNativeBuffer::Is(
+            buffer.get(), FFmpegNativeBuffer::kNativeSimulcast)) {
+        // the layer that was scaled for this stream; if the encoder has
+        // been adapted to a size the capture module didn't scale to,
+        // shrink the next larger layer rather than the full frame
+        layer = static_cast<FFmpegSimulcastFrameBuffer*>(buffer.get())->
+            FindLayer(width_, height_);
+        if (layer->width() != width_ || layer->height() != height_) {
+            rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+                webrtc::I420Buffer::Create(width_, height_);
+            scaled->ScaleFrom(*layer->ToI420());
+            layer = scaled;
+        }
+    }
+
+    // we claim native handle support on |encoder_|'s behalf
+    if (layer->type() == webrtc::VideoFrameBuffer::Type::kNative &&
+        !encoder_->GetEncoderInfo().supports_native_handle)
+        layer = layer->ToI420();
+    if (layer.get() == buffer.get()) return encoder_->Encode(frame, frameTypes);
+
+    // same as SimulcastEncoderAdapter does with the frames it scales
+    webrtc::VideoFrame layerFrame(frame);
+    layerFrame.set_video_frame_buffer(layer);
+    layerFrame.set_update_rect(
+        webrtc::VideoFrame::UpdateRect{0, 0, layer->width(), layer->height()});
+    return encoder_->Encode(layerFrame, frameTypes);
+}
+
+
+void
+FFmpegSimulcastVideoEncoder::SetRates(const RateControlParameters& parameters)
+{ encoder_->SetRates(parameters); }
+
+
+void
+FFmpegSimulcastVideoEncoder::OnPacketLossRateUpdate(float packetLossRate)
+{ encoder_->OnPacketLossRateUpdate(packetLossRate); }
+
+
+void
+FFmpegSimulcastVideoEncoder::OnRttUpdate(int64_t rttMs)
+{ encoder_->OnRttUpdate(rttMs); }
+
+
+void
+FFmpegSimulcastVideoEncoder::OnLossNotification(
+    const LossNotification& lossNotification)
+{ encoder_->OnLossNotification(lossNotification); }
+
+
+webrtc::VideoEncoder::EncoderInfo
+FFmpegSimulcastVideoEncoder::GetEncoderInfo() const
+{
+    EncoderInfo info = encoder_->GetEncoderInfo();
+    // have simulcast frames passed on unscaled
+    info.supports_native_handle = true;
+    return info;
+}
+
+
+FFmpegSimulcastVideoEncoderFactory::FFmpegSimulcastVideoEncoderFactory() { }
+
+
+FFmpegSimulcastVideoEncoderFactory::~FFmpegSimulcastVideoEncoderFactory() { }
+
+
+std::vector<webrtc::SdpVideoFormat>
+FFmpegSimulcastVideoEncoderFactory::GetSupportedFormats() const
+{ return streamFactory_.GetSupportedFormats(); }
+
+
+webrtc::VideoEncoderFactory::CodecInfo
+FFmpegSimulcastVideoEncoderFactory::QueryVideoEncoder(
+    const webrtc::SdpVideoFormat& format) const
+{ return streamFactory_.QueryVideoEncoder(format); }
+
+
+std::unique_ptr<webrtc::VideoEncoder>
+FFmpegSimulcastVideoEncoderFactory::CreateVideoEncoder(
+    const webrtc::SdpVideoFormat& format)
+{
+    // referenced from builtin_video_encoder_factory.cc
+    if (!format.IsCodecInList(streamFactory_.GetSupportedFormats()))
+        return nullptr;
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        new webrtc::EncoderSimulcastProxy(&streamFactory_, format));
+}
+
+
+FFmpegSimulcastVideoEncoderFactory::StreamEncoderFactory::StreamEncoderFactory()
+: factory_(new webrtc::InternalEncoderFactory())
+{ }
+
+
+FFmpegSimulcastVideoEncoderFactory::StreamEncoderFactory::~StreamEncoderFactory()
+{ }
+
+
+std::vector<webrtc::SdpVideoFormat>
+FFmpegSimulcastVideoEncoderFactory::StreamEncoderFactory::GetSupportedFormats() const
+{ return factory_->GetSupportedFormats(); }
+
+
+webrtc::VideoEncoderFactory::CodecInfo
+FFmpegSimulcastVideoEncoderFactory::StreamEncoderFactory::QueryVideoEncoder(
+    const webrtc::SdpVideoFormat& format) const
+{ return factory_->QueryVideoEncoder(format); }
+
+
+std::unique_ptr<webrtc::VideoEncoder>
+FFmpegSimulcastVideoEncoderFactory::StreamEncoderFactory::CreateVideoEncoder(
+    const webrtc::SdpVideoFormat& format)
+{
+    std::unique_ptr<webrtc::VideoEncoder> encoder =
+        factory_->CreateVideoEncoder(format);
+    if (!encoder) return nullptr;
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        new FFmpegSimulcastVideoEncoder(std::move(encoder)));
+}
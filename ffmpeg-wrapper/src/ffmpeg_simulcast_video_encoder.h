@@ -0,0 +1,105 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Encodes simulcast streams from the layers the capture module scaled.
+ */
+
+#ifndef DEMO_FFMPEG_SIMULCAST_VIDEO_ENCODER_H_
+#define DEMO_FFMPEG_SIMULCAST_VIDEO_ENCODER_H_
+
+#include <memory>
+#include <vector>
+
+#include "api/video_codecs/sdp_video_format.h"
+#include "api/video_codecs/video_encoder.h"
+#include "api/video_codecs/video_encoder_factory.h"
+
+
+// Encodes one simulcast stream. Given an FFmpegSimulcastFrameBuffer it
+// hands |encoder| the layer matching the stream's resolution, so the
+// SimulcastEncoderAdapter in front of it doesn't scale the frame again.
+// Other kNative frames are converted to I420 first, unless |encoder|
+// takes them as they are.
+//
+// InitEncode() refuses more than one stream, which makes the
+// EncoderSimulcastProxy fall back to a SimulcastEncoderAdapter with an
+// FFmpegSimulcastVideoEncoder per stream, instead of letting an encoder
+// with internal simulcast (libvpx VP8) do its own scaling.
+class FFmpegSimulcastVideoEncoder : public webrtc::VideoEncoder {
+public:
+    explicit FFmpegSimulcastVideoEncoder(
+        std::unique_ptr<webrtc::VideoEncoder> encoder);
+    ~FFmpegSimulcastVideoEncoder() override;
+
+    void SetFecControllerOverride(
+        webrtc::FecControllerOverride* fecControllerOverride) override;
+
+    int32_t InitEncode(
+        const webrtc::VideoCodec* codecSettings,
+        const webrtc::VideoEncoder::Settings& settings) override;
+
+    int32_t RegisterEncodeCompleteCallback(
+        webrtc::EncodedImageCallback* callback) override;
+
+    int32_t Release() override;
+
+    int32_t Encode(
+        const webrtc::VideoFrame& frame,
+        const std::vector<webrtc::VideoFrameType>* frameTypes) override;
+
+    void SetRates(const RateControlParameters& parameters) override;
+    void OnPacketLossRateUpdate(float packetLossRate) override;
+    void OnRttUpdate(int64_t rttMs) override;
+    void OnLossNotification(const LossNotification& lossNotification) override;
+
+    EncoderInfo GetEncoderInfo() const override;
+
+private:
+    std::unique_ptr<webrtc::VideoEncoder> encoder_;
+    int width_;  // of the stream, as of InitEncode()
+    int height_;
+};
+
+
+// What CreateBuiltinVideoEncoderFactory() builds, with every encoder
+// wrapped in an FFmpegSimulcastVideoEncoder.
+class FFmpegSimulcastVideoEncoderFactory : public webrtc::VideoEncoderFactory {
+public:
+    FFmpegSimulcastVideoEncoderFactory();
+    ~FFmpegSimulcastVideoEncoderFactory() override;
+
+    std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
+
+    CodecInfo QueryVideoEncoder(
+        const webrtc::SdpVideoFormat& format) const override;
+
+    std::unique_ptr<webrtc::VideoEncoder> CreateVideoEncoder(
+        const webrtc::SdpVideoFormat& format) override;
+
+private:
+    // the per-stream encoders
+    class StreamEncoderFactory : public webrtc::VideoEncoderFactory {
+    public:
+        StreamEncoderFactory();
+        ~StreamEncoderFactory() override;
+
+        std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
+
+        CodecInfo QueryVideoEncoder(
+            const webrtc::SdpVideoFormat& format) const override;
+
+        std::unique_ptr<webrtc::VideoEncoder> CreateVideoEncoder(
+            const webrtc::SdpVideoFormat& format) override;
+
+    private:
+        std::unique_ptr<webrtc::VideoEncoderFactory> factory_;
+    };
+
+    StreamEncoderFactory streamFactory_;
+};
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Sink list that frames are delivered to without taking a lock.
+ */
+
+#ifndef DEMO_FFMPEG_SINK_LIST_H_
+#define DEMO_FFMPEG_SINK_LIST_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "rtc_base/event.h"
+#include "rtc_base/synchronization/mutex.h"
+#include "rtc_base/time_utils.h"
+
+
+// Read-copy-update over a list of sink pointers. Delivery walks an
+// immutable snapshot of the list; adding or removing a sink publishes a new
+// snapshot and retires the old one once no delivery can still be walking
+// it. Deliveries register in one of two reader counts, picked by an epoch
+// that every update flips, so an update only waits for the deliveries that
+// started before it, never for ones that start while it waits: a removal
+// takes at most as long as one sink's OnFrame().
+//
+// ForEach() takes no lock and never waits: it counts itself in and out
+// with an atomic add each, and only if an update is waiting on it does the
+// last one out signal it. Add(), Remove() and Replace() are serialized
+// among themselves and may be called from any thread, while frames are
+// flowing, but not from within a sink ForEach() is calling, which would
+// wait for itself.
+template <typename T>
+class FFmpegSinkList {
+public:
+    struct Stats {
+        size_t   sinks;
+        uint64_t updates;        // snapshots published
+        int64_t  lastRemoveUs;   // waiting out the deliveries in progress
+        int64_t  maxRemoveUs;
+    };
+
+    FFmpegSinkList()
+    : snapshot_(new Snapshot()),
+      epoch_(0),
+      removing_(false),
+      updates_(0),
+      lastRemoveUs_(0),
+      maxRemoveUs_(0)
+    {
+        readers_[0].store(0, std::memory_order_relaxed);
+        readers_[1].store(0, std::memory_order_relaxed);
+    }
+
+    ~FFmpegSinkList()
+    { delete snapshot_.load(std::memory_order_relaxed); }
+
+    FFmpegSinkList(const FFmpegSinkList&) = delete;
+    FFmpegSinkList& operator=(const FFmpegSinkList&) = delete;
+
+    // Returns false if |sink| is null or listed already.
+    bool Add(T* sink)
+    { return Replace(nullptr, sink); }
+
+    // Once it returns, |sink| isn't being called and won't be again.
+    // Returns false if |sink| wasn't listed.
+    bool Remove(T* sink)
+    { return Replace(sink, nullptr); }
+
+    // Swaps |from| for |to| in one update, so no delivery misses both or
+    // reaches both; either may be null. Returns false if nothing changed.
+    bool Replace(T* from, T* to)
+    {
+        webrtc::MutexLock lock(&updateMutex_);
+        const Snapshot* current = snapshot_.load(std::memory_order_relaxed);
+        Snapshot* next = new Snapshot(*current);
+        bool changed = false;
+        if (from) {
+            auto it = std::find(next->begin(), next->end(), from);
+            if (it != next->end()) {
+                next->erase(it);
+                changed = true;
+            }
+        }
+        if (to && std::find(next->begin(), next->end(), to) == next->end()) {
+            next->push_back(to);
+            changed = true;
+        }
+        if (!changed) {
+            delete next;
+            return false;
+        }
+
+        snapshot_.store(next, std::memory_order_seq_cst);
+        updates_.fetch_add(1, std::memory_order_relaxed);
+        const int64_t startUs = rtc::TimeMicros();
+        Synchronize();
+        delete current;
+        if (from) {
+            int64_t removeUs = rtc::TimeMicros() - startUs;
+            lastRemoveUs_.store(removeUs, std::memory_order_relaxed);
+            if (removeUs > maxRemoveUs_.load(std::memory_order_relaxed))
+                maxRemoveUs_.store(removeUs, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Calls |f| with every sink listed as of the call. Returns how many
+    // there were.
+    template <typename F>
+    size_t ForEach(F f) const
+    {
+        size_t epoch;
+        for (;;) {
+            epoch = epoch_.load(std::memory_order_seq_cst) & 1;
+            readers_[epoch].fetch_add(1, std::memory_order_seq_cst);
+            // an update flipped the epoch in between, and may not wait
+            // for this count: take the other one
+            if ((epoch_.load(std::memory_order_seq_cst) & 1) == epoch) break;
+            Leave(epoch);
+        }
+        const Snapshot* snapshot = snapshot_.load(std::memory_order_seq_cst);
+        for (T* sink : *snapshot) f(sink);
+        const size_t count = snapshot->size();
+        Leave(epoch);
+        return count;
+    }
+
+    size_t Size() const
+    { return ForEach([](T*) { }); }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.sinks        = Size();
+        stats.updates      = updates_.load(std::memory_order_relaxed);
+        stats.lastRemoveUs = lastRemoveUs_.load(std::memory_order_relaxed);
+        stats.maxRemoveUs  = maxRemoveUs_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    typedef std::vector<T*> Snapshot;
+
+    void Leave(size_t epoch) const
+    {
+        // the last delivery out of an epoch wakes the update waiting on it
+        if (readers_[epoch].fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+            removing_.load(std::memory_order_seq_cst))
+            drained_.Set();
+    }
+
+    // Waits until every delivery that may have loaded the old snapshot is
+    // done with it. A delivery counts itself under the epoch it saw and
+    // checks the epoch again before loading the snapshot: if it still
+    // matches, the flip below hasn't happened and waits for it; if not, it
+    // counts itself again under the new epoch, which it can only see once
+    // the new snapshot is stored.
+    void Synchronize()
+    {
+        removing_.store(true, std::memory_order_seq_cst);
+        const size_t old = epoch_.fetch_add(1, std::memory_order_seq_cst) & 1;
+        while (readers_[old].load(std::memory_order_seq_cst) != 0)
+            drained_.Wait(kDrainPollMs);
+        removing_.store(false, std::memory_order_seq_cst);
+    }
+
+    // in case a wake-up comes between the check and the wait
+    static const int kDrainPollMs = 1;
+
+    webrtc::Mutex updateMutex_; // Add(), Remove() and Replace() only
+    std::atomic<Snapshot*> snapshot_;
+    std::atomic<size_t> epoch_;
+    mutable std::atomic<size_t> readers_[2];
+    std::atomic<bool> removing_;
+    mutable rtc::Event drained_;
+    std::atomic<uint64_t> updates_;
+    std::atomic<int64_t> lastRemoveUs_;
+    std::atomic<int64_t> maxRemoveUs_;
+};
+
+#endif
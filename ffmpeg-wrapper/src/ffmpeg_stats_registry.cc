@@ -0,0 +1,228 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Process-wide registry of capture statistics, dumped as text or JSON.
+ */
+
+#include "ffmpeg_stats_registry.h"
+
+#include <algorithm>
+#include <cstdio> // snprintf()
+#include <sstream>
+
+
+void
+FFmpegStatsReport::AddCounter(const std::string& name, uint64_t value)
+{
+    Field field = {};
+    field.name    = name;
+    field.kind    = Field::kCounter;
+    field.counter = value;
+    fields_.push_back(field);
+}
+
+
+void
+FFmpegStatsReport::AddValue(const std::string& name, int64_t value)
+{
+    Field field = {};
+    field.name  = name;
+    field.kind  = Field::kValue;
+    field.value = value;
+    fields_.push_back(field);
+}
+
+
+void
+FFmpegStatsReport::AddValue(const std::string& name, double value)
+{
+    Field field = {};
+    field.name = name;
+    field.kind = Field::kDouble;
+    field.real = value;
+    fields_.push_back(field);
+}
+
+
+void
+FFmpegStatsReport::AddHistogram(
+    const std::string& name,
+    const FFmpegLatencyHistogram::Snapshot& snapshot)
+{
+    Field field = {};
+    field.name      = name;
+    field.kind      = Field::kHistogram;
+    field.histogram = snapshot;
+    fields_.push_back(field);
+}
+
+
+FFmpegStatsRegistry*
+FFmpegStatsRegistry::GetInstance()
+{
+    // never destroyed: providers may unregister during static destruction
+    static FFmpegStatsRegistry* registry = new FFmpegStatsRegistry();
+    return registry;
+}
+
+
+void
+FFmpegStatsRegistry::Register(const std::string& name, Provider* provider)
+{
+    webrtc::MutexLock lock(&mutex_);
+    std::string unique = name;
+    for (int n = 2; std::any_of(providers_.begin(), providers_.end(),
+            [&](const Registration& r) { return r.name == unique; }); n++)
+        unique = name + "#" + std::to_string(n);
+    providers_.push_back({ unique, provider });
+}
+
+
+void
+FFmpegStatsRegistry::Unregister(Provider* provider)
+{
+    {
+        webrtc::MutexLock lock(&mutex_);
+        providers_.erase(std::remove_if(providers_.begin(), providers_.end(),
+            [&](const Registration& r) { return r.provider == provider; }),
+            providers_.end());
+    }
+    // a dump that listed it before it was removed may still be reporting it
+    webrtc::MutexLock wait(&reportMutex_);
+}
+
+
+std::vector<FFmpegStatsReport>
+FFmpegStatsRegistry::Collect(std::vector<std::string>& names)
+{
+    // held throughout, so a provider can't go away while it reports; the
+    // list's own lock isn't, so one can register from under a lock its
+    // ReportStats() takes
+    webrtc::MutexLock lock(&reportMutex_);
+    std::vector<Registration> providers;
+    {
+        webrtc::MutexLock listLock(&mutex_);
+        providers = providers_;
+    }
+    std::vector<FFmpegStatsReport> reports(providers.size());
+    names.clear();
+    for (size_t i = 0; i < providers.size(); i++) {
+        names.push_back(providers[i].name);
+        providers[i].provider->ReportStats(reports[i]);
+    }
+    return reports;
+}
+
+
+static std::string
+FormatDouble(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.3f", value);
+    return text;
+}
+
+
+std::string
+FFmpegStatsRegistry::DumpText()
+{
+    std::vector<std::string> names;
+    std::vector<FFmpegStatsReport> reports = Collect(names);
+
+    std::ostringstream text;
+    for (size_t i = 0; i < reports.size(); i++) {
+        text << names[i] << "\n";
+        for (const FFmpegStatsReport::Field& field : reports[i].fields_) {
+            text << "  " << field.name << " ";
+            switch (field.kind) {
+            case FFmpegStatsReport::Field::kCounter:
+                text << field.counter;
+                break;
+            case FFmpegStatsReport::Field::kValue:
+                text << field.value;
+                break;
+            case FFmpegStatsReport::Field::kDouble:
+                text << FormatDouble(field.real);
+                break;
+            case FFmpegStatsReport::Field::kHistogram: {
+                const FFmpegLatencyHistogram::Snapshot& h = field.histogram;
+                text << "count=" << h.count << " min=" << h.min
+                    << " p50=" << h.p50 << " p90=" << h.p90
+                    << " p99=" << h.p99 << " p999=" << h.p999
+                    << " max=" << h.max << " mean=" << h.mean;
+                break;
+            }
+            }
+            text << "\n";
+        }
+    }
+    return text.str();
+}
+
+
+// Device ids come from the command line; quote whatever they contain.
+static std::string
+JsonString(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += static_cast<char>(c);
+        }
+        else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else
+            quoted += static_cast<char>(c);
+    }
+    return quoted + "\"";
+}
+
+
+std::string
+FFmpegStatsRegistry::DumpJson()
+{
+    std::vector<std::string> names;
+    std::vector<FFmpegStatsReport> reports = Collect(names);
+
+    std::ostringstream json;
+    json << "{";
+    for (size_t i = 0; i < reports.size(); i++) {
+        json << (i ? "," : "") << JsonString(names[i]) << ":{";
+        const std::vector<FFmpegStatsReport::Field>& fields =
+            reports[i].fields_;
+        for (size_t j = 0; j < fields.size(); j++) {
+            const FFmpegStatsReport::Field& field = fields[j];
+            json << (j ? "," : "") << JsonString(field.name) << ":";
+            switch (field.kind) {
+            case FFmpegStatsReport::Field::kCounter:
+                json << field.counter;
+                break;
+            case FFmpegStatsReport::Field::kValue:
+                json << field.value;
+                break;
+            case FFmpegStatsReport::Field::kDouble:
+                json << FormatDouble(field.real);
+                break;
+            case FFmpegStatsReport::Field::kHistogram: {
+                const FFmpegLatencyHistogram::Snapshot& h = field.histogram;
+                json << "{\"count\":" << h.count << ",\"min\":" << h.min
+                    << ",\"p50\":" << h.p50 << ",\"p90\":" << h.p90
+                    << ",\"p99\":" << h.p99 << ",\"p999\":" << h.p999
+                    << ",\"max\":" << h.max << ",\"mean\":" << h.mean << "}";
+                break;
+            }
+            }
+        }
+        json << "}";
+    }
+    json << "}";
+    return json.str();
+}
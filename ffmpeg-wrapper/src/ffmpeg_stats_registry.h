@@ -0,0 +1,99 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Process-wide registry of capture statistics, dumped as text or JSON.
+ */
+
+#ifndef DEMO_FFMPEG_STATS_REGISTRY_H_
+#define DEMO_FFMPEG_STATS_REGISTRY_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rtc_base/synchronization/mutex.h"
+#include "ffmpeg_histogram.h"
+
+
+// One provider's statistics, in the order they were added.
+class FFmpegStatsReport {
+public:
+    void AddCounter(const std::string& name, uint64_t value);
+    void AddValue(const std::string& name, int64_t value);
+    void AddValue(const std::string& name, double value);
+    void AddHistogram(
+        const std::string& name,
+        const FFmpegLatencyHistogram::Snapshot& snapshot);
+
+private:
+    friend class FFmpegStatsRegistry;
+
+    struct Field {
+        enum Kind { kCounter, kValue, kDouble, kHistogram };
+        std::string name;
+        Kind kind;
+        uint64_t counter;
+        int64_t  value;
+        double   real;
+        FFmpegLatencyHistogram::Snapshot histogram;
+    };
+    std::vector<Field> fields_;
+};
+
+
+// Every capture module and audio device registers itself here, so one
+// call shows where each stream's time goes: how long frames take to read,
+// convert and deliver, how evenly they come out, and how many were lost.
+// Polled, never pushed; nothing is collected between dumps beyond the
+// providers' own counters and histograms.
+class FFmpegStatsRegistry {
+public:
+    class Provider {
+    public:
+        virtual ~Provider() { }
+
+        // Called during a dump, not under the lock Register() takes: read
+        // atomics, take short locks, and don't call back into the
+        // registry. Register() may be called with any of those locks held.
+        virtual void ReportStats(FFmpegStatsReport& report) = 0;
+    };
+
+    static FFmpegStatsRegistry* GetInstance();
+
+    // |name| gets a "#2", "#3"... if another provider has it already.
+    void Register(const std::string& name, Provider* provider);
+
+    // Waits for a dump in progress, so it must not be called with a lock
+    // ReportStats() takes. Removing what isn't there is fine.
+    void Unregister(Provider* provider);
+
+    // One block per provider:
+    //   video/cam0
+    //     framesDelivered 1500
+    //     readUs count=1500 min=310 p50=415 p90=703 p99=1215 p999=2431 ...
+    std::string DumpText();
+
+    // {"video/cam0":{"framesDelivered":1500,"readUs":{"count":1500,...}}}
+    std::string DumpJson();
+
+private:
+    struct Registration {
+        std::string name;
+        Provider* provider;
+    };
+
+    FFmpegStatsRegistry() { }
+
+    std::vector<FFmpegStatsReport> Collect(std::vector<std::string>& names);
+
+    webrtc::Mutex mutex_;
+    std::vector<Registration> providers_; // in the order they registered
+    // held through a dump, which Unregister() waits out
+    webrtc::Mutex reportMutex_;
+};
+
+#endif
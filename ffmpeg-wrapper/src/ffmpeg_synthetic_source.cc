@@ -0,0 +1,139 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Synthetic frames and PCM, and a stand-in for the ffmpeg CLI.
+ */
+
+#include "ffmpeg_synthetic_source.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>  // sscanf()
+#include <cstdlib> // atoi()
+#include <cstring> // memset(), strcmp()
+#include <string>
+#include <vector>
+
+#include "common_video/libyuv/include/webrtc_libyuv.h"
+
+
+static const double kToneHz        = 440;
+static const double kToneAmplitude = 0.25 * 32767;
+
+// ffmpeg's names for what the capture module asks the pipe for
+static const struct {
+    const char* name;
+    webrtc::VideoType type;
+} kPixelFormats[] = {
+    { "yuv420p", webrtc::VideoType::kI420  },
+    { "nv12",    webrtc::VideoType::kNV12  },
+    { "bgra",    webrtc::VideoType::kARGB  },
+    { "rgb24",   webrtc::VideoType::kRGB24 },
+};
+
+
+void
+FFmpegSyntheticSource::FillFrame(
+    uint8_t* data,
+    size_t size,
+    int width,
+    uint64_t frame)
+{
+    const size_t rowLength = static_cast<size_t>(std::max(width, 1));
+    size_t row = 0;
+    for (size_t offset = 0; offset < size; offset += rowLength, row++)
+        memset(data + offset, static_cast<uint8_t>(row - frame),
+            std::min(rowLength, size - offset));
+}
+
+
+void
+FFmpegSyntheticSource::FillPcm(
+    int16_t* samples,
+    size_t frames,
+    int channels,
+    int sampleRate,
+    uint64_t firstFrame)
+{
+    const double step = 2 * M_PI * kToneHz / std::max(sampleRate, 1);
+    for (size_t i = 0; i < frames; i++) {
+        int16_t sample = static_cast<int16_t>(kToneAmplitude *
+            std::sin(step * static_cast<double>((firstFrame + i) %
+                static_cast<uint64_t>(std::max(sampleRate, 1)))));
+        for (int channel = 0; channel < channels; channel++)
+            *samples++ = sample;
+    }
+}
+
+
+// false once the reader is gone
+static bool
+WriteAll(const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t count = write(STDOUT_FILENO, data, size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+int
+FFmpegSyntheticSource::Run(int argc, char** argv)
+{
+    std::string format;
+    std::string pixelFormat;
+    int width      = 0;
+    int height     = 0;
+    int channels   = 2;
+    int sampleRate = 48000;
+    for (int i = 0; i + 1 < argc; i++) {
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "-f") == 0) format = value;
+        else if (strcmp(argv[i], "-pix_fmt") == 0) pixelFormat = value;
+        else if (strcmp(argv[i], "-s") == 0)
+            sscanf(value, "%dx%d", &width, &height);
+        else if (strcmp(argv[i], "-ac") == 0) channels = atoi(value);
+        else if (strcmp(argv[i], "-ar") == 0) sampleRate = atoi(value);
+    }
+
+    // a closed pipe ends the loop below rather than the process
+    signal(SIGPIPE, SIG_IGN);
+
+    if (format == "s16le") {
+        if (channels <= 0 || sampleRate < 100) return 1;
+        // 10ms at a time, like ffmpeg's audio output
+        const size_t frames = sampleRate / 100;
+        std::vector<int16_t> chunk(frames * channels);
+        for (uint64_t first = 0; ; first += frames) {
+            FillPcm(&chunk[0], frames, channels, sampleRate, first);
+            if (!WriteAll(reinterpret_cast<const uint8_t*>(&chunk[0]),
+                    chunk.size() * sizeof(int16_t)))
+                return 0;
+        }
+    }
+
+    webrtc::VideoType type = webrtc::VideoType::kUnknown;
+    for (auto& known : kPixelFormats)
+        if (pixelFormat == known.name) type = known.type;
+    if (format != "image2pipe" || type == webrtc::VideoType::kUnknown ||
+        width <= 0 || height <= 0)
+        return 1;
+
+    std::vector<uint8_t> frame(webrtc::CalcBufferSize(type, width, height));
+    for (uint64_t index = 0; ; index++) {
+        FillFrame(&frame[0], frame.size(), width, index);
+        if (!WriteAll(&frame[0], frame.size())) return 0;
+    }
+}
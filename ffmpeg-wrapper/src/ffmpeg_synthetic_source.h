@@ -0,0 +1,45 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Synthetic frames and PCM, and a stand-in for the ffmpeg CLI.
+ */
+
+#ifndef DEMO_FFMPEG_SYNTHETIC_SOURCE_H_
+#define DEMO_FFMPEG_SYNTHETIC_SOURCE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+
+// Test input that needs no ffmpeg, no camera and no media file, for
+// benchmarks and the in-process test producer.
+//
+// Run() stands in for the ffmpeg child process itself: started with the
+// command line FFmpegVideoCaptureModule or FFmpegAudioDevice would give
+// ffmpeg, it writes what ffmpeg would to stdout (raw frames of the given
+// -pix_fmt and -s, or s16le PCM of the given -ac and -ar), as fast as the
+// pipe takes them, until the reader goes away. Point FFMPEG_BINARY at a
+// program that calls it to capture hermetically.
+class FFmpegSyntheticSource {
+public:
+    // Bands one pixel row high that move down a row per frame, over all
+    // |size| bytes of a frame |width| pixels wide, whatever its format.
+    static void FillFrame(uint8_t* data, size_t size, int width,
+        uint64_t frame);
+
+    // A 440 Hz tone, |frames| interleaved s16le sample frames of it,
+    // starting |firstFrame| frames in.
+    static void FillPcm(int16_t* samples, size_t frames, int channels,
+        int sampleRate, uint64_t firstFrame);
+
+    // |argv| is ffmpeg's command line without the program name.
+    // Returns the exit status: 0 once the pipe is closed, 1 if the output
+    // format isn't one the pipe ingests use.
+    static int Run(int argc, char** argv);
+};
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Scheduling, CPU affinity and NUMA policy of the threads we start.
+ */
+
+#include "ffmpeg_thread_policy.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdlib> // getenv(), strtol()
+#include <fstream>
+
+#include "rtc_base/logging.h"
+
+
+static const char kPolicyEnvironment[] = "FFMPEG_THREAD_POLICY";
+
+// from <numaif.h>, which would need libnuma's headers for two constants
+static const int kMpolPreferred = 1;
+static const int kMpolLocal     = 4;
+static const int kMaxNumaNodes  = 64;
+
+static const char* const kRoleNames[FFmpegThreadPolicy::kRoles] = {
+    "capture", "delivery", "reactor", "worker"
+};
+
+
+// the run function's Scope, if it has one
+static thread_local FFmpegThreadPolicy::Scope* currentScope = nullptr;
+
+
+static std::string
+Trim(const std::string& value)
+{
+    size_t begin = value.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return std::string();
+    size_t end = value.find_last_not_of(" \t\r");
+    return value.substr(begin, end - begin + 1);
+}
+
+
+// false unless all of |value| is a decimal number
+static bool
+ParseInt(const std::string& value, int& number)
+{
+    if (value.empty()) return false;
+    char* end;
+    long parsed = strtol(value.c_str(), &end, 10);
+    number = static_cast<int>(parsed);
+    return *end == '\0';
+}
+
+
+FFmpegThreadPolicy::Policy::Policy()
+: scheduler(SCHED_OTHER),
+  priority(0),
+  nice(0),
+  numaNode(kNumaDefault)
+{ }
+
+
+bool
+FFmpegThreadPolicy::Policy::IsDefault() const
+{
+    return scheduler == SCHED_OTHER && nice == 0 && cpus.empty() &&
+        numaNode == kNumaDefault;
+}
+
+
+FFmpegThreadPolicy::Scope::Scope(Role role, const std::string& name)
+: role_(role),
+  applied_(true),
+  cpu_(sched_getcpu()),
+  migrations_(0),
+  outer_(currentScope)
+{
+    Policy policy = FFmpegThreadPolicy::GetInstance()->GetPolicy(role);
+    if (!policy.IsDefault()) {
+        applied_ = Apply(role, policy, name);
+        cpu_.store(sched_getcpu(), std::memory_order_relaxed); // moved
+    }
+    currentScope = this;
+    FFmpegStatsRegistry::GetInstance()->Register("thread/" + name, this);
+}
+
+
+FFmpegThreadPolicy::Scope::~Scope()
+{
+    FFmpegStatsRegistry::GetInstance()->Unregister(this);
+    currentScope = outer_;
+}
+
+
+FFmpegThreadPolicy::Stats
+FFmpegThreadPolicy::Scope::GetStats() const
+{
+    Stats stats;
+    stats.role       = role_;
+    stats.applied    = applied_;
+    stats.cpu        = cpu_.load(std::memory_order_relaxed);
+    stats.migrations = migrations_.load(std::memory_order_relaxed);
+    stats.wakeUpUs   = wakeUpUs_.GetSnapshot();
+    return stats;
+}
+
+
+void
+FFmpegThreadPolicy::Scope::ReportStats(FFmpegStatsReport& report)
+{
+    Stats stats = GetStats();
+    report.AddValue("applied",      static_cast<int64_t>(stats.applied));
+    report.AddValue("cpu",          static_cast<int64_t>(stats.cpu));
+    report.AddCounter("migrations", stats.migrations);
+    report.AddHistogram("wakeUpUs", stats.wakeUpUs);
+}
+
+
+FFmpegThreadPolicy*
+FFmpegThreadPolicy::GetInstance()
+{
+    static FFmpegThreadPolicy policy;
+    return &policy;
+}
+
+
+FFmpegThreadPolicy::FFmpegThreadPolicy()
+{
+    const char* path = getenv(kPolicyEnvironment);
+    if (path && *path) LoadFile(path);
+}
+
+
+int32_t
+FFmpegThreadPolicy::LoadFile(const std::string& path)
+{
+    std::ifstream stream(path);
+    if (!stream) {
+        RTC_LOG(LS_ERROR) << "Failed to open thread policy " << path;
+        return -1;
+    }
+    return Load(stream);
+}
+
+
+int32_t
+FFmpegThreadPolicy::Load(std::istream& stream)
+{
+    Policy policies[kRoles];
+    bool read[kRoles] = { false };
+    int role = -1;
+    std::string line;
+    size_t lineNumber = 0;
+
+    // parse everything first, so a bad file leaves the policies untouched
+    while (std::getline(stream, line)) {
+        lineNumber++;
+        line = Trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+
+        if (line[0] == '[') {
+            role = -1;
+            for (int i = 0; i < kRoles; i++)
+                if (line == std::string("[") + kRoleNames[i] + "]") role = i;
+            if (role < 0 || read[role]) {
+                RTC_LOG(LS_ERROR) << "Thread policy line " << lineNumber
+                    << ": unknown or repeated section " << line;
+                return -1;
+            }
+            read[role] = true;
+            continue;
+        }
+
+        size_t equals = line.find('=');
+        if (role < 0 || equals == std::string::npos) {
+            RTC_LOG(LS_ERROR) << "Thread policy line " << lineNumber
+                << ": expected [role] or key = value";
+            return -1;
+        }
+
+        Policy& policy = policies[role];
+        std::string key   = Trim(line.substr(0, equals));
+        std::string value = Trim(line.substr(equals + 1));
+        bool valid = true;
+
+        if (key == "scheduler") {
+            if      (value == "other") policy.scheduler = SCHED_OTHER;
+            else if (value == "fifo")  policy.scheduler = SCHED_FIFO;
+            else if (value == "rr")    policy.scheduler = SCHED_RR;
+            else valid = false;
+        }
+        else if (key == "priority")
+            valid = ParseInt(value, policy.priority) &&
+                policy.priority >= 1 && policy.priority <= 99;
+        else if (key == "nice")
+            valid = ParseInt(value, policy.nice) &&
+                policy.nice >= -20 && policy.nice <= 19;
+        else if (key == "cpus")
+            valid = ParseCpus(value, policy.cpus);
+        else if (key == "numa") {
+            if (value == "local") policy.numaNode = kNumaLocal;
+            else valid = ParseInt(value, policy.numaNode) &&
+                policy.numaNode >= 0 && policy.numaNode < kMaxNumaNodes;
+        }
+        else valid = false;
+
+        if (!valid) {
+            RTC_LOG(LS_ERROR) << "Thread policy line " << lineNumber
+                << ": bad " << key << " \"" << value << "\"";
+            return -1;
+        }
+    }
+
+    int32_t roles = 0;
+    for (int i = 0; i < kRoles; i++) {
+        if (!read[i]) continue;
+        // each is meaningful under one kind of scheduler only
+        const bool realtime = policies[i].scheduler != SCHED_OTHER;
+        if (realtime ? policies[i].priority == 0 || policies[i].nice != 0
+                     : policies[i].priority != 0) {
+            RTC_LOG(LS_ERROR) << "Thread policy [" << kRoleNames[i] << "]: "
+                << "priority goes with fifo or rr, nice with other";
+            return -1;
+        }
+        roles++;
+    }
+
+    webrtc::MutexLock lock(&mutex_);
+    for (int i = 0; i < kRoles; i++)
+        if (read[i]) policies_[i] = policies[i];
+    return roles;
+}
+
+
+void
+FFmpegThreadPolicy::SetPolicy(Role role, const Policy& policy)
+{
+    webrtc::MutexLock lock(&mutex_);
+    policies_[role] = policy;
+}
+
+
+FFmpegThreadPolicy::Policy
+FFmpegThreadPolicy::GetPolicy(Role role) const
+{
+    webrtc::MutexLock lock(&mutex_);
+    return policies_[role];
+}
+
+
+void
+FFmpegThreadPolicy::RecordWakeUp(int64_t lateUs)
+{
+    Scope* scope = currentScope;
+    if (!scope) return;
+    scope->wakeUpUs_.Record(lateUs);
+    // only this thread writes them: no need for an atomic exchange
+    const int cpu  = sched_getcpu();
+    const int last = scope->cpu_.load(std::memory_order_relaxed);
+    if (cpu != last) {
+        scope->cpu_.store(cpu, std::memory_order_relaxed);
+        scope->migrations_.store(
+            scope->migrations_.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+    }
+}
+
+
+const char*
+FFmpegThreadPolicy::RoleName(Role role)
+{ return role < kRoles ? kRoleNames[role] : "unknown"; }
+
+
+bool
+FFmpegThreadPolicy::Apply(
+    Role role,
+    const Policy& policy,
+    const std::string& name)
+{
+    bool applied = true;
+
+    // memory first: whatever the thread allocates once pinned is then on
+    // the node it's pinned to
+    if (policy.numaNode != kNumaDefault) {
+        unsigned long mask = 0;
+        long result;
+        if (policy.numaNode == kNumaLocal)
+            result = syscall(SYS_set_mempolicy, kMpolLocal, NULL, 0);
+        else {
+            mask = 1UL << policy.numaNode;
+            result = syscall(SYS_set_mempolicy, kMpolPreferred, &mask,
+                kMaxNumaNodes + 1);
+        }
+        if (result < 0) {
+            RTC_LOG(LS_WARNING) << "Can't set NUMA policy of " << name
+                << ": " << errno;
+            applied = false;
+        }
+    }
+
+    if (!policy.cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : policy.cpus) CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            RTC_LOG(LS_WARNING) << "Can't pin " << name << " to its CPUs: "
+                << errno;
+            applied = false;
+        }
+    }
+
+    if (policy.scheduler != SCHED_OTHER) {
+        sched_param param;
+        param.sched_priority = policy.priority;
+        int error = pthread_setschedparam(pthread_self(), policy.scheduler,
+            &param);
+        if (error != 0) {
+            RTC_LOG(LS_WARNING) << "Can't schedule " << name
+                << " in real time: " << error;
+            applied = false;
+        }
+    }
+    else if (policy.nice != 0) {
+        // on Linux, a thread id sets that thread's nice level only
+        pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        if (setpriority(PRIO_PROCESS, tid, policy.nice) < 0) {
+            RTC_LOG(LS_WARNING) << "Can't set nice level of " << name
+                << ": " << errno;
+            applied = false;
+        }
+    }
+
+    if (applied)
+        RTC_LOG(LS_INFO) << "Thread " << name << " runs under the "
+            << kRoleNames[role] << " policy";
+    return applied;
+}
+
+
+// "2-3,6"
+bool
+FFmpegThreadPolicy::ParseCpus(const std::string& value, std::vector<int>& cpus)
+{
+    cpus.clear();
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t comma = value.find(',', begin);
+        if (comma == std::string::npos) comma = value.size();
+        std::string range = Trim(value.substr(begin, comma - begin));
+        size_t dash = range.find('-');
+        int first, last;
+        if (dash == std::string::npos) {
+            if (!ParseInt(range, first)) return false;
+            last = first;
+        }
+        else if (!ParseInt(Trim(range.substr(0, dash)), first) ||
+                 !ParseInt(Trim(range.substr(dash + 1)), last))
+            return false;
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        begin = comma + 1;
+    }
+    return !cpus.empty();
+}
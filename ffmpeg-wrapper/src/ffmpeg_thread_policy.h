@@ -0,0 +1,142 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Scheduling, CPU affinity and NUMA policy of the threads we start.
+ */
+
+#ifndef DEMO_FFMPEG_THREAD_POLICY_H_
+#define DEMO_FFMPEG_THREAD_POLICY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "rtc_base/synchronization/mutex.h"
+#include "ffmpeg_histogram.h"
+#include "ffmpeg_stats_registry.h"
+
+
+// Every thread the capture modules, the audio device and their shared
+// machinery start has a role, and each role a policy: the scheduler and
+// priority (SCHED_FIFO or SCHED_RR, or a nice level), the CPUs it may run
+// on, and the NUMA node its memory comes from. Left alone, a role's threads
+// run as any other; a policy applies to the threads started after it's set.
+//
+// The policies come from the file named by the FFMPEG_THREAD_POLICY
+// environment variable, if set, with one section per role:
+//
+//   [reactor]
+//   scheduler = fifo       # other (the default), fifo or rr
+//   priority  = 60         # 1-99, fifo and rr only
+//   cpus      = 2-3        # e.g. isolated with isolcpus=2-7
+//   numa      = local      # or a node number
+//
+//   [delivery]
+//   nice      = -10        # other only
+//   cpus      = 4-7,12
+//
+// "numa = local" allocates a thread's memory on the node of the CPU it
+// runs on, which a pinned thread never leaves; a number, on that node.
+// Frame buffers are created by the threads that first fill them, so they
+// are local to those. Real-time scheduling and negative nice levels need
+// CAP_SYS_NICE or an RLIMIT_RTPRIO; a policy that can't be applied is
+// logged, and the thread runs on as it was.
+//
+// Each thread reports how late it woke up for its deadlines, and how often
+// it woke up on another CPU than the time before, which is what a policy
+// should bring down. See Scope.
+class FFmpegThreadPolicy {
+public:
+    enum Role {
+        kCapture,   // an input's own reader: in-process, shared or warm
+                    // ingests, the test producer
+        kDelivery,  // a capture's scaling, pacing and delivery
+        kReactor,   // pipe reads, and the audio device's 10ms timers
+        kWorker,    // FFmpegWorkerPool's conversions
+        kRoles
+    };
+
+    static const int kNumaDefault = -1; // the process's
+    static const int kNumaLocal   = -2; // the node of the CPU it runs on
+
+    struct Policy {
+        int scheduler;          // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+        int priority;           // SCHED_FIFO and SCHED_RR
+        int nice;               // SCHED_OTHER
+        std::vector<int> cpus;  // empty for any
+        int numaNode;           // or kNumaDefault, kNumaLocal
+
+        Policy();
+        bool IsDefault() const;
+    };
+
+    struct Stats {
+        Role role;
+        bool applied;           // all of the role's policy took
+        int cpu;                // it last woke up on
+        uint64_t migrations;    // woke up on another CPU than the last time
+        // how late it woke up for a deadline: a paced frame, a timer
+        FFmpegLatencyHistogram::Snapshot wakeUpUs;
+    };
+
+    // First thing in a thread's run function: applies |role|'s policy to
+    // the thread, and reports its Stats to FFmpegStatsRegistry as
+    // "thread/<name>" until the thread returns.
+    class Scope : private FFmpegStatsRegistry::Provider {
+    public:
+        Scope(Role role, const std::string& name);
+        ~Scope();
+
+        Stats GetStats() const;
+
+    private:
+        friend class FFmpegThreadPolicy;
+
+        // FFmpegStatsRegistry::Provider
+        void ReportStats(FFmpegStatsReport& report) override;
+
+        const Role role_;
+        bool applied_;
+        std::atomic<int> cpu_;
+        std::atomic<uint64_t> migrations_;
+        FFmpegLatencyHistogram wakeUpUs_;
+        Scope* outer_;  // a run function nested in another's
+    };
+
+    static FFmpegThreadPolicy* GetInstance();
+
+    // Replaces the policies of the roles in |path|; nothing is changed if
+    // the file can't be parsed. Returns the number of roles read, or -1.
+    int32_t LoadFile(const std::string& path);
+    int32_t Load(std::istream& stream);
+
+    void SetPolicy(Role role, const Policy& policy);
+    Policy GetPolicy(Role role) const;
+
+    // On a thread with a Scope: it was due to wake up at a deadline, and
+    // did |lateUs| after it. Does nothing on other threads.
+    static void RecordWakeUp(int64_t lateUs);
+
+    static const char* RoleName(Role role);
+
+private:
+    FFmpegThreadPolicy();
+
+    // false if any of it couldn't be applied
+    static bool Apply(
+        Role role,
+        const Policy& policy,
+        const std::string& name);
+    static bool ParseCpus(const std::string& value, std::vector<int>& cpus);
+
+    mutable webrtc::Mutex mutex_;
+    Policy policies_[kRoles];  // guarded
+};
+
+#endif
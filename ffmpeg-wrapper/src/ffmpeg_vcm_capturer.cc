@@ -12,13 +12,77 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <cstring> // strncpy()
 #include <memory>
 
-#include "modules/video_capture/video_capture_factory.h"
 #include "rtc_base/checks.h"
 #include "rtc_base/logging.h"
 
 #include "examples/peerconnection/client/ffmpeg/ffmpeg_video_factory.h"
+#include "ffmpeg_native_buffer.h"
+#include "ffmpeg_video_capture_module.h"
+
+
+// 1/65536th of the pixels; no sink wants less, and the scale's numerator
+// and denominator stay well within an int64_t
+static const int kMaxAdaptSteps = 16;
+
+
+// Referenced from media/base/video_adapter.cc: the scales VideoAdapter
+// steps through, alternately 3/4 and 2/3 of the previous one. Picking from
+// the same list means the adapter finds nothing left to do.
+static webrtc::VideoCaptureCapability
+AdaptToWants(
+    const webrtc::VideoCaptureCapability& capability,
+    const rtc::VideoSinkWants& wants)
+{
+    webrtc::VideoCaptureCapability adapted = capability;
+    if (wants.max_framerate_fps > 0)
+        adapted.maxFPS = std::min(capability.maxFPS, wants.max_framerate_fps);
+
+    const int64_t inputPixels =
+        static_cast<int64_t>(capability.width) * abs(capability.height);
+    const int64_t maxPixels =
+        std::min<int64_t>(wants.max_pixel_count, inputPixels);
+    const int64_t targetPixels = std::min<int64_t>(
+        wants.target_pixel_count.value_or(wants.max_pixel_count), maxPixels);
+
+    int64_t numerator = 1, denominator = 1;
+    int64_t bestNumerator = 1, bestDenominator = 1;
+    int64_t bestDistance = -1;
+    for (int step = 0; step <= kMaxAdaptSteps; step++) {
+        int64_t pixels =
+            inputPixels * numerator / denominator * numerator / denominator;
+        if (pixels <= maxPixels) {
+            int64_t distance = std::abs(pixels - targetPixels);
+            if (bestDistance >= 0 && distance > bestDistance)
+                break; // only gets further away from here
+            bestDistance    = distance;
+            bestNumerator   = numerator;
+            bestDenominator = denominator;
+            if (pixels <= targetPixels) break;
+        }
+        if (pixels < 1 || step == kMaxAdaptSteps) break;
+        if (step % 2 == 0) { numerator *= 3; denominator *= 4; }
+        else               { numerator *= 2; denominator *= 3; }
+    }
+    if (bestDistance < 0) {
+        // a max_pixel_count of 0 or 1: as small as it goes
+        bestNumerator   = numerator;
+        bestDenominator = denominator;
+    }
+
+    // even sizes for the chroma planes, aligned for the encoder
+    const int alignment = std::max(2, wants.resolution_alignment);
+    int width  = static_cast<int>(
+        capability.width       * bestNumerator / bestDenominator);
+    int height = static_cast<int>(
+        abs(capability.height) * bestNumerator / bestDenominator);
+    adapted.width  = std::max(alignment, width  / alignment * alignment);
+    adapted.height = std::max(alignment, height / alignment * alignment);
+    return adapted;
+}
 
 
 FFmpegVcmCapturer::FFmpegVcmCapturer()
@@ -36,9 +100,12 @@ FFmpegVcmCapturer::Init(
     std::unique_ptr<webrtc::VideoCaptureModule::DeviceInfo> device_info(
         FFmpegVideoFactory::CreateDeviceInfo());
 
+    // |input| names a registered device; otherwise take the first one
     char device_name[256];
     char unique_name[256];
-    if (device_info->GetDeviceName(
+    if (device_info->NumberOfCapabilities(input.c_str()) >= 0)
+        strncpy(unique_name, input.c_str(), sizeof(unique_name) - 1);
+    else if (device_info->GetDeviceName(
         0u,
         device_name, sizeof(device_name),
         unique_name, sizeof(unique_name)) != 0)
@@ -46,17 +113,24 @@ FFmpegVcmCapturer::Init(
         Destroy();
         return false;
     }
+    unique_name[sizeof(unique_name) - 1] = '\0';
 
-    vcm_ = webrtc::VideoCaptureFactory::Create(unique_name);
+    vcm_ = FFmpegVideoFactory::Create(unique_name);
     if (!vcm_) return false;
     vcm_->RegisterCaptureDataCallback(this);
 
     device_info->GetCapability(vcm_->CurrentDeviceName(), 0, capability_);
 
+    // how the camera is mounted
+    webrtc::VideoRotation orientation = webrtc::kVideoRotation_0;
+    device_info->GetOrientation(vcm_->CurrentDeviceName(), orientation);
+    vcm_->SetCaptureRotation(orientation);
+
     capability_.width = static_cast<int32_t>(width);
     capability_.height = static_cast<int32_t>(height);
     capability_.maxFPS = static_cast<int32_t>(target_fps);
     capability_.videoType = webrtc::VideoType::kI420;
+    adapted_ = capability_; // no sinks yet
 
     if (vcm_->StartCapture(capability_) != 0) {
         Destroy();
@@ -101,6 +175,84 @@ FFmpegVcmCapturer::~FFmpegVcmCapturer()
 { Destroy(); }
 
 
+bool
+FFmpegVcmCapturer::SetCaptureFormat(
+    size_t width,
+    size_t height,
+    size_t target_fps)
+{
+    webrtc::MutexLock lock(&formatLock_);
+    if (!vcm_) return false;
+    capability_.width  = static_cast<int32_t>(width);
+    capability_.height = static_cast<int32_t>(height);
+    capability_.maxFPS = static_cast<int32_t>(target_fps);
+    return ApplyCaptureFormat();
+}
+
+
+void
+FFmpegVcmCapturer::AddOrUpdateSink(
+    rtc::VideoSinkInterface<webrtc::VideoFrame>* sink,
+    const rtc::VideoSinkWants& wants)
+{
+    webrtc::test::TestVideoCapturer::AddOrUpdateSink(sink, wants);
+    encodedBroadcaster_.AddOrUpdateSink(sink, wants);
+    webrtc::MutexLock lock(&formatLock_);
+    ApplyCaptureFormat();
+}
+
+
+void
+FFmpegVcmCapturer::RemoveSink(rtc::VideoSinkInterface<webrtc::VideoFrame>* sink)
+{
+    webrtc::test::TestVideoCapturer::RemoveSink(sink);
+    encodedBroadcaster_.RemoveSink(sink);
+    webrtc::MutexLock lock(&formatLock_);
+    ApplyCaptureFormat();
+}
+
+
+bool
+FFmpegVcmCapturer::ApplyCaptureFormat()
+{
+    if (!vcm_) return false;
+
+    // what every sink together still wants; the rotation is left to them
+    // unless one can't take it (no rotation RTP header extension)
+    rtc::VideoSinkWants wants = GetSinkWants();
+    vcm_->SetApplyRotation(wants.rotation_applied);
+
+    // the camera's stream is sent as it is; its encoder adapts to nothing.
+    // FFmpegVideoFactory makes no other kind of module
+    FFmpegVideoCaptureModule* module =
+        static_cast<FFmpegVideoCaptureModule*>(vcm_.get());
+    if (module->GetActiveIngestMode() ==
+            FFmpegVideoCaptureModule::kIngestPassthrough)
+        return true;
+
+    webrtc::VideoCaptureCapability adapted = AdaptToWants(capability_, wants);
+    if (adapted.width  == adapted_.width  &&
+        adapted.height == adapted_.height &&
+        adapted.maxFPS == adapted_.maxFPS)
+        return true;
+
+    // same pixel format, so the module reconfigures in place
+    if (vcm_->StartCapture(adapted) != 0) return false;
+    RTC_LOG(LS_INFO) << "Capturing " << adapted.width << "x" << adapted.height
+        << "@" << adapted.maxFPS << " for the sinks' wants";
+    adapted_ = adapted;
+    return true;
+}
+
+
 void
 FFmpegVcmCapturer::OnFrame(const webrtc::VideoFrame& frame)
-{ webrtc::test::TestVideoCapturer::OnFrame(frame); }
+{
+    // the VideoAdapter would crop, scale or drop it by its size and rate
+    const webrtc::VideoFrameBuffer* buffer = frame.video_frame_buffer().get();
+    if (FFmpegNativeBuffer::Is(buffer, FFmpegNativeBuffer::kNativeEncoded)) {
+        encodedBroadcaster_.OnFrame(frame);
+        return;
+    }
+    webrtc::test::TestVideoCapturer::OnFrame(frame);
+}
@@ -15,13 +15,23 @@
 #include <string>
 
 #include "api/scoped_refptr.h"
+#include "media/base/video_broadcaster.h"
 #include "modules/video_capture/video_capture.h"
+#include "rtc_base/synchronization/mutex.h"
 #include "test/test_video_capturer.h"
 
+// Adapts at the source: the sinks' wants (CPU and bandwidth adaptation's
+// max pixel count and frame rate) are turned into a smaller capture format,
+// so the capture module never scales, converts or delivers frames only to
+// have them scaled down or dropped by the VideoAdapter afterwards.
+// Encoded (passthrough) frames skip the VideoAdapter altogether: they
+// can't be scaled, and dropping one breaks the frames after it.
 class FFmpegVcmCapturer :
     public webrtc::test::TestVideoCapturer,
     public rtc::VideoSinkInterface<webrtc::VideoFrame> {
 public:
+    // |input| is the id of an FFmpegDeviceRegistry device; the first
+    // registered device is used if there is no such device.
     static FFmpegVcmCapturer* Create(
         std::string input,
         size_t width,
@@ -31,6 +41,17 @@ public:
 
     void OnFrame(const webrtc::VideoFrame& frame) override;
 
+    void AddOrUpdateSink(
+        rtc::VideoSinkInterface<webrtc::VideoFrame>* sink,
+        const rtc::VideoSinkWants& wants) override;
+    void RemoveSink(rtc::VideoSinkInterface<webrtc::VideoFrame>* sink) override;
+
+    // Switches the running capture to a new size and frame rate without
+    // restarting ffmpeg; see FFmpegVideoCaptureModule::Reconfigure().
+    // The sinks' wants still apply: this is the most they'll get. A
+    // passthrough capture keeps the camera's size and rate.
+    bool SetCaptureFormat(size_t width, size_t height, size_t target_fps);
+
 private:
     FFmpegVcmCapturer();
     bool Init(
@@ -39,9 +60,13 @@ private:
         size_t height,
         size_t target_fps);
     void Destroy();
+    bool ApplyCaptureFormat();
 
     rtc::scoped_refptr<webrtc::VideoCaptureModule> vcm_;
-    webrtc::VideoCaptureCapability capability_;
+    webrtc::Mutex formatLock_;
+    webrtc::VideoCaptureCapability capability_; // as asked for
+    webrtc::VideoCaptureCapability adapted_;    // ... within the sinks' wants
+    rtc::VideoBroadcaster encodedBroadcaster_;  // the same sinks, unadapted
 };
 
 #endif  // TEST_VCM_CAPTURER_H_
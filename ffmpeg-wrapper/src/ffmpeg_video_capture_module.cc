@@ -9,12 +9,17 @@
  */
 
 #include "ffmpeg_video_capture_module.h"
+#include "ffmpeg_av_ingest.h"
+#include "ffmpeg_thread_policy.h"
 
-#include <unistd.h> // usleep()
+#include <cstdlib> // std::abs()
+#include <utility> // std::swap()
 #include <vector>
 #include <sstream>
 
 #include "api/video/i420_buffer.h"
+#include "api/video/nv12_buffer.h"
+#include "common_video/include/video_frame_buffer.h"
 #include "rtc_base/logging.h"
 #include "rtc_base/time_utils.h"
 #include "system_wrappers/include/clock.h"
@@ -22,20 +27,111 @@
 #include "third_party/libyuv/include/libyuv.h"
 
 
+// The buffer pool is sized to cover this much video in flight between the
+// capture thread and the encoder, within a fixed memory budget.
+static const int    kBufferPoolLatencyMs  = 300;
+static const size_t kBufferPoolMaxBytes   = 64 * 1024 * 1024;
+// Frames queued between the reader and the delivery thread. The pool must
+// hold more than this or a full queue would starve the reader.
+static const size_t kFrameRingCapacity    = 4;
+static const size_t kBufferPoolMinBuffers = kFrameRingCapacity + 2;
+
+// How long the delivery thread parks before re-checking for a stop
+static const int    kDeliveryWaitMs       = 100;
+// A device "producer" that stands for FFmpegShmTestProducer
+static const char   kShmTestProducer[]    = "test";
+
+
+static size_t
+BufferPoolSizeFor(const webrtc::VideoCaptureCapability& capability,
+    size_t simulcastLayers)
+{
+    // RGB24 is converted, everything else is pooled as it comes in
+    webrtc::VideoType pooledType =
+        capability.videoType == webrtc::VideoType::kARGB ?
+            webrtc::VideoType::kARGB : webrtc::VideoType::kI420;
+
+    // every frame in flight takes a buffer per layer, each a quarter of
+    // the one before
+    size_t frameSize = 0;
+    for (size_t i = 0; i < simulcastLayers; i++)
+        frameSize += webrtc::CalcBufferSize(pooledType,
+            capability.width >> i, abs(capability.height) >> i);
+    size_t frames = capability.maxFPS * kBufferPoolLatencyMs / 1000;
+    if (frameSize > 0 && frames * frameSize > kBufferPoolMaxBytes)
+        frames = kBufferPoolMaxBytes / frameSize;
+    if (frames < kBufferPoolMinBuffers) frames = kBufferPoolMinBuffers;
+    return frames * simulcastLayers;
+}
+
+
 FFmpegVideoCaptureModule::FFmpegVideoCaptureModule(std::string deviceId)
+: pipePaused_(false),
+  simulcastScaler_(&bufferPool_),
+  frameConverter_(FFmpegWorkerPool::GetShared()),
+  frameRing_(kFrameRingCapacity),
+  stopEvent_(true /* manual reset */, false),
+  captureDone_(true /* manual reset */, false),
+  lastPaceErrorUs_(0),
+  maxPaceErrorUs_(0),
+  firstFrameUs_(-1),
+  framesRead_(0),
+  keyFrameRequests_(0),
+  framesZeroCopy_(0),
+  framesCopied_(0),
+  framesDropped_(0),
+  shortReads_(0),
+  bytesIngested_(0),
+  sourceSkewPpm_(0),
+  rotation_(webrtc::kVideoRotation_0),
+  applyRotation_(false),
+  framesDelivered_(0),
+  framesDecimated_(0),
+  formatSwitches_(0),
+  lastSwitchLatencyUs_(0),
+  maxSwitchLatencyUs_(0)
 {
+    dataCallback_     = nullptr;
+    cacheFrame_       = 0;
+    cacheLoops_       = 0;
     deviceId_         = deviceId;
+    ingestMode_       = kIngestLibav;
+    ingestModeSet_    = false;
+    activeIngestMode_ = kIngestLibav;
     deviceFd_         = NULL;
     captureStarted_   = false;
+    warmStart_        = false;
+    startUs_          = 0;
+    pipeFrameSize_    = 0;
+    avBytesRead_      = 0;
+    lastDeliveredUs_  = -1;
+    overflowPolicy_    = FrameRing::kBlock;
+    overflowPolicySet_ = false;
+    simulcastLayers_   = 1;
+    simulcastLayersSet_ = false;
+    realtime_          = false;
+    realtimeSet_       = false;
+    loop_              = false;
+    loopSet_           = false;
+    shared_            = true;
+    sharedSet_         = false;
+    pacing_            = false;
+    looping_           = false;
 
     currentCapability_.width     = 0;
     currentCapability_.height    = 0;
     currentCapability_.maxFPS    = 0;
     currentCapability_.videoType = webrtc::VideoType::kUnknown;
+    sourceCapability_            = currentCapability_;
+    deliveredGeneration_         = 0;
+    SetOutputFormat(currentCapability_, -1);
+
+    FFmpegStatsRegistry::GetInstance()->Register("video/" + deviceId_, this);
 }
 
 FFmpegVideoCaptureModule::~FFmpegVideoCaptureModule()
 {
+    FFmpegStatsRegistry::GetInstance()->Unregister(this);
     StopCapture();
     if (deviceFd_ != NULL) {
         fflush(deviceFd_);
@@ -50,7 +146,8 @@ FFmpegVideoCaptureModule::RegisterCaptureDataCallback(
     rtc::VideoSinkInterface<webrtc::VideoFrame>* dataCallback)
 {
     // rtc::CritScope cs(&captureCriticalSection_);
-    webrtc::MutexLock lock(&mutex_);
+    webrtc::MutexLock lock(&callbackMutex_);
+    sinks_.Replace(dataCallback_, dataCallback);
     dataCallback_ = dataCallback;
 }
 
@@ -59,11 +156,24 @@ void
 FFmpegVideoCaptureModule::DeRegisterCaptureDataCallback()
 {
     // rtc::CritScope cs(&captureCriticalSection_);
-    webrtc::MutexLock lock(&mutex_);
+    webrtc::MutexLock lock(&callbackMutex_);
+    if (dataCallback_) sinks_.Remove(dataCallback_);
     dataCallback_ = nullptr;
 }
 
 
+bool
+FFmpegVideoCaptureModule::AddSink(
+    rtc::VideoSinkInterface<webrtc::VideoFrame>* sink)
+{ return sinks_.Add(sink); }
+
+
+bool
+FFmpegVideoCaptureModule::RemoveSink(
+    rtc::VideoSinkInterface<webrtc::VideoFrame>* sink)
+{ return sinks_.Remove(sink); }
+
+
 webrtc::VideoCaptureModule::DeviceInfo*
 FFmpegVideoCaptureModule::CreateDeviceInfo()
 { return new FFmpegVideoDeviceInfo(); }
@@ -73,30 +183,317 @@ int32_t
 FFmpegVideoCaptureModule::StartCapture(
     const webrtc::VideoCaptureCapability& capability)
 {
-    // referenced from video_capture_linux.cc
+    const int64_t startUs = FFmpegCaptureClock::GetInstance()->TimeMicros();
+
+    // referenced from video_capture_linux.cc, except that a new size or
+    // frame rate doesn't cost an ffmpeg restart and a decoder warm-up
     if (captureStarted_) {
-        if (capability.width     == currentCapability_.width  &&
-            capability.height    == currentCapability_.height &&
-            capability.videoType == currentCapability_.videoType)
-            return 0;
-        else StopCapture();
+        if (Reconfigure(capability) == 0) return 0;
+        // the camera's stream would come back the same
+        if (GetActiveIngestMode() == kIngestPassthrough) return -1;
+        StopCapture();
     }
 
     // rtc::CritScope cs(&captureCriticalSection_);
     webrtc::MutexLock lock(&mutex_);
 
-    // 1. open [named?] pipe
-    frameCount_        = 0;
+    // picks up the device's current url and options; a running capture
+    // keeps the entry it was started with
+    device_ = FFmpegDeviceRegistry::GetInstance()->Find(deviceId_);
+    if (!device_) {
+        RTC_LOG(LS_ERROR) << "No ffmpeg device with id " << deviceId_;
+        return -1;
+    }
+
+    // the delivery thread is stopped, so the scaler can be changed
+    size_t layers = simulcastLayersSet_ ?
+        simulcastLayers_ : device_->simulcastLayers;
+    if (layers != simulcastScaler_.GetLayers())
+        bufferPool_.ReleaseUnused();
+    simulcastScaler_.SetLayers(layers);
+
+    // drop buffers sized for the previous capability
+    if (capability.width  != currentCapability_.width ||
+        capability.height != currentCapability_.height)
+        bufferPool_.ReleaseUnused();
+
+    startUs_           = startUs;
+    firstFrameUs_      = -1;
+    framesRead_        = 0;
+    keyFrameRequests_  = 0;
+    framesZeroCopy_    = 0;
+    framesCopied_      = 0;
+    framesDropped_     = 0;
+    shortReads_        = 0;
+    bytesIngested_     = 0;
+    lastDeliveredUs_   = -1;
+    readUs_.Reset();
+    convertUs_.Reset();
+    deliverUs_.Reset();
+    jitterUs_.Reset();
+    framesDelivered_   = 0;
+    framesDecimated_   = 0;
+    formatSwitches_    = 0;
+    lastSwitchLatencyUs_ = 0;
+    maxSwitchLatencyUs_  = 0;
+    lastPaceErrorUs_     = 0;
+    maxPaceErrorUs_      = 0;
+    timestampEstimator_.Reset();
+    currentCapability_ = capability;
+    sourceCapability_  = capability;
+    bufferPool_.SetMaxBuffers(BufferPoolSize());
+
+    // the delivery thread is stopped
+    SetOutputFormat(capability, -1);
+    deliveredGeneration_ = 0;
+    outputDecimator_.Reset();
+    pacing_  = realtimeSet_ ? realtime_ : device_->realtime;
+    looping_ = loopSet_ ? loop_ : device_->loop;
+    pacer_.Reset();
+    stopEvent_.Reset();
+
+    IngestMode mode = ingestMode_;
+    if (!ingestModeSet_ && device_->pipe) mode = kIngestPipe;
+    if (!ingestModeSet_ && device_->passthrough) mode = kIngestPassthrough;
+    if (!ingestModeSet_ && !device_->producer.empty())
+        mode = kIngestSharedMemory;
+    if (!ingestModeSet_ && !device_->cache.empty())
+        mode = kIngestFrameCache;
+
+    // a file (a cached clip is one) can wait for the encoder, and a paced
+    // source for its frames' deadlines; a live source (a producer is one)
+    // can't wait for us, unless dropping a frame would corrupt the rest of
+    // its GOP
+    const bool live = mode == kIngestSharedMemory ||
+        (mode != kIngestFrameCache &&
+         device_->url.find("://") != std::string::npos);
+    const FrameRing::OverflowPolicy overflowPolicy = overflowPolicySet_ ?
+        overflowPolicy_ : mode == kIngestPassthrough || pacing_ || !live ?
+            FrameRing::kBlock : FrameRing::kDropOldest;
+    frameRing_.SetOverflowPolicy(overflowPolicy);
+    frameRing_.Reset();
+
+    // one decode for every capture of the device, unless this one would
+    // read it differently
+    const bool shared = mode == kIngestLibav &&
+        (sharedSet_ ? shared_ : device_->shared) &&
+        pacing_ == device_->realtime && looping_ == device_->loop &&
+        FFmpegSharedIngest::IsShareable(*device_);
+
+    // 1. pass the input through, decode it in-process, or read an ffmpeg
+    //    pipe; the pool may have an ingest open already
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> warmFrame;
+    int64_t warmPtsUs = -1;
+    std::unique_ptr<FFmpegAVIngest> avIngest;
+    std::shared_ptr<FFmpegSharedIngest> sharedIngest;
+    bool warmStart = false;
+    if (mode == kIngestPassthrough)
+        avIngest = FFmpegIngestPool::GetInstance()->Acquire(
+            device_, true, warmFrame, warmPtsUs);
+
+    if (mode == kIngestPassthrough && !avIngest) {
+        avIngest.reset(new FFmpegAVIngest());
+        avIngest->SetLoop(looping_);
+        if (avIngest->Open(device_->url, device_->options,
+                capability, true) != 0) {
+            RTC_LOG(LS_WARNING) << "Passthrough failed; decoding instead.";
+            avIngest.reset();
+            mode = kIngestLibav;
+        }
+    }
+
+    // decoded once, by whichever capture of the clip came first; the
+    // others, and later ones, map what it wrote
+    if (mode == kIngestFrameCache) {
+        frameCache_ = FFmpegFrameCache::Open(*device_, device_->cache,
+            capability);
+        if (!frameCache_) {
+            RTC_LOG(LS_WARNING) << "Frame cache failed; decoding instead.";
+            mode = kIngestLibav;
+        }
+        cacheFrame_ = 0;
+        cacheLoops_ = 0;
+    }
+
+    // frames can come as soon as we're subscribed, ready to be queued:
+    // already paced, and never waiting for room
+    if (shared) {
+        pacing_ = false;
+        frameRing_.SetOverflowPolicy(FrameRing::kDropOldest);
+        sharedIngest = FFmpegSharedIngest::Subscribe(
+            device_, capability, this, warmStart);
+        // an input that can't be read in-process is a configuration
+        // error, not something to quietly read some other way
+        if (!sharedIngest) {
+            RTC_LOG(LS_ERROR) << "Can't open " << device_->url
+                << " in-process; set \"pipe = 1\" on device "
+                << device_->id << " to read it through ffmpeg.";
+            return -1;
+        }
+    }
+    else if (mode == kIngestLibav)
+        avIngest = FFmpegIngestPool::GetInstance()->Acquire(
+            device_, false, warmFrame, warmPtsUs);
+
+    if (!sharedIngest) warmStart = avIngest != nullptr;
+    if (avIngest) {
+        avIngest->SetLoop(looping_);
+        avIngest->SetOutputFormat(
+            capability.width, capability.height, capability.maxFPS);
+    }
+    else if (mode == kIngestLibav && !sharedIngest) {
+        avIngest.reset(new FFmpegAVIngest());
+        avIngest->SetLoop(looping_);
+        if (avIngest->Open(device_->url, device_->options, capability) != 0) {
+            RTC_LOG(LS_ERROR) << "Can't open " << device_->url
+                << " in-process; set \"pipe = 1\" on device "
+                << device_->id << " to read it through ffmpeg.";
+            return -1;
+        }
+    }
+    {
+        webrtc::MutexLock ingestLock(&ingestMutex_);
+        avIngest_     = std::move(avIngest);
+        sharedIngest_ = sharedIngest;
+        warmStart_    = warmStart;
+    }
+
+    if (mode == kIngestSharedMemory) {
+        if (StartSharedMemory(capability) != 0) return -1;
+    }
+    else if (!avIngest_ && !sharedIngest_ && !frameCache_ &&
+        StartPipe(capability) != 0)
+        return -1;
+
+    activeIngestMode_ = mode;
+
+    // 2. start the reader: a thread of its own for the in-process ingest
+    //    and the frame cache, the shared reactor for the pipe and the
+    //    ring; a shared ingest has its own
+    pipeFrame_  = nullptr;
+    pipePaused_ = false;
+    // a warm ingest's bytes so far went into the pool's reads, not ours
+    avBytesRead_ = avIngest_ ? avIngest_->BytesRead() : 0;
+    if (!avIngest_ && !sharedIngest_ && !frameCache_ &&
+        !FFmpegIngestReactor::GetInstance()->AddSource(this,
+            shmRing_ ? shmRing_->FilledFd() : fileno(deviceFd_))) {
+        if (shmRing_) StopSharedMemory();
+        else {
+            pclose(deviceFd_);
+            deviceFd_ = NULL;
+        }
+        return -1;
+    }
+
+    // the picture a warm live ingest decoded last goes out right away;
+    // it's at most a frame interval old
+    if (warmFrame) {
+        framesZeroCopy_.fetch_add(1, std::memory_order_relaxed);
+        QueueFrame(warmFrame, warmPtsUs);
+    }
+
+    captureStarted_ = true;
+    if ((avIngest_ || frameCache_) && !captureThread_) {
+        captureDone_.Reset();
+        captureThread_.reset(new rtc::PlatformThread(
+            FFmpegVideoCaptureModule::CaptureThread, this, "CaptureThread"));
+        captureThread_->Start();
+    }
+
+    // 3. and the delivery thread
+    if (!deliveryThread_) {
+        deliveryThread_.reset(new rtc::PlatformThread(
+            FFmpegVideoCaptureModule::DeliveryThread, this, "DeliveryThread"));
+        deliveryThread_->Start();
+    }
+
+    return 0;
+}
+
+
+int32_t
+FFmpegVideoCaptureModule::Reconfigure(
+    const webrtc::VideoCaptureCapability& capability)
+{
+    const int64_t requestedUs = FFmpegCaptureClock::GetInstance()->TimeMicros();
+    webrtc::MutexLock lock(&mutex_);
+    if (!captureStarted_ ||
+        capability.videoType != currentCapability_.videoType)
+        return -1;
+
+    if (capability.width  == currentCapability_.width  &&
+        capability.height == currentCapability_.height &&
+        capability.maxFPS == currentCapability_.maxFPS)
+        return 0;
+    if (activeIngestMode_ == kIngestPassthrough) {
+        RTC_LOG(LS_WARNING) << "Passthrough capture of " << deviceId_
+            << " can't change to " << capability.width << "x"
+            << capability.height << "@" << capability.maxFPS;
+        return -1;
+    }
+
     currentCapability_ = capability;
+    bufferPool_.SetMaxBuffers(BufferPoolSize());
+    // scale from the decoded picture rather than from an older output
+    if (avIngest_)
+        avIngest_->SetOutputFormat(
+            capability.width, capability.height, capability.maxFPS);
+    SetOutputFormat(capability, requestedUs);
+    formatSwitches_.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+
+void
+FFmpegVideoCaptureModule::SetOutputFormat(
+    const webrtc::VideoCaptureCapability& capability,
+    int64_t requestedUs)
+{
+    webrtc::MutexLock lock(&formatMutex_);
+    outputFormat_.width       = capability.width;
+    outputFormat_.height      = abs(capability.height);
+    outputFormat_.maxFPS      = capability.maxFPS;
+    outputFormat_.generation  = requestedUs < 0 ? 0 : outputFormat_.generation + 1;
+    outputFormat_.requestedUs = requestedUs;
+}
+
+
+size_t
+FFmpegVideoCaptureModule::BufferPoolSize()
+{
+    // buffers the frames are read into, and if they're scaled on the way
+    // out (ffmpeg pipe only) those they're scaled into
+    size_t layers = simulcastScaler_.GetLayers();
+    if (avIngest_ || sharedIngest_ || frameCache_ ||
+        (currentCapability_.width  == sourceCapability_.width &&
+         currentCapability_.height == sourceCapability_.height))
+        return BufferPoolSizeFor(currentCapability_, layers);
+    return BufferPoolSizeFor(sourceCapability_, 1) +
+        BufferPoolSizeFor(currentCapability_, layers);
+}
+
+
+int32_t
+FFmpegVideoCaptureModule::StartPipe(
+    const webrtc::VideoCaptureCapability& capability)
+{
     std::string pixelFormat;
 
     {
-        auto area = currentCapability_.width * currentCapability_.height;
+        auto area = capability.width * capability.height;
         switch (capability.videoType) {
+        // read straight into pooled frame buffers, see NextFrame()
         case webrtc::VideoType::kI420:
-            rawFrameBuffer_.resize(area * 3 / 2);
             pixelFormat = "yuv420p";
             break;
+        case webrtc::VideoType::kNV12:
+        case webrtc::VideoType::kNV21:
+            // there's no NV21 buffer type; have ffmpeg swap the chroma
+            pixelFormat = "nv12";
+            break;
+        case webrtc::VideoType::kARGB:
+            pixelFormat = "bgra"; // libyuv's ARGB byte order
+            break;
         case webrtc::VideoType::kRGB24:
             rawFrameBuffer_.resize(area * 3);
             pixelFormat = "rgb24";
@@ -107,44 +504,127 @@ FFmpegVideoCaptureModule::StartCapture(
         }
     }
 
+    if (pixelFormat != "rgb24") {
+        rawFrameBuffer_.clear();
+        rawFrameBuffer_.shrink_to_fit();
+    }
+
     std::ostringstream command;
-    command << "/usr/local/bin/ffmpeg";
-    // command << " -rtsp_transport tcp";
-    command << " -i video.h264";
+    command << FFmpegDeviceRegistry::FFmpegBinary();
+    for (auto& option : device_->options)
+        command << " -" << option.first << " " << option.second;
+    // no "-re": realtime pacing happens on our side of the pipe
+    if (looping_) command << " -stream_loop -1";
+    command << " -i " << device_->url;
     command << " -f image2pipe -c:v rawvideo -pix_fmt " << pixelFormat;
     command << " -r " << capability.maxFPS; // frames will be dropped if in-fps exceeds out-fps
     command << " -s " << capability.width << "x" << capability.height; // output size
     command << " -"; // pipe
     deviceFd_ = popen(command.str().c_str(), "r");
+    if (deviceFd_ == NULL) {
+        RTC_LOG(LS_ERROR) << "Failed to start ffmpeg.";
+        return -1;
+    }
 
-    // 2. start capture thread;
-    if (!captureThread_) {
-        captureThread_.reset(new rtc::PlatformThread(
-            FFmpegVideoCaptureModule::CaptureThread, this, "CaptureThread"));
-        captureThread_->Start();
-        // captureThread_->SetPriority(rtc::kHighPriority);
+    return 0;
+}
+
+
+int32_t
+FFmpegVideoCaptureModule::StartSharedMemory(
+    const webrtc::VideoCaptureCapability& capability)
+{
+    // a slot for every frame the pool would have had in flight
+    const size_t slots = std::min(BufferPoolSizeFor(capability, 1),
+        FFmpegShmRing::kMaxSlots);
+    shmRing_ = FFmpegShmRing::Create(capability.videoType,
+        capability.width, abs(capability.height), slots);
+    if (!shmRing_) return -1;
+
+    bool started;
+    if (device_->producer == kShmTestProducer) {
+        shmTestProducer_.reset(
+            new FFmpegShmTestProducer(shmRing_, capability.maxFPS));
+        started = shmTestProducer_->Start();
     }
+    else
+        started = shmProducer_.Start(device_->producer, *shmRing_);
 
-    captureStarted_ = true;
+    if (!started) {
+        StopSharedMemory();
+        return -1;
+    }
     return 0;
 }
 
 
+void
+FFmpegVideoCaptureModule::StopSharedMemory()
+{
+    if (!shmRing_) return;
+    shmRing_->Close(); // wakes a producer waiting for a slot
+    if (shmTestProducer_) {
+        shmTestProducer_->Stop();
+        shmTestProducer_.reset();
+    }
+    shmProducer_.Stop();
+    // the mapping stays until the sinks let go of the last slot
+    shmRing_.reset();
+}
+
+
 int32_t
 FFmpegVideoCaptureModule::StopCapture()
 {
+    // unblocks a reader waiting for room and the idle delivery thread,
+    // and one waiting for a paced frame's deadline
+    frameRing_.Close();
+    stopEvent_.Set();
+
+    // waits for a frame being handled on a reactor thread, or handed to
+    // us by the shared ingest
+    FFmpegIngestReactor::GetInstance()->RemoveSource(this);
+    if (sharedIngest_) sharedIngest_->Unsubscribe(this);
     if (captureThread_) {
+        // a read blocked on a stalled source (a network input, a pipe
+        // nobody writes to) would hold the join up for good
+        if (avIngest_ &&
+            !captureDone_.Wait(FFmpegAVIngest::kAbortGraceMs)) {
+            RTC_LOG(LS_WARNING) << "Aborting the read from "
+                << device_->url;
+            avIngest_->Abort();
+        }
         captureThread_->Stop();
         captureThread_.reset();
     }
+    if (deliveryThread_) {
+        deliveryThread_->Stop();
+        deliveryThread_.reset();
+    }
 
     // rtc::CritScope cs(&captureCriticalSection_);
     webrtc::MutexLock lock(&mutex_);
     if (captureStarted_) {
         captureStarted_ = false;
-        fflush(deviceFd_);
-        pclose(deviceFd_);
-        deviceFd_ = NULL;
+        frameRing_.Reset(); // hands queued buffers back to the pool
+        pipeFrame_ = nullptr;
+        std::unique_ptr<FFmpegAVIngest> avIngest;
+        std::shared_ptr<FFmpegSharedIngest> sharedIngest;
+        {
+            webrtc::MutexLock ingestLock(&ingestMutex_);
+            avIngest     = std::move(avIngest_);
+            sharedIngest = std::move(sharedIngest_);
+        }
+        // kept open for the next capture if the device is warm
+        FFmpegIngestPool::GetInstance()->Release(device_, std::move(avIngest));
+        sharedIngest.reset(); // the last subscriber out closed it
+        frameCache_.reset();   // mapped while the sinks hold its frames
+        StopSharedMemory();
+        if (deviceFd_ != NULL) {
+            fflush(deviceFd_);
+            pclose(deviceFd_);
+            deviceFd_ = NULL;
+        }
     }
 
     return 0;
@@ -169,50 +649,176 @@ FFmpegVideoCaptureModule::CaptureSettings(webrtc::VideoCaptureCapability& settin
 }
 
 
+// Both take effect from the next frame read; frames already queued keep
+// the rotation they were captured with.
 int32_t
-FFmpegVideoCaptureModule::SetCaptureRotation(webrtc::VideoRotation /* rotation */)
-{ return -1; }
+FFmpegVideoCaptureModule::SetCaptureRotation(webrtc::VideoRotation rotation)
+{
+    rotation_.store(rotation, std::memory_order_relaxed);
+    return 0;
+}
 
 
 bool
-FFmpegVideoCaptureModule::SetApplyRotation(bool /* enable */)
-{ return true; }
+FFmpegVideoCaptureModule::SetApplyRotation(bool enable)
+{
+    applyRotation_.store(enable, std::memory_order_relaxed);
+    return true;
+}
 
 
 bool
 FFmpegVideoCaptureModule::GetApplyRotation()
-{ return false; }
+{ return applyRotation_.load(std::memory_order_relaxed); }
 
 
-std::vector<FFmpegVideoCaptureModule::DeviceMeta>*
-FFmpegVideoCaptureModule::GetDevices()
+void
+FFmpegVideoCaptureModule::SetIngestMode(IngestMode mode)
 {
-    static bool loaded = false;
-    static std::vector<DeviceMeta> devices;
-    if (!loaded) {
-        DeviceMeta device0;
-        device0.name        = std::string("ffmpeg-0");     // arbitrary (name)
-        device0.id          = std::string("F3E977DB27F1"); // random (id)
-        device0.product     = std::string("A0A0860E9BDC"); // random (product id)
-        device0.orientation = webrtc::VideoRotation::kVideoRotation_0;
-        {
-            webrtc::VideoCaptureCapability capability;
-            capability.width      = 640;
-            capability.height     = 480;
-            capability.maxFPS     = 30;
-            capability.interlaced = false;
-            capability.videoType  = webrtc::VideoType::kI420;
-            device0.capabilities.push_back(capability);
-            capability.videoType  = webrtc::VideoType::kRGB24;
-            device0.capabilities.push_back(capability);
-            // kNV12 ("nv12")
-            // kNV21 ("nv21")
-            // kARGB ("argb")
-        }
-        devices.push_back(device0);
-        loaded = true;
-    }
-    return &devices;
+    webrtc::MutexLock lock(&mutex_);
+    ingestMode_    = mode;
+    ingestModeSet_ = true;
+}
+
+
+FFmpegVideoCaptureModule::IngestMode
+FFmpegVideoCaptureModule::GetIngestMode()
+{ return ingestMode_; }
+
+
+FFmpegVideoCaptureModule::IngestMode
+FFmpegVideoCaptureModule::GetActiveIngestMode()
+{
+    webrtc::MutexLock lock(&mutex_);
+    return captureStarted_ ? activeIngestMode_ : ingestMode_;
+}
+
+
+FFmpegFrameBufferPool::Stats
+FFmpegVideoCaptureModule::GetBufferPoolStats()
+{ return bufferPool_.GetStats(); }
+
+
+void
+FFmpegVideoCaptureModule::SetOverflowPolicy(FrameRing::OverflowPolicy policy)
+{
+    webrtc::MutexLock lock(&mutex_);
+    overflowPolicy_    = policy;
+    overflowPolicySet_ = true;
+    // a shared ingest's subscribers never hold it up
+    if (!sharedIngest_) frameRing_.SetOverflowPolicy(policy);
+}
+
+
+void
+FFmpegVideoCaptureModule::SetRealtime(bool realtime)
+{
+    webrtc::MutexLock lock(&mutex_);
+    realtime_    = realtime;
+    realtimeSet_ = true;
+}
+
+
+void
+FFmpegVideoCaptureModule::SetLoop(bool loop)
+{
+    webrtc::MutexLock lock(&mutex_);
+    loop_    = loop;
+    loopSet_ = true;
+}
+
+
+void
+FFmpegVideoCaptureModule::SetSharedIngest(bool shared)
+{
+    webrtc::MutexLock lock(&mutex_);
+    shared_    = shared;
+    sharedSet_ = true;
+}
+
+
+void
+FFmpegVideoCaptureModule::SetSimulcastLayers(size_t layers)
+{
+    webrtc::MutexLock lock(&mutex_);
+    simulcastLayers_    = layers;
+    simulcastLayersSet_ = true;
+}
+
+
+void
+FFmpegVideoCaptureModule::SetKeyFrameRequestHandler(
+    KeyFrameRequestHandler handler)
+{
+    webrtc::MutexLock lock(&callbackMutex_);
+    keyFrameRequestHandler_ = handler;
+}
+
+
+FFmpegVideoCaptureModule::PipelineStats
+FFmpegVideoCaptureModule::GetPipelineStats()
+{
+    PipelineStats stats;
+    stats.queue           = frameRing_.GetStats();
+    stats.framesRead      = framesRead_.load(std::memory_order_relaxed);
+    stats.framesDelivered = framesDelivered_.load(std::memory_order_relaxed);
+    stats.framesDecimated = framesDecimated_.load(std::memory_order_relaxed);
+    stats.formatSwitches  = formatSwitches_.load(std::memory_order_relaxed);
+    stats.lastSwitchLatencyUs =
+        lastSwitchLatencyUs_.load(std::memory_order_relaxed);
+    stats.maxSwitchLatencyUs =
+        maxSwitchLatencyUs_.load(std::memory_order_relaxed);
+    stats.keyFrameRequests = keyFrameRequests_.load(std::memory_order_relaxed);
+    stats.sourceSkewPpm   = sourceSkewPpm_.load(std::memory_order_relaxed);
+    stats.lastPaceErrorUs = lastPaceErrorUs_.load(std::memory_order_relaxed);
+    stats.maxPaceErrorUs  = maxPaceErrorUs_.load(std::memory_order_relaxed);
+    // not mutex_: StartCapture() holds it while it subscribes to a shared
+    // ingest, which registers with the stats registry
+    webrtc::MutexLock lock(&ingestMutex_);
+    stats.loops = avIngest_ ? avIngest_->Loops() :
+        sharedIngest_ ? sharedIngest_->GetStats().loops :
+        cacheLoops_.load(std::memory_order_relaxed);
+    stats.framesZeroCopy = framesZeroCopy_.load(std::memory_order_relaxed);
+    stats.framesCopied   = framesCopied_.load(std::memory_order_relaxed);
+    stats.warmStart      = warmStart_;
+    stats.sharedIngest   = sharedIngest_ != nullptr;
+    stats.firstFrameUs   = firstFrameUs_.load(std::memory_order_relaxed);
+    stats.framesDropped  = stats.queue.dropped +
+        framesDropped_.load(std::memory_order_relaxed);
+    stats.shortReads     = shortReads_.load(std::memory_order_relaxed);
+    stats.bytesIngested  = bytesIngested_.load(std::memory_order_relaxed);
+    FFmpegSinkList<Sink>::Stats sinks = sinks_.GetStats();
+    stats.sinks          = sinks.sinks;
+    stats.maxSinkRemoveUs = sinks.maxRemoveUs;
+    stats.readUs         = readUs_.GetSnapshot();
+    stats.convertUs      = convertUs_.GetSnapshot();
+    stats.deliverUs      = deliverUs_.GetSnapshot();
+    stats.jitterUs       = jitterUs_.GetSnapshot();
+    return stats;
+}
+
+
+void
+FFmpegVideoCaptureModule::ReportStats(FFmpegStatsReport& report)
+{
+    PipelineStats stats = GetPipelineStats();
+    report.AddCounter("framesRead",      stats.framesRead);
+    report.AddCounter("framesDelivered", stats.framesDelivered);
+    report.AddCounter("framesDropped",   stats.framesDropped);
+    report.AddCounter("framesDecimated", stats.framesDecimated);
+    report.AddCounter("shortReads",      stats.shortReads);
+    report.AddCounter("bytesIngested",   stats.bytesIngested);
+    report.AddCounter("queueDepth",      stats.queue.depth);
+    report.AddCounter("queueHighWater",  stats.queue.highWater);
+    report.AddCounter("sinks",           stats.sinks);
+    report.AddValue("firstFrameUs",      stats.firstFrameUs);
+    report.AddValue("maxSinkRemoveUs",   stats.maxSinkRemoveUs);
+    report.AddValue("maxPaceErrorUs",    stats.maxPaceErrorUs);
+    report.AddValue("sourceSkewPpm",     stats.sourceSkewPpm);
+    report.AddHistogram("readUs",        stats.readUs);
+    report.AddHistogram("convertUs",     stats.convertUs);
+    report.AddHistogram("deliverUs",     stats.deliverUs);
+    report.AddHistogram("jitterUs",      stats.jitterUs);
 }
 
 
@@ -224,32 +830,304 @@ FFmpegVideoCaptureModule::CaptureThread(void* object)
 // taken from video_capture_linux.cc
 {
     FFmpegVideoCaptureModule* module = static_cast<FFmpegVideoCaptureModule*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kCapture,
+        "capture/" + module->deviceId_);
     while (module->CaptureProcess()) { }
+    // end of input: let the delivery thread drain what's left
+    module->frameRing_.Close();
+    module->captureDone_.Set();
+}
+
+
+void
+FFmpegVideoCaptureModule::DeliveryThread(void* object)
+{
+    FFmpegVideoCaptureModule* module = static_cast<FFmpegVideoCaptureModule*>(object);
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kDelivery,
+        "delivery/" + module->deviceId_);
+    while (module->DeliveryProcess()) { }
 }
 
 
 bool
 FFmpegVideoCaptureModule::CaptureProcess()
 {
-    // rtc::CritScope cs(&captureCriticalSection_);
-    webrtc::MutexLock lock(&mutex_);
+    // No lock: StopCapture() joins this thread before touching the input,
+    // and blocking reads must not hold up (de)registration or delivery.
+    if (frameCache_) return ReadCachedFrame();
 
-    // do one-cycle's worth of work
-    if (captureStarted_) {
-        // Read a frame from the input pipe into the buffer
-        size_t count = fread(&rawFrameBuffer_[0], 1,
-            rawFrameBuffer_.size(), deviceFd_);
+    // Decoded pictures are delivered as-is, no copies
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+    int64_t ptsUs;
+    FFmpegCaptureClock* clock = FFmpegCaptureClock::GetInstance();
+    const int64_t readStartUs = clock->TimeMicros();
+    if (avIngest_->ReadFrame(buffer, ptsUs) != 0) return false;
+    readUs_.Record(clock->TimeMicros() - readStartUs);
+    const uint64_t bytesRead = avIngest_->BytesRead();
+    bytesIngested_.fetch_add(bytesRead - avBytesRead_,
+        std::memory_order_relaxed);
+    avBytesRead_ = bytesRead;
+    framesZeroCopy_.fetch_add(1, std::memory_order_relaxed);
+    QueueFrame(buffer, ptsUs);
 
-        // If we didn't get a frame, we're probably at the end
-        if (count != rawFrameBuffer_.size()) return false;
+    // the encoders hold back delta frames until the next keyframe;
+    // give the source a chance to send one early
+    if (avIngest_->IsPassthrough() && avIngest_->TakeKeyFrameRequest()) {
+        keyFrameRequests_.fetch_add(1, std::memory_order_relaxed);
+        webrtc::MutexLock lock(&callbackMutex_);
+        if (keyFrameRequestHandler_) keyFrameRequestHandler_(deviceId_);
+    }
 
-        CheckI420AndPush((unsigned char*)&rawFrameBuffer_[0],
-            rawFrameBuffer_.size(), currentCapability_);
+    return !frameRing_.IsClosed();
+}
+
+
+// Nothing to read or decode: the frame is where the cache's mapping has
+// it. Blocks only for room in the queue, which paced delivery makes at the
+// capability's frame rate.
+bool
+FFmpegVideoCaptureModule::ReadCachedFrame()
+{
+    const size_t frames = frameCache_->Frames();
+    const size_t index  = static_cast<size_t>(cacheFrame_ % frames);
+    if (cacheFrame_ > 0 && index == 0) {
+        if (!looping_) return false;
+        cacheLoops_.fetch_add(1, std::memory_order_relaxed);
     }
-    // else do nothing - thread may close soon
 
-    usleep(0);
-    return true;
+    // timestamps carry on across loops, at the rate the clip was
+    // decimated to when it was cached
+    const int fps = frameCache_->FrameRate();
+    const int64_t ptsUs = fps > 0 ?
+        static_cast<int64_t>(cacheFrame_ * rtc::kNumMicrosecsPerSec / fps) : -1;
+    cacheFrame_++;
+    bytesIngested_.fetch_add(frameCache_->FrameSize(),
+        std::memory_order_relaxed);
+    framesZeroCopy_.fetch_add(1, std::memory_order_relaxed);
+    QueueFrame(frameCache_->Frame(index), ptsUs);
+    return !frameRing_.IsClosed();
+}
+
+
+bool
+FFmpegVideoCaptureModule::DeliveryProcess()
+{
+    CapturedFrame frame;
+    if (frameRing_.Pop(frame, kDeliveryWaitMs)) {
+        // there's room for the pipe's next frame now
+        if (pipePaused_.exchange(false))
+            FFmpegIngestReactor::GetInstance()->Resume(this);
+        DeliverFrame(frame);
+        return true;
+    }
+    // closed and drained
+    return !(frameRing_.IsClosed() && frameRing_.Depth() == 0);
+}
+
+
+// kNative covers encoded and simulcast buffers too; only an ARGB one may
+// be cast to FFmpegARGBBuffer
+static bool
+IsARGB(const webrtc::VideoFrameBuffer& buffer)
+{ return FFmpegNativeBuffer::Is(&buffer, FFmpegNativeBuffer::kNativeARGB); }
+
+
+// Pooled buffers aren't padded, so their planes lie back to back exactly
+// as ffmpeg writes them to the pipe; returns nullptr if |buffer| is laid
+// out any other way.
+static uint8_t*
+RawFrameData(const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer)
+{
+    const int width  = buffer->width();
+    const int height = buffer->height();
+    switch (buffer->type()) {
+    case webrtc::VideoFrameBuffer::Type::kI420: {
+        webrtc::I420Buffer* i420 = static_cast<webrtc::I420Buffer*>(buffer.get());
+        const int chromaHeight = i420->ChromaHeight();
+        if (i420->StrideY() != width ||
+            i420->StrideU() != i420->ChromaWidth() ||
+            i420->StrideV() != i420->ChromaWidth() ||
+            i420->DataU() != i420->DataY() + width * height ||
+            i420->DataV() != i420->DataU() + i420->StrideU() * chromaHeight)
+            return nullptr;
+        return i420->MutableDataY();
+    }
+    case webrtc::VideoFrameBuffer::Type::kNV12: {
+        webrtc::NV12Buffer* nv12 = static_cast<webrtc::NV12Buffer*>(buffer.get());
+        if (nv12->StrideY() != width ||
+            nv12->StrideUV() != nv12->ChromaWidth() * 2 ||
+            nv12->DataUV() != nv12->DataY() + width * height)
+            return nullptr;
+        return nv12->MutableDataY();
+    }
+    default: {
+        if (!IsARGB(*buffer)) return nullptr;
+        FFmpegARGBBuffer* argb = static_cast<FFmpegARGBBuffer*>(buffer.get());
+        return argb->Stride() == width * 4 ? argb->MutableData() : nullptr;
+    }
+    }
+}
+
+
+uint8_t*
+FFmpegVideoCaptureModule::NextFrame(size_t& size)
+{
+    // one read of the semaphore per published slot
+    if (shmRing_) {
+        size = sizeof(shmSignal_);
+        return reinterpret_cast<uint8_t*>(&shmSignal_);
+    }
+
+    const int width  = sourceCapability_.width;
+    const int height = abs(sourceCapability_.height);
+    size = webrtc::CalcBufferSize(sourceCapability_.videoType, width, height);
+    pipeFrameSize_ = size;
+
+    // ffmpeg's yuv420p, nv12 and bgra output already is a frame buffer's
+    // layout: read it in place, no conversion
+    switch (sourceCapability_.videoType) {
+    case webrtc::VideoType::kI420:
+        pipeFrame_ = bufferPool_.CreateI420Buffer(width, height);
+        break;
+    case webrtc::VideoType::kNV12:
+    case webrtc::VideoType::kNV21:
+        pipeFrame_ = bufferPool_.CreateNV12Buffer(width, height);
+        break;
+    case webrtc::VideoType::kARGB:
+        pipeFrame_ = bufferPool_.CreateARGBBuffer(width, height);
+        break;
+    default:
+        pipeFrame_ = nullptr;
+        break;
+    }
+    uint8_t* data = pipeFrame_ ? RawFrameData(pipeFrame_) : nullptr;
+    if (data) return data;
+
+    // RGB24 is converted; so is anything the pool had no buffer for,
+    // which CheckI420AndPush() then drops
+    pipeFrame_ = nullptr;
+    rawFrameBuffer_.resize(size);
+    return &rawFrameBuffer_[0];
+}
+
+
+bool
+FFmpegVideoCaptureModule::OnFrame()
+{
+    if (!shmRing_)
+        bytesIngested_.fetch_add(pipeFrameSize_, std::memory_order_relaxed);
+
+    if (shmRing_)
+        TakeSharedMemoryFrame();
+    else if (pipeFrame_) {
+        framesCopied_.fetch_add(1, std::memory_order_relaxed);
+        QueueFrame(pipeFrame_, PipePtsUs());
+        pipeFrame_ = nullptr;
+    }
+    else {
+        framesCopied_.fetch_add(1, std::memory_order_relaxed);
+        CheckI420AndPush(&rawFrameBuffer_[0], rawFrameBuffer_.size(),
+            sourceCapability_, PipePtsUs());
+    }
+
+    // a reactor thread can't wait for room like the in-process reader
+    // does: stop reading instead, and let the pipe push back on ffmpeg
+    if (frameRing_.GetOverflowPolicy() != FrameRing::kBlock ||
+        frameRing_.Depth() < frameRing_.Capacity())
+        return true;
+    pipePaused_ = true;
+    // unless the delivery thread made room before it could see the flag
+    return frameRing_.Depth() < frameRing_.Capacity() &&
+        pipePaused_.exchange(false);
+}
+
+
+void
+FFmpegVideoCaptureModule::TakeSharedMemoryFrame()
+{
+    size_t index;
+    int64_t ptsUs;
+    if (!shmRing_->TakeSlot(index, ptsUs)) {
+        RTC_LOG(LS_ERROR) << "Frame producer signalled an empty slot";
+        return;
+    }
+
+    const uint8_t* data = shmRing_->SlotData(index);
+    bytesIngested_.fetch_add(shmRing_->FrameSize(), std::memory_order_relaxed);
+    if (shmRing_->Type() != webrtc::VideoType::kI420) {
+        // no buffer type to wrap it as: converted, and the slot handed
+        // straight back
+        framesCopied_.fetch_add(1, std::memory_order_relaxed);
+        CheckI420AndPush(const_cast<uint8_t*>(data), shmRing_->FrameSize(),
+            sourceCapability_, ptsUs);
+        shmRing_->ReleaseSlot(index);
+        return;
+    }
+
+    // the slot is the frame; it's the producer's again once the last
+    // sink drops the buffer, even after the capture has stopped
+    const int width        = shmRing_->Width();
+    const int height       = shmRing_->Height();
+    const int chromaWidth  = (width  + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+    const uint8_t* dataU = data  + width * height;
+    const uint8_t* dataV = dataU + chromaWidth * chromaHeight;
+    std::shared_ptr<FFmpegShmRing> ring = shmRing_;
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer =
+        webrtc::WrapI420Buffer(width, height,
+            data,  width,
+            dataU, chromaWidth,
+            dataV, chromaWidth,
+            [ring, index]() { ring->ReleaseSlot(index); });
+    framesZeroCopy_.fetch_add(1, std::memory_order_relaxed);
+    QueueFrame(buffer, ptsUs);
+}
+
+
+void
+FFmpegVideoCaptureModule::OnClosed()
+{
+    // end of input: let the delivery thread drain what's left
+    frameRing_.Close();
+}
+
+
+void
+FFmpegVideoCaptureModule::OnFrameRead(int64_t readUs)
+{
+    // the ring's signal says nothing about how long a frame took
+    if (!shmRing_) readUs_.Record(readUs);
+}
+
+
+void
+FFmpegVideoCaptureModule::OnShortRead(size_t filled, size_t size)
+{
+    RTC_LOG(LS_WARNING) << "Input ended " << filled << " bytes into a "
+        << size << "-byte frame";
+    shortReads_.fetch_add(1, std::memory_order_relaxed);
+    bytesIngested_.fetch_add(filled, std::memory_order_relaxed);
+}
+
+
+void
+FFmpegVideoCaptureModule::OnSharedFrame(
+    const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    int64_t ptsUs,
+    int64_t readUs)
+{
+    // the same buffer every other subscriber gets; it's only ever read
+    if (readUs >= 0) readUs_.Record(readUs);
+    framesZeroCopy_.fetch_add(1, std::memory_order_relaxed);
+    QueueFrame(buffer, ptsUs);
+}
+
+
+void
+FFmpegVideoCaptureModule::OnSharedEnd()
+{
+    // end of input: let the delivery thread drain what's left
+    frameRing_.Close();
 }
 
 
@@ -257,7 +1135,7 @@ int32_t FFmpegVideoCaptureModule::CheckI420AndPush(
     uint8_t* videoFrame,
     size_t videoFrameLength,
     const webrtc::VideoCaptureCapability& frameInfo,
-    int64_t captureTime)
+    int64_t ptsUs)
 {
     const int32_t width = frameInfo.width;
     const int32_t height = frameInfo.height;
@@ -269,24 +1147,37 @@ int32_t FFmpegVideoCaptureModule::CheckI420AndPush(
         return -1;
     }
 
-    int stride_y      = width;
-    int stride_uv     = (width + 1) / 2;
     int target_width  = width;
     int target_height = abs(height);
 
-    rtc::scoped_refptr<webrtc::I420Buffer> buffer = webrtc::I420Buffer::Create(
-        target_width, target_height, stride_y, stride_uv, stride_uv);
+    // rotated as it's converted, rather than in a pass of its own
+    const webrtc::VideoRotation rotation =
+        rotation_.load(std::memory_order_relaxed);
+    const bool applyRotation = applyRotation_.load(std::memory_order_relaxed);
+    if (applyRotation && (rotation == webrtc::kVideoRotation_90 ||
+        rotation == webrtc::kVideoRotation_270)) {
+        target_width  = abs(height);
+        target_height = width;
+    }
 
-    const int conversionResult = libyuv::ConvertToI420(
-        videoFrame, videoFrameLength,
-        buffer.get()->MutableDataY(), buffer.get()->StrideY(),
-        buffer.get()->MutableDataU(), buffer.get()->StrideU(),
-        buffer.get()->MutableDataV(), buffer.get()->StrideV(),
-        0, 0,  // No Cropping
+    // recycled once the last sink lets go of it
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        bufferPool_.CreateI420Buffer(target_width, target_height);
+    if (!buffer) {
+        // every buffer is still with the sinks
+        framesDropped_.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+
+    // in bands, on the shared worker pool
+    FFmpegCaptureClock* clock = FFmpegCaptureClock::GetInstance();
+    const int64_t convertStartUs = clock->TimeMicros();
+    const int conversionResult = frameConverter_.ConvertToI420(
+        videoFrame, videoFrameLength, frameInfo.videoType,
         width, height,
-        target_width, target_height,
-        libyuv::kRotate0,
-        ConvertVideoType(frameInfo.videoType));
+        applyRotation ?
+            static_cast<libyuv::RotationMode>(rotation) : libyuv::kRotate0,
+        buffer.get());
 
     if (conversionResult < 0) {
         RTC_LOG(LS_ERROR) << "Failed to convert capture frame from type "
@@ -294,13 +1185,279 @@ int32_t FFmpegVideoCaptureModule::CheckI420AndPush(
         return -1;
     }
 
-    webrtc::VideoFrame captureFrame(buffer, 0, rtc::TimeMillis(),
-        webrtc::VideoRotation::kVideoRotation_0);
-    captureFrame.set_ntp_time_ms(captureTime);
+    QueueFrame(buffer, ptsUs, rotation, applyRotation,
+        clock->TimeMicros() - convertStartUs);
+    return 0;
+}
 
-    frameCount_++;
-    if (dataCallback_)
-        dataCallback_->OnFrame(captureFrame);
 
-    return 0;
+int64_t
+FFmpegVideoCaptureModule::PipePtsUs()
+{
+    // "-r" makes ffmpeg's raw output constant frame rate, so the frame
+    // number is as good as a presentation time
+    if (sourceCapability_.maxFPS <= 0) return -1;
+    return framesRead_.load(std::memory_order_relaxed) *
+        rtc::kNumMicrosecsPerSec / sourceCapability_.maxFPS;
+}
+
+
+void
+FFmpegVideoCaptureModule::QueueFrame(
+    const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    int64_t ptsUs)
+{ QueueFrame(buffer, ptsUs, rotation_.load(std::memory_order_relaxed), false); }
+
+
+void
+FFmpegVideoCaptureModule::QueueFrame(
+    const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    int64_t ptsUs,
+    webrtc::VideoRotation rotation,
+    bool rotationApplied,
+    int64_t convertUs)
+{
+    // stamped here, so time spent in the queue doesn't skew it; the
+    // estimator strips the pipe's jitter and tracks the source's drift
+    CapturedFrame frame;
+    frame.buffer          = buffer;
+    frame.ptsUs           = ptsUs;
+    frame.rotation        = rotation;
+    frame.rotationApplied = rotationApplied;
+    frame.convertUs       = convertUs;
+    frame.captureTimeUs   = -1; // paced frames are stamped on delivery
+    if (!pacing_) {
+        frame.captureTimeUs = timestampEstimator_.ToLocalTime(ptsUs,
+            FFmpegCaptureClock::GetInstance()->TimeMicros());
+        sourceSkewPpm_.store(timestampEstimator_.SkewPpm(),
+            std::memory_order_relaxed);
+    }
+
+    framesRead_.fetch_add(1, std::memory_order_relaxed);
+    frameRing_.Push(std::move(frame));
+}
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegVideoCaptureModule::ScaleTo(
+    const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    int width,
+    int height)
+{
+    if (width <= 0 || height <= 0 ||
+        (buffer->width() == width && buffer->height() == height))
+        return buffer;
+
+    switch (buffer->type()) {
+    case webrtc::VideoFrameBuffer::Type::kNV12: {
+        rtc::scoped_refptr<webrtc::NV12Buffer> scaled =
+            bufferPool_.CreateNV12Buffer(width, height);
+        if (!scaled) return nullptr;
+        scaled->CropAndScaleFrom(*buffer->GetNV12(), 0, 0,
+            buffer->width(), buffer->height());
+        return scaled;
+    }
+    case webrtc::VideoFrameBuffer::Type::kNative: {
+        if (!IsARGB(*buffer)) break;
+        const FFmpegARGBBuffer* source =
+            static_cast<const FFmpegARGBBuffer*>(buffer.get());
+        rtc::scoped_refptr<FFmpegARGBBuffer> scaled =
+            bufferPool_.CreateARGBBuffer(width, height);
+        if (!scaled) return nullptr;
+        libyuv::ARGBScale(
+            source->Data(), source->Stride(),
+            source->width(), source->height(),
+            scaled->MutableData(), scaled->Stride(), width, height,
+            libyuv::kFilterBox);
+        return scaled;
+    }
+    default:
+        break;
+    }
+
+    // an encoded buffer has no pixels to give
+    rtc::scoped_refptr<webrtc::I420BufferInterface> source = buffer->ToI420();
+    if (!source) return nullptr;
+    rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+        bufferPool_.CreateI420Buffer(width, height);
+    if (!scaled) return nullptr;
+    scaled->ScaleFrom(*source);
+    return scaled;
+}
+
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+FFmpegVideoCaptureModule::Rotate(
+    const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+    webrtc::VideoRotation rotation)
+{
+    if (rotation == webrtc::kVideoRotation_0) return buffer;
+
+    const bool transpose = rotation == webrtc::kVideoRotation_90 ||
+        rotation == webrtc::kVideoRotation_270;
+    const int width  = transpose ? buffer->height() : buffer->width();
+    const int height = transpose ? buffer->width()  : buffer->height();
+    const libyuv::RotationMode mode =
+        static_cast<libyuv::RotationMode>(rotation);
+
+    switch (buffer->type()) {
+    case webrtc::VideoFrameBuffer::Type::kNV12: {
+        // the encoders would convert it to I420 anyway; do both in one go
+        const webrtc::NV12BufferInterface* source = buffer->GetNV12();
+        rtc::scoped_refptr<webrtc::I420Buffer> rotated =
+            bufferPool_.CreateI420Buffer(width, height);
+        if (!rotated) return nullptr;
+        libyuv::NV12ToI420Rotate(
+            source->DataY(), source->StrideY(),
+            source->DataUV(), source->StrideUV(),
+            rotated->MutableDataY(), rotated->StrideY(),
+            rotated->MutableDataU(), rotated->StrideU(),
+            rotated->MutableDataV(), rotated->StrideV(),
+            source->width(), source->height(), mode);
+        return rotated;
+    }
+    case webrtc::VideoFrameBuffer::Type::kNative: {
+        if (!IsARGB(*buffer)) break;
+        const FFmpegARGBBuffer* source =
+            static_cast<const FFmpegARGBBuffer*>(buffer.get());
+        rtc::scoped_refptr<FFmpegARGBBuffer> rotated =
+            bufferPool_.CreateARGBBuffer(width, height);
+        if (!rotated) return nullptr;
+        libyuv::ARGBRotate(
+            source->Data(), source->Stride(),
+            rotated->MutableData(), rotated->Stride(),
+            source->width(), source->height(), mode);
+        return rotated;
+    }
+    default:
+        break;
+    }
+
+    // an encoded buffer has no pixels to give
+    rtc::scoped_refptr<webrtc::I420BufferInterface> source = buffer->ToI420();
+    if (!source) return nullptr;
+    rtc::scoped_refptr<webrtc::I420Buffer> rotated =
+        bufferPool_.CreateI420Buffer(width, height);
+    if (!rotated) return nullptr;
+    libyuv::I420Rotate(
+        source->DataY(), source->StrideY(),
+        source->DataU(), source->StrideU(),
+        source->DataV(), source->StrideV(),
+        rotated->MutableDataY(), rotated->StrideY(),
+        rotated->MutableDataU(), rotated->StrideU(),
+        rotated->MutableDataV(), rotated->StrideV(),
+        source->width(), source->height(), mode);
+    return rotated;
+}
+
+
+void
+FFmpegVideoCaptureModule::DeliverFrame(const CapturedFrame& frame)
+{
+    FFmpegCaptureClock* clock = FFmpegCaptureClock::GetInstance();
+    OutputFormat format;
+    {
+        webrtc::MutexLock lock(&formatMutex_);
+        format = outputFormat_;
+    }
+
+    // Reconfigure() takes effect here, so frames already queued come out
+    // in the new format too; encoded frames can be neither dropped nor
+    // scaled. Scaling happens here rather than in the reader, which has
+    // to keep up with the source.
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer = frame.buffer;
+    webrtc::VideoRotation rotation = frame.rotation; // left to the sinks
+
+    // a paced frame is due, and stamped, at its deadline
+    int64_t captureTimeUs = frame.captureTimeUs;
+    if (pacing_) {
+        pacer_.SetFrameRate(format.maxFPS);
+        captureTimeUs = pacer_.Deadline(frame.ptsUs, clock->TimeMicros());
+    }
+
+    if (!FFmpegNativeBuffer::Is(
+            buffer.get(), FFmpegNativeBuffer::kNativeEncoded)) {
+        outputDecimator_.SetMaxFps(format.maxFPS);
+        if (!outputDecimator_.Accept(captureTimeUs)) {
+            framesDecimated_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        const int64_t convertStartUs = clock->TimeMicros();
+
+        // the output format is in the source's orientation
+        int width  = format.width;
+        int height = format.height;
+        if (frame.rotationApplied &&
+            (rotation == webrtc::kVideoRotation_90 ||
+             rotation == webrtc::kVideoRotation_270))
+            std::swap(width, height);
+        buffer = ScaleTo(buffer, width, height);
+
+        // rotated after scaling, so there are fewer pixels to move
+        if (frame.rotationApplied)
+            rotation = webrtc::kVideoRotation_0;
+        else if (buffer && applyRotation_.load(std::memory_order_relaxed)) {
+            buffer = Rotate(buffer, rotation);
+            rotation = webrtc::kVideoRotation_0;
+        }
+
+        // a no-op without simulcast layers
+        if (buffer) buffer = simulcastScaler_.Scale(buffer);
+        if (!buffer) {
+            // every buffer is still with the sinks
+            framesDropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        convertUs_.Record(frame.convertUs + clock->TimeMicros() - convertStartUs);
+    }
+
+    // scaled ahead of time, so only the wake-up is late
+    if (pacing_) {
+        if (!clock->WaitUntil(captureTimeUs, stopEvent_)) return; // stopping
+        int64_t errorUs = clock->TimeMicros() - captureTimeUs;
+        lastPaceErrorUs_.store(errorUs, std::memory_order_relaxed);
+        if (errorUs > maxPaceErrorUs_.load(std::memory_order_relaxed))
+            maxPaceErrorUs_.store(errorUs, std::memory_order_relaxed);
+    }
+
+    webrtc::VideoFrame captureFrame = webrtc::VideoFrame::Builder()
+        .set_video_frame_buffer(buffer)
+        .set_timestamp_us(captureTimeUs)
+        .set_ntp_time_ms(clock->NtpMs(captureTimeUs))
+        .set_rotation(rotation)
+        .build();
+
+    // the first frame out in a new format ends the switch
+    if (format.generation != deliveredGeneration_) {
+        deliveredGeneration_ = format.generation;
+        int64_t latencyUs = clock->TimeMicros() - format.requestedUs;
+        lastSwitchLatencyUs_.store(latencyUs, std::memory_order_relaxed);
+        if (latencyUs > maxSwitchLatencyUs_.load(std::memory_order_relaxed))
+            maxSwitchLatencyUs_.store(latencyUs, std::memory_order_relaxed);
+        RTC_LOG(LS_INFO) << "Switched to " << format.width << "x"
+            << format.height << "@" << format.maxFPS << " in "
+            << latencyUs << " us";
+    }
+
+    const int64_t nowUs = clock->TimeMicros();
+    if (lastDeliveredUs_ >= 0 && format.maxFPS > 0)
+        jitterUs_.Record(std::abs(nowUs - lastDeliveredUs_ -
+            rtc::kNumMicrosecsPerSec / format.maxFPS));
+    lastDeliveredUs_ = nowUs;
+
+    if (framesDelivered_.load(std::memory_order_relaxed) == 0) {
+        int64_t firstFrameUs = nowUs - startUs_;
+        firstFrameUs_.store(firstFrameUs, std::memory_order_relaxed);
+        FFmpegIngestPool::GetInstance()->ReportFirstFrame(
+            warmStart_, firstFrameUs);
+        RTC_LOG(LS_INFO) << "First frame out " << firstFrameUs << " us after "
+            << (warmStart_ ? "a warm" : "a cold") << " start";
+    }
+
+    // no lock: sinks are added and removed without waiting for a frame to
+    // go out, and frames without waiting for them
+    framesDelivered_.fetch_add(1, std::memory_order_relaxed);
+    if (sinks_.ForEach([&](Sink* sink) { sink->OnFrame(captureFrame); }) > 0)
+        deliverUs_.Record(clock->TimeMicros() - nowUs);
 }
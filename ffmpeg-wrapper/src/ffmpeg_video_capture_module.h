@@ -11,32 +11,101 @@
 #ifndef DEMO_FFMPEG_VIDEO_CAPTURE_MODULE_H_
 #define DEMO_FFMPEG_VIDEO_CAPTURE_MODULE_H_
 
+#include <atomic>
 #include <cstdio> // FILE, popen(), pclose(), fread(), fflush()
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 // #include "rtc_base/criticalsection.h"
+#include "rtc_base/event.h"
 #include "rtc_base/synchronization/mutex.h"
 #include "rtc_base/platform_thread.h"
 #include "modules/video_capture/video_capture.h"
-
-
-class FFmpegVideoCaptureModule : public webrtc::VideoCaptureModule {
+#include "ffmpeg_capture_clock.h"
+#include "ffmpeg_device_registry.h"
+#include "ffmpeg_frame_cache.h"
+#include "ffmpeg_frame_converter.h"
+#include "ffmpeg_frame_ring.h"
+#include "ffmpeg_frame_buffer_pool.h"
+#include "ffmpeg_histogram.h"
+#include "ffmpeg_ingest_pool.h"
+#include "ffmpeg_ingest_reactor.h"
+#include "ffmpeg_shared_ingest.h"
+#include "ffmpeg_shm_ring.h"
+#include "ffmpeg_sink_list.h"
+#include "ffmpeg_simulcast_scaler.h"
+#include "ffmpeg_stats_registry.h"
+
+class FFmpegAVIngest;
+
+
+// The in-process ingest reads on a thread of its own (libavformat's reads
+// block), or for live and paced devices subscribes to the device's
+// FFmpegSharedIngest, which decodes once for every capture of it; the
+// ffmpeg pipe and the shared memory ring are read by the shared
+// FFmpegIngestReactor. All hand frames to a delivery thread that scales,
+// paces and delivers them.
+//
+// Frames go to every sink added, the registered callback among them,
+// through an FFmpegSinkList: delivery takes no lock, and sinks come and go
+// while frames flow.
+//
+// Every module reports its PipelineStats to FFmpegStatsRegistry as
+// "video/<device id>".
+class FFmpegVideoCaptureModule :
+    public webrtc::VideoCaptureModule,
+    private FFmpegIngestReactor::Source,
+    private FFmpegSharedIngest::Subscriber,
+    private FFmpegStatsRegistry::Provider {
 public:
+    enum IngestMode {
+        kIngestLibav,      // demux and decode in-process (default)
+        kIngestPipe,       // popen() an ffmpeg child and read raw frames
+        kIngestPassthrough, // demux only; emit H.264 access units as-is
+        kIngestSharedMemory, // the device's producer fills an FFmpegShmRing
+        kIngestFrameCache  // play the clip decoded once into an FFmpegFrameCache
+    };
+
     FFmpegVideoCaptureModule(std::string deviceId);
     ~FFmpegVideoCaptureModule();
 
     static DeviceInfo* CreateDeviceInfo();
 
     //   Register capture data callback
+    // It's one of the sinks: registering another replaces it, in a single
+    // update, and sinks added with AddSink() stay.
     void RegisterCaptureDataCallback(
         rtc::VideoSinkInterface<webrtc::VideoFrame>* dataCallback);
 
     //  Remove capture data callback
     void DeRegisterCaptureDataCallback();
 
-    // Start capture device
+    // Delivers frames to |sink| too, from the next one on: monitoring
+    // taps, recorders, more encoders. Every sink gets the same frame, so
+    // none may write to its buffer. Returns false if it's there already.
+    bool AddSink(rtc::VideoSinkInterface<webrtc::VideoFrame>* sink);
+
+    // Once it returns, |sink| isn't being called and won't be again; it
+    // waits for at most the frame being delivered. Not from within a
+    // sink's OnFrame(). Returns false if |sink| wasn't added.
+    bool RemoveSink(rtc::VideoSinkInterface<webrtc::VideoFrame>* sink);
+
+    // Start capture device. On a running device, a new size or frame rate
+    // in the same pixel format is applied with Reconfigure(); anything else
+    // restarts the input.
     int32_t StartCapture(const webrtc::VideoCaptureCapability& capability);
 
+    // Changes the size and frame rate of a running capture without
+    // restarting the input: frames are rescaled and re-paced on their way
+    // to the sinks, from the next one delivered on. The in-process ingest
+    // also rescales from the decoded picture; the ffmpeg pipe keeps its
+    // size and rate, so frames can't come faster than it was started at.
+    // Returns -1 if nothing is running or the pixel format differs, and
+    // for any change to a passthrough capture, whose access units can't be
+    // rescaled or re-paced; StartCapture() doesn't restart one for it.
+    int32_t Reconfigure(const webrtc::VideoCaptureCapability& capability);
+
     int32_t StopCapture();
 
     // Returns the name of the device used by this module.
@@ -58,45 +127,300 @@ public:
     // the rotation is applied and the generated frame is up right. When set to
     // false, generated frames will carry the rotation information from
     // SetCaptureRotation. Return value indicates whether this operation succeeds.
+    //
+    // Applied rotations cost no extra pass over the pixels where a pass is
+    // made anyway: the pipe's RGB24 frames rotate as they're converted, NV12
+    // frames as they're converted to I420. I420 and ARGB frames take one
+    // rotating copy, after any scaling. Passthrough frames always carry it.
+    // Off by default, as in VideoCaptureImpl.
     bool SetApplyRotation(bool enable);
 
     // Return whether the rotation is applied or left pending.
     bool GetApplyRotation();
 
-private:
-    struct DeviceMeta {
-        std::string name;
-        std::string id;
-        std::string product;
-        webrtc::VideoRotation orientation;
-        std::vector<webrtc::VideoCaptureCapability> capabilities;
+    // Selects how frames are ingested. Takes effect on the next
+    // StartCapture(). kIngestPassthrough falls back to kIngestLibav when the
+    // input isn't H.264; StartCapture() fails if kIngestLibav can't open
+    // the input (see FFmpegDeviceConfig::pipe). Defaults to kIngestPipe for
+    // a "pipe" device, to the device's "passthrough" setting, to
+    // kIngestSharedMemory for a device with a "producer", or to
+    // kIngestFrameCache for one with a "cache" directory.
+    //
+    // kIngestSharedMemory starts the producer with a ring of frame slots
+    // in the capture format and wraps each I420 slot as a frame buffer,
+    // without copying it; other formats are converted out of the slot.
+    //
+    // kIngestFrameCache decodes the clip only if no capture has cached it
+    // at this size and frame rate yet, in this process or another; then
+    // every frame is a view into the file's mapping, at the capability's
+    // frame rate. Falls back to kIngestLibav if it can't be cached.
+    //
+    // Passthrough frames carry FFmpegEncodedFrameBuffers; the peer
+    // connection needs an FFmpegPassthroughVideoEncoderFactory to send them.
+    void SetIngestMode(IngestMode mode);
+    IngestMode GetIngestMode();
+
+    // The mode the running capture ended up with, after the fallbacks
+    // above, or GetIngestMode() if nothing is running. A shared ingest is
+    // kIngestLibav.
+    IngestMode GetActiveIngestMode();
+
+    // Counters of the pool the pipe reader draws its frame buffers from.
+    FFmpegFrameBufferPool::Stats GetBufferPoolStats();
+
+    struct CapturedFrame {
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+        int64_t ptsUs;         // the source's, -1 if unknown
+        int64_t captureTimeUs; // on FFmpegCaptureClock; paced: on delivery
+        webrtc::VideoRotation rotation; // as of capture
+        bool rotationApplied;  // |buffer| is upright already
+        int64_t convertUs;     // spent converting it on the reader side
+    };
+    typedef FFmpegFrameRing<CapturedFrame> FrameRing;
+
+    // What the reader thread does when the delivery thread falls behind.
+    // Defaults to kBlock for local files and kDropOldest for anything else.
+    void SetOverflowPolicy(FrameRing::OverflowPolicy policy);
+
+    // Number of simulcast layers to scale each frame into: the frame
+    // itself, then 1/2, 1/4 of its size. Takes effect on the next
+    // StartCapture(); defaults to the device's "layers" setting.
+    //
+    // Layered frames carry FFmpegSimulcastFrameBuffers; the peer connection
+    // needs an FFmpegSimulcastVideoEncoderFactory to use the layers rather
+    // than scale the full frame again.
+    void SetSimulcastLayers(size_t layers);
+
+    // Releases frames to the sinks in real time, on absolute deadlines
+    // derived from their presentation times (or the frame rate, if they
+    // have none), instead of as fast as they're read. For files and VOD,
+    // which would otherwise arrive in bursts; paced frames are stamped
+    // with their deadlines. The reader runs at most a few frames ahead.
+    // Takes effect on the next StartCapture(); defaults to the device's
+    // "realtime" setting.
+    void SetRealtime(bool realtime);
+
+    // Starts the input over when it ends, with no gap in the frames'
+    // timestamps. Takes effect on the next StartCapture(); defaults to
+    // the device's "loop" setting.
+    void SetLoop(bool loop);
+
+    // Subscribes to the device's FFmpegSharedIngest rather than opening an
+    // in-process ingest of its own, if the device is live or paced and this
+    // capture doesn't loop or pace it differently. A subscriber's queue
+    // always drops its oldest frame when full, whatever the overflow
+    // policy: it can't hold up the others. Takes effect on the next
+    // StartCapture(); defaults to the device's "shared" setting.
+    void SetSharedIngest(bool shared);
+
+    // Called on the reader thread when a passthrough encoder needs a
+    // keyframe, e.g. to have the camera send an IDR through its own API.
+    // Until one arrives, the encoders hold back delta frames.
+    typedef std::function<void(const std::string& deviceId)>
+        KeyFrameRequestHandler;
+    void SetKeyFrameRequestHandler(KeyFrameRequestHandler handler);
+
+    struct PipelineStats {
+        FFmpegFrameRingStats queue; // reader -> delivery
+        uint64_t framesRead;        // reader stage
+        uint64_t framesDelivered;   // delivery stage
+        uint64_t framesDecimated;   // dropped to meet the frame rate
+        uint64_t formatSwitches;    // Reconfigure() calls that changed it
+        int64_t  lastSwitchLatencyUs; // Reconfigure() -> first frame out
+        int64_t  maxSwitchLatencyUs;
+        uint64_t keyFrameRequests;  // passthrough only
+        double sourceSkewPpm;       // source clock vs. capture clock
+        int64_t  lastPaceErrorUs;   // realtime: frame out vs. its deadline
+        int64_t  maxPaceErrorUs;
+        uint64_t loops;             // in-process ingest and frame cache
+        // frames passed on in the memory they arrived in (shared memory
+        // slots, decoded pictures) vs. those read or converted into ours
+        uint64_t framesZeroCopy;
+        uint64_t framesCopied;
+        bool warmStart;             // the ingest came from FFmpegIngestPool,
+                                    // or the shared one was open already
+        bool sharedIngest;          // frames come from an FFmpegSharedIngest
+        int64_t  firstFrameUs;      // StartCapture() -> first frame out;
+                                    // -1 until then
+        // lost on the way: the queue overflowed (queue.dropped), or there
+        // was no buffer to read, convert or scale them into
+        uint64_t framesDropped;
+        uint64_t shortReads;        // input ended part way through a frame
+        uint64_t bytesIngested;     // read from the pipe or ring, or demuxed;
+                                    // a shared ingest counts its own
+        size_t   sinks;             // the registered callback included
+        int64_t  maxSinkRemoveUs;   // RemoveSink() and the like waiting out
+                                    // the frame being delivered
+        // Per frame, in microseconds. Read: pipe, from a frame's first
+        // byte to its last; in-process, the demuxing and decoding of it.
+        // Convert: pixel format conversion, scaling and rotation, either
+        // side of the queue. Deliver: all sinks' OnFrame(). Jitter: how
+        // far the time between two frames out is from 1/maxFPS.
+        FFmpegLatencyHistogram::Snapshot readUs;
+        FFmpegLatencyHistogram::Snapshot convertUs;
+        FFmpegLatencyHistogram::Snapshot deliverUs;
+        FFmpegLatencyHistogram::Snapshot jitterUs;
     };
+    PipelineStats GetPipelineStats();
 
-    rtc::VideoSinkInterface<webrtc::VideoFrame>* dataCallback_;
+private:
+    typedef rtc::VideoSinkInterface<webrtc::VideoFrame> Sink;
+    FFmpegSinkList<Sink> sinks_;
+    Sink* dataCallback_;  // guarded by callbackMutex_
     std::unique_ptr<rtc::PlatformThread> captureThread_;
+    std::unique_ptr<rtc::PlatformThread> deliveryThread_;
     // rtc::CriticalSection captureCriticalSection_;
     webrtc::Mutex mutex_;
+    // only guards the callbacks' registration, so it never waits on a read;
+    // delivery doesn't take it
+    webrtc::Mutex callbackMutex_;
+    KeyFrameRequestHandler keyFrameRequestHandler_;
+    // held with mutex_ to change avIngest_, sharedIngest_ and warmStart_,
+    // alone to read them for the stats, which take no other lock of ours
+    webrtc::Mutex ingestMutex_;
 
     std::string deviceId_;
+    FFmpegDeviceRegistry::Entry device_; // as of the last StartCapture()
+    IngestMode ingestMode_;
+    bool ingestModeSet_;
+    IngestMode activeIngestMode_; // as of the last StartCapture()
+    std::unique_ptr<FFmpegAVIngest> avIngest_;
+    std::shared_ptr<FFmpegSharedIngest> sharedIngest_;
+    std::shared_ptr<FFmpegFrameCache> frameCache_;
+    uint64_t cacheFrame_;         // capture thread only: frames played
+    std::atomic<uint64_t> cacheLoops_;
     FILE* deviceFd_;
     std::vector<uint8_t> rawFrameBuffer_;
+    // the pipe's frame being read, if read straight into a pooled buffer
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> pipeFrame_;
+    std::atomic<bool> pipePaused_; // until the delivery thread makes room
+    std::shared_ptr<FFmpegShmRing> shmRing_; // kIngestSharedMemory
+    std::unique_ptr<FFmpegShmTestProducer> shmTestProducer_;
+    FFmpegShmProducerProcess shmProducer_;
+    uint64_t shmSignal_;          // a read of the ring's "filled" eventfd
+    FFmpegFrameBufferPool bufferPool_;
+    FFmpegSimulcastScaler simulcastScaler_; // delivery thread only
+    FFmpegFrameConverter frameConverter_;   // CheckI420AndPush() only
+    size_t simulcastLayers_;
+    bool simulcastLayersSet_;
+    FrameRing frameRing_;
+    FrameRing::OverflowPolicy overflowPolicy_; // as set
+    bool overflowPolicySet_;
+    bool realtime_;      // as set
+    bool realtimeSet_;
+    bool loop_;
+    bool loopSet_;
+    bool shared_;
+    bool sharedSet_;
+    bool pacing_;        // as of the last StartCapture()
+    bool looping_;
+    FFmpegFramePacer pacer_; // delivery thread only
+    rtc::Event stopEvent_;   // cuts a paced wait short
+    rtc::Event captureDone_; // the capture thread is returning
+    std::atomic<int64_t> lastPaceErrorUs_;
+    std::atomic<int64_t> maxPaceErrorUs_;
 
     bool captureStarted_;
-    size_t frameCount_;
-    webrtc::VideoCaptureCapability currentCapability_;
-
-    // hard-coded ffmpeg devices
-    static std::vector<DeviceMeta>* GetDevices();
+    bool warmStart_;
+    int64_t startUs_;    // when StartCapture() was called
+    std::atomic<int64_t> firstFrameUs_;
+    std::atomic<uint64_t> framesRead_;
+    std::atomic<uint64_t> keyFrameRequests_;
+    std::atomic<uint64_t> framesZeroCopy_;
+    std::atomic<uint64_t> framesCopied_;
+    std::atomic<uint64_t> framesDropped_;  // not counting the queue's
+    std::atomic<uint64_t> shortReads_;
+    std::atomic<uint64_t> bytesIngested_;
+    size_t pipeFrameSize_;       // reactor thread only
+    uint64_t avBytesRead_;       // capture thread only, as last counted
+    int64_t lastDeliveredUs_;    // delivery thread only
+    FFmpegLatencyHistogram readUs_;
+    FFmpegLatencyHistogram convertUs_;
+    FFmpegLatencyHistogram deliverUs_;
+    FFmpegLatencyHistogram jitterUs_;
+    FFmpegTimestampEstimator timestampEstimator_;
+    std::atomic<double> sourceSkewPpm_;
+    webrtc::VideoCaptureCapability currentCapability_; // what sinks get
+    webrtc::VideoCaptureCapability sourceCapability_;  // what the input was
+                                                       // opened with
+    std::atomic<webrtc::VideoRotation> rotation_;
+    std::atomic<bool> applyRotation_;
+
+    // What the delivery thread scales and paces frames to
+    struct OutputFormat {
+        int width;
+        int height;
+        int maxFPS;
+        uint64_t generation;  // bumped by every change
+        int64_t requestedUs;  // when it was asked for, on FFmpegCaptureClock
+    };
+    webrtc::Mutex formatMutex_;
+    OutputFormat outputFormat_;             // guarded by formatMutex_
+    uint64_t deliveredGeneration_;          // delivery thread only
+    FFmpegFrameDecimator outputDecimator_;  // delivery thread only
+    std::atomic<uint64_t> framesDelivered_;
+    std::atomic<uint64_t> framesDecimated_;
+    std::atomic<uint64_t> formatSwitches_;
+    std::atomic<int64_t> lastSwitchLatencyUs_;
+    std::atomic<int64_t> maxSwitchLatencyUs_;
 
     // async functions
     // static bool CaptureThread(void* object);
     static void CaptureThread(void* object);
+    static void DeliveryThread(void* object);
     bool CaptureProcess();
+    bool ReadCachedFrame();
+    bool DeliveryProcess();
+
+    // FFmpegIngestReactor::Source: the ffmpeg pipe, or the shared memory
+    // ring's "filled" eventfd, on a reactor thread
+    uint8_t* NextFrame(size_t& size) override;
+    bool OnFrame() override;
+    void OnClosed() override;
+    void OnFrameRead(int64_t readUs) override;
+    void OnShortRead(size_t filled, size_t size) override;
+
+    // FFmpegSharedIngest::Subscriber, on the shared ingest's reader thread
+    void OnSharedFrame(
+        const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        int64_t ptsUs,
+        int64_t readUs) override;
+    void OnSharedEnd() override;
+
+    // FFmpegStatsRegistry::Provider
+    void ReportStats(FFmpegStatsReport& report) override;
+
+    int32_t StartPipe(const webrtc::VideoCaptureCapability& capability);
+    int32_t StartSharedMemory(const webrtc::VideoCaptureCapability& capability);
+    void StopSharedMemory();
+    void TakeSharedMemoryFrame();
     int32_t CheckI420AndPush(
         uint8_t* videoFrame,
         size_t videoFrameLength,
         const webrtc::VideoCaptureCapability& frameInfo,
-        int64_t captureTime = 0);
+        int64_t ptsUs = -1);
+    int64_t PipePtsUs();
+    void QueueFrame(
+        const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        int64_t ptsUs);
+    void QueueFrame(
+        const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        int64_t ptsUs,
+        webrtc::VideoRotation rotation,
+        bool rotationApplied,
+        int64_t convertUs = 0);
+    void SetOutputFormat(
+        const webrtc::VideoCaptureCapability& capability,
+        int64_t requestedUs);
+    size_t BufferPoolSize();
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> ScaleTo(
+        const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        int width,
+        int height);
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> Rotate(
+        const rtc::scoped_refptr<webrtc::VideoFrameBuffer>& buffer,
+        webrtc::VideoRotation rotation);
+    void DeliverFrame(const CapturedFrame& frame);
 
 public:
     class FFmpegVideoDeviceInfo : public webrtc::VideoCaptureModule::DeviceInfo {
@@ -154,7 +478,7 @@ public:
             uint32_t positionY);
 
      private:
-        std::vector<DeviceMeta>& devices_;
+        FFmpegDeviceRegistry* registry_;
 
         inline int32_t NextMatchScore(
             const webrtc::VideoCaptureCapability& target,
@@ -15,7 +15,7 @@
 
 
 FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::FFmpegVideoDeviceInfo()
-: devices_(*FFmpegVideoCaptureModule::GetDevices())
+: registry_(FFmpegDeviceRegistry::GetInstance())
 { }
 
 
@@ -24,7 +24,7 @@ FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::~FFmpegVideoDeviceInfo() { }
 
 uint32_t
 FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::NumberOfDevices()
-{ return devices_.size(); }
+{ return static_cast<uint32_t>(registry_->NumberOfDevices()); }
 
 
 int32_t
@@ -38,15 +38,15 @@ FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::GetDeviceName(
     uint32_t productUniqueIdUTF8Length)
 {
     // validate parameters
-    if (deviceNumber >= devices_.size()) return -1;
     if (!(deviceNameUTF8 && deviceUniqueIdUTF8)) return -1;
+    auto device = registry_->GetDevice(deviceNumber);
+    if (!device) return -1;
     // copy device names
-    auto& device = devices_[deviceNumber];
-    strncpy(deviceNameUTF8, device.name.c_str(), deviceNameLength);
-    strncpy(deviceUniqueIdUTF8, device.id.c_str(),
+    strncpy(deviceNameUTF8, device->name.c_str(), deviceNameLength);
+    strncpy(deviceUniqueIdUTF8, device->id.c_str(),
         deviceUniqueIdUTF8Length);
     if (productUniqueIdUTF8)
-        strncpy(productUniqueIdUTF8, device.product.c_str(),
+        strncpy(productUniqueIdUTF8, device->product.c_str(),
             productUniqueIdUTF8Length);
     return 0;
 }
@@ -56,10 +56,9 @@ int32_t
 FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::NumberOfCapabilities(
     const char* deviceUniqueIdUTF8)
 {
-    for (auto& device : devices_)
-        if (device.id == deviceUniqueIdUTF8)
-            return static_cast<int32_t>(device.capabilities.size());
-    return -1;
+    auto device = registry_->Find(deviceUniqueIdUTF8);
+    if (!device) return -1;
+    return static_cast<int32_t>(device->capabilities.size());
 }
 
 
@@ -69,16 +68,11 @@ FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::GetCapability(
     const uint32_t deviceCapabilityNumber,
     webrtc::VideoCaptureCapability& capability)
 {
-    for (auto& device : devices_) {
-        if (device.id != deviceUniqueIdUTF8) continue;
-        if (deviceCapabilityNumber >= device.capabilities.size())
-            break;
-        else {
-            capability = device.capabilities[deviceCapabilityNumber];
-            return 0;
-        }
-    }
-    return -1;
+    auto device = registry_->Find(deviceUniqueIdUTF8);
+    if (!device || deviceCapabilityNumber >= device->capabilities.size())
+        return -1;
+    capability = device->capabilities[deviceCapabilityNumber];
+    return 0;
 }
 
 
@@ -87,12 +81,10 @@ FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::GetOrientation(
     const char* deviceUniqueIdUTF8,
     webrtc::VideoRotation& orientation)
 {
-    for (auto& device : devices_) {
-        if (device.id != deviceUniqueIdUTF8) continue;
-        orientation = device.orientation;
-        return 0;
-    }
-    return -1;
+    auto device = registry_->Find(deviceUniqueIdUTF8);
+    if (!device) return -1;
+    orientation = device->orientation;
+    return 0;
 }
 
 
@@ -102,23 +94,20 @@ FFmpegVideoCaptureModule::FFmpegVideoDeviceInfo::GetBestMatchedCapability(
     const webrtc::VideoCaptureCapability& requested,
     webrtc::VideoCaptureCapability& resulting)
 {
-    for (auto& device : devices_) {
-        if (device.id != deviceUniqueIdUTF8) continue;
-        if (device.capabilities.size() == 0) break;
-        int32_t best = 0;
-        int32_t score = INT_MAX;
-        for (size_t i = 1; i < device.capabilities.size(); i++) {
-            int32_t next_score =
-                NextMatchScore(requested, device.capabilities[i]);
-            if (next_score < score) {
-                score = next_score;
-                best = i;
-            }
+    auto device = registry_->Find(deviceUniqueIdUTF8);
+    if (!device || device->capabilities.size() == 0) return -1;
+    int32_t best = 0;
+    int32_t score = INT_MAX;
+    for (size_t i = 1; i < device->capabilities.size(); i++) {
+        int32_t next_score =
+            NextMatchScore(requested, device->capabilities[i]);
+        if (next_score < score) {
+            score = next_score;
+            best = i;
         }
-        resulting = device.capabilities[best];
-        return best;
     }
-    return -1;
+    resulting = device->capabilities[best];
+    return best;
 }
 
 
@@ -10,6 +10,7 @@
 
 #include "ffmpeg_video_factory.h"
 #include "ffmpeg_video_capture_module.h"
+#include "ffmpeg_device_registry.h"
 
 #include "rtc_base/ref_counted_object.h"
 
@@ -23,6 +24,8 @@ FFmpegVideoFactory::~FFmpegVideoFactory() { }
 rtc::scoped_refptr<webrtc::VideoCaptureModule>
 FFmpegVideoFactory::Create(const char* device_id) {
     if (device_id == nullptr) return nullptr;
+    // devices may come and go at runtime; only hand out known ones
+    if (!FFmpegDeviceRegistry::GetInstance()->Find(device_id)) return nullptr;
     rtc::scoped_refptr<FFmpegVideoCaptureModule> capture(
         new rtc::RefCountedObject<FFmpegVideoCaptureModule>(
             std::string(device_id)));
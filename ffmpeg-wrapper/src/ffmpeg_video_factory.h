@@ -20,6 +20,8 @@ class FFmpegVideoFactory
 public:
     FFmpegVideoFactory();
     ~FFmpegVideoFactory();
+    // |device| is the unique id of an FFmpegDeviceRegistry entry;
+    // returns nullptr if there is no such device.
     static rtc::scoped_refptr<webrtc::VideoCaptureModule> Create(const char* device);
     static webrtc::VideoCaptureModule::DeviceInfo* CreateDeviceInfo();
     // static void DestroyDeviceInfo(webrtc::VideoCaptureModule::DeviceInfo* info);
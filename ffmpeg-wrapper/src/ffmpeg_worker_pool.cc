@@ -0,0 +1,217 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Fixed set of threads that run batches of short, independent tasks.
+ */
+
+#include "ffmpeg_worker_pool.h"
+
+#include <stdlib.h> // getenv(), atoi()
+
+#include <algorithm>
+
+#include "system_wrappers/include/cpu_info.h"
+#include "ffmpeg_thread_policy.h"
+
+
+FFmpegWorkerPool*
+FFmpegWorkerPool::GetShared()
+{
+    // never destroyed: capture modules may still be running at exit
+    static FFmpegWorkerPool* pool = [] {
+        const char* value = getenv("FFMPEG_WORKER_THREADS");
+        int threads = value ? atoi(value) : -1;
+        if (threads < 0)
+            threads = std::max<int>(
+                webrtc::CpuInfo::DetectNumberOfCores() - 1, 0);
+        return new FFmpegWorkerPool(threads, "FrameWorker");
+    }();
+    return pool;
+}
+
+
+FFmpegWorkerPool::FFmpegWorkerPool(size_t threads, const std::string& name)
+: stopping_(false),
+  nextWorker_(0),
+  batches_(0),
+  tasks_(0),
+  steals_(0)
+{
+    for (size_t i = 0; i < threads; i++) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->pool  = this;
+        worker->index = i;
+        worker->name  = name + std::to_string(i);
+        workers_.push_back(std::move(worker));
+    }
+    // every queue exists before any thread can steal from it
+    for (size_t i = 0; i < threads; i++) {
+        workers_[i]->thread.reset(new rtc::PlatformThread(
+            FFmpegWorkerPool::WorkerThread, workers_[i].get(),
+            workers_[i]->name));
+        workers_[i]->thread->Start();
+    }
+}
+
+
+FFmpegWorkerPool::~FFmpegWorkerPool()
+{
+    stopping_.store(true, std::memory_order_release);
+    for (auto& worker : workers_) {
+        worker->wake.Set();
+        worker->thread->Stop();
+    }
+}
+
+
+size_t
+FFmpegWorkerPool::NumberOfThreads() const
+{ return workers_.size(); }
+
+
+FFmpegWorkerPool::Stats
+FFmpegWorkerPool::GetStats() const
+{
+    Stats stats;
+    stats.threads = workers_.size();
+    stats.batches = batches_.load(std::memory_order_relaxed);
+    stats.tasks   = tasks_.load(std::memory_order_relaxed);
+    stats.steals  = steals_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+
+void
+FFmpegWorkerPool::Run(std::vector<Task>& tasks)
+{
+    if (tasks.empty()) return;
+    batches_.fetch_add(1, std::memory_order_relaxed);
+
+    if (workers_.empty() || tasks.size() == 1) {
+        for (Task& task : tasks) task();
+        tasks_.fetch_add(tasks.size(), std::memory_order_relaxed);
+        return;
+    }
+
+    BatchRef batch = std::make_shared<Batch>();
+    batch->pending.store(tasks.size(), std::memory_order_relaxed);
+
+    // deal the batch out, starting where the last one left off so that
+    // concurrent batches don't all pile onto the first workers
+    const size_t count = workers_.size();
+    const size_t first = nextWorker_.fetch_add(tasks.size(),
+        std::memory_order_relaxed) % count;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        Worker& worker = *workers_[(first + i) % count];
+        webrtc::MutexLock lock(&worker.mutex);
+        worker.queue.push_back(Item{ &tasks[i], batch });
+    }
+    for (size_t i = 0; i < std::min(tasks.size(), count); i++)
+        workers_[(first + i) % count]->wake.Set();
+
+    // help out rather than sleep
+    Item item;
+    while (batch->pending.load(std::memory_order_acquire) > 0 &&
+            Steal(first, item)) {
+        steals_.fetch_add(1, std::memory_order_relaxed);
+        RunItem(item);
+    }
+    batch->done.Wait(rtc::Event::kForever);
+}
+
+
+void
+FFmpegWorkerPool::AddSlices(
+    std::vector<Task>& tasks,
+    int rows,
+    int width,
+    int alignment,
+    const SliceTask& slice) const
+{
+    if (rows <= 0) return;
+    alignment = std::max(alignment, 1);
+
+    const int64_t pixels = static_cast<int64_t>(rows) * std::max(width, 1);
+    int64_t slices = std::min<int64_t>(pixels / kMinSlicePixels,
+        (workers_.size() + 1) * kSlicesPerThread);
+    slices = std::max<int64_t>(std::min<int64_t>(slices, rows / alignment), 1);
+
+    // even bands, rounded to the alignment; the last one takes the rest
+    const int band = static_cast<int>(
+        (rows / slices + alignment - 1) / alignment * alignment);
+    for (int first = 0; first < rows; first += band) {
+        const int count = std::min(band, rows - first);
+        tasks.push_back([slice, first, count]() { slice(first, count); });
+    }
+}
+
+
+void
+FFmpegWorkerPool::WorkerThread(void* object)
+{
+    Worker* worker = static_cast<Worker*>(object);
+    FFmpegWorkerPool* pool = worker->pool;
+    FFmpegThreadPolicy::Scope scope(FFmpegThreadPolicy::kWorker, worker->name);
+    for (;;) {
+        Item item;
+        while (pool->Take(worker->index, item))
+            pool->RunItem(item);
+
+        // set by whoever queued after the queues above were seen empty
+        worker->wake.Wait(rtc::Event::kForever);
+        if (pool->stopping_.load(std::memory_order_acquire)) return;
+    }
+}
+
+
+bool
+FFmpegWorkerPool::Take(size_t worker, Item& item)
+{
+    {
+        // newest first: its data is the likeliest to still be in cache
+        Worker& own = *workers_[worker];
+        webrtc::MutexLock lock(&own.mutex);
+        if (!own.queue.empty()) {
+            item = std::move(own.queue.back());
+            own.queue.pop_back();
+            return true;
+        }
+    }
+    if (!Steal(worker + 1, item)) return false;
+    steals_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+
+bool
+FFmpegWorkerPool::Steal(size_t first, Item& item)
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        // oldest first, leaving the owner the end it works from
+        Worker& victim = *workers_[(first + i) % workers_.size()];
+        webrtc::MutexLock lock(&victim.mutex);
+        if (!victim.queue.empty()) {
+            item = std::move(victim.queue.front());
+            victim.queue.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void
+FFmpegWorkerPool::RunItem(Item& item)
+{
+    (*item.task)();
+    tasks_.fetch_add(1, std::memory_order_relaxed);
+
+    // the last one out lets Run() return
+    if (item.batch->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        item.batch->done.Set();
+    item.batch.reset();
+}
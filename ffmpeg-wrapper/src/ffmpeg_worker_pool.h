@@ -0,0 +1,115 @@
+/*
+ *  Copyright (c) 2021 The WebRTC project authors. All Rights Reserved.
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree.
+ *
+ *  Fixed set of threads that run batches of short, independent tasks.
+ */
+
+#ifndef DEMO_FFMPEG_WORKER_POOL_H_
+#define DEMO_FFMPEG_WORKER_POOL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rtc_base/event.h"
+#include "rtc_base/platform_thread.h"
+#include "rtc_base/synchronization/mutex.h"
+
+
+// Runs batches of tasks on its threads and on the calling one, and returns
+// once all of a batch is done. Any number of threads may submit batches at
+// once, which is how the frames of many streams share the cores.
+//
+// Each worker has a queue of its own. A batch is dealt round-robin across
+// them, a worker takes from the back of its own queue and, once that's
+// empty, steals from the front of the others', so a worker stuck in one
+// huge slice doesn't hold up the tasks dealt to it. The submitting thread
+// steals too while it waits, possibly another batch's tasks, instead of
+// sleeping.
+class FFmpegWorkerPool {
+public:
+    typedef std::function<void()> Task;
+    // rows [first, first + count) of something |rows| tall
+    typedef std::function<void(int first, int count)> SliceTask;
+
+    struct Stats {
+        size_t   threads;
+        uint64_t batches;
+        uint64_t tasks;
+        uint64_t steals;   // tasks run by a thread they weren't dealt to
+    };
+
+    // Shared by every capture module: FFMPEG_WORKER_THREADS workers if
+    // set, else one less than there are cores.
+    static FFmpegWorkerPool* GetShared();
+
+    // |threads| workers besides the caller; 0 runs everything inline
+    FFmpegWorkerPool(size_t threads, const std::string& name);
+    ~FFmpegWorkerPool();
+
+    size_t NumberOfThreads() const;
+    Stats GetStats() const;
+
+    void Run(std::vector<Task>& tasks);
+
+    // Appends tasks that each run |slice| over a horizontal band of
+    // |rows| rows, |width| pixels wide. Bands start on multiples of
+    // |alignment| rows (2 keeps 4:2:0 chroma rows whole), are never smaller
+    // than kMinSlicePixels, and are at most kSlicesPerThread per thread:
+    // small frames stay a single task, big ones are spread over every core
+    // with a few to spare for stealing.
+    void AddSlices(
+        std::vector<Task>& tasks,
+        int rows,
+        int width,
+        int alignment,
+        const SliceTask& slice) const;
+
+    static const int kMinSlicePixels  = 256 * 1024;
+    static const int kSlicesPerThread = 2;
+
+private:
+    struct Batch {
+        std::atomic<size_t> pending;
+        rtc::Event done;
+    };
+    typedef std::shared_ptr<Batch> BatchRef;
+
+    struct Item {
+        Task* task;
+        BatchRef batch;   // kept alive until its last task is done
+    };
+
+    struct Worker {
+        FFmpegWorkerPool* pool;
+        size_t index;
+        std::string name;
+        webrtc::Mutex mutex;  // guards |queue|
+        std::deque<Item> queue;
+        rtc::Event wake;
+        std::unique_ptr<rtc::PlatformThread> thread;
+    };
+
+    std::atomic<bool> stopping_;
+    std::atomic<size_t> nextWorker_; // where the next batch is dealt from
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::atomic<uint64_t> batches_;
+    std::atomic<uint64_t> tasks_;
+    std::atomic<uint64_t> steals_;
+
+    static void WorkerThread(void* object);
+    bool Take(size_t worker, Item& item);  // own queue first, then steal
+    bool Steal(size_t first, Item& item);
+    void RunItem(Item& item);
+};
+
+#endif